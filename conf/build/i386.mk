@@ -6,4 +6,11 @@ USE_ACPICA = 1
 
 ifeq ($(USE_ACPICA), 1)
 CFLAGS += -DACPICA_ENABLED
+endif
+
+# Spinlock statistics (exposed in /kernel/spinlocks)
+USE_SPINLOCK_STATS = 1
+
+ifeq ($(USE_SPINLOCK_STATS), 1)
+CFLAGS += -DSPINLOCK_STATS
 endif
\ No newline at end of file
@@ -160,6 +160,7 @@ fs_node_t *ahci_createNode(ahci_port_t *port) {
     ret->length = port->size;
     ret->mask = 0770;
     ret->flags = VFS_BLOCKDEVICE;
+    ret->cache = VFS_CACHE_PAGES;
 
     // Set methods
     ret->read = ahci_read;
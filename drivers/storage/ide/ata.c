@@ -590,6 +590,7 @@ fs_node_t *ide_createNode(ide_device_t *device) {
     out->read = ide_readFS;
     out->write = ide_writeFS;
     out->flags = VFS_BLOCKDEVICE;
+    out->cache = VFS_CACHE_PAGES;
     out->mask = 0770;
     out->length = device->size;
     out->dev = (void*)device;
@@ -244,8 +244,8 @@ __attribute__((noreturn)) void arch_main(multiboot_t *bootinfo, uint32_t multibo
     dprintf(INFO, "Available physical memory to machine: %i KB\n", parameters->mem_size);
 
     // Start the PMM system
-    uintptr_t *pmm_frames = (uintptr_t*)arch_allocate_structure((parameters->mem_size * 1024) / PMM_BLOCK_SIZE);
-    pmm_init(parameters->mem_size * 1024, pmm_frames);
+    void *pmm_storage = (void*)arch_allocate_structure(pmm_getStorageSize(parameters->mem_size * 1024));
+    pmm_init(parameters->mem_size * 1024, pmm_storage);
 
     // Mark memory as valid/invalid. 
     arch_mark_memory(parameters, highest_kernel_address, parameters->mem_size * 1024);
@@ -44,7 +44,7 @@ static page_t       *mem_kernelDirectory;       // Kernel page directory
                                                 // TODO: We can stack allocate and align this.
 
 // Reference counts
-uint8_t     *mem_pageReferences     = NULL;     // Holds a bitmap of references
+mem_frame_t *mem_frames             = NULL;     // Per-frame metadata (reference counts)
 
 // Heap/identity map stuff
 uintptr_t    mem_kernelHeap;                    // Location of the kernel heap in memory
@@ -177,15 +177,14 @@ int mem_incrementPageReference(page_t *page) {
         return 0;
     }
 
-    // First get the index in refcounts of the frame
-    uintptr_t idx = page->bits.address;
-    if (mem_pageReferences[idx] == UINT8_MAX) {
+    uint32_t *refs = &mem_frames[page->bits.address].refs;
+    uint32_t old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+    do {
         // We're too high, return 0 and hope they make a copy of the page
-        return 0; 
-    }
+        if (old >= MEM_FRAME_MAX_REFS) return 0;
+    } while (!__atomic_compare_exchange_n(refs, &old, old + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 
-    mem_pageReferences[idx]++;
-    return mem_pageReferences[idx];
+    return (int)(old + 1);
 }
 
 /**
@@ -200,16 +199,14 @@ int mem_decrementPageReference(page_t *page) {
         return 0;
     }
 
-    // First get the index in refcounts of the frame
-    uintptr_t idx = page->bits.address;
-    if (mem_pageReferences[idx] == 0) {
+    uint32_t old = __atomic_fetch_sub(&mem_frames[page->bits.address].refs, 1, __ATOMIC_ACQ_REL);
+    if (old == 0) {
         // Bail out!
         kernel_panic_extended(MEMORY_MANAGEMENT_ERROR, "pageref", "*** Tried to release reference on page with 0 references (bug)\n");
         __builtin_unreachable();
     }
 
-    mem_pageReferences[idx]--;
-    return mem_pageReferences[idx];
+    return (int)(old - 1);
 }
 
 
@@ -250,14 +247,14 @@ static void mem_copyUserPage(page_t *src, page_t *dest) {
     // Check if the source page is writable
     if (src->bits.rw) {
         // It is, initialize reference counts for the page's frame
-        if (mem_pageReferences[src->bits.address]) {
+        if (__atomic_load_n(&mem_frames[src->bits.address].refs, __ATOMIC_ACQUIRE)) {
             // There's already references??
             kernel_panic_extended(MEMORY_MANAGEMENT_ERROR, "CoW", "*** Source page already has references\n");
             __builtin_unreachable();
         }
 
         // 2 references
-        mem_pageReferences[src->bits.address] = 2;
+        __atomic_store_n(&mem_frames[src->bits.address].refs, 2, __ATOMIC_RELEASE);
 
         // Now what we do is mark the source AND destination page as R/O and set them both to have a CoW pending
         // Any writes will trigger a page fault, which our handler will detect and auto handle CoW
@@ -360,7 +357,7 @@ page_t *mem_clone(page_t *dir) {
             page_t *dest_pte = &dest_pt[pte];
 
             // Is it a usermode page? We need to do CoW in that case
-            if (src_pte->bits.usermode) {
+            if (MEM_PAGE_IS_USER(src_pte)) {
                 mem_copyUserPage(src_pte, dest_pte);
             } else {
                 // Just do raw copy
@@ -604,6 +601,7 @@ void mem_allocatePage(page_t *page, uintptr_t flags) {
     page->bits.usermode         = (flags & MEM_PAGE_KERNEL) ? 0 : 1;
     page->bits.writethrough     = (flags & MEM_PAGE_WRITETHROUGH) ? 1 : 0;
     page->bits.cache_disable    = (flags & MEM_PAGE_NOT_CACHEABLE) ? 1 : 0;
+    page->bits.noaccess         = 0;
 }
 
 /**
@@ -618,6 +616,7 @@ void mem_freePage(page_t *page) {
     page->bits.present = 0;
     page->bits.rw = 0;
     page->bits.usermode = 0;
+    page->bits.noaccess = 0;
     
     // Free the block
     pmm_freeBlock(MEM_GET_FRAME(page));
@@ -764,9 +763,9 @@ void mem_init(uintptr_t high_address) {
     // Make space for reference counts in kernel heap
     // Reference counts will be initialized when a user PTE is copied.
     // NOTE: This has to be done here because mem_sbrk calls mem_getPage which in turn can wrap into mem_remapPhys' map pool system
-    size_t refcount_bytes = frame_bytes >> MEM_PAGE_SHIFT;  // One byte per page
-    mem_pageReferences = (uint8_t*)mem_sbrk((refcount_bytes & 0xFFF) ? MEM_ALIGN_PAGE(refcount_bytes) : refcount_bytes);
-    memset(mem_pageReferences, 0, refcount_bytes);
+    size_t refcount_bytes = (frame_bytes >> MEM_PAGE_SHIFT) * sizeof(mem_frame_t);  // One entry per page
+    mem_frames = (mem_frame_t*)mem_sbrk((refcount_bytes & 0xFFF) ? MEM_ALIGN_PAGE(refcount_bytes) : refcount_bytes);
+    memset(mem_frames, 0, refcount_bytes);
 
     // Initialize regions
     mem_regionsInitialize();
@@ -931,6 +930,7 @@ void mem_free(uintptr_t start, size_t size, uintptr_t flags) {
             dprintf(WARN, "Tried to free page %p but it is not present (?)\n", i);
         }
         
+        if (pg && !pg->bits.present) continue;
         mem_allocatePage(pg, MEM_PAGE_FREE);
     }
 
@@ -941,6 +941,38 @@ void mem_free(uintptr_t start, size_t size, uintptr_t flags) {
     }
 }
 
+/**
+ * @brief Change the protection of the present usermode pages in a range of the current directory
+ * @param start The starting virtual address (page aligned)
+ * @param size The size of the range
+ * @param flags @c MEM_PAGE_READONLY to make the pages read-only, otherwise they become writable.
+ *              @c MEM_PAGE_KERNEL to make them inaccessible to usermode until the next call without it
+ * @note Pages pending CoW stay read-only, the CoW fault makes them writable
+ */
+void mem_protect(uintptr_t start, size_t size, uintptr_t flags) {
+    if (!size) return;
+
+    for (uintptr_t i = start; i < start + size; i += PAGE_SIZE) {
+        page_t *pg = mem_getPage(NULL, i, MEM_DEFAULT);
+        if (!pg || !pg->bits.present || !MEM_PAGE_IS_USER(pg)) continue;
+
+        pg->bits.rw = (!(flags & MEM_PAGE_READONLY) && !pg->bits.cow) ? 1 : 0;
+        pg->bits.usermode = (flags & MEM_PAGE_KERNEL) ? 0 : 1;
+        pg->bits.noaccess = (flags & MEM_PAGE_KERNEL) ? 1 : 0;
+        mem_invalidatePage(i);
+    }
+}
+
+/**
+ * @brief Give a usermode page pending CoW (or mapping the shared zero page) its own frame
+ * @param address The address of the page in the current directory
+ * @returns 1 if the page has its own frame now, 0 if it wasn't pending CoW
+ * @note i386 doesn't share pages between directories (see EXPERIMENTAL_COW) or map the zero page
+ */
+int mem_breakCopyOnWrite(uintptr_t address) {
+    return 0;
+}
+
 /**
  * @brief Validate a specific pointer in memory
  * @param ptr The pointer you wish to validate
@@ -131,6 +131,24 @@ int cpu_pml5supported() {
     return ecx & CPUID_FEAT_ECX_PML5;
 }
 
+/**
+ * @brief x86_64: Check if global pages are supported
+ */
+int cpu_pgeSupported() {
+    uint32_t edx, unused;
+    __cpuid(0x01, unused, unused, unused, edx);
+    return edx & CPUID_FEAT_EDX_PGE;
+}
+
+/**
+ * @brief x86_64: Check if process-context identifiers are supported
+ */
+int cpu_pcidSupported() {
+    uint32_t ecx, unused;
+    __cpuid(0x01, unused, unused, ecx, unused);
+    return ecx & CPUID_FEAT_ECX_PCID;
+}
+
 /**
  * @brief x86_64: Get the maximum linear-address width supported by the CPU
  * 
@@ -16,6 +16,7 @@
 #include <kernel/arch/x86_64/smp.h>
 #include <kernel/arch/x86_64/arch.h>
 #include <kernel/task/syscall.h>
+#include <kernel/task/process.h>
 #include <kernel/processor_data.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
@@ -91,6 +92,10 @@ const char *hal_exception_table[X86_64_MAX_EXCEPTIONS] = {
 };
 
 
+/* Double fault stacks. Overflowing a kernel stack page faults in the guard page below it, and the page fault
+ * can't be pushed onto that stack either, so the double fault needs a stack of its own. */
+static uint8_t hal_doubleFaultStacks[MAX_CPUS][X86_64_DOUBLE_FAULT_STACK_SIZE] __attribute__((aligned(16)));
+
 /**
  * @brief Sets up a core's data in the global GDT
  * @param core The core number to setup
@@ -112,6 +117,9 @@ static void hal_setupGDTCoreData(int core) {
     gdt[core].table.entries[6].base_mid = (tss >> 16) & 0xFF;
     gdt[core].table.entries[6].base_hi = (tss >> 24) & 0xFF;
     gdt[core].table.tss_extra.base_higher = (tss >> 32) & 0xFFFFFFFFF;
+
+    // Give the core its double fault stack
+    gdt[core].tss.ist[X86_64_DOUBLE_FAULT_IST - 1] = (uintptr_t)&hal_doubleFaultStacks[core][X86_64_DOUBLE_FAULT_STACK_SIZE];
 }
 
 /**
@@ -246,6 +254,10 @@ void hal_exceptionHandler(registers_t *regs, extended_registers_t *regs_extended
         // Print it out
         dprintf(NOHEADER, "*** ISR detected exception: Page fault at address 0x%016llX\n\n", page_fault_addr);
         printf("*** Page fault at address 0x%016llX detected in kernel.\n", page_fault_addr);
+    } else if (exception_index == 8 && current_cpu->kstack && regs_extended->cr2 >= current_cpu->kstack - PROCESS_KSTACK_SIZE - PAGE_SIZE && regs_extended->cr2 < current_cpu->kstack - PROCESS_KSTACK_SIZE) {
+        // The fault was in the guard page of the kernel stack
+        dprintf(NOHEADER, "*** ISR detected exception: Kernel stack overflow (guard page 0x%016llX hit)\n\n", regs_extended->cr2);
+        printf("*** Kernel stack overflow detected (stack top 0x%016llX).\n", current_cpu->kstack);
     } else if (exception_index < X86_64_MAX_EXCEPTIONS) {
         // Other exception
         dprintf(NOHEADER, "*** ISR detected exception %i - %s\n\n", exception_index, hal_exception_table[exception_index]);
@@ -506,6 +518,7 @@ void hal_initializeInterrupts() {
     hal_registerInterruptVector(6, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halInvalidOpcodeException);
     hal_registerInterruptVector(7, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halNoFPUException);
     hal_registerInterruptVector(8, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halDoubleFaultException);
+    hal_idt_table[8].ist = X86_64_DOUBLE_FAULT_IST;
     hal_registerInterruptVector(9, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halCoprocessorSegmentException);
     hal_registerInterruptVector(10, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halInvalidTSSException);
     hal_registerInterruptVector(11, X86_64_IDT_DESC_PRESENT | X86_64_IDT_DESC_BIT32, 0x08, (uint64_t)&halSegmentNotPresentException);
@@ -33,23 +33,44 @@
 /* Uncomment to disable CoW */
 // #define DISABLE_COW
 
+/* Uncomment to disable transparent 2MiB pages for usermode memory */
+// #define DISABLE_HUGE_PAGES
+
+/* mem_allocate page flags that rule out a 2MiB page (kernel memory always uses 4KiB pages) */
+#define MEM_LARGE_PAGE_EXCLUDE      (MEM_PAGE_KERNEL | MEM_PAGE_NOALLOC | MEM_PAGE_NOT_PRESENT | MEM_PAGE_FREE | MEM_PAGE_WRITE_COMBINE | MEM_PAGE_ZERO)
+
 // Heap/MMIO/driver space
 uintptr_t mem_kernelHeap                = 0xAAAAAAAAAAAAAAAA;   // Kernel heap
 uintptr_t mem_driverRegion              = MEM_DRIVER_REGION;    // Driver space
 uintptr_t mem_dmaRegion                 = MEM_DMA_REGION;       // DMA region
 uintptr_t mem_mmioRegion                = MEM_MMIO_REGION;      // MMIO region
 
-// Reference counts
-uint8_t  *mem_pageReferences            = NULL;
+// Frames unmapped by mem_free, given back once the TLBs are flushed
+#define MEM_FREE_DEFER_MAX 16
+typedef struct mem_deferred_free {
+    uintptr_t frame;                    // First frame
+    size_t blocks;                      // Amount of frames
+} mem_deferred_free_t;
+
+// Per-frame metadata (reference counts)
+mem_frame_t *mem_frames                 = NULL;
+#define MEM_FRAME_REFS(page) (&mem_frames[(page)->bits.address].refs)
+
+// Shared zero frame (see MEM_PAGE_ZERO). It never has references and is never freed
+static uintptr_t mem_zeroFrame          = 0x0;
+#define MEM_IS_ZERO_PAGE(page) ((page)->bits.cow && (page)->bits.address == (mem_zeroFrame >> MEM_PAGE_SHIFT))
 
 // Spinlocks
-static spinlock_t ref_lock = { 0 };
-static spinlock_t cow_lock = { 0 };
 static spinlock_t heap_lock = { 0 };
 static spinlock_t driver_lock = { 0 };
 static spinlock_t dma_lock = { 0 };
 static spinlock_t mmio_lock = { 0 };
 
+// Locks for unsharing page tables (see mem_unshareTable), picked by the table's frame so unrelated tables don't contend
+#define MEM_TABLE_LOCKS 64
+static spinlock_t mem_tableLocks[MEM_TABLE_LOCKS] = { 0 };
+#define MEM_TABLE_LOCK(pde) (&mem_tableLocks[(pde)->bits.address % MEM_TABLE_LOCKS])
+
 // Stub variables (for debugger)
 uintptr_t mem_mapPool                   = 0xAAAAAAAAAAAAAAAA;
 uintptr_t mem_identityMapCacheSize      = 0xAAAAAAAAAAAAAAAA;   
@@ -57,6 +78,9 @@ uintptr_t mem_identityMapCacheSize      = 0xAAAAAAAAAAAAAAAA;
 // Whether to use 5-level paging (TODO)
 static int mem_use5LevelPaging = 0;
 
+// Whether CR3 loads are tagged with a PCID (see mem_switchDirectory)
+static int mem_usePCID = 0;
+
 // TODO: i386 doesn't use this method of having preallocated page structures... maybe we should use it there?
 
 // Base page layout - loader uses this
@@ -73,13 +97,19 @@ page_t mem_highBasePDPT[512] __attribute__((aligned(PAGE_SIZE))) = {0};
 page_t mem_highBasePDs[64][512] __attribute__((aligned(PAGE_SIZE))) = {0}; // If we're already using 2MiB paging, why bother with PTs? 
 
 // Heap PDPT/PD/PT
+// The heap base PTs map the PMM's per-frame storage, 2MiB per PT (8 bytes per frame, so 1GiB of memory per PT)
+#define MEM_HEAP_BASE_PTS   32
 page_t mem_heapBasePDPT[512] __attribute__((aligned(PAGE_SIZE))) = {0};
 page_t mem_heapBasePD[512] __attribute__((aligned(PAGE_SIZE))) = {0};
-page_t mem_heapBasePT[512*3] __attribute__((aligned(PAGE_SIZE))) = {0};
+page_t mem_heapBasePT[512*MEM_HEAP_BASE_PTS] __attribute__((aligned(PAGE_SIZE))) = {0};
 
 // Log method
 #define LOG(status, ...) dprintf_module(status, "ARCH:MEM", __VA_ARGS__);
 
+// Prototypes
+static page_t *mem_getPDE(page_t *dir, uintptr_t address, uintptr_t flags);
+static void mem_splitLargePage(page_t *dir, page_t *pde, uintptr_t address, smp_tlb_batch_t *batch);
+
 /**
  * @brief Get the current directory (just current CPU)
  */
@@ -106,12 +136,13 @@ uintptr_t mem_getKernelHeap() {
 
 /**
  * @brief Invalidate a page in the TLB
+ * @param dir The directory the page was changed in, or NULL for the current directory
  * @param addr The address of the page 
  * @warning This function is only to be used when removing P-V mappings. Just free the page if it's identity.
  */
-static inline void mem_invalidatePage(uintptr_t addr) {
-    asm volatile ("invlpg (%0)" :: "r"(addr) : "memory");
-    smp_tlbShootdown(addr);
+static inline void mem_invalidatePage(page_t *dir, uintptr_t addr) {
+    if (!dir) dir = current_cpu->current_dir;
+    smp_tlbShootdownRange((addr < MEM_USERMODE_STACK_REGION + MEM_USERMODE_STACK_SIZE) ? dir : NULL, addr, PAGE_SIZE);
 } 
 
 /**
@@ -126,23 +157,15 @@ int mem_incrementPageReference(page_t *page) {
         return 0;
     }
 
-    spinlock_acquire(&ref_lock);
-
-    // First get the index in refcounts of the frame
-    uintptr_t idx = page->bits.address;
-    if (mem_pageReferences[idx] == UINT8_MAX) {
+    uint32_t *refs = MEM_FRAME_REFS(page);
+    uint32_t old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+    do {
         // We're too high, return 0 and hope they make a copy of the page
-        spinlock_release(&ref_lock);
-        return 0; 
-    }
-
-    mem_pageReferences[idx]++;
-    int new_refs = mem_pageReferences[idx];
+        if (old >= MEM_FRAME_MAX_REFS) return 0;
+    } while (!__atomic_compare_exchange_n(refs, &old, old + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 
-    spinlock_release(&ref_lock);
-
-    // LOG(DEBUG, "[REFCOUNT] INCREASE: %p %d\n", MEM_GET_FRAME(page), new_refs);
-    return new_refs;
+    // LOG(DEBUG, "[REFCOUNT] INCREASE: %p %d\n", MEM_GET_FRAME(page), old + 1);
+    return (int)(old + 1);
 }
 
 /**
@@ -157,23 +180,74 @@ int mem_decrementPageReference(page_t *page) {
         return 0;
     }
 
-    spinlock_acquire(&ref_lock);
-
-    // First get the index in refcounts of the frame
-    uintptr_t idx = page->bits.address;
-    if (mem_pageReferences[idx] == 0) {
+    uint32_t old = __atomic_fetch_sub(MEM_FRAME_REFS(page), 1, __ATOMIC_ACQ_REL);
+    if (old == 0) {
         // Bail out!
         kernel_panic_extended(MEMORY_MANAGEMENT_ERROR, "pageref", "*** Tried to release reference on page with 0 references (bug)\n");
         __builtin_unreachable();
     }
 
-    mem_pageReferences[idx]--;
-    int new_refs = mem_pageReferences[idx];
+    // LOG(DEBUG, "[REFCOUNT] DECREASE: %p %d\n", MEM_GET_FRAME(page), old - 1);
+    return (int)(old - 1);
+}
+
+/**
+ * @brief Get the PCID to load a directory with on the current CPU (call with interrupts disabled)
+ * 
+ * Every CPU remembers which directory it gave each of its PCIDs. If the directory still has one,
+ * its TLB entries are up to date (anything that changes them drops the PCID, see @c mem_dropPCID)
+ * and are kept. Otherwise the oldest PCID is handed over and flushed by the CR3 load.
+ * 
+ * @param dir The directory
+ * @returns The bits to OR into CR3
+ */
+static uintptr_t mem_getPCID(page_t *dir) {
+    processor_t *cpu = &processor_data[arch_current_cpu()];
+
+    for (int i = 0; i < MEM_PCID_SLOTS; i++) {
+        if (__atomic_load_n(&cpu->pcid_dirs[i], __ATOMIC_ACQUIRE) == dir) return (i + 1) | MEM_CR3_NOFLUSH;
+    }
+
+    int slot = cpu->pcid_next;
+    cpu->pcid_next = (slot + 1) % MEM_PCID_SLOTS;
+    __atomic_store_n(&cpu->pcid_dirs[slot], dir, __ATOMIC_RELEASE);
+    return slot + 1;
+}
+
+/**
+ * @brief Forget the PCIDs a directory was given on every CPU
+ * 
+ * Its TLB entries may be stale, so the next switch to it on each CPU flushes them.
+ * 
+ * @param dir The directory, or NULL to forget every directory
+ */
+void mem_dropPCID(page_t *dir) {
+    if (!mem_usePCID) return;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (int i = 0; i < MEM_PCID_SLOTS; i++) {
+            page_t *slot_dir = __atomic_load_n(&processor_data[cpu].pcid_dirs[i], __ATOMIC_RELAXED);
+            if (!slot_dir || (dir && slot_dir != dir)) continue;
+            __atomic_compare_exchange_n(&processor_data[cpu].pcid_dirs[i], &slot_dir, NULL, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Enable global pages and PCIDs on the current CPU (if supported)
+ * 
+ * Called by @c mem_init for the BSP and by every AP when it starts.
+ */
+void mem_initializeTLB() {
+    uintptr_t cr4;
+    asm volatile ("movq %%cr4, %0" : "=r"(cr4));
+
+    if (cpu_pgeSupported()) cr4 |= MEM_CR4_PGE;
 
-    spinlock_release(&ref_lock);
+    // PCIDE can only be set while CR3 has PCID 0, which is what the boot tables were loaded with
+    if (mem_usePCID) cr4 |= MEM_CR4_PCIDE;
 
-    // LOG(DEBUG, "[REFCOUNT] DECREASE: %p %02x\n", MEM_GET_FRAME(page), mem_pageReferences[idx]);
-    return new_refs;
+    asm volatile ("movq %0, %%cr4" :: "r"(cr4) : "memory");
 }
 
 /**
@@ -199,13 +273,21 @@ int mem_switchDirectory(page_t *pagedir) {
         phys = (uintptr_t)pagedir & ~(MEM_PHYSMEM_MAP_REGION);
     }
 
-    // Load PDBR
-    asm volatile ("movq %0, %%cr3" :: "r"(phys & ~0xFFF));
+    // A shootdown must not be serviced between publishing the directory and loading it, it would miss the new PCID
+    uintptr_t flags = arch_disable_interrupts();
 
-    // Set current directory
+    // Set current directory before loading it, TLB shootdowns use it to pick their targets
     // !!!: THIS WILL CAUSE PROBLEMS IF THIS IS PHYSMEM MAPPED
     current_cpu->current_dir = pagedir;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
+    phys &= ~0xFFF;
+    if (mem_usePCID) phys |= mem_getPCID(pagedir);
+
+    // Load PDBR
+    asm volatile ("movq %0, %%cr3" :: "r"(phys) : "memory");
+
+    arch_restore_interrupts(flags);
     return 0;
 
 }
@@ -228,6 +310,9 @@ page_t *mem_createVAS() {
  * @warning Make sure the VAS being freed isn't the current one selected
  */
 void mem_destroyVAS(page_t *vas) {
+    // The directory's memory can come back as another directory, which must not find this one's PCIDs
+    mem_dropPCID(vas);
+
     // !!!: <256 - requires problem zone to be fixed in mem_clone()
     for (size_t pml4e = 0; pml4e < 256; pml4e++) {
         if (vas[pml4e].bits.present) {
@@ -238,23 +323,38 @@ void mem_destroyVAS(page_t *vas) {
                     // Get the PD
                     page_t *pd = (page_t*)mem_remapPhys((pdpt[pdpte].bits.address << MEM_PAGE_SHIFT), 0);
                     for (size_t pde = 0; pde < 512; pde++) {
+                        if (pd[pde].bits.present && pd[pde].bits.size) {
+                            // 2MiB page, these are never shared
+                            if (MEM_PAGE_IS_USER(&pd[pde])) pmm_freeBlocks(pd[pde].bits.address << MEM_PAGE_SHIFT, MEM_PAGES_PER_LARGE);
+                            pd[pde].data = 0;
+                            continue;
+                        }
+
+                        if (pd[pde].bits.present && pd[pde].bits.cow) {
+                            // Shared page table, only the last directory using it frees it
+                            // The lock keeps the count steady for a directory that is unsharing it right now
+                            spinlock_t *lock = MEM_TABLE_LOCK(&pd[pde]);
+                            spinlock_acquire(lock);
+                            int refs = mem_decrementPageReference(&pd[pde]);
+                            spinlock_release(lock);
+
+                            if (refs) {
+                                pd[pde].data = 0;
+                                continue;
+                            }
+                        }
+
                         if (pd[pde].bits.present) {
                             // Get the PT
                             page_t *pt = (page_t*)mem_remapPhys((pd[pde].bits.address << MEM_PAGE_SHIFT), 0);
                             for (size_t pte = 0; pte < 512; pte++) {
                                 page_t *pg = &pt[pte];
-                                if (pg->bits.usermode && pg->bits.present) {
+                                if (MEM_PAGE_IS_USER(pg) && pg->bits.present) {
                                     // Free this page (only if refcounts == 0)
                                     uintptr_t address = ((pml4e << (9 * 3 + 12)) | (pdpte << (9*2 + 12)) | (pde << (9 + 12)) | (pte << MEM_PAGE_SHIFT));
                                     LOG(DEBUG, "Usermode page at address %016llX (frame: %p, cow waiting: %d, rw: %d) - FREE\n", address, MEM_GET_FRAME(pg), pg->bits.cow, pg->bits.rw);
 
-                                    if (pg->bits.rw) {
-                                        mem_freePage(pg);
-                                    } else {
-                                        if (!mem_decrementPageReference(pg)) {
-                                            pmm_freeBlock(MEM_GET_FRAME(pg));
-                                        }
-                                    }
+                                    mem_freePage(pg);
                                 }
                             }
 
@@ -283,44 +383,62 @@ void mem_destroyVAS(page_t *vas) {
 
 /**
  * @brief Handle a copy on write
+ * @param dir The directory the page is in, or NULL for the current directory
  * @param page The page to handle CoW on
  * @param address Address for TLB shootdown if required
  */
-static void mem_copyOnWrite(page_t *page, uintptr_t address) {
+static void mem_copyOnWrite(page_t *dir, page_t *page, uintptr_t address) {
     if (!page || !page->bits.cow) {
         LOG(ERR, "Cannot do copy-on-write for a page not pending copy-on-write\n");
         return;
     }
 
-    spinlock_acquire(&cow_lock);
+    if (MEM_IS_ZERO_PAGE(page)) {
+        // The shared zero page, nothing to copy
+        uintptr_t block = pmm_allocateBlock();
+        uintptr_t block_remap = mem_remapPhys(block, PAGE_SIZE);
+        memset((void*)block_remap, 0, PAGE_SIZE);
+        mem_unmapPhys(block_remap, PAGE_SIZE);
+
+        MEM_SET_FRAME(page, block);
+        page->bits.cow = 0;
+        page->bits.rw = 1;
+        mem_invalidatePage(dir, address);
+        return;
+    }
 
     // Is this the last reference to the page?
-    if (mem_decrementPageReference(page) == 0) {
+    // Only holders of a frame can add references to it, so if we're the only one left nobody else can come in
+    uint32_t refs = 1;
+    if (__atomic_compare_exchange_n(MEM_FRAME_REFS(page), &refs, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || !refs) {
         // Yes. We can just mark the page as writable
         page->bits.rw = 1;
         page->bits.cow = 0;
-        mem_invalidatePage(address);
-        spinlock_release(&cow_lock);
+        mem_invalidatePage(dir, address);
         return;
     }
 
-    uintptr_t src_frame = mem_remapPhys(MEM_GET_FRAME(page), PAGE_SIZE);
+    // Copy while still holding our reference, so nobody else can take the frame over and write to it meanwhile
+    uintptr_t src_frame_block = MEM_GET_FRAME(page);
+    uintptr_t src_frame = mem_remapPhys(src_frame_block, PAGE_SIZE);
     uintptr_t dest_frame_block = pmm_allocateBlock();
     uintptr_t dest_frame = mem_remapPhys(dest_frame_block, PAGE_SIZE);
     memcpy((void*)dest_frame, (void*)src_frame, PAGE_SIZE);
 
+    mem_unmapPhys(dest_frame, PAGE_SIZE);
+    mem_unmapPhys(src_frame, PAGE_SIZE);
+
     // Setup bits
     MEM_SET_FRAME(page, dest_frame_block);
     page->bits.cow = 0; // Not CoW
     page->bits.rw = 1;
 
-    mem_unmapPhys(dest_frame, PAGE_SIZE);
-    mem_unmapPhys(src_frame, PAGE_SIZE);
+    mem_invalidatePage(dir, address);
 
-    mem_invalidatePage(address);
+    // Drop our reference. If the others went away while we were copying, the old frame is ours to free
+    if (__atomic_sub_fetch(&mem_frames[src_frame_block >> MEM_PAGE_SHIFT].refs, 1, __ATOMIC_ACQ_REL) == 0) pmm_freeBlock(src_frame_block);
 
-    spinlock_release(&cow_lock);
-    LOG(DEBUG, "Finished performing CoW for page %p. Switched frames from %p -> %p\n", address, src_frame, dest_frame);
+    LOG(DEBUG, "Finished performing CoW for page %p. Switched frames from %p -> %p\n", address, src_frame_block, dest_frame_block);
     return;
 
 }
@@ -328,13 +446,22 @@ static void mem_copyOnWrite(page_t *page, uintptr_t address) {
 /**
  * @brief Maybe copy a usermode page. 
  * 
- * Does CoW if more than @c UINT8_MAX processes reference the page.
+ * Does CoW unless more than @c MEM_FRAME_MAX_REFS processes reference the page.
  * 
  * @param src_page The source page
  * @param dest_page The destination page
  * @param address Address for TLB shootdown
+ * @param batch TLB batch to add the source page to if it changes
+ * @note The source page must be in a table only the caller can change (its own, or a shared one with
+ *       its table lock held), the reference count is the only thing shared with other directories
  */
-static void mem_copyUserPage(page_t *src_page, page_t *dest_page, uintptr_t address, int force_no_cow) {
+static void mem_copyUserPage(page_t *src_page, page_t *dest_page, uintptr_t address, int force_no_cow, smp_tlb_batch_t *batch) {
+    // The shared zero page is already read-only and pending CoW, it can just be mapped again
+    if (MEM_IS_ZERO_PAGE(src_page)) {
+        dest_page->data = src_page->data;
+        return;
+    }
+
 #ifndef DISABLE_COW
     // When a page needs to be shared during a clone, it is automatically CoW'd and has
     // its reference counts initialized. Reference counts for a page are ONLY created when
@@ -357,20 +484,19 @@ static void mem_copyUserPage(page_t *src_page, page_t *dest_page, uintptr_t addr
         return;
     }
 
-    spinlock_acquire(&cow_lock);
-
-    // Is the source page writable or read only?
-    if (src_page->bits.rw) {
-        // Writable. That means the page is fresh and has no references.
+    // Is the source page already pending CoW?
+    // Read-only pages (e.g. after mprotect()) that aren't CoW are fresh too
+    if (!src_page->bits.cow) {
+        // No. That means the page is fresh and has no references.
         // Just make sure though
-        if (mem_pageReferences[src_page->bits.address]) {
+        if (__atomic_load_n(MEM_FRAME_REFS(src_page), __ATOMIC_ACQUIRE)) {
             // What? If a page has references it should be using CoW.
             kernel_panic_extended(MEMORY_MANAGEMENT_ERROR, "CoW", "*** Source page %p (frame %p) already has references. Corrupted references bitmap?\n", address, MEM_GET_FRAME(src_page));
             __builtin_unreachable();
         }
 
         // Initialize references
-        mem_pageReferences[src_page->bits.address] = 2;
+        __atomic_store_n(MEM_FRAME_REFS(src_page), 2, __ATOMIC_RELEASE);
 
         // Mark the source and destination page as R/O and set them both to have a CoW pending
         // Writes will trigger a page fault which the handler with detect and auto handle CoW
@@ -382,12 +508,11 @@ static void mem_copyUserPage(page_t *src_page, page_t *dest_page, uintptr_t addr
         dest_page->bits.cow = 1;
 
         // All done
-        mem_invalidatePage(address);
-        spinlock_release(&cow_lock);
+        smp_tlbBatchAdd(batch, address, PAGE_SIZE);
         return;
     }
 
-    // It's not writable and probably already has pending CoW
+    // It already has pending CoW
     // Can we add a new reference?
     if (mem_incrementPageReference(src_page) == 0) {
         // No. There are too many reference counts and we should copy the page.
@@ -405,13 +530,11 @@ static void mem_copyUserPage(page_t *src_page, page_t *dest_page, uintptr_t addr
 
         mem_unmapPhys(dest_frame, PAGE_SIZE);
         mem_unmapPhys(src_frame, PAGE_SIZE);
-        spinlock_release(&cow_lock);
         return;
     }
 
     // Yes, we can. Raw copy and return
     dest_page->data = src_page->data;
-    spinlock_release(&cow_lock);
 
 #else
     // Just copy the page
@@ -431,14 +554,117 @@ static void mem_copyUserPage(page_t *src_page, page_t *dest_page, uintptr_t addr
 #endif
 }
 
+/**
+ * @brief Share a page table between two directories during a clone
+ * 
+ * The PDE is marked R/O with @c cow set in both directories, and the table frame gets a reference
+ * count like a CoW page would. The first write through either PDE faults and calls @c mem_unshareTable.
+ * 
+ * @param src_pde The source PDE
+ * @param dest_pde The destination PDE
+ * @param address The address the table maps
+ * @param batch TLB batch to add the source table's range to if it changes
+ * @returns 1 if the table is now shared, 0 if it has to be copied
+ */
+static int mem_shareTable(page_t *src_pde, page_t *dest_pde, uintptr_t address, smp_tlb_batch_t *batch) {
+#ifndef DISABLE_COW
+    // Only share usermode tables. Stacks are always copied (see mem_clone) and the kernel's identity mapped
+    // tables are static, so they could never be freed by the last directory using them.
+    if (address >= MEM_USERMODE_STACK_REGION || (address >= MEM_DMA_REGION && address < MEM_DMA_REGION + MEM_DMA_REGION_SIZE)) return 0;
+    uintptr_t table = MEM_GET_FRAME(src_pde);
+    if (table >= (uintptr_t)mem_lowBasePT && table < (uintptr_t)mem_lowBasePT + sizeof(mem_lowBasePT)) return 0;
+
+    // The source directory is ours, so nobody can unshare this PDE meanwhile. Other directories
+    // sharing the table only ever touch its reference count.
+    if (src_pde->bits.cow) {
+        // Already shared, add another reference
+        if (mem_incrementPageReference(src_pde) == 0) {
+            // Too many references, copy it instead
+            return 0;
+        }
+    } else {
+        if (__atomic_load_n(MEM_FRAME_REFS(src_pde), __ATOMIC_ACQUIRE)) {
+            kernel_panic_extended(MEMORY_MANAGEMENT_ERROR, "CoW", "*** Page table for %p (frame %p) already has references. Corrupted references bitmap?\n", address, table);
+            __builtin_unreachable();
+        }
+
+        __atomic_store_n(MEM_FRAME_REFS(src_pde), 2, __ATOMIC_RELEASE);
+        src_pde->bits.rw = 0;
+        src_pde->bits.cow = 1;
+        smp_tlbBatchAdd(batch, address, PAGE_SIZE_LARGE);
+    }
+
+    dest_pde->data = src_pde->data;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Give a directory its own copy of a shared page table
+ * 
+ * The last directory using the table just takes it over. Otherwise the table is copied and
+ * every usermode page in it is shared CoW between the old and the new table, like @c mem_clone would.
+ * 
+ * @param dir The directory the PDE is in, or NULL for the current directory
+ * @param pde The PDE of the shared table
+ * @param address The address the table maps
+ */
+static void mem_unshareTable(page_t *dir, page_t *pde, uintptr_t address) {
+    smp_tlb_batch_t batch;
+    smp_tlbBatchInit(&batch, dir ? dir : current_cpu->current_dir);
+
+    // Copying the table changes the pages in it, so only one directory can unshare a table at once
+    spinlock_t *lock = MEM_TABLE_LOCK(pde);
+    spinlock_acquire(lock);
+
+    if (!pde->bits.cow) {
+        // Another thread got here first
+        spinlock_release(lock);
+        return;
+    }
+
+    if (__atomic_load_n(MEM_FRAME_REFS(pde), __ATOMIC_ACQUIRE) > 1) {
+        uintptr_t block = pmm_allocateBlock();
+        page_t *src = (page_t*)mem_remapPhys(MEM_GET_FRAME(pde), PMM_BLOCK_SIZE);
+        page_t *dest = (page_t*)mem_remapPhys(block, PMM_BLOCK_SIZE);
+
+        for (size_t i = 0; i < 512; i++) {
+            if (src[i].bits.present && MEM_PAGE_IS_USER(&src[i])) {
+                mem_copyUserPage(&src[i], &dest[i], address + (i << MEM_PAGE_SHIFT), 0, &batch);
+            } else {
+                dest[i].data = src[i].data;
+            }
+        }
+
+        mem_unmapPhys((uintptr_t)dest, PMM_BLOCK_SIZE);
+        mem_unmapPhys((uintptr_t)src, PMM_BLOCK_SIZE);
+
+        mem_decrementPageReference(pde);
+        MEM_SET_FRAME(pde, block);
+    } else {
+        // We're the last one using it
+        mem_decrementPageReference(pde);
+    }
+
+    pde->bits.rw = 1;
+    pde->bits.cow = 0;
+
+    spinlock_release(lock);
+
+    smp_tlbBatchAdd(&batch, address, PAGE_SIZE_LARGE);
+    smp_tlbBatchFlush(&batch);
+}
+
 spinlock_t clone_lock = { 0 };
 
 /**
  * @brief Clone a page directory.
  * 
  * This is a full PROPER page directory clone.
- * This function does it properly and clones the page directory, its tables, and their respective entries fully.
- * It also has the option to do CoW on usermode pages
+ * This function does it properly and clones the page directory and its PDPTs and PDs fully.
+ * Usermode page tables are shared CoW (see @c mem_shareTable) and only copied when first written to.
  * 
  * @param dir The source page directory. Keep as NULL to clone the current page directory.
  * @returns The page directory on success
@@ -449,13 +675,14 @@ page_t *mem_clone(page_t *dir) {
     // Create a new VAS
     page_t *dest = mem_createVAS();
 
+    // Source pages that get marked CoW are invalidated all at once at the end
+    smp_tlb_batch_t batch;
+    smp_tlbBatchInit(&batch, dir);
+
     LOG(DEBUG, "[CLONE   ] Clone page directory %016llX -> %016llX\n", dir, dest);
 
     // Copy top half. This contains the kernel's important regions, including the heap
-    // !!!: THIS IS A PROBLEM ZONE. The heap contains PDPTs/PDs/PTs that are premapped but not enough! With an infinitely
-    // !!!: expanding heap we create issues where once we run out of a PDPT the heap won't update in other PMLs. Page fault
-    // !!!: handlers can take care of this and remap PDPTs but for things like kernel stacks it might be better to map them as global
-    // !!!: (avoiding flushing them in TLB)
+    // Every kernel PML4 entry has a PDPT from mem_init on, so the kernel half is shared and anything mapped later shows up everywhere
     memcpy(&dest[256], &dir[256], 256 * sizeof(page_t));
 
     // Copy low PDPTs (i.e. usermode code location and kernel code)
@@ -504,14 +731,31 @@ page_t *mem_clone(page_t *dir) {
 
                 page_t *pt_destentry = &pd_dest[pt];
 
+                if (pt_srcentry->bits.size) {
+                    if (!MEM_PAGE_IS_USER(pt_srcentry)) {
+                        // Raw copy
+                        pt_destentry->data = pt_srcentry->data;
+                        continue;
+                    }
+
+                    // 2MiB pages are split so CoW can work on 4KiB pages
+                    mem_splitLargePage(dir, pt_srcentry, ((pdpt << (9 * 3 + 12)) | (pd << (9*2 + 12)) | (pt << (9 + 12))), &batch);
+                }
+
+                // Usermode tables are shared until one side writes to them (stacks are copied right away)
+                uintptr_t table_address = ((pdpt << (9 * 3 + 12)) | (pd << (9*2 + 12)) | (pt << (9 + 12)));
+                if (table_address < MEM_USERMODE_STACK_REGION && mem_shareTable(pt_srcentry, pt_destentry, table_address, &batch)) continue;
+
                 // Allocate a new page table
                 uintptr_t pt_dest_block = pmm_allocateBlock();
                 page_t *pt_dest  = (page_t*)mem_remapPhys(pt_dest_block, PAGE_SIZE);
                 memset((void*)pt_dest, 0, PAGE_SIZE);
 
-                // Do a raw copy but set the frame
+                // Do a raw copy but set the frame (the source table may be a shared one we couldn't add a reference to)
                 pt_destentry->data = pt_srcentry->data;
                 MEM_SET_FRAME(pt_destentry, pt_dest_block);
+                pt_destentry->bits.rw = 1;
+                pt_destentry->bits.cow = 0;
 
                 // Now map in the existing PT
                 page_t *pt_src = (page_t*)mem_remapPhys(MEM_GET_FRAME(pt_srcentry), PAGE_SIZE);
@@ -522,10 +766,10 @@ page_t *mem_clone(page_t *dir) {
                     page_t *page_dest = &pt_dest[page];
                     if (!page_src || !(page_src->bits.present)) continue; // Not present
 
-                    if (page_src->bits.usermode) {
+                    if (MEM_PAGE_IS_USER(page_src)) {
                         uintptr_t address = ((pdpt << (9 * 3 + 12)) | (pd << (9*2 + 12)) | (pt << (9 + 12)) | (page << MEM_PAGE_SHIFT));
-                        mem_copyUserPage(page_src, page_dest, address, (address >= MEM_USERMODE_STACK_REGION) ? 1 : 0);
-                        LOG(DEBUG, "Usermode page at address %016llX (frame: %p, refs: %d) - CoW\n", address, MEM_GET_FRAME(page_src), mem_pageReferences[page_src->bits.address]);
+                        mem_copyUserPage(page_src, page_dest, address, (address >= MEM_USERMODE_STACK_REGION) ? 1 : 0, &batch);
+                        LOG(DEBUG, "Usermode page at address %016llX (frame: %p, refs: %d) - CoW\n", address, MEM_GET_FRAME(page_src), __atomic_load_n(MEM_FRAME_REFS(page_src), __ATOMIC_RELAXED));
                     } else {
                         // Raw copy
                         page_dest->data = page_src->data;
@@ -535,6 +779,7 @@ page_t *mem_clone(page_t *dir) {
         }
     }
     
+    smp_tlbBatchFlush(&batch);
 
     return dest;
 }
@@ -550,6 +795,9 @@ page_t *mem_clone(page_t *dir) {
 void mem_mapAddress(page_t *dir, uintptr_t phys, uintptr_t virt, int flags) {
     if (!MEM_IS_CANONICAL(virt)) return;
 
+    // Kernel-only mappings in the kernel half are the same everywhere
+    if ((flags & MEM_PAGE_KERNEL) && MEM_IS_KERNEL_HALF(virt)) flags |= MEM_PAGE_GLOBAL;
+
     page_t *pg = mem_getPage(dir, virt, MEM_CREATE);
     if (pg) {
         mem_allocatePage(pg, MEM_PAGE_NOALLOC | flags);
@@ -559,26 +807,22 @@ void mem_mapAddress(page_t *dir, uintptr_t phys, uintptr_t virt, int flags) {
 
 
 /**
- * @brief Returns the page entry requested
+ * @brief Returns the page directory entry for an address
  * @param dir The directory to search. Specify NULL for current directory
- * @param address The virtual address of the page (will be aligned for you if not aligned)
- * @param flags The flags of the page to look for
- * 
- * @warning Specifying MEM_CREATE will only create needed structures, it will NOT allocate the page!
- *          Please use a function such as mem_allocatePage to do that.
+ * @param address The virtual address
+ * @param flags MEM_CREATE to create the PDPT and PD if they do not exist
+ * @returns The PDE, which can be a 2MiB page, or NULL
  */
-page_t *mem_getPage(page_t *dir, uintptr_t address, uintptr_t flags) {
+static page_t *mem_getPDE(page_t *dir, uintptr_t address, uintptr_t flags) {
     // Validate that the address is canonical
     if (!MEM_IS_CANONICAL(address)) return NULL;
 
-    // Align the address and get the dircetory
-    uintptr_t addr = (address % PAGE_SIZE != 0) ? MEM_ALIGN_PAGE_DESTRUCTIVE(address) : address;
     page_t *directory = (dir == NULL) ? current_cpu->current_dir : dir;
 
     // Get the PML4
-    page_t *pml4_entry = &(directory[MEM_PML4_INDEX(addr)]);
+    page_t *pml4_entry = &(directory[MEM_PML4_INDEX(address)]);
     if (!pml4_entry->bits.present) {
-        if (!flags & MEM_CREATE) goto bad_page;
+        if (!(flags & MEM_CREATE)) return NULL;
 
         // Allocate a new PML4 entry and zero it
         uintptr_t block = pmm_allocateBlock();
@@ -596,10 +840,10 @@ page_t *mem_getPage(page_t *dir, uintptr_t address, uintptr_t flags) {
 
     // Get the PDPT and the entry
     page_t *pdpt = (page_t*)mem_remapPhys(MEM_GET_FRAME(pml4_entry), PMM_BLOCK_SIZE);
-    page_t *pdpt_entry = &(pdpt[MEM_PDPT_INDEX(addr)]);
+    page_t *pdpt_entry = &(pdpt[MEM_PDPT_INDEX(address)]);
     
     if (!pdpt_entry->bits.present) {
-        if (!flags & MEM_CREATE) goto bad_page;
+        if (!(flags & MEM_CREATE)) return NULL;
 
         // Allocate a new PDPT entry and zero it
         uintptr_t block = pmm_allocateBlock();
@@ -622,10 +866,120 @@ page_t *mem_getPage(page_t *dir, uintptr_t address, uintptr_t flags) {
 
     // Get the PD and the entry
     page_t *pd = (page_t*)mem_remapPhys(MEM_GET_FRAME(pdpt_entry), PMM_BLOCK_SIZE);
-    page_t *pde = &(pd[MEM_PAGEDIR_INDEX(addr)]);
+    return &(pd[MEM_PAGEDIR_INDEX(address)]);
+}
+
+/**
+ * @brief Split a 2MiB page into a page table of 4KiB pages
+ * @param dir The directory the page is in, or NULL for the current directory
+ * @param pde The PDE of the 2MiB page
+ * @param address The address of the 2MiB page
+ * @param batch Optional TLB batch to add the 2MiB page to. If NULL, it is shot down immediately
+ */
+static void mem_splitLargePage(page_t *dir, page_t *pde, uintptr_t address, smp_tlb_batch_t *batch) {
+    uintptr_t frame = MEM_GET_FRAME(pde);
+
+    uintptr_t block = pmm_allocateBlock();
+    page_t *table = (page_t*)mem_remapPhys(block, PMM_BLOCK_SIZE);
+
+    // Every 4KiB page keeps the protection of the 2MiB page
+    for (size_t i = 0; i < MEM_PAGES_PER_LARGE; i++) {
+        table[i].data = 0;
+        table[i].bits.present = 1;
+        table[i].bits.rw = pde->bits.rw;
+        table[i].bits.usermode = pde->bits.usermode;
+        table[i].bits.noaccess = pde->bits.noaccess;
+        table[i].bits.writethrough = pde->bits.writethrough;
+        table[i].bits.cache_disable = pde->bits.cache_disable;
+        table[i].bits.nx = pde->bits.nx;
+        MEM_SET_FRAME((&table[i]), (frame + i * PAGE_SIZE));
+    }
+
+    mem_unmapPhys((uintptr_t)table, PMM_BLOCK_SIZE);
+
+    // Point the PDE at the table
+    page_t entry = { .data = 0 };
+    entry.bits.present = 1;
+    entry.bits.rw = 1;
+    entry.bits.usermode = 1;
+    MEM_SET_FRAME((&entry), block);
+    pde->data = entry.data;
+
+    if (batch) {
+        smp_tlbBatchAdd(batch, address, PAGE_SIZE_LARGE);
+    } else {
+        smp_tlbShootdownRange(dir ? dir : current_cpu->current_dir, address, PAGE_SIZE_LARGE);
+    }
+}
+
+/**
+ * @brief Map a fresh 2MiB page
+ * @param pde The PDE to map the page in (must not be present)
+ * @param flags The flags to use, see @c mem_allocatePage
+ * @returns 1 on success, 0 if there wasn't a free, aligned 2MiB block of memory
+ */
+static int mem_allocateLargePage(page_t *pde, uintptr_t flags) {
+    uintptr_t block = pmm_tryAllocateBlocks(MEM_PAGES_PER_LARGE);
+    if (!block) return 0;
+
+    page_t entry = { .data = 0 };
+    entry.bits.present = 1;
+    entry.bits.size = 1;
+    entry.bits.rw = (flags & MEM_PAGE_READONLY) ? 0 : 1;
+    entry.bits.usermode = (flags & MEM_PAGE_KERNEL) ? 0 : 1;
+    entry.bits.writethrough = (flags & MEM_PAGE_WRITETHROUGH) ? 1 : 0;
+    entry.bits.cache_disable = (flags & MEM_PAGE_NOT_CACHEABLE) ? 1 : 0;
+    MEM_SET_FRAME((&entry), block);
+    pde->data = entry.data;
+
+    return 1;
+}
+
+/**
+ * @brief Look up the page entry for an address without changing any paging structures
+ * @param dir The directory to search. Specify NULL for current directory
+ * @param address The virtual address of the page
+ * @returns The page entry or NULL if there is no page table (or it is a 2MiB page)
+ * @note Unlike @c mem_getPage this doesn't unshare page tables, so don't change the returned page.
+ */
+static page_t *mem_lookupPage(page_t *dir, uintptr_t address) {
+    page_t *pde = mem_getPDE(dir, address, MEM_DEFAULT);
+    if (!pde || !pde->bits.present || pde->bits.size) return NULL;
+
+    page_t *table = (page_t*)mem_remapPhys(MEM_GET_FRAME(pde), PMM_BLOCK_SIZE);
+    return &(table[MEM_PAGETBL_INDEX(address)]);
+}
+
+/**
+ * @brief Returns the page entry requested
+ * @param dir The directory to search. Specify NULL for current directory
+ * @param address The virtual address of the page (will be aligned for you if not aligned)
+ * @param flags The flags of the page to look for
+ * 
+ * @warning Specifying MEM_CREATE will only create needed structures, it will NOT allocate the page!
+ *          Please use a function such as mem_allocatePage to do that.
+ * 
+ * @note Usermode 2MiB pages are split when MEM_CREATE is given, since the caller wants to change a single page.
+ *       Otherwise NULL is returned for them - use @c mem_getPhysicalAddress or @c mem_validate to look them up.
+ * @note Page tables shared by @c mem_clone are unshared first.
+ */
+page_t *mem_getPage(page_t *dir, uintptr_t address, uintptr_t flags) {
+    // Align the address and get the PDE
+    uintptr_t addr = (address % PAGE_SIZE != 0) ? MEM_ALIGN_PAGE_DESTRUCTIVE(address) : address;
+    page_t *pde = mem_getPDE(dir, addr, flags);
+    if (!pde) return NULL;
+
+    if (pde->bits.present && pde->bits.size) {
+        // LOG(WARN, "Tried to get page from a PD that is 2MiB\n");
+        if (!(flags & MEM_CREATE) || !pde->bits.usermode) return NULL;
+        mem_splitLargePage(dir, pde, addr & ~(PAGE_SIZE_LARGE - 1), NULL);
+    }
+
+    // The caller may change the page, so it can't be in a table shared with another directory
+    if (pde->bits.present && pde->bits.cow) mem_unshareTable(dir, pde, addr & ~(PAGE_SIZE_LARGE - 1));
 
     if (!pde->bits.present) {
-        if (!flags & MEM_CREATE) goto bad_page;
+        if (!(flags & MEM_CREATE)) return NULL;
 
         // Allocate a new PDE and zero it
         uintptr_t block = pmm_allocateBlock();
@@ -642,20 +996,12 @@ page_t *mem_getPage(page_t *dir, uintptr_t address, uintptr_t flags) {
         mem_unmapPhys(block_remap, PMM_BLOCK_SIZE); // we don't even have to do this
     }
 
-    if (pde->bits.size) {
-        // LOG(WARN, "Tried to get page from a PD that is 2MiB\n");
-        return NULL;
-    }
-
     // Get the table
     page_t *table = (page_t*)mem_remapPhys(MEM_GET_FRAME(pde), PMM_BLOCK_SIZE);
     page_t *pte = &(table[MEM_PAGETBL_INDEX(addr)]);
 
     // Return
     return pte;
-
-bad_page:
-    return NULL;
 }
 
 
@@ -677,6 +1023,12 @@ void mem_allocatePage(page_t *page, uintptr_t flags) {
         return;
     }
 
+    if (flags & MEM_PAGE_ZERO) {
+        // Map the shared zero page, the CoW fault handles the first write
+        MEM_SET_FRAME(page, mem_zeroFrame);
+        flags |= MEM_PAGE_NOALLOC | MEM_PAGE_READONLY;
+    }
+
     if (!(flags & MEM_PAGE_NOALLOC)) {
         // There isn't a frame configured, and the user wants to allocate one.
         uintptr_t block = pmm_allocateBlock();
@@ -689,6 +1041,9 @@ void mem_allocatePage(page_t *page, uintptr_t flags) {
     page->bits.usermode         = (flags & MEM_PAGE_KERNEL) ? 0 : 1;
     page->bits.writethrough     = (flags & MEM_PAGE_WRITETHROUGH) ? 1 : 0;
     page->bits.cache_disable    = (flags & MEM_PAGE_NOT_CACHEABLE) ? 1 : 0;
+    page->bits.cow              = (flags & MEM_PAGE_ZERO) ? 1 : 0;
+    page->bits.noaccess         = 0;
+    page->bits.global           = (flags & MEM_PAGE_GLOBAL) ? 1 : 0;
 
     if (flags & MEM_PAGE_WRITE_COMBINE) {
         // Index into #6 entry of PAT
@@ -699,26 +1054,49 @@ void mem_allocatePage(page_t *page, uintptr_t flags) {
 }
 
 /**
- * @brief Free a page
- * 
- * @param page The page to free
+ * @brief Unmap a page and drop its reference to its frame
+ * @param page The page to unmap
+ * @returns The frame to free (once no TLB can map it anymore), or 0x0 if it is still in use or never freed
  */
-void mem_freePage(page_t *page) {
-    if (!page) return;
+static uintptr_t mem_releasePage(page_t *page) {
+    if (MEM_IS_ZERO_PAGE(page)) {
+        // The shared zero page is never freed
+        page->data = 0;
+        return 0x0;
+    }
 
     // Check reference counts
-    if (mem_pageReferences[page->bits.address]) {
-        if (mem_decrementPageReference(page)) return; // Still references on this page
+    if (__atomic_load_n(MEM_FRAME_REFS(page), __ATOMIC_ACQUIRE)) {
+        if (mem_decrementPageReference(page)) {
+            // Still references on this page, only our mapping goes away
+            page->data = 0;
+            return 0x0;
+        }
     }
 
+    uintptr_t frame = MEM_GET_FRAME(page);
+
     // Mark the page as not present
     page->bits.present = 0;
     page->bits.rw = 0;
     page->bits.usermode = 0;
-    
-    // Free the block
-    pmm_freeBlock(MEM_GET_FRAME(page));
+    page->bits.cow = 0;
+    page->bits.noaccess = 0;
     MEM_SET_FRAME(page, 0x0);
+
+    return frame;
+}
+
+/**
+ * @brief Free a page
+ * 
+ * @param page The page to free
+ */
+void mem_freePage(page_t *page) {
+    if (!page) return;
+
+    uintptr_t frame = mem_releasePage(page);
+    if (frame) pmm_freeBlock(frame);
 }
 
 
@@ -764,7 +1142,10 @@ uintptr_t mem_getPhysicalAddress(page_t *dir, uintptr_t virtaddr) {
         virtaddr = virtaddr & ~0xFFF;
     } 
     
-    page_t *pg = mem_getPage(dir, virtaddr, MEM_DEFAULT);
+    page_t *pde = mem_getPDE(dir, virtaddr, MEM_DEFAULT);
+    if (pde && pde->bits.present && pde->bits.size) return MEM_GET_FRAME(pde) + (virtaddr & (PAGE_SIZE_LARGE - 1)) + offset;
+
+    page_t *pg = mem_lookupPage(dir, virtaddr);
 
     if (pg) return MEM_GET_FRAME(pg) + offset;
     return 0x0;
@@ -779,22 +1160,62 @@ uintptr_t mem_getPhysicalAddress(page_t *dir, uintptr_t virtaddr) {
 int mem_pageFault(uintptr_t exception_index, registers_t *regs, extended_registers_t *regs_extended) {
     // Check if this was a usermode page fault
     if (regs->cs != 0x08) {
-        // Yes, it was
+        // Yes, it was. Is the page table still shared from a fork?
+        page_t *pde = mem_getPDE(NULL, regs_extended->cr2, MEM_DEFAULT);
+        if (pde && pde->bits.present && pde->bits.cow) {
+            // Get our own copy and retry, any page CoW is handled by the next fault
+            mem_unshareTable(NULL, pde, regs_extended->cr2 & ~(PAGE_SIZE_LARGE - 1));
+            return 0;
+        }
+
+        // Writing to a read-only mapping is never resolved, even if the page is still pending CoW
+        int prot = vma_getProtection(&current_cpu->current_process->vmas, regs_extended->cr2);
+        if (prot == PROT_NONE || (prot > 0 && !(prot & PROT_WRITE) && (regs->err_code & 0x2))) goto _fault;
+
         page_t *pg = mem_getPage(NULL, regs_extended->cr2, MEM_DEFAULT);
         if (pg) {
             if (pg->bits.cow) {
-                mem_copyOnWrite(pg, regs_extended->cr2);
+                mem_copyOnWrite(NULL, pg, regs_extended->cr2);
                 return 0;
             }
         }
 
+        // Part of a mapping that hasn't been populated yet?
+        if (vma_fault(&current_cpu->current_process->vmas, regs_extended->cr2, regs->err_code & 0x2)) return 0;
+
         // Was this an exception because we didn't map their heap?
         if (regs_extended->cr2 >= current_cpu->current_process->heap_base && regs_extended->cr2 < current_cpu->current_process->heap) {
-            // Yes, it was, handle appropriately by mapping this page
-            mem_allocatePage(mem_getPage(NULL, regs_extended->cr2, MEM_CREATE), MEM_DEFAULT);
-            return 0;
+            if (!(regs->err_code & 0x2)) {
+                // Reads of untouched heap get the shared zero page until they are written to
+                page_t *zero_pg = mem_getPage(NULL, regs_extended->cr2, MEM_CREATE);
+                if (zero_pg && !zero_pg->bits.present) {
+                    mem_allocatePage(zero_pg, MEM_PAGE_ZERO);
+                    return 0;
+                }
+            }
+
+#ifndef DISABLE_HUGE_PAGES
+            // If the whole 2MiB around the fault is heap and nothing is mapped there yet, map a 2MiB page
+            uintptr_t large = regs_extended->cr2 & ~(PAGE_SIZE_LARGE - 1);
+            if (large >= current_cpu->current_process->heap_base && large + PAGE_SIZE_LARGE <= current_cpu->current_process->heap) {
+                page_t *pde = mem_getPDE(NULL, large, MEM_CREATE);
+                if (pde && !pde->bits.present && mem_allocateLargePage(pde, MEM_DEFAULT)) {
+                    memset((void*)mem_remapPhys(MEM_GET_FRAME(pde), PAGE_SIZE_LARGE), 0, PAGE_SIZE_LARGE);
+                    return 0;
+                }
+            }
+#endif
+
+            // Yes, it was, handle appropriately by mapping a zeroed page
+            page_t *heap_pg = mem_getPage(NULL, regs_extended->cr2, MEM_CREATE);
+            if (heap_pg && !heap_pg->bits.present) {
+                mem_allocatePage(heap_pg, MEM_DEFAULT);
+                memset((void*)mem_remapPhys(MEM_GET_FRAME(heap_pg), PAGE_SIZE), 0, PAGE_SIZE);
+                return 0;
+            }
         }
 
+_fault:
         // TODO: This code can probably bug out - to be extensively tested
         printf(COLOR_CODE_RED "Process \"%s\" (PID: %d) encountered a page fault at address %p and will be shutdown\n" COLOR_CODE_RESET, current_cpu->current_process->name, current_cpu->current_process->pid, regs_extended->cr2);
         LOG(ERR, "Process \"%s\" (PID: %d) encountered page fault at %p with no valid resolution (error code: 0x%x). Shutdown\n", current_cpu->current_process->name, current_cpu->current_process->pid, regs_extended->cr2, regs->err_code);
@@ -803,6 +1224,9 @@ int mem_pageFault(uintptr_t exception_index, registers_t *regs, extended_registe
     }
 
 
+    // The kernel can touch mappings that haven't been populated yet too (e.g. system call buffers)
+    if (regs_extended->cr2 < MEM_USERMODE_STACK_REGION && current_cpu->current_process && vma_fault(&current_cpu->current_process->vmas, regs_extended->cr2, 1)) return 0;
+
     // Page fault, get the address
     kernel_panic_prepare(CPU_EXCEPTION_UNHANDLED);
     
@@ -895,7 +1319,7 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
 
         // Using 512-page blocks
         for (size_t j = 0; j < 512; j++) {
-            mem_highBasePDs[i][j].data = ((i << 30) + (j << 21)) | 0x80 | 0x03;
+            mem_highBasePDs[i][j].data = ((i << 30) + (j << 21)) | 0x100 | 0x80 | 0x03; // Global, 2MiB, R/W, present
         }
     }
 
@@ -961,50 +1385,44 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
     mem_kernelPML[0][510].bits.rw = 1;
     mem_kernelPML[0][510].bits.usermode = 1;
     
+    // The PMM storage has to fit in the heap base PTs. Anything above what they can describe is left unused
+    uintptr_t max_mem_size = ((uintptr_t)512 * MEM_HEAP_BASE_PTS * PAGE_SIZE / pmm_getStorageSize(PMM_BLOCK_SIZE)) * PMM_BLOCK_SIZE;
+    if (mem_size > max_mem_size) {
+        LOG(WARN, "Too much memory available - only using the first %d MB of %d MB\n", max_mem_size / 1024 / 1024, mem_size / 1024 / 1024);
+        mem_size = max_mem_size;
+    }
+
     // Calculate the amount of pages required for our PMM
-    size_t frame_bytes = PMM_INDEX_BIT((mem_size >> 12) * 8);
+    size_t frame_bytes = pmm_getStorageSize(mem_size);
     frame_bytes = MEM_ALIGN_PAGE(frame_bytes);
     size_t frame_pages = frame_bytes >> MEM_PAGE_SHIFT;
 
-    if (frame_pages > 512 * 3) {
-        // 512 * 3 = size of the heap base provided, so that's not great.
-        LOG(WARN, "Too much memory available - %i pages required for allocation bitmap (max 1536)\n", frame_pages);
-        // TODO: We can probably resolve this by just rewriting some parts of mem_mapAddress
-    }
-
     // Setup hierarchy (ugly)
     mem_heapBasePDPT[0].bits.address = ((uintptr_t)&mem_heapBasePD >> MEM_PAGE_SHIFT);
     mem_heapBasePDPT[0].bits.present = 1;
     mem_heapBasePDPT[0].bits.rw = 1;
     mem_heapBasePDPT[0].bits.usermode = 1;
 
-    mem_heapBasePD[0].bits.address = ((uintptr_t)&mem_heapBasePT[0] >> MEM_PAGE_SHIFT);
-    mem_heapBasePD[0].bits.present = 1;
-    mem_heapBasePD[0].bits.rw = 1;
-    mem_heapBasePD[0].bits.usermode = 1;
-
-    mem_heapBasePD[1].bits.address = ((uintptr_t)&mem_heapBasePT[512] >> MEM_PAGE_SHIFT);
-    mem_heapBasePD[1].bits.present = 1;
-    mem_heapBasePD[1].bits.rw = 1;
-    mem_heapBasePD[1].bits.usermode = 1;
-
-    mem_heapBasePD[2].bits.address = ((uintptr_t)&mem_heapBasePT[1024] >> MEM_PAGE_SHIFT);
-    mem_heapBasePD[2].bits.present = 1;
-    mem_heapBasePD[2].bits.rw = 1;
-    mem_heapBasePD[2].bits.usermode = 1;
+    for (size_t i = 0; i < MEM_HEAP_BASE_PTS; i++) {
+        mem_heapBasePD[i].bits.address = ((uintptr_t)&mem_heapBasePT[i * 512] >> MEM_PAGE_SHIFT);
+        mem_heapBasePD[i].bits.present = 1;
+        mem_heapBasePD[i].bits.rw = 1;
+        mem_heapBasePD[i].bits.usermode = 1;
+    }
 
     // Map a bunch o' entries
     for (size_t i = 0; i < frame_pages; i++) {
         mem_heapBasePT[i].bits.address = ((kernel_addr + (i << 12)) >> MEM_PAGE_SHIFT);
         mem_heapBasePT[i].bits.present = 1;
         mem_heapBasePT[i].bits.rw = 1;
+        mem_heapBasePT[i].bits.global = 1;
     }
 
     // Tada. We've finished setting up our heap, so now we need to use mem_remapPhys to remap our PML.
     current_cpu->current_dir = (page_t*)mem_remapPhys((uintptr_t)current_cpu->current_dir, 0x0); // Size is arbitrary
 
     // Now that we have a heap mapped, we can allocate frame bytes.
-    uintptr_t *frames = (uintptr_t*)MEM_HEAP_REGION;
+    void *frames = (void*)MEM_HEAP_REGION;
 
     // Initialize PMM
     pmm_init(mem_size, frames); 
@@ -1014,6 +1432,9 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
     extern void arch_mark_memory(uintptr_t highest_address, uintptr_t mem_size);
     arch_mark_memory(kernel_pts * 512 * PAGE_SIZE, mem_size);
 
+    // The PMM storage lives right after the kernel and can run past the region marked above
+    pmm_deinitializeRegion(kernel_addr, frame_bytes);
+
     // Setup kernel heap to point to after frames
     mem_kernelHeap = MEM_HEAP_REGION + frame_bytes;
 
@@ -1031,12 +1452,26 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
         if (pg) pg->bits.rw = 0;
     }
 
-    // Make space for reference counts in kernel heap
+    // Make space for the per-frame metadata in kernel heap
     // Reference counts will be initialized when a user PTE is copied.
-    size_t refcount_bytes = frame_bytes;  // One byte per page
+    size_t refcount_bytes = (mem_size / PAGE_SIZE) * sizeof(mem_frame_t);  // One entry per frame
     refcount_bytes = (refcount_bytes & 0xFFF) ? MEM_ALIGN_PAGE(refcount_bytes) : refcount_bytes;
-    mem_pageReferences = (uint8_t*)mem_sbrk(refcount_bytes);
-    memset(mem_pageReferences, 0, refcount_bytes);
+    mem_frames = (mem_frame_t*)mem_sbrk(refcount_bytes);
+    memset(mem_frames, 0, refcount_bytes);
+
+    // Give every kernel PML4 entry a PDPT now. mem_clone shares the kernel half by copying these entries,
+    // so this way tables created later are seen by every directory
+    for (size_t i = 256; i < 512; i++) {
+        if (mem_kernelPML[0][i].bits.present) continue;
+
+        uintptr_t pdpt = pmm_allocateBlock();
+        memset((void*)mem_remapPhys(pdpt, PAGE_SIZE), 0, PAGE_SIZE);
+        mem_kernelPML[0][i].data = pdpt | 0x07;
+    }
+
+    // Allocate the shared zero frame
+    mem_zeroFrame = pmm_allocateBlock();
+    memset((void*)mem_remapPhys(mem_zeroFrame, PAGE_SIZE), 0, PAGE_SIZE);
 
     // Setup the PAT
     // TODO: Write a better interface for the PAT
@@ -1053,6 +1488,11 @@ void mem_init(uintptr_t mem_size, uintptr_t kernel_addr) {
     // Initialize regions
     mem_regionsInitialize();
 
+    // Global pages and PCIDs
+    mem_usePCID = cpu_pcidSupported();
+    mem_initializeTLB();
+    LOG(INFO, "Global pages: %s, PCIDs: %s\n", cpu_pgeSupported() ? "yes" : "no", mem_usePCID ? "yes" : "no");
+
     // Register page fault
     hal_registerExceptionHandler(14, mem_pageFault);
 
@@ -1132,6 +1572,9 @@ uintptr_t mem_allocate(uintptr_t start, size_t size, uintptr_t flags, uintptr_t
         page_flags |= MEM_PAGE_KERNEL;
     }
 
+    // Kernel-only mappings in the kernel half are the same everywhere
+    if ((page_flags & MEM_PAGE_KERNEL) && MEM_IS_KERNEL_HALF(start)) page_flags |= MEM_PAGE_GLOBAL;
+
     // Align start
     uintptr_t size_actual = size + (start & 0xFFF);
     start &= ~0xFFF;
@@ -1160,6 +1603,17 @@ uintptr_t mem_allocate(uintptr_t start, size_t size, uintptr_t flags, uintptr_t
 
     // Now actually start mapping
     for (uintptr_t i = start; i < start + size_actual; i += PAGE_SIZE) {
+#ifndef DISABLE_HUGE_PAGES
+        // Usermode ranges covering a whole, unmapped 2MiB page get a 2MiB page (if the PMM has one)
+        if (!(flags & MEM_ALLOC_CONTIGUOUS) && !(page_flags & MEM_LARGE_PAGE_EXCLUDE) && !(i & (PAGE_SIZE_LARGE - 1)) && i + PAGE_SIZE_LARGE <= start + size_actual) {
+            page_t *pde = mem_getPDE(NULL, i, MEM_CREATE);
+            if (pde && !pde->bits.present && mem_allocateLargePage(pde, page_flags)) {
+                i += PAGE_SIZE_LARGE - PAGE_SIZE;
+                continue;
+            }
+        }
+#endif
+
         page_t *pg = mem_getPage(NULL, i, MEM_CREATE); 
         if (!pg) {
             LOG(ERR, "Could not get page at %p\n", i);
@@ -1194,6 +1648,21 @@ _error:
     return 0x0;
 }
 
+/**
+ * @brief Flush a TLB batch and then give back the frames that were unmapped in it
+ * @param batch The batch
+ * @param frames The frames
+ * @param count The amount of frames
+ */
+static void mem_freeDeferred(smp_tlb_batch_t *batch, mem_deferred_free_t *frames, size_t count) {
+    smp_tlbBatchFlush(batch);
+
+    for (size_t i = 0; i < count; i++) {
+        if (frames[i].blocks == 1) pmm_freeBlock(frames[i].frame);
+        else pmm_freeBlocks(frames[i].frame, frames[i].blocks);
+    }
+}
+
 /**
  * @brief Free a region of memory
  * @param start The starting virtual address (must be specified)
@@ -1213,16 +1682,64 @@ void mem_free(uintptr_t start, size_t size, uintptr_t flags) {
     // If we're getting from heap, grab lock
     if (flags & MEM_ALLOC_HEAP) spinlock_acquire(&heap_lock);
 
+    // Every page we free is shot down in one go at the end. Frames are only given back after that,
+    // another CPU could still reach them through its TLB before
+    smp_tlb_batch_t batch;
+    smp_tlbBatchInit(&batch, current_cpu->current_dir);
+    mem_deferred_free_t frames[MEM_FREE_DEFER_MAX];
+    size_t frame_count = 0;
+    uintptr_t pending = start;  // First address not added to the batch yet
+
     // Start freeing
     for (uintptr_t i = start; i < start + size; i += PAGE_SIZE) {
+        if (frame_count == MEM_FREE_DEFER_MAX) {
+            // No room for more frames, flush what we have so far
+            smp_tlbBatchAdd(&batch, pending, i - pending);
+            mem_freeDeferred(&batch, frames, frame_count);
+            frame_count = 0;
+            pending = i;
+        }
+
+#ifndef DISABLE_HUGE_PAGES
+        page_t *pde = mem_getPDE(NULL, i, MEM_DEFAULT);
+        if (pde && pde->bits.present && pde->bits.size && MEM_PAGE_IS_USER(pde)) {
+            uintptr_t large = i & ~(PAGE_SIZE_LARGE - 1);
+            if (large == i && i + PAGE_SIZE_LARGE <= start + size) {
+                // The whole 2MiB page is going
+                frames[frame_count].frame = MEM_GET_FRAME(pde);
+                frames[frame_count++].blocks = MEM_PAGES_PER_LARGE;
+                pde->data = 0;
+                i += PAGE_SIZE_LARGE - PAGE_SIZE;
+                continue;
+            }
+
+            // Only part of it is, split it
+            mem_splitLargePage(NULL, pde, large, &batch);
+        }
+#endif
+
+        // Lazily populated mappings (see vma.c) can have holes, skip whole tables that were never created
         page_t *pg = mem_getPage(NULL, i, MEM_DEFAULT);
         if (!pg) {
-            LOG(WARN, "Tried to free page %p but it is not present (?)\n", i);
+            i = (i & ~(PAGE_SIZE_LARGE - 1)) + PAGE_SIZE_LARGE - PAGE_SIZE;
+            continue;
         }
+
+        if (!pg->bits.present) continue;
+
+        // Kernel mappings are shared by every directory
+        if (!MEM_PAGE_IS_USER(pg)) batch.dir = NULL;
         
-        mem_allocatePage(pg, MEM_PAGE_FREE);
+        uintptr_t frame = mem_releasePage(pg);
+        if (frame) {
+            frames[frame_count].frame = frame;
+            frames[frame_count++].blocks = 1;
+        }
     }
 
+    smp_tlbBatchAdd(&batch, pending, start + size - pending);
+    mem_freeDeferred(&batch, frames, frame_count);
+
     // All done
     if (flags & MEM_ALLOC_HEAP) {
         mem_kernelHeap -= size;
@@ -1230,6 +1747,91 @@ void mem_free(uintptr_t start, size_t size, uintptr_t flags) {
     }
 }
 
+/**
+ * @brief Change the protection of the present usermode pages in a range of the current directory
+ * @param start The starting virtual address (page aligned)
+ * @param size The size of the range
+ * @param flags @c MEM_PAGE_READONLY to make the pages read-only, otherwise they become writable.
+ *              @c MEM_PAGE_KERNEL to make them inaccessible to usermode until the next call without it
+ * @note Pages pending CoW stay read-only, the CoW fault makes them writable
+ */
+void mem_protect(uintptr_t start, size_t size, uintptr_t flags) {
+    if (!MEM_IS_CANONICAL(start) || !size) return;
+
+    int writable = (flags & MEM_PAGE_READONLY) ? 0 : 1;
+    int noaccess = (flags & MEM_PAGE_KERNEL) ? 1 : 0;
+
+    smp_tlb_batch_t batch;
+    smp_tlbBatchInit(&batch, current_cpu->current_dir);
+
+    for (uintptr_t i = start; i < start + size; i += PAGE_SIZE) {
+#ifndef DISABLE_HUGE_PAGES
+        page_t *pde = mem_getPDE(NULL, i, MEM_DEFAULT);
+        if (pde && pde->bits.present && pde->bits.size && MEM_PAGE_IS_USER(pde)) {
+            uintptr_t large = i & ~(PAGE_SIZE_LARGE - 1);
+            if (large == i && i + PAGE_SIZE_LARGE <= start + size) {
+                // The whole 2MiB page changes
+                pde->bits.rw = writable;
+                pde->bits.usermode = !noaccess;
+                pde->bits.noaccess = noaccess;
+                i += PAGE_SIZE_LARGE - PAGE_SIZE;
+                continue;
+            }
+
+            // Only part of it does, split it
+            mem_splitLargePage(NULL, pde, large, &batch);
+        }
+#endif
+
+        // Skip whole tables that were never created
+        page_t *pg = mem_getPage(NULL, i, MEM_DEFAULT);
+        if (!pg) {
+            i = (i & ~(PAGE_SIZE_LARGE - 1)) + PAGE_SIZE_LARGE - PAGE_SIZE;
+            continue;
+        }
+
+        if (!pg->bits.present || !MEM_PAGE_IS_USER(pg)) continue;
+        pg->bits.rw = (writable && !pg->bits.cow) ? 1 : 0;
+        pg->bits.usermode = !noaccess;
+        pg->bits.noaccess = noaccess;
+    }
+
+    smp_tlbBatchAdd(&batch, start, size);
+    smp_tlbBatchFlush(&batch);
+}
+
+/**
+ * @brief Give a usermode page pending CoW (or mapping the shared zero page) its own frame
+ * @param address The address of the page in the current directory
+ * @returns 1 if the page has its own frame now, 0 if it wasn't pending CoW (or in a shared table)
+ * @note The kernel doesn't fault on writes to read-only pages, so call this before writing to such a page
+ */
+int mem_breakCopyOnWrite(uintptr_t address) {
+    if (!MEM_IS_CANONICAL(address)) return 0;
+    address &= ~0xFFF;
+
+    page_t *pde = mem_getPDE(NULL, address, MEM_DEFAULT);
+    if (!pde || !pde->bits.present || pde->bits.size) return 0;
+
+    // Don't unshare the table unless the page needs it. A table still shared from a fork keeps its pages
+    // writable, only the PDE is read-only, so the kernel would write into the frame the other directory maps
+    page_t *pg = mem_lookupPage(NULL, address);
+    if (!pg || !pg->bits.present || !pg->bits.usermode || (!pg->bits.cow && !pde->bits.cow)) return 0;
+
+    // Read-only mappings keep sharing their frames
+    if (current_cpu->current_process) {
+        int prot = vma_getProtection(&current_cpu->current_process->vmas, address);
+        if (prot >= 0 && !(prot & PROT_WRITE)) return 0;
+    }
+
+    // This unshares the table. The page is only pending CoW afterwards if another directory still uses the old table
+    pg = mem_getPage(NULL, address, MEM_DEFAULT);
+    if (!pg) return 0;
+
+    if (pg->bits.cow) mem_copyOnWrite(NULL, pg, address);
+    return 1;
+}
+
 /**
  * @brief Validate a specific pointer in memory
  * @param ptr The pointer you wish to validate
@@ -1238,8 +1840,21 @@ void mem_free(uintptr_t start, size_t size, uintptr_t flags) {
  */
 int mem_validate(void *ptr, unsigned int flags) {
     // Get page of pointer
-    page_t *pg = mem_getPage(NULL, (uintptr_t)ptr, MEM_DEFAULT);
-    if (!pg) return 0;
+    page_t *pg = mem_lookupPage(NULL, (uintptr_t)ptr);
+    if (!pg) {
+        // Maybe it's in a 2MiB page
+        pg = mem_getPDE(NULL, (uintptr_t)ptr, MEM_DEFAULT);
+        if (!pg || !pg->bits.present || !pg->bits.size) return 0;
+    }
+
+    // The kernel ignores R/O, so pages pending CoW (e.g. the zero page) or in a table still shared from a fork
+    // have to be broken before they can be written to (see mem_breakCopyOnWrite)
+    if (!pg->bits.size && !(flags & PTR_READONLY)) {
+        if (pg->bits.cow) return 0;
+
+        page_t *pde = mem_getPDE(NULL, (uintptr_t)ptr, MEM_DEFAULT);
+        if (pde && pde->bits.cow) return 0;
+    }
 
     // Validate flags
     int valid = 1;
@@ -59,22 +59,68 @@ static int ap_startup_finished = 0;
 static int ap_shutdown_finished = 0;
 
 /* TLB shootdown */
-static uintptr_t tlb_shootdown_address = 0x0;
-static spinlock_t tlb_shootdown_lock = { 0 };
+static smp_tlb_batch_t *tlb_shootdown_batch = NULL;     // Batch currently being shot down
+static volatile uint8_t tlb_shootdown_targets[MAX_CPUS] = { 0 }; // Set for every CPU (by CPU ID) that has not acknowledged it yet
+static volatile int tlb_shootdown_remaining = 0;        // Amount of CPUs that have not acknowledged it yet
+static volatile int tlb_shootdown_busy = 0;             // Held by the CPU sending a shootdown
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "SMP", __VA_ARGS__)
 
 /**
- * @brief Handle a TLB shootdown
+ * @brief Invalidate a TLB batch on the current CPU
+ * @param batch The batch to invalidate
  */
-int smp_handleTLBShootdown(uintptr_t exception_index, uintptr_t interrupt_number, registers_t *regs, extended_registers_t *extended) {
-    if (tlb_shootdown_address) {
-        asm ("invlpg (%0)" :: "r"(tlb_shootdown_address));
+static void smp_tlbInvalidateLocal(smp_tlb_batch_t *batch) {
+    if (batch->flush_all || batch->pages > SMP_TLB_FLUSH_THRESHOLD) {
+        if (!batch->dir) {
+            // Kernel mappings can be global, which survive a CR3 reload. Toggling CR4.PGE flushes everything
+            uintptr_t cr4;
+            asm volatile ("movq %%cr4, %0" : "=r"(cr4));
+            if (cr4 & MEM_CR4_PGE) {
+                asm volatile ("movq %0, %%cr4" :: "r"(cr4 & ~MEM_CR4_PGE) : "memory");
+                asm volatile ("movq %0, %%cr4" :: "r"(cr4) : "memory");
+                return;
+            }
+        }
+
+        // Cheaper to reload CR3
+        uintptr_t cr3;
+        asm volatile ("movq %%cr3, %0" : "=r"(cr3));
+        asm volatile ("movq %0, %%cr3" :: "r"(cr3) : "memory");
+        return;
     }
 
+    for (size_t i = 0; i < batch->count; i++) {
+        for (uintptr_t addr = batch->ranges[i].start; addr < batch->ranges[i].end; addr += PAGE_SIZE) {
+            asm volatile ("invlpg (%0)" :: "r"(addr) : "memory");
+        }
+    }
+}
+
+/**
+ * @brief Service the pending TLB shootdown if this CPU is a target of it
+ * 
+ * This is called from the IPI handler, but also by CPUs spinning on the shootdown or on any
+ * spinlock (see @c spinlock_acquire), so a CPU waiting with interrupts disabled on a lock the
+ * sender holds still acknowledges.
+ */
+void smp_tlbService() {
+    int cpu = arch_current_cpu();
+    if (cpu < 0 || cpu >= MAX_CPUS || !__atomic_load_n(&tlb_shootdown_targets[cpu], __ATOMIC_ACQUIRE)) return;
+
+    // Claim it, the IPI can land while a spinning CPU is servicing it. The sender doesn't let go
+    // of the batch until every target acknowledged it
+    if (!__atomic_exchange_n(&tlb_shootdown_targets[cpu], 0, __ATOMIC_ACQUIRE)) return;
+    smp_tlbInvalidateLocal(tlb_shootdown_batch);
+    __atomic_sub_fetch(&tlb_shootdown_remaining, 1, __ATOMIC_RELEASE);
+}
 
-    // LOG(DEBUG, "TLB shootdown acknowledged for %p\n", tlb_shootdown_address);
+/**
+ * @brief Handle a TLB shootdown
+ */
+int smp_handleTLBShootdown(uintptr_t exception_index, uintptr_t interrupt_number, registers_t *regs, extended_registers_t *extended) {
+    smp_tlbService();
     return 0;
 }
 
@@ -114,6 +160,7 @@ __attribute__((noreturn)) void smp_finalizeAP() {
 
     // Set current core's directory
     current_cpu->current_dir = mem_getKernelDirectory();
+    mem_initializeTLB();
 
     // Reinitialize the APIC
     lapic_initialize(lapic_remapped);
@@ -222,7 +269,7 @@ _finish_collection:
     smp_collectAPInfo(0);
 
     // Register TLB shootdown IRQ
-    hal_registerInterruptHandler(124 - 32, smp_handleTLBShootdown);
+    hal_registerInterruptHandler(SMP_TLB_SHOOTDOWN_VECTOR - 32, smp_handleTLBShootdown);
 
     processor_count = smp_data->processor_count;
     LOG(INFO, "SMP initialization completed successfully - %i CPUs available to system\n", processor_count);
@@ -279,20 +326,153 @@ void smp_disableCores() {
 }
 
 /**
- * @brief Perform a TLB shootdown on a specific page
- * @param address The address to perform the TLB shootdown on
+ * @brief Initialize a TLB batch
+ * @param batch The batch to initialize
+ * @param dir The page directory the batch is for (NULL for kernel mappings)
  */
-void smp_tlbShootdown(uintptr_t address) {
-    if (!address || !smp_data) return; // no.
-    if (processor_count < 2) return; // No CPUs
+void smp_tlbBatchInit(smp_tlb_batch_t *batch, void *dir) {
+    batch->dir = dir;
+    batch->flush_all = 0;
+    batch->count = 0;
+    batch->pages = 0;
+}
+
+/**
+ * @brief Add a range to a TLB batch
+ * @param batch The batch to add to
+ * @param start The starting address of the range
+ * @param size The size of the range in bytes
+ */
+void smp_tlbBatchAdd(smp_tlb_batch_t *batch, uintptr_t start, size_t size) {
+    if (batch->flush_all || !size) return;
+
+    uintptr_t end = (start + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    start &= ~(PAGE_SIZE - 1);
+    batch->pages += (end - start) / PAGE_SIZE;
+
+    // Try to merge with the last range (the common case is walking linearly)
+    if (batch->count) {
+        uintptr_t *last_end = &batch->ranges[batch->count - 1].end;
+        if (*last_end == start) {
+            *last_end = end;
+            return;
+        }
+    }
+
+    if (batch->count == SMP_TLB_BATCH_MAX) {
+        batch->flush_all = 1;
+        return;
+    }
 
-    spinlock_acquire(&tlb_shootdown_lock);
+    batch->ranges[batch->count].start = start;
+    batch->ranges[batch->count].end = end;
+    batch->count++;
+}
 
-    // Send an IPI for the TLB shootdown vector
-    // TODO: Make this vector changeable
-    tlb_shootdown_address    = address;
-    lapic_sendIPI(0, 124, LAPIC_ICR_DESTINATION_PHYSICAL | LAPIC_ICR_INITDEASSERT | LAPIC_ICR_EDGE | LAPIC_ICR_DESTINATION_EXCLUDE_SELF);
+/**
+ * @brief Request a full TLB flush in a batch
+ * @param batch The batch
+ */
+void smp_tlbBatchFlushAll(smp_tlb_batch_t *batch) {
+    batch->flush_all = 1;
+}
 
-    spinlock_release(&tlb_shootdown_lock);
+/**
+ * @brief Flush a TLB batch
+ * @param batch The batch to flush
+ */
+void smp_tlbBatchFlush(smp_tlb_batch_t *batch) {
+    if (!batch->count && !batch->flush_all) return;
+
+    // Local CPU first
+    smp_tlbInvalidateLocal(batch);
+
+    // Only the PCID that is loaded was invalidated. Every other PCID the directory has is dropped, this is done before
+    // looking at what other CPUs have loaded so a CPU that switches in the meantime is either seen or flushes.
+    // Kernel mappings are global, invlpg and the PGE toggle already flush them for every PCID
+    if (batch->dir) mem_dropPCID(batch->dir);
+    if (!smp_data || processor_count < 2) goto _done;
+
+    // Take the shootdown slot. Keep servicing whoever holds it in the meantime
+    while (__atomic_exchange_n(&tlb_shootdown_busy, 1, __ATOMIC_ACQUIRE)) {
+        smp_tlbService();
+        asm volatile ("pause");
+    }
+
+    // Make sure our page table writes are visible before we look at what other CPUs have loaded.
+    // A CPU that switches to the directory after this point will load the new tables anyway.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // CPU IDs are local APIC IDs, which index processor_data
+    int self = current_cpu->cpu_id;
+    uint8_t targets[MAX_CPUS] = { 0 };
+    int target_count = 0;
+
+    for (int i = 0; i < smp_data->processor_count; i++) {
+        int cpu = smp_data->lapic_ids[i];
+        if (cpu == self || cpu >= MAX_CPUS) continue;
+        if (batch->dir && processor_data[cpu].current_dir != batch->dir) continue;
+        targets[cpu] = 1;
+        target_count++;
+    }
+
+    if (!target_count) goto _release;
+
+    // Targets can see their flag (and acknowledge) before the IPI arrives, so everything else has to be set up first
+    tlb_shootdown_batch = batch;
+    __atomic_store_n(&tlb_shootdown_remaining, target_count, __ATOMIC_RELEASE);
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (targets[cpu]) __atomic_store_n(&tlb_shootdown_targets[cpu], 1, __ATOMIC_RELEASE);
+    }
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (targets[cpu]) {
+            lapic_sendIPI(cpu, SMP_TLB_SHOOTDOWN_VECTOR, LAPIC_ICR_DESTINATION_PHYSICAL | LAPIC_ICR_INITDEASSERT | LAPIC_ICR_EDGE);
+        }
+    }
+
+    // Wait for everyone to acknowledge. A shootdown is never dropped, stale TLB entries would outlive the mapping.
+    // Targets spinning on a lock we hold with interrupts disabled service it from spinlock_acquire
+    uint64_t deadline = clock_readTicks() + SMP_TLB_ACK_TIMEOUT;
+    int warned = 0;
+    while (__atomic_load_n(&tlb_shootdown_remaining, __ATOMIC_ACQUIRE)) {
+        if (!warned && clock_readTicks() > deadline) {
+            LOG(WARN, "TLB shootdown is taking long, still waiting for %d CPUs\n", tlb_shootdown_remaining);
+            warned = 1;
+        }
+
+        asm volatile ("pause");
+    }
+
+    // Everyone is done with the batch
+    tlb_shootdown_batch = NULL;
+
+_release:
+    __atomic_store_n(&tlb_shootdown_busy, 0, __ATOMIC_RELEASE);
+
+_done:
+    smp_tlbBatchInit(batch, batch->dir);
+}
+
+/**
+ * @brief Perform a TLB shootdown on a range of addresses
+ * @param dir The page directory the mappings belong to (NULL for kernel mappings)
+ * @param start The starting address of the range
+ * @param size The size of the range in bytes
+ */
+void smp_tlbShootdownRange(void *dir, uintptr_t start, size_t size) {
+    smp_tlb_batch_t batch;
+    smp_tlbBatchInit(&batch, dir);
+    smp_tlbBatchAdd(&batch, start, size);
+    smp_tlbBatchFlush(&batch);
+}
+
+/**
+ * @brief Perform a TLB shootdown on a specific page
+ * @param address The address to perform the TLB shootdown on
+ */
+void smp_tlbShootdown(uintptr_t address) {
+    if (!address) return; // no.
+    smp_tlbShootdownRange(NULL, address, PAGE_SIZE);
 }
 
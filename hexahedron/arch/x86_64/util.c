@@ -15,6 +15,7 @@
 #include <kernel/arch/x86_64/hal.h>
 #include <kernel/arch/arch.h>
 #include <kernel/processor_data.h>
+#include <kernel/drivers/x86/local_apic.h>
 
 /* External parameters */
 extern generic_parameters_t *parameters;
@@ -43,6 +44,27 @@ void arch_pause() {
                     "cli\n");
 }
 
+/**
+ * @brief Disable interrupts on the current CPU
+ * @returns The previous interrupt state, to give to @c arch_restore_interrupts
+ */
+uintptr_t arch_disable_interrupts() {
+    uintptr_t flags;
+    asm volatile (  "pushf\n"
+                    "pop %0\n"
+                    "cli\n" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+/**
+ * @brief Restore the interrupt state of the current CPU
+ * @param state The state returned by @c arch_disable_interrupts
+ */
+void arch_restore_interrupts(uintptr_t state) {
+    asm volatile (  "push %0\n"
+                    "popf\n" :: "r"(state) : "memory", "cc");
+}
+
 /**
  * @brief Determine whether the interrupt fired came from usermode 
  * 
@@ -59,6 +81,17 @@ int arch_from_usermode(registers_t *registers, extended_registers_t *extended) {
 void arch_prepare_switch(struct thread *thread) {
     // Ask HAL to nicely load the kstack
     hal_loadKernelStack(thread->parent->kstack);
+
+    // Program the timer for the end of this thread's timeslice
+    lapic_timerArm(thread, 1);
+}
+
+/**
+ * @brief Wake up an idle CPU so it can pick up new work
+ * @param cpu The CPU to wake up
+ */
+void arch_wakeup_cpu(int cpu) {
+    lapic_timerKick(cpu);
 }
 
 /**
@@ -79,7 +79,9 @@ int dprintf_va(char *module, DEBUG_LOG_TYPE status, char *format, va_list ap) {
 
     // Wait for our lock
     // !!!: This should not be using a lock. System will deadlock.
-    if (debug_lock.cpu != arch_current_cpu()) {
+    // Nested prints on the CPU that already holds it (e.g. from a fault while printing) must not release it either
+    int locked = (debug_lock.cpu != SPINLOCK_HOLDER(arch_current_cpu()));
+    if (locked) {
         spinlock_acquire(&debug_lock);
     }
 
@@ -132,7 +134,7 @@ int dprintf_va(char *module, DEBUG_LOG_TYPE status, char *format, va_list ap) {
 _write_format: ;
     int returnValue = xvasprintf(debug_print, NULL, format, ap);
 
-    spinlock_release(&debug_lock);
+    if (locked) spinlock_release(&debug_lock);
     return returnValue;
 }
 
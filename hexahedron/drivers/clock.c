@@ -61,6 +61,14 @@ uint64_t clock_getTickCount() {
     return tick_count;
 }
 
+/**
+ * @brief Get a high resolution timestamp
+ * @returns Microseconds from the clock device's timer (the TSC on x86), or 0 if there is no clock yet
+ */
+uint64_t clock_getTimestamp() {
+    return clock_device.get_timer ? clock_device.get_timer() : 0;
+}
+
 /**
  * @brief Sleep for a period of time
  * @param delay Delay to sleep in ms
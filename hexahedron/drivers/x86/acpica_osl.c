@@ -30,6 +30,7 @@
 #endif
 
 // Kernel includes
+#include <kernel/arch/arch.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
 #include <kernel/mem/mem.h>
@@ -168,7 +169,8 @@ ACPI_STATUS AcpiOsCreateSemaphore(UINT32 MaxUnits, UINT32 InitialUnits, ACPI_SEM
 
 /* Delete semaphore */
 ACPI_STATUS AcpiOsDeleteSemaphore(ACPI_SEMAPHORE Handle) {
-    semaphore_destroy((semaphore_t*)Handle);
+    if (!Handle) return AE_BAD_PARAMETER;
+    if (semaphore_destroy((semaphore_t*)Handle)) return AE_ERROR;
     return AE_OK;
 }
 
@@ -184,10 +186,17 @@ ACPI_STATUS AcpiOsWaitSemaphore(ACPI_SEMAPHORE Handle, UINT32 Units, UINT16 Time
         return AE_TIME;
     }
 
-    time_t start_time = now(); // Start time in ms
     UINT32 remaining = Units;
+    if (Timeout == ACPI_WAIT_FOREVER) {
+        // Sleep until we have everything
+        while (remaining > 0) remaining -= semaphore_wait(Handle, remaining);
+        return AE_OK;
+    }
+
+    time_t start_time = now(); // Start time in ms
     while (remaining > 0 && now() - start_time < Timeout) {
-        remaining -= semaphore_wait(Handle, remaining);
+        remaining -= semaphore_tryWait(Handle, remaining);
+        if (remaining) arch_pause();
     }
 
     if (remaining > 0) {
@@ -23,6 +23,7 @@
 #include <kernel/drivers/clock.h>
 
 #include <kernel/drivers/x86/pit.h>
+#include <kernel/misc/args.h>
 
 #if defined(__ARCH_I386__)
 #include <kernel/arch/i386/cpu.h>
@@ -39,6 +40,12 @@
 /* APIC base */
 uintptr_t lapic_base = 0x0;
 
+/* Timer mode (LAPIC_TIMER_PERIODIC disables dynamic ticks) */
+static uint32_t lapic_timer_mode = LAPIC_TIMER_PERIODIC;
+
+/* Timer counts per LAPIC_TIMER_PERIOD_US, calibrated against the TSC */
+static uint64_t lapic_timer_period_count = 0;
+
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "X86:LAPIC", __VA_ARGS__)
 
@@ -166,25 +173,110 @@ int lapic_irq(uintptr_t exception_index, uintptr_t irq_number, registers_t *regi
  */
 int lapic_timer_irq(uintptr_t exception_index, uintptr_t irq_number, registers_t *registers, extended_registers_t *extended) {
     // Update clock
-    clock_update(clock_readTicks());
+    uint64_t now = clock_readTicks();
+    clock_update(now);
+
+    // In dynamic tick mode we don't fire every tick, so work out how many passed
+    unsigned int elapsed = 1;
+    if (lapic_timer_mode != LAPIC_TIMER_PERIODIC) {
+        elapsed = (now - current_cpu->lapic_timer_last) / LAPIC_TIMER_PERIOD_US;
+        current_cpu->lapic_timer_last += elapsed * LAPIC_TIMER_PERIOD_US;
+    }
     
     // Only if the process is running do we preempt
-    if (current_cpu->current_thread && current_cpu->current_process != current_cpu->idle_process && current_cpu->current_thread->status & THREAD_STATUS_RUNNING && !(current_cpu->current_thread->flags & THREAD_FLAG_NO_PREEMPT)) {
+    if (elapsed && current_cpu->current_thread && current_cpu->current_process != current_cpu->idle_process && current_cpu->current_thread->status & THREAD_STATUS_RUNNING && !(current_cpu->current_thread->flags & THREAD_FLAG_NO_PREEMPT)) {
         // Is it time to switch processes?
-        if (scheduler_update(clock_getTickCount()) == 1) {
+        if (scheduler_updateElapsed(clock_getTickCount(), elapsed) == 1) {
             // LOG(DEBUG, "Process is out of timeslice - yielding (LAPIC)\n");
             
             // End interrupt
             hal_endInterrupt(irq_number);
 
-            // Yes, it is. Switch to next process
+            // Yes, it is. Switch to next process (the timer is armed for it in arch_prepare_switch)
             process_yield(1);
+            return 0;
         }
     }
 
+    // Program the next event
+    lapic_timerArm(current_cpu->current_thread, 0);
     return 0;
 }
 
+/**
+ * @brief Program the timer to fire after a delay
+ * @param delay The delay in microseconds
+ */
+static void lapic_timerProgram(uint64_t delay) {
+    if (delay < LAPIC_TIMER_MIN_US) delay = LAPIC_TIMER_MIN_US;
+
+    if (lapic_timer_mode == LAPIC_TIMER_TSCDEADLINE) {
+        uint64_t deadline = clock_readTSC() + delay * clock_getTSCSpeed();
+        cpu_setMSR(LAPIC_MSR_TSC_DEADLINE, deadline & 0xFFFFFFFF, deadline >> 32);
+    } else {
+        uint64_t count = (lapic_timer_period_count * delay) / LAPIC_TIMER_PERIOD_US;
+        if (count > UINT32_MAX) count = UINT32_MAX;
+        if (!count) count = 1;
+        lapic_write(LAPIC_REGISTER_INITCOUNT, count);
+    }
+}
+
+/**
+ * @brief Program the local APIC timer for the next event on this core
+ * 
+ * In dynamic tick mode the timer is programmed to fire at the end of the thread's timeslice
+ * or at the nearest sleep deadline, whichever comes first. Does nothing in periodic mode.
+ * 
+ * @param thread The thread that is (about to be) running on this core
+ * @param new_slice Set if @c thread is being switched to and its timeslice starts now
+ */
+void lapic_timerArm(struct thread *thread, int new_slice) {
+    if (lapic_timer_mode == LAPIC_TIMER_PERIODIC) return;
+
+    uint64_t now = clock_readTicks();
+    if (new_slice) current_cpu->lapic_timer_last = now;
+
+    uint64_t delay;
+    if (!thread) {
+        // Tasking hasn't started yet, just keep ticking
+        delay = LAPIC_TIMER_PERIOD_US;
+    } else if (thread->parent != current_cpu->idle_process && !(thread->flags & THREAD_FLAG_NO_PREEMPT)) {
+        // Fire at the end of the timeslice
+        time_t slice = (thread->preempt_ticks > 0) ? thread->preempt_ticks : 1;
+        uint64_t slice_end = current_cpu->lapic_timer_last + slice * LAPIC_TIMER_PERIOD_US;
+        delay = (slice_end > now) ? slice_end - now : 0;
+    } else {
+        // Nothing to preempt, sleep as long as we can
+        delay = LAPIC_TIMER_IDLE_MAX_US;
+    }
+
+    // Is there a sleeper that wants to wake up sooner?
+    uint64_t deadline = sleep_getNextDeadline();
+    if (deadline != UINT64_MAX) {
+        unsigned long seconds, subseconds;
+        clock_getCurrentTime(&seconds, &subseconds);
+        uint64_t current = ((uint64_t)seconds * SUBSECONDS_PER_SECOND) + subseconds;
+
+        if (deadline <= current) {
+            delay = 0;
+        } else if (deadline - current < delay) {
+            delay = deadline - current;
+        }
+    }
+
+    lapic_timerProgram(delay);
+}
+
+/**
+ * @brief Kick another core out of a long timer sleep
+ * @param lapic_id The ID of the APIC to kick
+ */
+void lapic_timerKick(uint8_t lapic_id) {
+    // Periodic timers will get there on their own
+    if (lapic_timer_mode == LAPIC_TIMER_PERIODIC) return;
+    lapic_sendIPI(lapic_id, LAPIC_TIMER_IRQ, LAPIC_ICR_DESTINATION_PHYSICAL | LAPIC_ICR_INITDEASSERT | LAPIC_ICR_EDGE);
+}
+
 /**
  * @brief Acknowledge local APIC interrupt
  */
@@ -252,11 +344,29 @@ int lapic_initialize(uintptr_t lapic_address) {
     // Calculate target
     uint64_t ms = (after-before) / clock_getTSCSpeed();
     uint64_t target = 10000000000UL / ms;
+    lapic_timer_period_count = target;
+
+    // Pick a timer mode. Dynamic ticks use the TSC deadline timer if it's available and one-shot mode otherwise.
+    if (kargs_has("--no-tickless")) {
+        lapic_timer_mode = LAPIC_TIMER_PERIODIC;
+    } else {
+        uint32_t ecx, discard;
+        __cpuid(CPUID_GETFEATURES, discard, discard, ecx, discard);
+        lapic_timer_mode = (ecx & CPUID_FEAT_ECX_TSC) ? LAPIC_TIMER_TSCDEADLINE : LAPIC_TIMER_ONESHOT;
+    }
 
     // Setup initial count register
     lapic_write(LAPIC_REGISTER_DIVCONF, 1);
-    lapic_write(LAPIC_REGISTER_TIMER, LAPIC_TIMER_IRQ | 0x20000);
-    lapic_write(LAPIC_REGISTER_INITCOUNT, target);
+    lapic_write(LAPIC_REGISTER_TIMER, LAPIC_TIMER_IRQ | lapic_timer_mode);
+
+    if (lapic_timer_mode == LAPIC_TIMER_PERIODIC) {
+        lapic_write(LAPIC_REGISTER_INITCOUNT, target);
+    } else {
+        // The LVT write has to land before the deadline MSR is written
+        asm volatile ("mfence" ::: "memory");
+        current_cpu->lapic_timer_last = clock_readTicks();
+        lapic_timerProgram(LAPIC_TIMER_PERIOD_US);
+    }
 
     // Enable IRQs in TPR
     lapic_write(LAPIC_REGISTER_TPR, 0);
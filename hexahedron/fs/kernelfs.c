@@ -0,0 +1,133 @@
+/**
+ * @file hexahedron/fs/kernelfs.c
+ * @brief Kernel information filesystem
+ * 
+ * Entries are mounted under /kernel. Each one has a generator that prints its contents
+ * into a buffer when the file is read from the start, and further reads continue from that snapshot.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/fs/kernelfs.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/debug.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "FS:KERNELFS", __VA_ARGS__)
+
+/**
+ * @brief Kernelfs read
+ */
+static ssize_t kernelfs_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    kernelfs_entry_t *entry = (kernelfs_entry_t*)node->dev;
+    if (!entry || !size || !buffer) return 0;
+
+    spinlock_acquire(&entry->lock);
+    int regenerate = (offset == 0 || !entry->length);
+    spinlock_release(&entry->lock);
+
+    // Regenerate on a fresh read. Generators allocate and look at other subsystems' locked state,
+    // so they run without the lock into a buffer of their own which is swapped in afterwards
+    if (regenerate) {
+        kernelfs_entry_t scratch;
+        memset(&scratch, 0, sizeof(kernelfs_entry_t));
+        scratch.node = entry->node;
+        scratch.data = entry->data;
+
+        if (entry->get_data(&scratch, entry->data)) {
+            LOG(WARN, "Generator for /kernel/%s failed\n", node->name);
+        }
+
+        spinlock_acquire(&entry->lock);
+        char *old = entry->buffer;
+        entry->buffer = scratch.buffer;
+        entry->buffer_size = scratch.buffer_size;
+        entry->length = scratch.length;
+        node->length = entry->length;
+        spinlock_release(&entry->lock);
+
+        if (old) kfree(old);
+    }
+
+    spinlock_acquire(&entry->lock);
+
+    if ((size_t)offset >= entry->length) {
+        spinlock_release(&entry->lock);
+        return 0;
+    }
+
+    if (offset + size > entry->length) size = entry->length - offset;
+    memcpy(buffer, entry->buffer + offset, size);
+
+    spinlock_release(&entry->lock);
+    return size;
+}
+
+/**
+ * @brief Create a new read-only entry in the kernel filesystem
+ * @param name Name of the entry (mounted at /kernel/<name>)
+ * @param get_data Function that generates the contents
+ * @param data User-specified data for @c get_data
+ * @returns The entry
+ */
+kernelfs_entry_t *kernelfs_createEntry(char *name, kernelfs_get_data_t get_data, void *data) {
+    kernelfs_entry_t *entry = kmalloc(sizeof(kernelfs_entry_t));
+    memset(entry, 0, sizeof(kernelfs_entry_t));
+    entry->lock.name = "kernelfs entry lock";
+    entry->get_data = get_data;
+    entry->data = data;
+
+    entry->node = kmalloc(sizeof(fs_node_t));
+    memset(entry->node, 0, sizeof(fs_node_t));
+    strncpy(entry->node->name, name, 255);
+    entry->node->flags = VFS_FILE;
+    entry->node->mask = 0444;
+    entry->node->read = kernelfs_read;
+    entry->node->dev = (void*)entry;
+
+    char path[256];
+    snprintf(path, 256, KERNELFS_MOUNT_PATH "/%s", name);
+    vfs_mount(entry->node, path);
+
+    return entry;
+}
+
+/**
+ * @brief Append formatted text to a kernelfs entry (only call from its generator)
+ * @param entry The entry
+ * @param fmt Format string
+ * @returns The amount of characters written
+ */
+int kernelfs_appendData(kernelfs_entry_t *entry, char *fmt, ...) {
+    va_list ap;
+
+    while (1) {
+        size_t remaining = entry->buffer_size - entry->length;
+
+        va_start(ap, fmt);
+        int written = remaining ? vsnprintf(entry->buffer + entry->length, remaining, fmt, ap) : 0;
+        va_end(ap);
+
+        if (remaining && written >= 0 && (size_t)written < remaining) {
+            entry->length += written;
+            return written;
+        }
+
+        // Didn't fit, grow the buffer and try again
+        size_t needed = entry->length + ((written > 0) ? (size_t)written : 0) + 1;
+        size_t new_size = entry->buffer_size ? entry->buffer_size : KERNELFS_INITIAL_BUFFER;
+        while (new_size < needed) new_size *= 2;
+        if (new_size == entry->buffer_size) new_size *= 2;
+
+        entry->buffer = krealloc(entry->buffer, new_size);
+        entry->buffer_size = new_size;
+    }
+}
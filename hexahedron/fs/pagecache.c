@@ -0,0 +1,348 @@
+/**
+ * @file hexahedron/fs/pagecache.c
+ * @brief VFS page cache
+ * 
+ * Nodes with @c VFS_CACHE_PAGES set have their reads served from here. Pages are read in
+ * whole from the node on a miss and kept until they are written to, or evicted because the
+ * cache is full or physical memory is running low. Eviction is least recently used first.
+ * 
+ * Contents live in PMM frames, so evicting a page gives its memory straight back. The PMM
+ * also evicts pages itself before it runs out of memory (see @c pagecache_shrink).
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/fs/pagecache.h>
+#include <kernel/mem/mem.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/debug.h>
+
+#include <string.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "FS:PAGECACHE", __VA_ARGS__)
+
+/* Page hash table */
+static pagecache_page_t *pagecache_buckets[PAGECACHE_BUCKETS] = { 0 };
+
+/* LRU list */
+static ilist_t pagecache_lru = { .name = "page cache LRU" };
+
+/* Lock */
+static spinlock_t pagecache_lock = { 0 };
+
+/* Amount of cached pages */
+static size_t pagecache_pages = 0;
+
+/* Pages evicted by the PMM, whose structures are freed on the next fill */
+static pagecache_page_t *pagecache_graveyard = NULL;
+
+/* Invalidation counters (see pagecache_fill). Nodes sharing one only cost each other a cache miss */
+static uint64_t pagecache_generations[PAGECACHE_GENERATIONS] = { 0 };
+#define PAGECACHE_GENERATION(node) (&pagecache_generations[pagecache_hash((node)->dev, (node)->inode, 0) % PAGECACHE_GENERATIONS])
+
+/* Check whether a page belongs to a node */
+#define PAGECACHE_MATCHES(page, node) ((page)->read == (node)->read && (page)->dev == (node)->dev && (page)->inode == (node)->inode)
+
+/**
+ * @brief Hash a page of a node (see @c PAGECACHE_MATCHES)
+ */
+static inline size_t pagecache_hash(void *dev, uint64_t inode, uint64_t index) {
+    uint64_t hash = (uint64_t)(uintptr_t)dev ^ (inode * 0x9E3779B97F4A7C15ULL) ^ (index * 0xC2B2AE3D27D4EB4FULL);
+    hash ^= hash >> 29;
+    return (size_t)(hash % PAGECACHE_BUCKETS);
+}
+
+/**
+ * @brief Find a cached page (call with the lock held)
+ */
+static pagecache_page_t *pagecache_lookup(fs_node_t *node, uint64_t index) {
+    for (pagecache_page_t *page = pagecache_buckets[pagecache_hash(node->dev, node->inode, index)]; page; page = page->next) {
+        if (page->index == index && PAGECACHE_MATCHES(page, node)) return page;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Free a page that is no longer in the cache
+ */
+static void pagecache_free(pagecache_page_t *page) {
+    pmm_freeBlock(page->frame);
+    kfree(page);
+}
+
+/**
+ * @brief Take a page out of the hash table and LRU list (call with the lock held)
+ * @returns 1 if the page can be freed now, 0 if a reader will free it
+ */
+static int pagecache_remove(pagecache_page_t *page) {
+    pagecache_page_t **link = &pagecache_buckets[pagecache_hash(page->dev, page->inode, page->index)];
+    while (*link && *link != page) link = &(*link)->next;
+    if (*link) *link = page->next;
+
+    ilist_delete(&pagecache_lru, &page->lru);
+    pagecache_pages--;
+
+    if (page->refs) {
+        page->dead = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Drop a reader's reference on a page
+ */
+static void pagecache_release(pagecache_page_t *page) {
+    spinlock_acquire(&pagecache_lock);
+    int free = (--page->refs == 0 && page->dead);
+    spinlock_release(&pagecache_lock);
+
+    if (free) pagecache_free(page);
+}
+
+/**
+ * @brief Make room for a new page
+ */
+static void pagecache_makeRoom() {
+    // Free what the PMM left behind
+    spinlock_acquire(&pagecache_lock);
+    pagecache_page_t *dead = pagecache_graveyard;
+    pagecache_graveyard = NULL;
+    spinlock_release(&pagecache_lock);
+
+    while (dead) {
+        pagecache_page_t *next = dead->next;
+        kfree(dead);
+        dead = next;
+    }
+
+    size_t max = pmm_getMaximumBlocks() / PAGECACHE_MAX_DIVISOR;
+    size_t low = pmm_getMaximumBlocks() / PAGECACHE_PRESSURE_DIVISOR;
+
+    while (pagecache_pages && (pagecache_pages >= max || pmm_getFreeBlocks() < low)) {
+        if (!pagecache_reclaim(1)) break;
+    }
+}
+
+/**
+ * @brief Read a page of a node into a new cached page
+ * @returns The page with a reference held, or NULL if the node couldn't be read
+ */
+static pagecache_page_t *pagecache_fill(fs_node_t *node, uint64_t index) {
+    pagecache_makeRoom();
+
+    // A write that is invalidated while we read could leave us with the old contents
+    spinlock_acquire(&pagecache_lock);
+    uint64_t generation = *PAGECACHE_GENERATION(node);
+    spinlock_release(&pagecache_lock);
+
+    pagecache_page_t *page = kmalloc(sizeof(pagecache_page_t));
+    memset(page, 0, sizeof(pagecache_page_t));
+    page->read = node->read;
+    page->dev = node->dev;
+    page->inode = node->inode;
+    page->index = index;
+    page->frame = pmm_allocateBlock();
+
+    uint64_t start = index * PAGE_SIZE;
+    page->length = (node->length - start < PAGE_SIZE) ? node->length - start : PAGE_SIZE;
+
+    // Read the whole page in
+    uint8_t *data = (uint8_t*)mem_remapPhys(page->frame, PAGE_SIZE);
+    ssize_t ret = node->read(node, start, page->length, data);
+    mem_unmapPhys((uintptr_t)data, PAGE_SIZE);
+
+    if (ret != (ssize_t)page->length) {
+        LOG(ERR, "Failed to read page %d of node \"%s\" (got %d of %d bytes)\n", index, node->name, ret, page->length);
+        pagecache_free(page);
+        return NULL;
+    }
+
+    spinlock_acquire(&pagecache_lock);
+
+    // Someone else could've read it in while we were
+    pagecache_page_t *existing = pagecache_lookup(node, index);
+    if (existing) {
+        existing->refs++;
+        spinlock_release(&pagecache_lock);
+        pagecache_free(page);
+        return existing;
+    }
+
+    if (*PAGECACHE_GENERATION(node) != generation) {
+        // The node was written to meanwhile. The caller can have what we read, but it isn't cached
+        page->refs = 1;
+        page->dead = 1;
+        spinlock_release(&pagecache_lock);
+        return page;
+    }
+
+    size_t bucket = pagecache_hash(node->dev, node->inode, index);
+    page->next = pagecache_buckets[bucket];
+    pagecache_buckets[bucket] = page;
+    ilist_append(&pagecache_lru, &page->lru);
+    pagecache_pages++;
+    page->refs++;
+
+    spinlock_release(&pagecache_lock);
+    return page;
+}
+
+/**
+ * @brief Read from a node through the page cache
+ * @param node The node to read from (must have @c VFS_CACHE_PAGES set)
+ * @param offset The offset to read at
+ * @param size The amount of bytes to read
+ * @param buffer The buffer to store the bytes in
+ * @returns The amount of bytes read
+ */
+ssize_t pagecache_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+    if (!node || !node->read || !buffer || offset < 0) return 0;
+    if ((uint64_t)offset >= node->length) return 0;
+    if (size > node->length - offset) size = node->length - offset;
+
+    size_t done = 0;
+    while (done < size) {
+        uint64_t position = offset + done;
+        uint64_t index = position / PAGE_SIZE;
+        size_t page_offset = position % PAGE_SIZE;
+
+        spinlock_acquire(&pagecache_lock);
+        pagecache_page_t *page = pagecache_lookup(node, index);
+        if (page) {
+            // Hit, it's the most recently used now
+            page->refs++;
+            ilist_delete(&pagecache_lru, &page->lru);
+            ilist_append(&pagecache_lru, &page->lru);
+        }
+        spinlock_release(&pagecache_lock);
+
+        if (!page) {
+            page = pagecache_fill(node, index);
+            if (!page) break;
+        }
+
+        // Copy out without the lock, the buffer can fault (and the fault can read from the cache)
+        size_t count = page->length - page_offset;
+        if (count > size - done) count = size - done;
+
+        uint8_t *data = (uint8_t*)mem_remapPhys(page->frame, PAGE_SIZE);
+        memcpy(buffer + done, data + page_offset, count);
+        mem_unmapPhys((uintptr_t)data, PAGE_SIZE);
+
+        pagecache_release(page);
+        done += count;
+    }
+
+    return done;
+}
+
+/**
+ * @brief Drop the cached pages of a node in a range
+ * @param node The node that was written to
+ * @param offset The offset of the range
+ * @param size The size of the range
+ */
+void pagecache_invalidate(fs_node_t *node, off_t offset, size_t size) {
+    if (!node || !size || offset < 0) return;
+
+    uint64_t first = offset / PAGE_SIZE;
+    uint64_t last = (offset + size - 1) / PAGE_SIZE;
+
+    // Fills that started before this don't get to insert what they read
+    spinlock_acquire(&pagecache_lock);
+    (*PAGECACHE_GENERATION(node))++;
+    spinlock_release(&pagecache_lock);
+
+    for (uint64_t index = first; index <= last; index++) {
+        spinlock_acquire(&pagecache_lock);
+        pagecache_page_t *page = pagecache_lookup(node, index);
+        int free = (page && pagecache_remove(page));
+        spinlock_release(&pagecache_lock);
+
+        if (free) pagecache_free(page);
+    }
+}
+
+/**
+ * @brief Evict the least recently used pages
+ * @param pages How many pages to evict
+ * @param defer Only free the frames, leave the structures in the graveyard (no heap calls)
+ * @returns How many pages were evicted
+ */
+static size_t pagecache_evict(size_t pages, int defer) {
+    size_t evicted = 0;
+
+    while (evicted < pages) {
+        spinlock_acquire(&pagecache_lock);
+
+        ilist_node_t *lru = pagecache_lru.head;
+        if (!lru) {
+            spinlock_release(&pagecache_lock);
+            break;
+        }
+
+        pagecache_page_t *page = ilist_entry(lru, pagecache_page_t, lru);
+        uintptr_t frame = page->frame;
+        int free = pagecache_remove(page);
+        if (free && defer) {
+            // Once it's in the graveyard, another CPU can free it
+            page->next = pagecache_graveyard;
+            pagecache_graveyard = page;
+        }
+        spinlock_release(&pagecache_lock);
+
+        if (free && defer) pmm_freeBlock(frame);
+        else if (free) pagecache_free(page);
+        evicted++;
+    }
+
+    return evicted;
+}
+
+/**
+ * @brief Evict the least recently used pages
+ * @param pages How many pages to evict
+ * @returns How many pages were evicted
+ */
+size_t pagecache_reclaim(size_t pages) {
+    return pagecache_evict(pages, 0);
+}
+
+/**
+ * @brief Reclaimer for the PMM, evicts pages when an allocation ran out of memory
+ * 
+ * The heap can be in the middle of allocating, so the structures of the pages are left for later.
+ * 
+ * @param blocks How many blocks are wanted
+ * @returns How many blocks were given back
+ */
+static size_t pagecache_shrink(size_t blocks) {
+    return pagecache_evict(blocks, 1);
+}
+
+/**
+ * @brief Initialize the page cache
+ */
+void pagecache_init() {
+    if (pmm_registerReclaimer(pagecache_shrink)) {
+        LOG(WARN, "Could not register the page cache with the PMM\n");
+    }
+}
+
+/**
+ * @brief Get the amount of pages in the cache
+ */
+size_t pagecache_getCachedPages() {
+    return pagecache_pages;
+}
@@ -21,6 +21,8 @@
 
 #include <kernel/arch/arch.h>
 #include <kernel/fs/periphfs.h>
+#include <kernel/task/process.h>
+#include <kernel/task/sleep.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/fs/vfs.h>
 #include <kernel/debug.h>
@@ -32,10 +34,38 @@ fs_node_t *kbd_node = NULL;
 fs_node_t *mouse_node = NULL;
 fs_node_t *stdin_node = NULL;
 
+/* Threads waiting for keyboard events */
+static sleep_queue_t *kbd_queue = NULL;
+
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "FS:PERIPHFS", __VA_ARGS__)
 
 
+/**
+ * @brief Sleep condition for a circular buffer having data
+ */
+static int periphfs_hasData(struct thread *thread, void *context) {
+    circbuf_t *buf = (circbuf_t*)context;
+    return buf->head != buf->tail;
+}
+
+/**
+ * @brief Put the current thread to sleep until a circular buffer has data
+ * @param buf The buffer to wait on
+ */
+static void periphfs_waitForData(circbuf_t *buf) {
+    while (buf->head == buf->tail) {
+        if (!current_cpu->current_thread) {
+            // No scheduler yet
+            arch_pause();
+            continue;
+        }
+
+        sleep_untilCondition(current_cpu->current_thread, kbd_queue, periphfs_hasData, (void*)buf);
+        process_yield(0);
+    }
+}
+
 /**
  * @brief Keyboard device read
  */
@@ -50,9 +80,8 @@ static ssize_t keyboard_read(fs_node_t *node, off_t offset, size_t size, uint8_t
 
     circbuf_t *buf = (circbuf_t*)node->dev;
 
-    // TODO: This is really really bad.. like actually horrendous. We should also be putting the thread to sleep
     while (circbuf_read(buf, size, buffer)) {
-        while (buf->head == buf->tail) arch_pause();
+        periphfs_waitForData(buf);
     }
 
     
@@ -72,10 +101,8 @@ static ssize_t stdin_read(fs_node_t *node, off_t offset, size_t size, uint8_t *b
     
     for (size_t i = 0; i < size; i++) {
         while (1) {
-            // TODO: This is really really bad.. like actually horrendous. We should also be putting the thread to sleep
             while (circbuf_read(buf, sizeof(key_event_t), (uint8_t*)&event)) {
-                // LOG(DEBUG, "CWAIT\n");
-                while (buf->head == buf->tail) arch_pause();
+                periphfs_waitForData(buf);
             }
 
             // Did we get a key press event?
@@ -96,6 +123,7 @@ static ssize_t stdin_read(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 void periphfs_init() {
     // Create keyboard circular buffer
     circbuf_t *kbd_buffer = circbuf_create("kbd buffer", sizeof(key_event_t) * 512);
+    kbd_queue = sleep_createQueue("kbd queue");
 
     // Create and mount keyboard node
     kbd_node = kmalloc(sizeof(fs_node_t));
@@ -130,6 +158,7 @@ int periphfs_sendKeyboardEvent(int event_type, uint8_t scancode) {
 
 
     circbuf_write((circbuf_t*)kbd_node->dev, sizeof(key_event_t), (uint8_t*)&event);
+    sleep_wakeupQueue(kbd_queue);
     LOG(DEBUG, "SEND key event type=%d\n", event_type);
     return 0;
 }
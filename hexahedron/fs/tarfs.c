@@ -114,6 +114,9 @@ static fs_node_t *tarfs_ustarToNode(ustar_header_t *header, uint64_t inode, fs_n
 
     node->inode = inode;
     node->dev = parent_node->dev;
+
+    // Files are cached, so reads don't have to go through their header every time
+    if (node->flags == VFS_FILE) node->cache = VFS_CACHE_PAGES;
     
     // Setup functions
     node->open = NULL;
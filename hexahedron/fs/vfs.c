@@ -13,6 +13,7 @@
  */
 
 #include <kernel/fs/vfs.h>
+#include <kernel/fs/pagecache.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -94,6 +95,7 @@ ssize_t fs_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
     if (!node) return 0;
 
     if (node->read) {
+        if (node->cache & VFS_CACHE_PAGES) return pagecache_read(node, offset, size, buffer);
         return node->read(node, offset, size, buffer);
     }
 
@@ -112,7 +114,11 @@ ssize_t fs_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
     if (!node) return 0;
 
     if (node->write) {
-        return node->write(node, offset, size, buffer);
+        ssize_t ret = node->write(node, offset, size, buffer);
+
+        // Cached pages are dropped, not updated - some drivers don't report what they wrote
+        if (node->cache & VFS_CACHE_PAGES) pagecache_invalidate(node, offset, size);
+        return ret;
     }
 
     return 0;
@@ -243,6 +249,9 @@ void vfs_init() {
     // Load spinlocks
     vfs_lock = spinlock_create("vfs lock");
 
+    // Let the PMM take pages back from the page cache
+    pagecache_init();
+
     LOG(INFO, "VFS initialized\n");
 }
 
@@ -73,6 +73,18 @@ extern int arch_current_cpu();
  */
 void arch_pause();
 
+/**
+ * @brief Disable interrupts on the current CPU
+ * @returns The previous interrupt state, to give to @c arch_restore_interrupts
+ */
+uintptr_t arch_disable_interrupts();
+
+/**
+ * @brief Restore the interrupt state of the current CPU
+ * @param state The state returned by @c arch_disable_interrupts
+ */
+void arch_restore_interrupts(uintptr_t state);
+
 /**
  * @brief Determine whether the interrupt fired came from usermode 
  * 
@@ -86,6 +98,12 @@ int arch_from_usermode(struct _registers *registers, struct _extended_registers
  */
 void arch_prepare_switch(struct thread *thread);
 
+/**
+ * @brief Wake up an idle CPU so it can pick up new work
+ * @param cpu The CPU to wake up
+ */
+void arch_wakeup_cpu(int cpu);
+
 /**
  * @brief Initialize the thread context
  * @param thread The thread to initialize the context for
@@ -34,7 +34,8 @@ typedef union page {
         uint32_t pat:1;
         uint32_t global:1;
         uint32_t cow:1;         // Part of available bits, used from a prototype memory system. If this is 1 then a page fault on this page will cause a new writable one to be created
-        uint32_t available:2;
+        uint32_t noaccess:1;    // Part of available bits. Usermode page made inaccessible (PROT_NONE)
+        uint32_t available:1;
         uint32_t address:20;
     } bits;
 
@@ -87,6 +88,7 @@ typedef union page {
 // IMPORTANT: THIS IS THE HEXAHEDRON MEMORY MAP CONFIGURED FOR I386
 // 0x00000000 - 0x00200000: Kernel code. This can be expanded since heap is positioned right after
 // 0x00200000 - 0x00400000: Kernel heap. This is just an example heap.
+// 0x40000000 - 0x70000000: Usermode mmap() region
 // 0x70000000 - 0x80000000: DMA region
 // 0x80000000 - 0x90000000: Usermode stack space
 // 0x90000000 - 0xA0000000: MMIO region
@@ -95,6 +97,7 @@ typedef union page {
 // 0xC0000000 - 0xF0000000: Physical memory mapping region. Basically one big pool.
 // 0xFFC00000 - 0xFFFFF000: Recursive paging location
 
+#define MEM_MMAP_REGION                 (uintptr_t)0x40000000
 #define MEM_DMA_REGION                  (uintptr_t)0x70000000
 #define MEM_USERMODE_STACK_REGION       (uintptr_t)0x80000000
 #define MEM_MMIO_REGION                 (uintptr_t)0x90000000
@@ -105,6 +108,7 @@ typedef union page {
 #define MEM_RECURSIVE_PAGING_REGION     (uintptr_t)0xFFC00000
 
 #define MEM_USERMODE_STACK_SIZE         (uintptr_t)0x10000000
+#define MEM_MMAP_REGION_SIZE            (uintptr_t)0x30000000
 #define MEM_DMA_REGION_SIZE             (uintptr_t)0x10000000 
 #define MEM_MMIO_REGION_SIZE            (uintptr_t)0x10000000
 #define MEM_DRIVER_REGION_SIZE          (uintptr_t)0x10000000 // !!!: This region is bad - we should have much more space for drivers (but i386 is so damn limited)
@@ -127,6 +131,7 @@ typedef union page {
 
 #define MEM_SET_FRAME(page, frame) (page->bits.address = ((uintptr_t)frame >> MEM_PAGE_SHIFT))      // Set the frame of a page. Used because of our weird union thing.
 #define MEM_GET_FRAME(page) (page->bits.address << MEM_PAGE_SHIFT)                                  // Get the frame of a page. Used because of our weird union thing.
+#define MEM_PAGE_IS_USER(page) ((page)->bits.usermode || (page)->bits.noaccess)                     // Whether a page belongs to usermode, even if it was made inaccessible
 
 
 /**** FUNCTIONS ****/
@@ -213,6 +213,16 @@ char *cpu_getBrandString();
  */
 int cpu_pml5supported();
 
+/**
+ * @brief x86_64: Check if global pages are supported
+ */
+int cpu_pgeSupported();
+
+/**
+ * @brief x86_64: Check if process-context identifiers are supported
+ */
+int cpu_pcidSupported();
+
 /**
  * @brief x86_64: Get the maximum linear-address width supported by the CPU
  * 
@@ -126,6 +126,8 @@ typedef int (*interrupt_handler_context_t)(void *context);
 #define X86_64_IDT_DESC_PRESENT 0x80   // 10000000
 #define X86_64_MAX_INTERRUPTS  255
 #define X86_64_MAX_EXCEPTIONS  31
+#define X86_64_DOUBLE_FAULT_IST 1                // IST entry of the double fault handler
+#define X86_64_DOUBLE_FAULT_STACK_SIZE 8192      // Size of the double fault stack of each CPU
 
 // PIC definitions
 #define X86_64_PIC1_ADDR       0x20                // Master PIC address
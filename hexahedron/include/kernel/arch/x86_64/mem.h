@@ -37,7 +37,8 @@ typedef union page {
         uint64_t address:28;        // The page data
         uint64_t reserved:12;       // These should be set to 0
         uint64_t cow:1;             // Copy on write, part of available and impl-specific
-        uint64_t available3:10;     // Free bits!
+        uint64_t noaccess:1;        // Usermode page made inaccessible (PROT_NONE), part of available and impl-specific
+        uint64_t available3:9;      // Free bits!
         uint64_t nx:1;              // No execute bit
     } bits;
     
@@ -50,6 +51,8 @@ typedef union page {
 #define PAGE_SIZE       0x1000      // 4 KiB
 #define PAGE_SIZE_LARGE 0x200000    // 2 MiB
 
+#define MEM_PAGES_PER_LARGE (PAGE_SIZE_LARGE / PAGE_SIZE)   // 4 KiB pages in a 2 MiB page
+
 // Page shifting
 #define MEM_PAGE_SHIFT  12
 
@@ -57,6 +60,7 @@ typedef union page {
 // IMPORTANT: THIS IS THE HEXAHEDRON MEMORY MAP CONFIGURED FOR I386
 // 0x0000000000000000 - 0x0000000000200000: Kernel code - this can be expanded a decent amount.
 // 0x00000000A0000000 - 0x00000000F0000000: DMA region (in low memory)
+// 0x0000040000000000 - 0x0000060000000000: Usermode mmap() region
 // 0x0000600000000000 - 0x0000700000000000: Usermode stack. Only a small amount of this is mapped to start with
 // 0x0000800000000000 - 0x0000800000400000: Framebuffer memory (todo: this can probably be relocated).  
 // 0xFFFFFF0000000000 - 0xFFFFFF0000010000: Heap memory 
@@ -65,6 +69,7 @@ typedef union page {
 // 0xFFFFFFFF00000000 - 0xFFFFFFFF80000000: Driver memory space
 
 #define MEM_DMA_REGION              (uintptr_t)0x00000000A0000000
+#define MEM_MMAP_REGION             (uintptr_t)0x0000040000000000
 #define MEM_USERMODE_STACK_REGION   (uintptr_t)0x0000060000000000 
 #define MEM_FRAMEBUFFER_REGION      (uintptr_t)0x0000080000000000
 #define MEM_HEAP_REGION             (uintptr_t)0xFFFFFF0000000000
@@ -75,9 +80,16 @@ typedef union page {
 #define MEM_MMIO_REGION_SIZE        (uintptr_t)0x0000000100000000
 #define MEM_USERMODE_STACK_SIZE     (uintptr_t)0x0000010000000000 
 #define MEM_DMA_REGION_SIZE         (uintptr_t)0x0000000050000000
+#define MEM_MMAP_REGION_SIZE        (uintptr_t)0x0000020000000000
 #define MEM_PHYSMEM_MAP_SIZE        (uintptr_t)0x0000001000000000
 #define MEM_DRIVER_REGION_SIZE      (uintptr_t)0x0000000080000000
 
+// TLB tagging
+#define MEM_PCID_SLOTS              8                   // PCIDs handed out per CPU (PCID 0 is left to the boot tables)
+#define MEM_CR3_NOFLUSH             (1ULL << 63)        // Keep the TLB entries of the PCID loaded into CR3
+#define MEM_CR4_PGE                 (1 << 7)            // CR4.PGE (global pages)
+#define MEM_CR4_PCIDE               (1 << 17)           // CR4.PCIDE (process-context identifiers)
+
 /**** MACROS ****/
 
 #define MEM_ALIGN_PAGE(addr) ((addr + PAGE_SIZE) & ~0xFFF) // Align an address to the nearest page
@@ -90,8 +102,10 @@ typedef union page {
 
 #define MEM_SET_FRAME(page, frame) (page->bits.address = ((uintptr_t)frame >> MEM_PAGE_SHIFT))      // Set the frame of a page. Used because of our weird union thing.
 #define MEM_GET_FRAME(page) (page->bits.address << MEM_PAGE_SHIFT)                                  // Get the frame of a page. Used because of our weird union thing.
+#define MEM_PAGE_IS_USER(page) ((page)->bits.usermode || (page)->bits.noaccess)                     // Whether a page belongs to usermode, even if it was made inaccessible
 
 #define MEM_IS_CANONICAL(addr) (((addr & 0xFFFF000000000000) == 0xFFFF000000000000) || !(addr & 0xFFFF000000000000))    // Ugly macro to verify if an address is canonical
+#define MEM_IS_KERNEL_HALF(addr) ((uintptr_t)(addr) >= 0xFFFF800000000000)                                              // Whether an address is in the kernel half, which every directory shares
 
 /**** FUNCTIONS ****/
 
@@ -106,4 +120,20 @@ typedef union page {
  */
 void mem_init(uintptr_t mem_size, uintptr_t kernel_addr);
 
+/**
+ * @brief Enable global pages and PCIDs on the current CPU (if supported)
+ * 
+ * Called by @c mem_init for the BSP and by every AP when it starts.
+ */
+void mem_initializeTLB();
+
+/**
+ * @brief Forget the PCIDs a directory was given on every CPU
+ * 
+ * Its TLB entries may be stale, so the next switch to it on each CPU flushes them.
+ * 
+ * @param dir The directory, or NULL to forget every directory
+ */
+void mem_dropPCID(page_t *dir);
+
 #endif
\ No newline at end of file
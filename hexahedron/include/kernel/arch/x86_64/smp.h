@@ -16,6 +16,7 @@
 
 /**** INCLUDES ****/
 #include <stdint.h>
+#include <stddef.h>
 
 
 /**** DEFINITIONS ****/
@@ -30,6 +31,18 @@
 // !!!: DO. NOT. MODIFY. THIS WILL BREAK LITERALLY EVERYTHING!
 #define SMP_AP_BOOTSTRAP_PAGE   0x1000
 
+// TLB shootdown vector
+#define SMP_TLB_SHOOTDOWN_VECTOR    124
+
+// Maximum amount of ranges a TLB batch can hold before it degrades into a full flush
+#define SMP_TLB_BATCH_MAX           16
+
+// Amount of pages past which a CPU reloads CR3 instead of doing invlpg on every page
+#define SMP_TLB_FLUSH_THRESHOLD     64
+
+// Time (in microseconds) to wait for other CPUs to acknowledge a shootdown before complaining
+#define SMP_TLB_ACK_TIMEOUT         100000
+
 /**** TYPES ****/
 
 // Structure passed to SMP driver containing information (MADT/MP table/whatever) - TODO: check uint32_t?
@@ -58,6 +71,18 @@ typedef struct _smp_ap_parameters {
     uintptr_t lapic_id;
 } smp_ap_parameters_t;
 
+// A batch of TLB invalidations that are sent out together (see smp_tlbBatchFlush)
+typedef struct _smp_tlb_batch {
+    void        *dir;                       // Page directory the mappings were changed in (NULL = kernel mappings, all CPUs)
+    int         flush_all;                  // Set when the batch overflowed or a full flush was requested
+    size_t      count;                      // Amount of ranges in the batch
+    size_t      pages;                      // Total pages covered by the ranges
+    struct {
+        uintptr_t start;                    // Start of the range (page aligned)
+        uintptr_t end;                      // End of the range (exclusive, page aligned)
+    } ranges[SMP_TLB_BATCH_MAX];
+} smp_tlb_batch_t;
+
 /**** FUNCTIONS ****/
 
 /**
@@ -95,8 +120,59 @@ void smp_acknowledgeCoreShutdown();
 /**
  * @brief Perform a TLB shootdown on a specific page
  * @param address The address to perform the TLB shootdown on
+ * @note This targets every CPU. Prefer @c smp_tlbShootdownRange or a batch when the directory is known.
  */
 void smp_tlbShootdown(uintptr_t address);
 
+/**
+ * @brief Perform a TLB shootdown on a range of addresses
+ * @param dir The page directory the mappings belong to (NULL for kernel mappings)
+ * @param start The starting address of the range
+ * @param size The size of the range in bytes
+ */
+void smp_tlbShootdownRange(void *dir, uintptr_t start, size_t size);
+
+/**
+ * @brief Initialize a TLB batch
+ * @param batch The batch to initialize
+ * @param dir The page directory the batch is for (NULL for kernel mappings)
+ */
+void smp_tlbBatchInit(smp_tlb_batch_t *batch, void *dir);
+
+/**
+ * @brief Add a range to a TLB batch
+ * 
+ * Ranges adjacent to the last range added are merged into it. If the batch is full
+ * it turns into a full flush.
+ * 
+ * @param batch The batch to add to
+ * @param start The starting address of the range
+ * @param size The size of the range in bytes
+ */
+void smp_tlbBatchAdd(smp_tlb_batch_t *batch, uintptr_t start, size_t size);
+
+/**
+ * @brief Request a full TLB flush in a batch
+ * @param batch The batch
+ */
+void smp_tlbBatchFlushAll(smp_tlb_batch_t *batch);
+
+/**
+ * @brief Flush a TLB batch
+ * 
+ * Invalidates the batch on this CPU, sends it to every other CPU that has the
+ * batch's page directory loaded (or every CPU for kernel mappings), and waits for them to acknowledge.
+ * The batch is emptied afterwards and can be reused.
+ * 
+ * @param batch The batch to flush
+ */
+void smp_tlbBatchFlush(smp_tlb_batch_t *batch);
+
+/**
+ * @brief Service the pending TLB shootdown if this CPU is a target of it
+ * @note Anything that spins with interrupts disabled should call this, or a shootdown can wait on it forever
+ */
+void smp_tlbService();
+
 
 #endif
\ No newline at end of file
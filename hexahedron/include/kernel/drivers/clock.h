@@ -87,6 +87,12 @@ void clock_update(uint64_t ticks);
  */
 uint64_t clock_getTickCount();
 
+/**
+ * @brief Get a high resolution timestamp
+ * @returns Microseconds from the clock device's timer (the TSC on x86), or 0 if there is no clock yet
+ */
+uint64_t clock_getTimestamp();
+
 /**
  * @brief Register an update callback
  * @returns -EINVAL on too many full, else it returns the index.
@@ -112,6 +112,23 @@
 // Timer IRQ
 #define LAPIC_TIMER_IRQ                 0x7B    // ISR 123
 
+// Timer modes (LVT timer register bits 17-18)
+#define LAPIC_TIMER_ONESHOT             0x00000
+#define LAPIC_TIMER_PERIODIC            0x20000
+#define LAPIC_TIMER_TSCDEADLINE         0x40000
+
+// TSC deadline MSR
+#define LAPIC_MSR_TSC_DEADLINE          0x6E0
+
+// Timer lengths (in microseconds)
+#define LAPIC_TIMER_PERIOD_US           10000   // Length of one scheduler tick
+#define LAPIC_TIMER_MIN_US              50      // Shortest delay the timer will be programmed with
+#define LAPIC_TIMER_IDLE_MAX_US         1000000 // Longest an idle core will go without a timer interrupt
+
+/**** TYPES ****/
+
+struct thread;
+
 /**** FUNCTIONS ****/
 
 /**
@@ -179,4 +196,21 @@ uint8_t lapic_readError();
  */
 void lapic_sendIPI(uint8_t lapic_id, uint8_t irq_no, uint32_t flags);
 
+/**
+ * @brief Program the local APIC timer for the next event on this core
+ * 
+ * In dynamic tick mode the timer is programmed to fire at the end of the thread's timeslice
+ * or at the nearest sleep deadline, whichever comes first. Does nothing in periodic mode.
+ * 
+ * @param thread The thread that is (about to be) running on this core
+ * @param new_slice Set if @c thread is being switched to and its timeslice starts now
+ */
+void lapic_timerArm(struct thread *thread, int new_slice);
+
+/**
+ * @brief Kick another core out of a long timer sleep
+ * @param lapic_id The ID of the APIC to kick
+ */
+void lapic_timerKick(uint8_t lapic_id);
+
 #endif
\ No newline at end of file
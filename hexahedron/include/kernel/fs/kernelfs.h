@@ -0,0 +1,71 @@
+/**
+ * @file hexahedron/include/kernel/fs/kernelfs.h
+ * @brief Kernel information filesystem
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_FS_KERNELFS_H
+#define KERNEL_FS_KERNELFS_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/misc/spinlock.h>
+
+/**** DEFINITIONS ****/
+
+#define KERNELFS_MOUNT_PATH         "/kernel"
+#define KERNELFS_INITIAL_BUFFER     1024
+
+/**** TYPES ****/
+
+struct kernelfs_entry;
+
+/**
+ * @brief Generate the contents of a kernelfs entry
+ * @param entry The entry being read. Use @c kernelfs_appendData to write to it.
+ * @param data User-specified data
+ * @returns 0 on success
+ */
+typedef int (*kernelfs_get_data_t)(struct kernelfs_entry *entry, void *data);
+
+typedef struct kernelfs_entry {
+    fs_node_t *node;                // Node mounted in the VFS
+    spinlock_t lock;                // Lock held while the buffer is swapped or read (not while generating)
+    kernelfs_get_data_t get_data;   // Generator
+    void *data;                     // Generator data
+    char *buffer;                   // Generated contents
+    size_t buffer_size;             // Allocated size of the buffer
+    size_t length;                  // Length of the generated contents
+} kernelfs_entry_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Create a new read-only entry in the kernel filesystem
+ * 
+ * The contents are regenerated every time the entry is read from offset 0.
+ * 
+ * @param name Name of the entry (mounted at /kernel/<name>)
+ * @param get_data Function that generates the contents
+ * @param data User-specified data for @c get_data
+ * @returns The entry
+ */
+kernelfs_entry_t *kernelfs_createEntry(char *name, kernelfs_get_data_t get_data, void *data);
+
+/**
+ * @brief Append formatted text to a kernelfs entry (only call from its generator)
+ * @param entry The entry
+ * @param fmt Format string
+ * @returns The amount of characters written
+ */
+int kernelfs_appendData(kernelfs_entry_t *entry, char *fmt, ...);
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * @file hexahedron/include/kernel/fs/pagecache.h
+ * @brief VFS page cache
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_FS_PAGECACHE_H
+#define KERNEL_FS_PAGECACHE_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <kernel/fs/vfs.h>
+#include <structs/ilist.h>
+
+/**** DEFINITIONS ****/
+
+#define PAGECACHE_BUCKETS           1024    // Buckets in the page hash table
+#define PAGECACHE_GENERATIONS       256     // Invalidation counters, nodes are hashed onto them
+#define PAGECACHE_MAX_DIVISOR       4       // The cache holds at most 1/x of physical memory
+#define PAGECACHE_PRESSURE_DIVISOR  16      // Pages are evicted when less than 1/x of physical memory is free
+
+/**** TYPES ****/
+
+/**
+ * @brief A cached page of a node
+ * 
+ * Nodes are cloned every time they are opened, so pages are not keyed on the node pointer but
+ * on what identifies its contents: the read method, the device and the inode.
+ */
+typedef struct pagecache_page {
+    read_t read;                // Read method of the node
+    void *dev;                  // Device of the node
+    uint64_t inode;             // Inode of the node
+    uint64_t index;             // Index of the page in the node
+
+    uintptr_t frame;            // Frame holding the contents
+    size_t length;              // Valid bytes in the frame (less than PAGE_SIZE at the end of the node)
+
+    int refs;                   // Readers copying out of the page
+    int dead;                   // The page was evicted while it had readers, the last one frees it
+
+    struct pagecache_page *next;    // Next page in the bucket
+    ilist_node_t lru;               // Node in the LRU list (first is least recently used)
+} pagecache_page_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Initialize the page cache
+ */
+void pagecache_init();
+
+/**
+ * @brief Read from a node through the page cache
+ * @param node The node to read from (must have @c VFS_CACHE_PAGES set)
+ * @param offset The offset to read at
+ * @param size The amount of bytes to read
+ * @param buffer The buffer to store the bytes in
+ * @returns The amount of bytes read
+ */
+ssize_t pagecache_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
+
+/**
+ * @brief Drop the cached pages of a node in a range
+ * @param node The node that was written to
+ * @param offset The offset of the range
+ * @param size The size of the range
+ */
+void pagecache_invalidate(fs_node_t *node, off_t offset, size_t size);
+
+/**
+ * @brief Evict the least recently used pages
+ * @param pages How many pages to evict
+ * @returns How many pages were evicted
+ */
+size_t pagecache_reclaim(size_t pages);
+
+/**
+ * @brief Get the amount of pages in the cache
+ */
+size_t pagecache_getCachedPages();
+
+#endif
@@ -34,6 +34,10 @@
 #define VFS_MOUNTPOINT      0x40
 #define VFS_SOCKET          0x80
 
+// Cache flags
+#define VFS_CACHE_NONE      0x00    // Reads always go to the node
+#define VFS_CACHE_PAGES     0x01    // Reads are served from the page cache. Contents may only change through fs_write
+
 
 /**** TYPES ****/
 
@@ -68,6 +72,7 @@ typedef struct fs_node {
     uint64_t inode;         // Device-specific, provides a way for the filesystem to idenrtify files
     uint64_t length;        // Size of file
     uint64_t impl;          // Implementation-defined number
+    uint64_t cache;         // Cache flags (e.g. VFS_CACHE_PAGES)
 
     // Times
     time_t atime;           // Access timestamp (last access time)
@@ -71,6 +71,9 @@ uintptr_t elf_loadBuffer(uint8_t *fbuf, int flags);
  * @param file The file to load into memory
  * @param flags The flags to use (ELF_KERNEL or ELF_USER)
  * @returns A pointer to the file that can be passed to @c elf_getEntrypoint or @c elf_findSymbol - or NULL if there was an error. 
+ * 
+ * @note Executables loaded with ELF_USER are demand paged: only their headers are read and the pointer returned
+ *       only covers those. The segments are mapped in the current process (see @c vma_map).
  */
 uintptr_t elf_load(fs_node_t *node, int flags);
 
@@ -14,6 +14,10 @@
  * 
  * All of the above should be contained in a single directory (e.g. hexalloc or toaru_alloc).
  * 
+ * Every allocation made through kmalloc and friends is charged to a tag. By default that is the
+ * source file making the call, define ALLOC_TAG before including this header to charge a whole
+ * module to one name instead, or use the *_tagged variants.
+ * 
  * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
@@ -29,9 +33,22 @@
 
 /**** INCLUDES ****/
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <time.h>
 
+/**** DEFINITIONS ****/
+
+#define ALLOC_MAX_TAGS          256         // Maximum amount of tags
+#define ALLOC_TAG_NAME_LENGTH   64          // Maximum length of a tag name
+#define ALLOC_HEADER_MAGIC      0xA110CA7E  // Allocation header magic
+#define ALLOC_HEADER_VALLOC     0x01        // The allocation came from kvalloc
+
+/* Default tag for this source file */
+#ifndef ALLOC_TAG
+#define ALLOC_TAG __FILE__
+#endif
+
 /**** TYPES ****/
 
 /* Allocator information structure */
@@ -40,10 +57,42 @@ typedef struct _allocator_info {
     uint32_t    version_major;      // Major version of allocator
     uint32_t    version_minor;      // Minor version of allocator
     int         support_valloc;     // Whether the allocator supports valloc().
+    int         support_stats;      // Whether the allocator supports alloc_getStats()
 
     // TODO: More flags will be added
 } allocator_info_t;
 
+/* Allocator statistics structure */
+typedef struct _allocator_stats {
+    size_t      heap_size;          // Bytes of memory the allocator is holding on to
+    size_t      used;               // Bytes handed out, including size class rounding and allocator headers
+    size_t      free;               // Bytes held but not handed out
+    size_t      free_chunks;        // Amount of separate free pieces making up @c free
+} allocator_stats_t;
+
+/**
+ * @brief Allocation tag
+ * 
+ * Counters are updated atomically without a lock, so a snapshot can be slightly inconsistent.
+ */
+typedef struct alloc_tag {
+    char        name[ALLOC_TAG_NAME_LENGTH];    // Name of the tag
+    size_t      bytes;              // Bytes currently allocated
+    size_t      objects;            // Objects currently allocated
+    size_t      peak_bytes;         // Highest value @c bytes has reached
+    size_t      allocations;        // Objects ever allocated
+} alloc_tag_t;
+
+/**
+ * @brief Header in front of every kmalloc allocation
+ */
+typedef struct alloc_header {
+    uint32_t    magic;              // ALLOC_HEADER_MAGIC
+    uint16_t    tag;                // Index of the tag this allocation is charged to
+    uint16_t    flags;              // ALLOC_HEADER_...
+    size_t      size;               // Requested size
+} __attribute__((aligned(16))) alloc_header_t;
+
 /**** FUNCTIONS ****/
 
 
@@ -82,6 +131,13 @@ extern void alloc_free(void *ptr);
  */
 allocator_info_t *alloc_getInfo();
 
+/**
+ * @brief Get heap usage and fragmentation statistics
+ * @param stats The structure to fill in
+ * @note This is optional. Set the allocator info part support_stats to 0 to not provide.
+ */
+void alloc_getStats(allocator_stats_t *stats);
+
 
 /* ALLOCATOR MANAGEMENT SYSTEM (alloc.c) WILL PROVIDE THESE FUNCTIONS */
 
@@ -131,4 +187,61 @@ void kfree(void *ptr);
  */
 int alloc_canHasValloc();
 
+/**
+ * @brief Get a tag by name, creating it if it doesn't exist
+ * @param name The name of the tag (leading "./" is stripped)
+ * @returns The index of the tag
+ */
+int alloc_getTag(const char *name);
+
+/**
+ * @brief Allocate kernel memory charged to a tag
+ * @param size The size of the allocation
+ * @param tag The index of the tag (see @c alloc_getTag)
+ */
+__attribute__((malloc)) void *kmalloc_tagged(size_t size, int tag);
+
+/**
+ * @brief Reallocate kernel memory charged to a tag
+ * @param ptr A pointer to the previous structure
+ * @param size The new size of the structure.
+ * @param tag The tag to charge if @p ptr is NULL (otherwise the allocation keeps its tag)
+ */
+__attribute__((malloc)) void *krealloc_tagged(void *ptr, size_t size, int tag);
+
+/**
+ * @brief Contiguous allocation function charged to a tag
+ * @param elements The amount of elements to allocate
+ * @param size The size of each element
+ * @param tag The index of the tag
+ */
+__attribute__((malloc)) void *kcalloc_tagged(size_t elements, size_t size, int tag);
+
+/**
+ * @brief Page-aligned memory allocator charged to a tag
+ * @param size The size to allocate.
+ * @param tag The index of the tag
+ */
+__attribute__((malloc)) void *kvalloc_tagged(size_t size, int tag);
+
+/**
+ * @brief Create /kernel/kmalloc, which reports every tag and the allocator's fragmentation
+ */
+void alloc_mountStats();
+
+/**** MACROS ****/
+
+#ifndef ALLOC_NO_TAG_MACROS
+
+/* Tag of this source file, looked up on first use */
+static int __attribute__((unused)) alloc_file_tag = -1;
+#define ALLOC_FILE_TAG ((alloc_file_tag >= 0) ? alloc_file_tag : (alloc_file_tag = alloc_getTag(ALLOC_TAG)))
+
+#define kmalloc(size)               kmalloc_tagged((size), ALLOC_FILE_TAG)
+#define krealloc(ptr, size)         krealloc_tagged((ptr), (size), ALLOC_FILE_TAG)
+#define kcalloc(elements, size)     kcalloc_tagged((elements), (size), ALLOC_FILE_TAG)
+#define kvalloc(size)               kvalloc_tagged((size), ALLOC_FILE_TAG)
+
+#endif
+
 #endif
\ No newline at end of file
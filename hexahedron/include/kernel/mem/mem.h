@@ -49,6 +49,8 @@
 #define MEM_PAGE_FREE               0x80    // Free the page. Sets it to zero if specified in mem_allocatePage
 #define MEM_PAGE_NO_EXECUTE         0x100   // (x86_64 only) Set the page as non-executable.
 #define MEM_PAGE_WRITE_COMBINE      0x200   // Sets up the page as write-combining if the architecture supports it
+#define MEM_PAGE_ZERO               0x400   // (x86_64 only) Map the shared zero page read-only. The first write gives the page its own zeroed frame
+#define MEM_PAGE_GLOBAL             0x800   // (x86_64 only) The page is global and survives CR3 reloads. Only for mappings that are the same in every directory
 
 // Flags to mem_allocate
 #define MEM_ALLOC_CONTIGUOUS        0x01    // Allocate contiguous blocks of memory, rather than fragmenting PMM blocks
@@ -61,6 +63,18 @@
 #define PTR_READONLY                0x02    // Read-only or read-write pointer (STRICT: Only read-only)
 #define PTR_STRICT                  0x04    // Strict pointer validation
 
+// Reference counts saturate here, after which a page is copied instead of shared (see mem_incrementPageReference)
+#define MEM_FRAME_MAX_REFS          INT32_MAX
+
+/**** TYPES ****/
+
+/**
+ * @brief Metadata of a physical frame (the architecture keeps one for every frame of memory)
+ */
+typedef struct mem_frame {
+    uint32_t refs;                  // Copy-on-write references, 0 if the frame has a single owner. Only touched atomically
+} mem_frame_t;
+
 /**** FUNCTIONS ****/
 
 /**
@@ -273,6 +287,24 @@ uintptr_t mem_allocate(uintptr_t start, size_t size, uintptr_t flags, uintptr_t
  */
 void mem_free(uintptr_t start, size_t size, uintptr_t flags);
 
+/**
+ * @brief Change the protection of the present usermode pages in a range of the current directory
+ * @param start The starting virtual address (page aligned)
+ * @param size The size of the range
+ * @param flags @c MEM_PAGE_READONLY to make the pages read-only, otherwise they become writable.
+ *              @c MEM_PAGE_KERNEL to make them inaccessible to usermode until the next call without it
+ * @note Pages pending CoW stay read-only, the CoW fault makes them writable
+ */
+void mem_protect(uintptr_t start, size_t size, uintptr_t flags);
+
+/**
+ * @brief Give a usermode page pending CoW (or mapping the shared zero page) its own frame
+ * @param address The address of the page in the current directory
+ * @returns 1 if the page has its own frame now, 0 if it wasn't pending CoW (or in a shared table)
+ * @note The kernel doesn't fault on writes to read-only pages, so call this before writing to such a page
+ */
+int mem_breakCopyOnWrite(uintptr_t address);
+
 /**
  * @brief Validate a specific pointer in memory
  * @param ptr The pointer you wish to validate
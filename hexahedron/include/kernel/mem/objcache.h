@@ -0,0 +1,109 @@
+/**
+ * @file hexahedron/include/kernel/mem/objcache.h
+ * @brief Object cache
+ *
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_MEM_OBJCACHE_H
+#define KERNEL_MEM_OBJCACHE_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/misc/spinlock.h>
+
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/smp.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/smp.h>
+#else
+#error "Unsupported architecture"
+#endif
+
+/**** DEFINITIONS ****/
+
+#define OBJCACHE_MAGAZINE_SIZE      8                               // Objects held by a per-CPU magazine
+#define OBJCACHE_MAGAZINE_BATCH     (OBJCACHE_MAGAZINE_SIZE / 2)    // Objects moved between a magazine and the depot at once
+
+/**** TYPES ****/
+
+struct objcache;
+
+/**
+ * @brief Create a new object for a cache
+ * @param cache The cache that needs an object
+ * @returns The object or NULL
+ */
+typedef void *(*objcache_create_t)(struct objcache *cache);
+
+/**
+ * @brief Destroy an object of a cache that is over its limit
+ * @param cache The cache the object belongs to
+ * @param obj The object
+ */
+typedef void (*objcache_destroy_t)(struct objcache *cache, void *obj);
+
+/**
+ * @brief Per-CPU magazine of free objects
+ */
+typedef struct objcache_magazine {
+    size_t count;                               // Objects in the magazine
+    void *objects[OBJCACHE_MAGAZINE_SIZE];      // Objects
+} objcache_magazine_t;
+
+/**
+ * @brief An object cache
+ *
+ * Free objects are kept around instead of being given back, first in a magazine of the CPU
+ * that freed them and then in the depot, which links them through their first word.
+ */
+typedef struct objcache {
+    char *name;                     // Name for debugging
+    size_t size;                    // Size of an object
+    objcache_create_t create;       // Creates objects (NULL to kmalloc them)
+    objcache_destroy_t destroy;     // Destroys objects (NULL to kfree them)
+    size_t depot_max;               // Objects the depot may hold before they are destroyed (0 for no limit)
+
+    void *depot;                    // Free objects shared by every CPU
+    size_t depot_count;             // Objects in the depot
+    size_t objects;                 // Objects that exist (in use or cached)
+    spinlock_t lock;                // Lock for the depot
+
+    objcache_magazine_t magazines[MAX_CPUS]; // Per-CPU magazines
+} objcache_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Create an object cache
+ * @param name Name for debugging
+ * @param size The size of an object (at least a pointer)
+ * @param depot_max How many free objects the depot may hold, 0 to never destroy objects
+ * @param create Creates a new object, or NULL to kmalloc @p size bytes
+ * @param destroy Destroys an object, or NULL to kfree it
+ * @returns The new cache
+ */
+objcache_t *objcache_create(char *name, size_t size, size_t depot_max, objcache_create_t create, objcache_destroy_t destroy);
+
+/**
+ * @brief Allocate an object from a cache
+ * @param cache The cache to allocate from
+ * @returns The object (not cleared) or NULL if a new one couldn't be created
+ */
+void *objcache_alloc(objcache_t *cache);
+
+/**
+ * @brief Return an object to its cache
+ * @param cache The cache the object came from
+ * @param obj The object
+ */
+void objcache_free(objcache_t *cache, void *obj);
+
+#endif
@@ -16,22 +16,75 @@
 
 /**** INCLUDES ****/
 #include <stdint.h>
-
-/**** MACROS ****/
-#define PMM_INDEX_BIT(a) (a / (8 * 4))
-#define PMM_OFFSET_BIT(a) (a % (8 * 4))
+#include <stddef.h>
+#include <kernel/misc/spinlock.h>
 
 /**** DEFINITIONS ****/
 #define PMM_BLOCK_SIZE  4096
 
+#define PMM_MAX_ORDER   16          // Amount of orders. The largest free block is 1 << (PMM_MAX_ORDER - 1) frames
+#define PMM_FRAME_NONE  0x7FFFFFF   // No frame (end of a free list). Also the most frames the PMM can handle
+#define PMM_ORDER_NONE  0x1F        // Frame does not start a free block
+
+#define PMM_CACHE_SIZE  256         // Most frames a per-CPU frame cache can hold
+#define PMM_CACHE_LOW   16          // Default low watermark (an empty cache is refilled up to this)
+#define PMM_CACHE_HIGH  64          // Default high watermark (a cache going over this is drained down to the low watermark)
+
+#define PMM_MAX_RECLAIMERS  4       // Most reclaimers that can be registered
+#define PMM_RECLAIM_BATCH   32      // Blocks asked of the reclaimers when a single block can't be allocated
+
+/**** TYPES ****/
+
+/**
+ * @brief Per-frame buddy allocator information
+ */
+typedef struct pmm_block {
+    uint32_t next;                  // Next free block of the same order
+    uint32_t prev:27;               // Previous free block of the same order
+    uint32_t order:5;               // Order of the free block starting at this frame, or PMM_ORDER_NONE
+} pmm_block_t;
+
+/**
+ * @brief Per-CPU cache of free frames
+ * 
+ * Frames are kept in a ring. Freed frames go on the hot end (start + count - 1) and are handed out
+ * first, since they are likely still in the CPU's caches. Refills go on the cold end (start), which is also
+ * what gets drained back to the buddy allocator.
+ * 
+ * The lock is only contended when another CPU drains every cache (see @c pmm_drainCaches).
+ */
+typedef struct pmm_cache {
+    uint32_t frames[PMM_CACHE_SIZE];    // Frames
+    size_t start;                       // Cold end of the ring
+    size_t count;                       // Amount of frames in the cache
+    spinlock_t lock;                    // Lock
+} pmm_cache_t;
+
+/**
+ * @brief Give memory held by a cache back to the PMM (see @c pmm_registerReclaimer)
+ * 
+ * Called from allocations that ran out of memory, with no PMM lock held. It must not allocate memory
+ * or take locks that are held around allocations.
+ * 
+ * @param blocks How many blocks are wanted
+ * @returns How many blocks were given back
+ */
+typedef size_t (*pmm_reclaimer_t)(size_t blocks);
+
 /**** FUNCTIONS ****/
 
+/**
+ * @brief Get the amount of bytes @c pmm_init needs for its per-frame storage
+ * @param memsize Available physical memory in bytes.
+ */
+size_t pmm_getStorageSize(uintptr_t memsize);
+
 /**
  * @brief Initialize the physical memory system.
  * @param memsize Available physical memory in bytes.
- * @param frames_bitmap The bitmap of frames allocated to the system (mapped into memory)
+ * @param storage Per-frame storage, at least @c pmm_getStorageSize bytes (mapped into memory)
  */
-int pmm_init(uintptr_t memsize, uintptr_t *frames_bitmap);
+int pmm_init(uintptr_t memsize, void *storage);
 
 /**
  * @brief Initialize a region as available memory
@@ -65,6 +118,13 @@ void pmm_freeBlock(uintptr_t block);
  */
 uintptr_t pmm_allocateBlocks(size_t blocks);
 
+/**
+ * @brief Try to allocate @c blocks amount of blocks, without faulting if there is no memory
+ * @param blocks The amount of blocks to allocate. Must be aligned to PMM_BLOCK_SIZE - do not pass bytes!
+ * @returns The address of the blocks, aligned to the next power of two, or 0x0 on failure
+ */
+uintptr_t pmm_tryAllocateBlocks(size_t blocks);
+
 /**
  * @brief Frees @c blocks amount of blocks
  * @param base Pointer returned by @c pmm_allocateBlocks
@@ -92,5 +152,31 @@ uintptr_t pmm_getUsedBlocks();
  */
 uintptr_t pmm_getFreeBlocks();
 
+/**
+ * @brief Gets the amount of free blocks of an order
+ * @param order The order (blocks of 1 << order frames)
+ */
+uintptr_t pmm_getFreeBlocksOfOrder(int order);
+
+/**
+ * @brief Gets the amount of free blocks held in per-CPU caches
+ */
+uintptr_t pmm_getCachedBlocks();
+
+/**
+ * @brief Set the watermarks of the per-CPU frame caches
+ * @param low Frames an empty cache is refilled to, and a full cache is drained to
+ * @param high Frames a cache can hold before it is drained
+ * @returns 0 on success, -EINVAL if the watermarks are bad
+ */
+int pmm_setCacheWatermarks(size_t low, size_t high);
+
+/**
+ * @brief Register a reclaimer, which is asked to give memory back before an allocation fails
+ * @param reclaimer The reclaimer
+ * @returns 0 on success, -ENOSPC if too many are registered
+ */
+int pmm_registerReclaimer(pmm_reclaimer_t reclaimer);
+
 
 #endif
\ No newline at end of file
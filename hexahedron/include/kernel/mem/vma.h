@@ -0,0 +1,145 @@
+/**
+ * @file hexahedron/include/kernel/mem/vma.h
+ * @brief Virtual memory areas of a process
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_MEM_VMA_H
+#define KERNEL_MEM_VMA_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/misc/spinlock.h>
+
+/**** TYPES ****/
+
+/**
+ * @brief A virtual memory area
+ * 
+ * Pages of an area are mapped when they are first touched. Anything between @c file_start
+ * and @c file_end is read from @c node, the rest of the area is zero-filled.
+ */
+typedef struct vma {
+    uintptr_t start;            // Start of the area (page aligned)
+    uintptr_t end;              // End of the area (page aligned)
+    int prot;                   // Protection of the area (PROT_...)
+    int max_prot;               // Highest protection the area may be changed to
+    int flags;                  // Flags of the area (MAP_...)
+
+    uintptr_t file_start;       // Start of the file contents
+    uintptr_t file_end;         // End of the file contents
+    off_t offset;               // Offset of file_start in the file
+    fs_node_t *node;            // File backing the area (holds a reference), or NULL
+
+    struct vma *left;           // Areas below this one
+    struct vma *right;          // Areas above this one
+    int height;                 // Height of the subtree
+} vma_t;
+
+/**
+ * @brief The areas of a process, kept in an AVL tree ordered by address
+ */
+typedef struct vma_tree {
+    vma_t *root;                // Root of the tree
+    size_t count;               // Amount of areas
+    spinlock_t lock;            // Lock
+} vma_tree_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Add an area
+ * @param tree The tree to add the area to
+ * @param start The start of the area (rounded down to a page)
+ * @param size The size of the area (rounded up to a page)
+ * @param prot The protection of the area
+ * @param max_prot The highest protection @c vma_protect may give the area later
+ * @param flags The flags of the area
+ * @param node The file to read the start of the area from, or NULL to zero-fill all of it
+ * @param offset The offset of @p start in @p node
+ * @param file_size How many bytes from @p start are read from @p node
+ * @returns 0 on success, -EEXIST if another area is in the way
+ */
+int vma_map(vma_tree_t *tree, uintptr_t start, size_t size, int prot, int max_prot, int flags, fs_node_t *node, off_t offset, size_t file_size);
+
+/**
+ * @brief Remove the areas in a range and free their pages in the current directory
+ * @param tree The tree to remove the areas from
+ * @param start The start of the range (page aligned)
+ * @param size The size of the range
+ * @returns 0 on success
+ * @note Areas partially in the range are split
+ */
+int vma_unmap(vma_tree_t *tree, uintptr_t start, size_t size);
+
+/**
+ * @brief Change the protection of the areas in a range and their pages in the current directory
+ * @param tree The tree of areas
+ * @param start The start of the range (page aligned)
+ * @param size The size of the range
+ * @param prot The new protection
+ * @returns 0 on success, -ENOMEM if part of the range isn't mapped, -EACCES if @p prot is above an area's maximum
+ */
+int vma_protect(vma_tree_t *tree, uintptr_t start, size_t size, int prot);
+
+/**
+ * @brief Get the protection of the area containing an address
+ * @param tree The tree of areas
+ * @param address The address to look up
+ * @returns The protection of the area, or -1 if there is no area
+ */
+int vma_getProtection(vma_tree_t *tree, uintptr_t address);
+
+/**
+ * @brief Check whether a range is free of areas
+ * @param tree The tree of areas
+ * @param start The start of the range
+ * @param size The size of the range
+ * @returns 1 if no area overlaps the range
+ */
+int vma_isFree(vma_tree_t *tree, uintptr_t start, size_t size);
+
+/**
+ * @brief Find a free range in the mmap region
+ * @param tree The tree of areas
+ * @param hint Address to use if it is in the region and free (can be 0)
+ * @param size The size of the range (page aligned)
+ * @returns The start of the range or 0x0 if the region is full
+ */
+uintptr_t vma_findFree(vma_tree_t *tree, uintptr_t hint, size_t size);
+
+/**
+ * @brief Map the page of an area containing an address
+ * @param tree The tree of areas (must belong to the current directory)
+ * @param address The address that was touched
+ * @param write Whether the page is about to be written to. Reads of pages with nothing to read in map the shared zero page
+ * @returns 1 if the page is mapped now, 0 if the address isn't in an accessible area or it was already mapped
+ */
+int vma_fault(vma_tree_t *tree, uintptr_t address, int write);
+
+/**
+ * @brief Copy every area of a tree (the pages themselves are cloned with the directory)
+ * @param dest The tree to copy to (must be empty)
+ * @param src The tree to copy from
+ */
+void vma_clone(vma_tree_t *dest, vma_tree_t *src);
+
+/**
+ * @brief Remove every area of a tree
+ * @param tree The tree to empty
+ * @note This doesn't unmap pages, destroy the directory to do that
+ */
+void vma_destroy(vma_tree_t *tree);
+
+#endif
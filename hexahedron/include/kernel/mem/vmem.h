@@ -0,0 +1,102 @@
+/**
+ * @file hexahedron/include/kernel/mem/vmem.h
+ * @brief Virtual address arena allocator
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_MEM_VMEM_H
+#define KERNEL_MEM_VMEM_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/misc/spinlock.h>
+
+/**** DEFINITIONS ****/
+
+#define VMEM_FREELISTS          (sizeof(uintptr_t) * 8)     // One free list per power of two quanta
+#define VMEM_HASH_BUCKETS       256                         // Buckets in the allocated segment hash table
+
+/**** TYPES ****/
+
+/**
+ * @brief A segment of an arena (its boundary tag)
+ * 
+ * Every segment is on the address-ordered segment list. Free segments are also on the free list
+ * of their size, allocated segments are in the hash table so they can be found by address.
+ */
+typedef struct vmem_segment {
+    uintptr_t base;                 // Start of the segment
+    size_t size;                    // Size of the segment
+    int free;                       // Whether the segment is free
+
+    struct vmem_segment *prev;      // Previous segment in address order
+    struct vmem_segment *next;      // Next segment in address order
+
+    struct vmem_segment *link_prev; // Previous segment on the free list (free segments only)
+    struct vmem_segment *link_next; // Next segment on the free list or in the hash bucket
+} vmem_segment_t;
+
+/**
+ * @brief An arena of addresses
+ */
+typedef struct vmem {
+    char *name;                     // Name for debugging
+    uintptr_t base;                 // Start of the arena
+    size_t size;                    // Size of the arena
+    size_t quantum;                 // Every allocation is a multiple of this
+    size_t used;                    // Bytes allocated
+
+    vmem_segment_t *segments;                       // Lowest segment
+    vmem_segment_t *freelist[VMEM_FREELISTS];       // Free segments of [2^n, 2^(n+1)) quanta
+    uintptr_t freemap;                              // Bit n is set when freelist[n] isn't empty
+    vmem_segment_t *hash[VMEM_HASH_BUCKETS];        // Allocated segments by base
+
+    spinlock_t lock;                // Lock
+} vmem_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Create an arena
+ * @param name Name for debugging
+ * @param base The start of the arena (aligned to @p quantum)
+ * @param size The size of the arena (a multiple of @p quantum)
+ * @param quantum The allocation granularity, a power of two
+ * @returns The new arena or NULL if the arguments are bad
+ */
+vmem_t *vmem_create(char *name, uintptr_t base, size_t size, size_t quantum);
+
+/**
+ * @brief Allocate a range from an arena
+ * @param arena The arena to allocate from
+ * @param size The size of the range (rounded up to the quantum)
+ * @returns The start of the range or 0x0 if no free segment is big enough
+ */
+uintptr_t vmem_alloc(vmem_t *arena, size_t size);
+
+/**
+ * @brief Check that a range is allocated from an arena
+ * @param arena The arena the range came from
+ * @param base The address returned by @c vmem_alloc
+ * @param size The size given to @c vmem_alloc
+ * @returns 1 if @c vmem_free would accept the range
+ */
+int vmem_isAllocated(vmem_t *arena, uintptr_t base, size_t size);
+
+/**
+ * @brief Return a range to an arena
+ * @param arena The arena the range came from
+ * @param base The address returned by @c vmem_alloc
+ * @param size The size given to @c vmem_alloc
+ */
+void vmem_free(vmem_t *arena, uintptr_t base, size_t size);
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * @file hexahedron/include/kernel/misc/mutex.h
+ * @brief Sleeping mutex
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_MISC_MUTEX_H
+#define KERNEL_MISC_MUTEX_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/task/sleep.h>
+
+/**** TYPES ****/
+
+struct thread;
+
+typedef struct mutex {
+    char *name;                 // Optional name for debugging
+    spinlock_t lock;            // Protects the fields below
+    volatile int locked;        // Whether the mutex is held
+    struct thread *owner;       // Thread holding the mutex (NULL if held before threading started)
+    sleep_queue_t waiters;      // Threads waiting for the mutex
+} mutex_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Create a new mutex
+ * @param name Optional mutex name (for debugging)
+ */
+mutex_t *mutex_create(char *name);
+
+/**
+ * @brief Initialize a mutex embedded in another structure
+ * @param mutex The mutex to initialize
+ * @param name Optional mutex name (for debugging)
+ */
+void mutex_init(mutex_t *mutex, char *name);
+
+/**
+ * @brief Acquire a mutex, putting the current thread to sleep while it is held
+ * @param mutex The mutex to acquire
+ * @note Before the scheduler is running this spins instead.
+ */
+void mutex_acquire(mutex_t *mutex);
+
+/**
+ * @brief Try to acquire a mutex without sleeping
+ * @param mutex The mutex to acquire
+ * @returns 1 if the mutex was acquired, 0 if it is held
+ */
+int mutex_tryAcquire(mutex_t *mutex);
+
+/**
+ * @brief Release a mutex, waking up the next waiter
+ * @param mutex The mutex to release
+ */
+void mutex_release(mutex_t *mutex);
+
+/**
+ * @brief Destroy a mutex created with @c mutex_create
+ * @param mutex The mutex to destroy
+ */
+void mutex_destroy(mutex_t *mutex);
+
+#endif
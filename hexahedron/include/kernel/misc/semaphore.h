@@ -1,6 +1,6 @@
 /**
  * @file hexahedron/include/kernel/misc/semaphore.h
- * @brief Header for the semaphore interface (binary semaphores) 
+ * @brief Header for the semaphore interface (counting semaphores) 
  * 
  * 
  * @copyright
@@ -17,15 +17,16 @@
 /**** INCLUDES ****/
 #include <stdint.h>
 #include <kernel/misc/spinlock.h>
+#include <kernel/task/sleep.h>
 
 /**** TYPES ****/
 typedef struct _semaphore {
     spinlock_t *lock;           // TODO: This would benefit from a shorter lock
     char *name;                 // Optional name for debugging
     volatile int value;         // Current value
-    volatile int max_value;     // Maximum value (signal will wait if exceeded)
-
-    // TODO: When threading is implemented, thread lists will be put here.
+    volatile int max_value;     // Maximum value (0 for no maximum, signal adds at most up to it)
+    volatile int waiting;       // Threads inside semaphore_wait (protected by lock)
+    sleep_queue_t waiters;      // Threads waiting for the value to become non-zero
 } semaphore_t;
 
 /**** FUNCTIONS ****/
@@ -34,23 +35,34 @@ typedef struct _semaphore {
  * @brief Initialize and create a semaphore
  * @param name          Optional semaphore name (for debugging)
  * @param value         The initialization value of the semaphore
- * @param max_value     The maximum value of the semaphore (afterwards, signal will wait)
+ * @param max_value     The maximum value of the semaphore (0 for no maximum)
  */
 semaphore_t *semaphore_create(char *name, int value, int max_value);
 
 /**
  * @brief Wait on the semaphore
+ * 
+ * If the semaphore is empty the current thread sleeps until it is signalled.
+ * 
  * @param semaphore     The semaphore to use
  * @param items         The amount of items to take from the semaphore
- * @returns Items taken
+ * @returns Items taken (at least one, at most @c items)
  */
 int semaphore_wait(semaphore_t *semaphore, int items);
 
+/**
+ * @brief Take items from the semaphore without sleeping
+ * @param semaphore     The semaphore to use
+ * @param items         The amount of items to take from the semaphore
+ * @returns Items taken, 0 if the semaphore is empty
+ */
+int semaphore_tryWait(semaphore_t *semaphore, int items);
+
 /**
  * @brief Signal to the semaphore
  * @param semaphore     The semaphore to use
  * @param items         The amount of items to add to the semaphore
- * @returns Items added
+ * @returns Items added (less than @c items if the maximum was reached)
  */
 int semaphore_signal(semaphore_t *semaphore, int items);
 
@@ -63,8 +75,13 @@ int semaphore_getItems(semaphore_t *semaphore);
 
 /**
  * @brief Destroy the semaphore
+ * 
+ * Fails while any thread is still waiting on the semaphore, since waiters would
+ * come back to a freed lock.
+ * 
  * @param semaphore     The semaphore to use
+ * @returns 0 on success, -EBUSY if threads are still waiting
  */
-void semaphore_destroy(semaphore_t *semaphore);
+int semaphore_destroy(semaphore_t *semaphore);
 
 #endif
\ No newline at end of file
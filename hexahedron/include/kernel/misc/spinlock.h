@@ -16,15 +16,46 @@
 
 /**** INCLUDES ****/
 #include <stdint.h>
+#include <stddef.h>
 #include <stdatomic.h>
 
+/**** DEFINITIONS ****/
+
+// SPINLOCK_STATS records acquisitions, contention and hold times for each named lock (see USE_SPINLOCK_STATS in conf/build)
+
+// Value of spinlock_t::cpu when nobody holds the lock. Statically initialized locks ({ 0 }) start out unowned.
+#define SPINLOCK_UNOWNED        0
+
+// Value of spinlock_t::cpu when the lock is held by a CPU
+#define SPINLOCK_HOLDER(cpu)    ((cpu) + 1)
+
+// Maximum amount of lock names tracked with SPINLOCK_STATS
+#define SPINLOCK_STATS_MAX      128
+
 /**** TYPES ****/
 
+/**
+ * @brief Spinlock statistics, shared by every lock with the same name
+ */
+typedef struct spinlock_stats {
+    char *name;                 // Name of the lock(s)
+    uint64_t acquisitions;      // Times the lock was acquired
+    uint64_t contended;         // Acquisitions that had to wait for another holder
+    uint64_t spins;             // Total amount of times we paused waiting for the lock
+    uint64_t max_hold;          // Longest the lock was held for (in TSC cycles)
+} spinlock_stats_t;
+
 // spin
 typedef struct spinlock {
-    char *name;         // Optional name
-    int cpu;            // ID of the CPU holding the spinlock 
-    atomic_flag lock;   // Lock
+    char *name;                 // Optional name
+    int cpu;                    // SPINLOCK_HOLDER() of the CPU holding the spinlock, or SPINLOCK_UNOWNED
+    atomic_uint next_ticket;    // Next ticket to hand out
+    atomic_uint serving;        // Ticket that currently owns the lock
+
+#ifdef SPINLOCK_STATS
+    uint64_t acquire_time;      // Timestamp of the current acquisition
+    spinlock_stats_t *stats;    // Statistics for this lock's name
+#endif
 } spinlock_t;
 
 /**** FUNCTIONS ****/
@@ -45,7 +76,7 @@ void spinlock_destroy(spinlock_t *spinlock);
 /**
  * @brief Lock a spinlock
  * 
- * Will spin around until we acquire the lock
+ * Will spin around until we acquire the lock. Waiters are served in the order they arrived.
  */
 void spinlock_acquire(spinlock_t *spinlock);
 
@@ -54,5 +85,21 @@ void spinlock_acquire(spinlock_t *spinlock);
  */
 void spinlock_release(spinlock_t *spinlock);
 
+/**
+ * @brief Get the spinlock statistics table
+ * @param count Output for the amount of entries in the table
+ * @returns The statistics table, or NULL if SPINLOCK_STATS is disabled
+ */
+spinlock_stats_t *spinlock_getStats(size_t *count);
+
+/**
+ * @brief Dump spinlock statistics to the debug log
+ */
+void spinlock_dumpStats();
+
+/**
+ * @brief Create /kernel/spinlocks, which reports the statistics of every named lock
+ */
+void spinlock_mountStats();
 
 #endif
\ No newline at end of file
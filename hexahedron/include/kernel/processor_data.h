@@ -24,6 +24,8 @@
 #include <kernel/arch/arch.h>
 #include <kernel/mem/mem.h>
 #include <kernel/task/process.h>
+#include <kernel/misc/spinlock.h>
+#include <structs/ilist.h>
 
 
 /**** TYPES ****/
@@ -59,8 +61,22 @@ typedef struct _processor {
     const char *cpu_manufacturer;
     int cpu_model_number;
     int cpu_family;
+
+    uint64_t lapic_timer_last;          // Clock ticks of the last scheduler tick accounted for by the LAPIC timer
+#endif
+
+    /* Scheduler run queue (appended last as assembly relies on the offsets above) */
+    ilist_t run_queue[SCHEDULER_PRIORITY_LEVELS]; // Threads waiting to run on this CPU, one queue per priority
+    uint32_t run_queue_bitmap;          // Bitmap of non-empty run queues (bit N = priority N)
+    size_t run_queue_count;             // Total amount of threads queued on this CPU
+    uint64_t run_queue_ticks;           // Scheduler ticks seen by this CPU, used for aging
+    spinlock_t *run_queue_lock;         // Lock for the run queues
+
+#ifdef __ARCH_X86_64__
+    /* PCIDs (see mem_switchDirectory) */
+    page_t *pcid_dirs[MEM_PCID_SLOTS];  // Directory that has each PCID on this CPU (PCID = slot + 1), NULL when it's free
+    int pcid_next;                      // Slot handed out when a directory has none
 #endif
-    
 
 } processor_t;
 
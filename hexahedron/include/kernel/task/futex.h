@@ -0,0 +1,59 @@
+/**
+ * @file hexahedron/include/kernel/task/futex.h
+ * @brief Futex wait/wake
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef KERNEL_TASK_FUTEX_H
+#define KERNEL_TASK_FUTEX_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <sys/futex.h>
+#include <sys/time.h>
+#include <structs/ilist.h>
+
+/**** DEFINITIONS ****/
+
+#define FUTEX_BUCKETS           64      // Amount of wait buckets (must be a power of two)
+
+/**** TYPES ****/
+
+struct thread;
+
+/**
+ * @brief Futex waiter, lives on the waiting thread's kernel stack
+ */
+typedef struct futex_waiter {
+    uintptr_t key;              // Physical address of the futex word
+    struct thread *thread;      // Thread waiting
+    ilist_node_t node;          // Node in the bucket
+} futex_waiter_t;
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Wait on a futex word
+ * @param uaddr The futex word in the current address space
+ * @param val The value the word must still have to go to sleep
+ * @param timeout Optional relative timeout
+ * @returns 0 when woken up, -EAGAIN if the value changed, -ETIMEDOUT on timeout, or -EINVAL
+ */
+long futex_wait(uint32_t *uaddr, uint32_t val, const struct timeval *timeout);
+
+/**
+ * @brief Wake up threads waiting on a futex word
+ * @param uaddr The futex word in the current address space
+ * @param count Maximum amount of threads to wake
+ * @returns The amount of threads woken, or -EINVAL
+ */
+long futex_wake(uint32_t *uaddr, uint32_t count);
+
+#endif
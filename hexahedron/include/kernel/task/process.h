@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <structs/list.h>
+#include <structs/ilist.h>
 #include <time.h>
 
 #include <kernel/task/thread.h>
@@ -27,6 +28,7 @@
 
 #include <kernel/processor_data.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/mem/vma.h>
 #include <structs/tree.h>
 
 #include <kernel/arch/arch.h>
@@ -37,7 +39,8 @@
 #define PROCESS_MAX_PIDS            32768                                       // Maximum amount of PIDs. The kernel uses a bitmap to keep track of these
 #define PROCESS_PID_BITMAP_SIZE     PROCESS_MAX_PIDS / (sizeof(uint32_t) * 8)   // Bitmap size
 
-#define PROCESS_KSTACK_SIZE         8192    // Kernel stack size
+#define PROCESS_KSTACK_SIZE         8192    // Kernel stack size (there is an unmapped guard page below it)
+#define PROCESS_CACHE_MAX           64      // Free process structures kept in the process cache
 
 /**** TYPES ****/
 
@@ -65,7 +68,15 @@ typedef struct process {
     
     // QUEUE INFORMATION
     tree_node_t *node;          // Node in the process tree
-    list_t *waitpid_queue;      // Wait queue for the process
+    ilist_t waitpid_queue;      // Threads waiting in waitpid (linked through thread_t::wait_node)
+    ilist_node_t list_node;     // Node in process_list
+
+    // ACCOUNTING (totals over every thread of the process, see thread_t)
+    uint64_t run_time;          // Time spent running
+    uint64_t wait_time;         // Time spent runnable in a run queue
+    uint64_t max_latency;       // Longest run queue latency of any thread
+    size_t voluntary_switches;  // Times a thread gave up the CPU itself
+    size_t involuntary_switches;// Times a thread was preempted
 
     // THREADS
     thread_t *main_thread;      // Main thread in the process  - whatever the ELF entrypoint was
@@ -78,6 +89,7 @@ typedef struct process {
     // MEMORY REGIONS
     uintptr_t heap;             // Heap of the process. Positioned after the ELF binary
     uintptr_t heap_base;        // Base location of the heap
+    vma_tree_t vmas;            // Mappings of the process (ELF segments, mmap), populated when touched
 
     // OTHER
     uintptr_t kstack;           // Kernel stack (see PROCESS_KSTACK_SIZE)
@@ -85,6 +97,14 @@ typedef struct process {
     struct _registers *regs;    // Dirty hack. See process_fork
 } process_t;
 
+/**** VARIABLES ****/
+
+/**
+ * @brief List of every process that exists, including kernel processes (which aren't in the tree)
+ */
+extern ilist_t process_list;
+extern spinlock_t process_list_lock;
+
 /**** FUNCTIONS ****/
 
 /**
@@ -17,6 +17,7 @@
 /**** INCLUDES ****/
 #include <stdint.h>
 #include <structs/list.h>
+#include <sys/types.h>
 
 /**** DEFINITIONS ****/
 
@@ -32,6 +33,34 @@
 #define PRIORITY_MED            2
 #define PRIORITY_LOW            1
 
+// Amount of run queues each CPU has (one per priority, index 0 unused)
+#define SCHEDULER_PRIORITY_LEVELS   (PRIORITY_HIGH + 1)
+
+// Scheduler ticks a thread can wait in its queue before it is aged past higher priorities
+#define SCHEDULER_AGING_TICKS       20
+
+// Scheduler trace events
+#define SCHEDULER_EVENT_WAKEUP      0       // A sleeping thread was woken up (arg: CPU it last ran on)
+#define SCHEDULER_EVENT_SWITCH      1       // A CPU switched to a thread (arg: PID of the previous thread's process, or -1)
+#define SCHEDULER_EVENT_MIGRATE     2       // A thread started running on a different CPU (arg: CPU it last ran on)
+
+// Amount of events kept in the scheduler trace ring
+#define SCHEDULER_TRACE_SIZE        512
+
+/**** TYPES ****/
+
+/**
+ * @brief Scheduler trace event
+ */
+typedef struct scheduler_trace_event {
+    uint64_t timestamp;         // Time of the event (see clock_getTimestamp)
+    int cpu;                    // CPU the event happened on
+    int event;                  // Event type
+    pid_t pid;                  // PID of the thread's process
+    struct thread *thread;      // Thread the event is about
+    long arg;                   // Event-specific argument
+} scheduler_trace_event_t;
+
 /**** VARIABLES ****/
 
 /**
@@ -79,4 +108,36 @@ thread_t *scheduler_get();
  */
 int scheduler_update(uint64_t ticks);
 
+/**
+ * @brief Scheduler tick method for timers that don't fire every tick
+ * @param ticks Current clock ticks
+ * @param elapsed The amount of scheduler ticks that passed since the last update
+ * @returns 1 if the current thread is out of its timeslice
+ */
+int scheduler_updateElapsed(uint64_t ticks, unsigned int elapsed);
+
+/**
+ * @brief Account for a context switch
+ * @param prev The thread being switched away from, or NULL
+ * @param next The thread being switched to
+ * @param involuntary Whether @c prev was preempted rather than giving up the CPU
+ * @note Call this after @c scheduler_get and before @c prev is queued back in.
+ */
+void scheduler_accountSwitch(struct thread *prev, struct thread *next, int involuntary);
+
+/**
+ * @brief Account for the last time slice of an exiting thread
+ * @param thread The thread, still running on this CPU
+ * @note @c process_switchNextThread doesn't touch exiting threads, call this before the thread can be reaped
+ */
+void scheduler_accountExit(struct thread *thread);
+
+/**
+ * @brief Record an event in the scheduler trace
+ * @param event The event type (SCHEDULER_EVENT_...)
+ * @param thread The thread the event is about
+ * @param arg Event-specific argument
+ */
+void scheduler_trace(int event, struct thread *thread, long arg);
+
 #endif
\ No newline at end of file
@@ -20,6 +20,7 @@
 #include <kernel/misc/spinlock.h>
 #include <kernel/mem/mem.h>
 #include <structs/node.h>
+#include <structs/ilist.h>
 
 /**** DEFINITIONS ****/
 
@@ -41,21 +42,35 @@ struct thread;
  */
 typedef int (*sleep_condition_t)(struct thread *thread, void *context);
 
+/**
+ * @brief Sleep queue
+ * 
+ * Threads sleeping on a condition are kept in one of these instead of being polled
+ * every tick. Whoever can change the condition calls @c sleep_wakeupQueue to recheck them.
+ */
+typedef struct sleep_queue {
+    char *name;                             // Name of the queue
+    ilist_t sleepers;                       // Threads sleeping in this queue
+} sleep_queue_t;
+
 /**
  * @brief Sleeper structure
  */
 typedef struct thread_sleep {
     struct thread *thread;                  // Thread which is sleeping
-    node_t *node;                           // Assigned node in the sleeping queue
+    ilist_node_t node;                      // Linkage in the sleep queue or wakeup queue
     volatile int sleep_state;               // Sleeping flags
 
     // Conditional-sleeping threads
     sleep_condition_t condition;            // Condition on which to wakeup
     void *context;                          // Context for said condition
+    sleep_queue_t *queue;                   // Sleep queue the thread is waiting in
 
     // Specific to threads sleeping for time
     unsigned long seconds;                  // Seconds on which to wakeup
     unsigned long subseconds;               // Subseconds on which to wakeup
+    uint64_t deadline;                      // Deadline in subseconds, used as the key in the deadline heap
+    size_t heap_index;                      // Index in the deadline heap
 } thread_sleep_t;
 
 
@@ -78,20 +93,35 @@ int sleep_untilNever(struct thread *thread);
 /**
  * @brief Put a thread to sleep until a specific condition is ready
  * @param thread The thread to put to sleep
+ * @param queue The sleep queue to wait in. The condition is only checked when this queue is woken up.
  * @param condition Condition function
  * @param context Optional context passed to condition function
  * @returns 0 on success
  * 
  * @note If you're putting the current thread to sleep, yield immediately after without rescheduling.
  */
-int sleep_untilCondition(struct thread *thread, sleep_condition_t condition, void *context);
+int sleep_untilCondition(struct thread *thread, sleep_queue_t *queue, sleep_condition_t condition, void *context);
+
+/**
+ * @brief Put a thread to sleep in a sleep queue until it is woken up
+ * 
+ * Unlike @c sleep_untilCondition there is no condition - the thread wakes up on the next
+ * @c sleep_wakeupQueue or @c sleep_wakeupQueueOne that reaches it. Callers are expected to
+ * hold their own lock over checking their state and calling this, and to hold it again when waking.
+ * 
+ * @param thread The thread to put to sleep
+ * @param queue The sleep queue to wait in
+ * @returns 0 on success
+ * @note If you're putting the current thread to sleep, yield immediately after without rescheduling.
+ */
+int sleep_inQueue(struct thread *thread, sleep_queue_t *queue);
 
 /**
  * @brief Put a thread to sleep until a specific amount of time in the future has passed
  * @param thread The thread to put to sleep
  * @param seconds Seconds to wait in the future
  * @param subseconds Subseconds to wait in the future
- * @returns 0 on success
+ * @returns 0 on success, 1 if the thread could not be put to sleep (it is still runnable)
  * 
  * @note If you're putting the current thread to sleep, yield immediately after without rescheduling.
  */
@@ -114,4 +144,50 @@ int sleep_untilUnlocked(struct thread *thread, spinlock_t *lock);
  */
 int sleep_wakeup(struct thread *thread);
 
+/**
+ * @brief Get the earliest time a sleeping thread needs to be woken up at
+ * @returns The deadline in subseconds (see @c clock_getCurrentTime), 0 if a wakeup is pending, or UINT64_MAX if there is none
+ */
+uint64_t sleep_getNextDeadline();
+
+/**
+ * @brief Create a new sleep queue
+ * @param name The name of the sleep queue
+ * @returns A new sleep queue
+ */
+sleep_queue_t *sleep_createQueue(char *name);
+
+/**
+ * @brief Initialize a sleep queue embedded in another structure
+ * @param queue The queue to initialize
+ * @param name The name of the sleep queue
+ */
+void sleep_initQueue(sleep_queue_t *queue, char *name);
+
+/**
+ * @brief Wake up every thread in a sleep queue without freeing it
+ * @param queue The queue to drain
+ */
+void sleep_drainQueue(sleep_queue_t *queue);
+
+/**
+ * @brief Destroy a sleep queue, waking up anything still in it
+ * @param queue The queue to destroy
+ */
+void sleep_destroyQueue(sleep_queue_t *queue);
+
+/**
+ * @brief Recheck the conditions of every thread in a sleep queue
+ * @param queue The queue to wake up
+ * @returns The amount of threads woken up
+ */
+int sleep_wakeupQueue(sleep_queue_t *queue);
+
+/**
+ * @brief Wake up the first thread in a sleep queue that is ready to go
+ * @param queue The queue to wake up
+ * @returns 1 if a thread was woken up, 0 if not
+ */
+int sleep_wakeupQueueOne(sleep_queue_t *queue);
+
 #endif
\ No newline at end of file
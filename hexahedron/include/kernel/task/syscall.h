@@ -22,6 +22,7 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 
 /**** DEFINITIONS ****/
 
@@ -84,5 +85,9 @@ long sys_wait(pid_t pid, int *wstatus, int options);
 long sys_getcwd(char *buf, size_t size);
 long sys_chdir(const char *path);
 long sys_fchdir(int fd);
+long sys_futex(uint32_t *uaddr, int op, uint32_t val, const struct timeval *timeout);
+long sys_mmap(sys_mmap_context_t *context);
+long sys_munmap(void *addr, size_t len);
+long sys_mprotect(void *addr, size_t len, int prot);
 
 #endif
\ No newline at end of file
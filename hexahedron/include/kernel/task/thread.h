@@ -19,6 +19,7 @@
 #include <kernel/arch/arch.h>
 #include <kernel/mem/mem.h>
 #include <kernel/task/sleep.h>
+#include <structs/ilist.h>
 
 /**** DEFINITIONS ****/
 
@@ -38,6 +39,9 @@
 // Stack size of thread
 #define THREAD_STACK_SIZE           4096
 
+// Free thread structures kept in the thread cache
+#define THREAD_CACHE_MAX            64
+
 /**** TYPES ****/
 
 // Prototype
@@ -51,14 +55,29 @@ typedef struct thread {
     struct process *parent;     // Parent process
     unsigned int status;        // Status of this thread
     unsigned int flags;         // Flags of the thread
+    int cpu;                    // CPU the thread last ran on (-1 if it never ran)
 
     // SCHEDULER TIMES
     time_t preempt_ticks;       // Ticks until the thread is preempted
     time_t total_ticks;         // Total amount of ticks the thread has been running for
     time_t start_ticks;         // Starting ticks
+    time_t queue_ticks;         // Run queue tick the thread was queued at (used for aging)
+
+    // ACCOUNTING (microseconds, see clock_getTimestamp)
+    uint64_t run_time;          // Time spent running
+    uint64_t wait_time;         // Time spent runnable in a run queue
+    uint64_t max_latency;       // Longest time spent in a run queue before getting to run
+    uint64_t stamp;             // When the thread was last queued or started running
+    size_t voluntary_switches;  // Times the thread gave up the CPU itself (sleeping, blocking)
+    size_t involuntary_switches;// Times the thread was preempted
+
+    // QUEUE VARIABLES
+    ilist_node_t sched_node;    // Linkage in a run queue
+    ilist_node_t wait_node;     // Linkage in a process' waitpid queue
 
     // BLOCKING VARIABLES
-    thread_sleep_t *sleep;      // Sleep structure
+    thread_sleep_t *sleep;      // Sleep structure (points to sleep_record while sleeping)
+    thread_sleep_t sleep_record;// Storage for the sleep structure, so sleeping doesn't need to allocate
 
     // THREAD VARIABLES
     arch_context_t context;     // Thread context (defined by architecture)
@@ -99,4 +118,10 @@ thread_t *thread_create(struct process *parent, page_t *dir, uintptr_t entrypoin
  */
 int thread_destroy(thread_t *thr);
 
+/**
+ * @brief Return the structure of a thread to the thread cache
+ * @param thr The thread, which must not be running, queued or sleeping anymore
+ */
+void thread_free(thread_t *thr);
+
 #endif
\ No newline at end of file
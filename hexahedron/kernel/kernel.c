@@ -51,6 +51,7 @@
 // Misc.
 #include <kernel/misc/ksym.h>
 #include <kernel/misc/args.h>
+#include <kernel/misc/spinlock.h>
 
 // Tasking
 #include <kernel/task/process.h>
@@ -151,8 +152,9 @@ void kthread() {
         iterations++;
         dprintf(DEBUG, "Hi from %s! This is iteration %d\n", current_cpu->current_process->name, iterations);
 
-        sleep_untilTime(current_cpu->current_thread, 3, 0);
-        process_yield(0);
+        // Couldn't sleep? Stay runnable
+        int failed = sleep_untilTime(current_cpu->current_thread, 3, 0);
+        process_yield(failed);
     }
 }
 
@@ -180,6 +182,8 @@ void kmain() {
     zerodev_init();
     debug_mountNode();
     periphfs_init();
+    alloc_mountStats();
+    spinlock_mountStats();
     vfs_dump();
 
     // Networking
@@ -19,9 +19,12 @@
 #include <kernel/misc/ksym.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/mem/mem.h>
+#include <kernel/task/process.h>
+#include <kernel/processor_data.h>
 #include <kernel/debug.h>
 
 #include <string.h>
+#include <errno.h>
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "ELFLDR", __VA_ARGS__)
@@ -394,6 +397,89 @@ int elf_loadExecutable(Elf64_Ehdr *ehdr) {
     return 0;
 }
 
+/**
+ * @brief Map a PT_LOAD segment so it is read in when first touched
+ * 
+ * Segments don't have to start on a page boundary, so the first page of one can also be
+ * the last page of the segment before it. That page already belongs to an area, so our
+ * part of it is read in right away and only the rest of the segment gets a new area.
+ * 
+ * @param node The file of the executable
+ * @param phdr The PHDR of the segment
+ * @returns 0 on success
+ */
+static int elf_mapSegment(fs_node_t *node, Elf64_Phdr *phdr) {
+    vma_tree_t *vmas = &current_cpu->current_process->vmas;
+    int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+    int ret = vma_map(vmas, phdr->p_vaddr, phdr->p_memsz, prot, prot, MAP_PRIVATE, node, phdr->p_offset, phdr->p_filesz);
+    if (ret != -EEXIST) return ret;
+
+    // Only the first page may be shared, anything else is a real overlap
+    uintptr_t page = phdr->p_vaddr & ~(PAGE_SIZE - 1);
+    size_t head = (page + PAGE_SIZE) - phdr->p_vaddr;
+    if (head > phdr->p_memsz) head = phdr->p_memsz;
+    if (vma_getProtection(vmas, page) == -1) return -EEXIST;
+    if (head < phdr->p_memsz && !vma_isFree(vmas, page + PAGE_SIZE, phdr->p_memsz - head)) return -EEXIST;
+
+    // Populate the shared page with its own writable frame
+    vma_fault(vmas, page, 1);
+    mem_breakCopyOnWrite(page);
+    page_t *pg = mem_getPage(NULL, page, MEM_DEFAULT);
+    if (!pg || !pg->bits.present || !pg->bits.rw) return -ENOMEM;
+
+    size_t file_head = (phdr->p_filesz < head) ? phdr->p_filesz : head;
+    if (file_head && fs_read(node, phdr->p_offset, file_head, (uint8_t*)phdr->p_vaddr) != (ssize_t)file_head) return -EIO;
+    memset((uint8_t*)phdr->p_vaddr + file_head, 0, head - file_head);
+
+    if (head == phdr->p_memsz) return 0;
+
+    // The rest starts on a page boundary
+    size_t file_rest = (phdr->p_filesz > head) ? phdr->p_filesz - head : 0;
+    return vma_map(vmas, page + PAGE_SIZE, phdr->p_memsz - head, prot, prot, MAP_PRIVATE, file_rest ? node : NULL, phdr->p_offset + head, file_rest);
+}
+
+/**
+ * @brief Map an executable's segments so they are read in when first touched
+ * @param node The file of the executable
+ * @param ehdr The EHDR of the executable, followed by its PHDRs
+ * @returns 0 on success
+ */
+static int elf_mapExecutable(fs_node_t *node, Elf64_Ehdr *ehdr) {
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        // Get the PHDR
+        Elf64_Phdr *phdr = ELF_PHDR(ehdr, i);
+
+        switch (phdr->p_type) {
+            case PT_NULL:
+                // No work to be done - PT_NULL
+                break;
+            
+            case PT_LOAD:
+                // The current process gets a mapping which the page fault handler will populate
+                LOG(DEBUG, "PHDR #%d - OFFSET 0x%x VADDR %p PADDR %p FILESIZE %d MEMSIZE %d (lazy)\n", i, phdr->p_offset, phdr->p_vaddr, phdr->p_paddr, phdr->p_filesz, phdr->p_memsz);
+
+                if (phdr->p_filesz > phdr->p_memsz || phdr->p_offset + phdr->p_filesz > node->length) {
+                    LOG(ERR, "PHDR #%d is out of bounds of the file\n", i);
+                    return ELF_FAIL;
+                }
+
+                if (!phdr->p_memsz) break;
+                if (elf_mapSegment(node, phdr)) {
+                    LOG(ERR, "Failed to map PHDR #%d\n", i);
+                    return ELF_FAIL;
+                }
+                break;
+
+            default:
+                LOG(ERR, "Failed to load PHDR #%d - unimplemented type 0x%x\n", i, phdr->p_type);
+                return ELF_FAIL;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * @brief Find a specific symbol by name and get its value
  * @param ehdr_address The address of the EHDR (as elf64/elf32 could be in use)
@@ -541,6 +627,38 @@ uintptr_t elf_load(fs_node_t *node, int flags) {
         return 0x0;
     }
 
+    // Usermode executables only need their headers now, segments are read in when they are first touched
+    if (flags == ELF_USER) {
+        Elf64_Ehdr ehdrtmp;
+        if (fs_read(node, 0, sizeof(Elf64_Ehdr), (uint8_t*)&ehdrtmp) != sizeof(Elf64_Ehdr)) {
+            LOG(ERR, "Failed to read ELF file\n");
+            return 0x0;
+        }
+
+        if (ehdrtmp.e_type == ET_EXEC) {
+            size_t header_size = ehdrtmp.e_phoff + (size_t)ehdrtmp.e_phnum * ehdrtmp.e_phentsize;
+            if (ehdrtmp.e_phentsize < sizeof(Elf64_Phdr) || header_size > node->length) {
+                LOG(ERR, "ELF file has invalid program headers\n");
+                return 0x0;
+            }
+
+            uint8_t *hbuf = kmalloc(header_size);
+            if (fs_read(node, 0, header_size, hbuf) != (ssize_t)header_size) {
+                LOG(ERR, "Failed to read ELF file\n");
+                kfree(hbuf);
+                return 0x0;
+            }
+
+            if (elf_mapExecutable(node, (Elf64_Ehdr*)hbuf)) {
+                LOG(ERR, "Failed to load executable ELF file.\n");
+                kfree(hbuf);
+                return 0x0;
+            }
+
+            return (uintptr_t)hbuf;
+        }
+    }
+
     // Now we can read the full file into a buffer 
     uint8_t *fbuf = kmalloc(node->length);
     memset(fbuf, 0, node->length);
@@ -5,6 +5,10 @@
  * Multiple allocators are suported for Hexahedron (not simultaneous, at compile-time)
  * This allocator system handles debug, feature support, forwarding, profiling, etc.
  * 
+ * Each allocation gets an @c alloc_header_t in front of it recording its size and tag, which lets
+ * every tag keep live byte and object counts. There is no room in front of a kvalloc allocation,
+ * so those headers are kept in a small hash table keyed by address instead.
+ * 
  * @warning No initialization system is present. This means that anything calling kmalloc before initialization will crash.
  * 
  * @copyright
@@ -15,6 +19,8 @@
  * Copyright (C) 2024 Samuel Stuart
  */
 
+#define ALLOC_NO_TAG_MACROS
+
 #include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
@@ -24,16 +30,255 @@
 
 #include <kernel/mem/alloc.h>
 #include <kernel/mem/mem.h>
+#include <kernel/fs/kernelfs.h>
+#include <kernel/misc/spinlock.h>
 #include <kernel/panic.h>
 #include <kernel/debug.h>
 
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "ALLOC", __VA_ARGS__)
 
 /* Internal copy of the allocator's data */
 static allocator_info_t *alloc_info = NULL; // !!!: What if a bad allocator changes this after giving it to us? 
 
+/* Tags. Tag 0 is used for anything that doesn't have one (or when the table is full) */
+static alloc_tag_t alloc_tags[ALLOC_MAX_TAGS] = { [0] = { .name = "untagged" } };
+static int alloc_tag_count = 1;
+static spinlock_t alloc_tag_lock = { 0 };
+
+/* Headers of kvalloc allocations */
+#define ALLOC_VALLOC_BUCKETS    64
+#define ALLOC_VALLOC_HASH(ptr)  (((uintptr_t)(ptr) / PAGE_SIZE) % ALLOC_VALLOC_BUCKETS)
+
+typedef struct alloc_valloc {
+    void *ptr;                      // The page-aligned allocation
+    struct alloc_valloc *next;      // Next entry in the bucket
+    alloc_header_t header;          // Its header
+} alloc_valloc_t;
+
+static alloc_valloc_t *alloc_valloc_table[ALLOC_VALLOC_BUCKETS] = { 0 };
+static spinlock_t alloc_valloc_lock = { 0 };
+
+
+/** ACCOUNTING **/
+
+/**
+ * @brief Raise the peak of a tag to @p bytes if it is higher
+ */
+static void alloc_updatePeak(alloc_tag_t *t, size_t bytes) {
+    size_t peak = __atomic_load_n(&t->peak_bytes, __ATOMIC_RELAXED);
+    while (bytes > peak && !__atomic_compare_exchange_n(&t->peak_bytes, &peak, bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Charge an allocation to a tag
+ */
+static void alloc_charge(alloc_header_t *header, size_t size, int tag) {
+    if (tag < 0 || tag >= alloc_tag_count) tag = 0;
+
+    header->magic = ALLOC_HEADER_MAGIC;
+    header->tag = tag;
+    header->flags = 0;
+    header->size = size;
+
+    alloc_tag_t *t = &alloc_tags[tag];
+    size_t bytes = __atomic_add_fetch(&t->bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->objects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->allocations, 1, __ATOMIC_RELAXED);
+    alloc_updatePeak(t, bytes);
+}
+
+/**
+ * @brief Change the size charged for a live allocation (it is still one object and one allocation)
+ */
+static void alloc_recharge(alloc_header_t *header, size_t size) {
+    alloc_tag_t *t = &alloc_tags[header->tag];
+
+    if (size >= header->size) {
+        alloc_updatePeak(t, __atomic_add_fetch(&t->bytes, size - header->size, __ATOMIC_RELAXED));
+    } else {
+        __atomic_sub_fetch(&t->bytes, header->size - size, __ATOMIC_RELAXED);
+    }
+
+    header->size = size;
+}
+
+/**
+ * @brief Take an allocation of @p size bytes off a tag
+ */
+static void alloc_uncharge(int tag, size_t size) {
+    alloc_tag_t *t = &alloc_tags[tag];
+    __atomic_sub_fetch(&t->bytes, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&t->objects, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Get the header of a pointer returned by kmalloc and friends
+ */
+static alloc_header_t *alloc_getHeader(void *ptr) {
+    alloc_header_t *header = (alloc_header_t*)ptr - 1;
+    if (header->magic != ALLOC_HEADER_MAGIC) {
+        kernel_panic_extended(MEMORY_MANAGEMENT_ERROR, "alloc", "*** Bad pointer %p given to the allocator (corrupted or not allocated)\n", ptr);
+        __builtin_unreachable();
+    }
+
+    return header;
+}
+
+/**
+ * @brief Find the entry of a kvalloc allocation
+ * @param ptr The pointer (page-aligned)
+ * @param remove Whether to take the entry out of the table
+ * @returns The entry or NULL if @p ptr didn't come from kvalloc
+ */
+static alloc_valloc_t *alloc_findValloc(void *ptr, int remove) {
+    spinlock_acquire(&alloc_valloc_lock);
+
+    alloc_valloc_t **link = &alloc_valloc_table[ALLOC_VALLOC_HASH(ptr)];
+    while (*link && (*link)->ptr != ptr) link = &(*link)->next;
+
+    alloc_valloc_t *entry = *link;
+    if (entry && remove) *link = entry->next;
+
+    spinlock_release(&alloc_valloc_lock);
+    return entry;
+}
+
+/**
+ * @brief Get a tag by name, creating it if it doesn't exist
+ * @param name The name of the tag (leading "./" is stripped)
+ * @returns The index of the tag
+ */
+int alloc_getTag(const char *name) {
+    if (!name) return 0;
+    if (name[0] == '.' && name[1] == '/') name += 2;
+
+    spinlock_acquire(&alloc_tag_lock);
+
+    for (int i = 0; i < alloc_tag_count; i++) {
+        if (!strncmp(alloc_tags[i].name, name, ALLOC_TAG_NAME_LENGTH - 1)) {
+            spinlock_release(&alloc_tag_lock);
+            return i;
+        }
+    }
+
+    if (alloc_tag_count == ALLOC_MAX_TAGS) {
+        spinlock_release(&alloc_tag_lock);
+        LOG(WARN, "Out of tags, \"%s\" is charged as untagged\n", name);
+        return 0;
+    }
+
+    int tag = alloc_tag_count;
+    strncpy(alloc_tags[tag].name, name, ALLOC_TAG_NAME_LENGTH - 1);
+    __atomic_store_n(&alloc_tag_count, tag + 1, __ATOMIC_RELEASE);
+
+    spinlock_release(&alloc_tag_lock);
+    return tag;
+}
+
 
 /** FORWARDER FUNCTIONS **/
 
+/**
+ * @brief Allocate kernel memory charged to a tag
+ * @param size The size of the allocation
+ * @param tag The index of the tag (see @c alloc_getTag)
+ */
+__attribute__((malloc)) void *kmalloc_tagged(size_t size, int tag) {
+    if (size > SIZE_MAX - sizeof(alloc_header_t)) return NULL;
+
+    alloc_header_t *header = alloc_malloc(size + sizeof(alloc_header_t));
+    if (!header) return NULL;
+
+    alloc_charge(header, size, tag);
+    return (void*)(header + 1);
+}
+
+/**
+ * @brief Reallocate kernel memory charged to a tag
+ * @param ptr A pointer to the previous structure
+ * @param size The new size of the structure.
+ * @param tag The tag to charge if @p ptr is NULL (otherwise the allocation keeps its tag)
+ */
+__attribute__((malloc)) void *krealloc_tagged(void *ptr, size_t size, int tag) {
+    if (!ptr) return kmalloc_tagged(size, tag);
+
+    if (!size) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    if (size > SIZE_MAX - sizeof(alloc_header_t)) return NULL;
+
+    alloc_valloc_t *entry = ((uintptr_t)ptr & (PAGE_SIZE - 1)) ? NULL : alloc_findValloc(ptr, 0);
+    if (entry) {
+        // The allocator doesn't know where this one starts, move it by hand
+        void *new = kmalloc_tagged(size, entry->header.tag);
+        if (!new) return NULL;
+
+        memcpy(new, ptr, (size < entry->header.size) ? size : entry->header.size);
+        kfree(ptr);
+
+        // Still the same allocation as far as the tag is concerned
+        __atomic_sub_fetch(&alloc_tags[alloc_getHeader(new)->tag].allocations, 1, __ATOMIC_RELAXED);
+        return new;
+    }
+
+    alloc_header_t *header = alloc_getHeader(ptr);
+    alloc_header_t *new_header = alloc_realloc(header, size + sizeof(alloc_header_t));
+    if (!new_header) return NULL;
+
+    // The header moved along with the data, only the size changes
+    alloc_recharge(new_header, size);
+    return (void*)(new_header + 1);
+}
+
+/**
+ * @brief Contiguous allocation function charged to a tag
+ * @param elements The amount of elements to allocate
+ * @param size The size of each element
+ * @param tag The index of the tag
+ */
+__attribute__((malloc)) void *kcalloc_tagged(size_t elements, size_t size, int tag) {
+    if (size && elements > SIZE_MAX / size) return NULL;
+
+    void *ptr = kmalloc_tagged(elements * size, tag);
+    if (ptr) memset(ptr, 0, elements * size);
+    return ptr;
+}
+
+/**
+ * @brief Page-aligned memory allocator charged to a tag
+ * @param size The size to allocate.
+ * @param tag The index of the tag
+ */
+__attribute__((malloc)) void *kvalloc_tagged(size_t size, int tag) {
+    if (!alloc_canHasValloc()) {
+        kernel_panic_extended(UNSUPPORTED_FUNCTION_ERROR, "alloc", "valloc() is not supported in this context.\n");
+        __builtin_unreachable();
+    }
+
+    alloc_valloc_t *entry = alloc_malloc(sizeof(alloc_valloc_t));
+    if (!entry) return NULL;
+
+    entry->ptr = alloc_valloc(size);
+    if (!entry->ptr) {
+        alloc_free(entry);
+        return NULL;
+    }
+
+    alloc_charge(&entry->header, size, tag);
+    entry->header.flags = ALLOC_HEADER_VALLOC;
+
+    spinlock_acquire(&alloc_valloc_lock);
+    size_t bucket = ALLOC_VALLOC_HASH(entry->ptr);
+    entry->next = alloc_valloc_table[bucket];
+    alloc_valloc_table[bucket] = entry;
+    spinlock_release(&alloc_valloc_lock);
+
+    return entry->ptr;
+}
+
 /**
  * @brief Allocate kernel memory
  * @param size The size of the allocation
@@ -41,8 +286,7 @@ static allocator_info_t *alloc_info = NULL; // !!!: What if a bad allocator chan
  * @returns A pointer. It will crash otherwise.
  */
 __attribute__((malloc)) void *kmalloc(size_t size) {
-    void *ptr = alloc_malloc(size);
-    return ptr;
+    return kmalloc_tagged(size, 0);
 }
 
 /**
@@ -53,8 +297,7 @@ __attribute__((malloc)) void *kmalloc(size_t size) {
  * @returns A pointer. It will crash otherwise.
  */
 __attribute__((malloc)) void *krealloc(void *ptr, size_t size) {
-    void *ret_ptr = alloc_realloc(ptr, size);
-    return ret_ptr;
+    return krealloc_tagged(ptr, size, 0);
 }
 
 /**
@@ -65,8 +308,7 @@ __attribute__((malloc)) void *krealloc(void *ptr, size_t size) {
  * @returns A pointer. It will crash otherwise.
  */
 __attribute__((malloc)) void *kcalloc(size_t elements, size_t size) {
-    void *ptr = alloc_calloc(elements, size);
-    return ptr;
+    return kcalloc_tagged(elements, size, 0);
 }
 
 /**
@@ -77,13 +319,7 @@ __attribute__((malloc)) void *kcalloc(size_t elements, size_t size) {
  * @returns A pointer or crashes with an unimplemented exception.
  */
 __attribute__((malloc)) void *kvalloc(size_t size) {
-    if (alloc_canHasValloc()) {
-        void *ptr = alloc_valloc(size);
-        return ptr;
-    } else {
-        kernel_panic_extended(UNSUPPORTED_FUNCTION_ERROR, "alloc", "valloc() is not supported in this context.\n");
-        __builtin_unreachable();
-    }
+    return kvalloc_tagged(size, 0);
 }
 
 /**
@@ -91,7 +327,23 @@ __attribute__((malloc)) void *kvalloc(size_t size) {
  * @param ptr A pointer to the previous memory
  */
 void kfree(void *ptr) {
-    alloc_free(ptr);
+    if (!ptr) return;
+
+    // Only page-aligned pointers can be kvalloc allocations
+    if (!((uintptr_t)ptr & (PAGE_SIZE - 1))) {
+        alloc_valloc_t *entry = alloc_findValloc(ptr, 1);
+        if (entry) {
+            alloc_uncharge(entry->header.tag, entry->header.size);
+            alloc_free(ptr);
+            alloc_free(entry);
+            return;
+        }
+    }
+
+    alloc_header_t *header = alloc_getHeader(ptr);
+    alloc_uncharge(header->tag, header->size);
+    header->magic = 0;
+    alloc_free(header);
 }
 
 /** ALLOCATOR-MANAGEMENT FUNCTIONS **/
@@ -106,4 +358,55 @@ int alloc_canHasValloc() {
     }
 
     return alloc_info->support_valloc;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Generate /kernel/kmalloc
+ */
+static int alloc_getStatsEntry(kernelfs_entry_t *entry, void *data) {
+    if (!alloc_info) alloc_info = alloc_getInfo();
+
+    // Snapshot the tags first, printing allocates
+    int count = __atomic_load_n(&alloc_tag_count, __ATOMIC_ACQUIRE);
+    alloc_tag_t *tags = kmalloc_tagged(count * sizeof(alloc_tag_t), 0);
+    if (!tags) return -ENOMEM;
+    memcpy(tags, alloc_tags, count * sizeof(alloc_tag_t));
+
+    size_t requested = 0, objects = 0;
+    for (int i = 0; i < count; i++) {
+        requested += tags[i].bytes;
+        objects += tags[i].objects;
+    }
+
+    kernelfs_appendData(entry, "# allocator %s %d.%d\n", alloc_info->name, alloc_info->version_major, alloc_info->version_minor);
+    kernelfs_appendData(entry, "requested %zu objects %zu headers %zu\n", requested, objects, objects * sizeof(alloc_header_t));
+
+    if (alloc_info->support_stats) {
+        allocator_stats_t stats = { 0 };
+        alloc_getStats(&stats);
+
+        // Internal fragmentation is rounding and headers, external is what's held but not handed out
+        size_t internal = (stats.used > requested) ? stats.used - requested : 0;
+        kernelfs_appendData(entry, "heap %zu used %zu free %zu free_chunks %zu\n", stats.heap_size, stats.used, stats.free, stats.free_chunks);
+        kernelfs_appendData(entry, "internal_fragmentation %zu (%zu%%) external_fragmentation %zu (%zu%%)\n",
+                            internal, stats.used ? internal * 100 / stats.used : 0,
+                            stats.free, stats.heap_size ? stats.free * 100 / stats.heap_size : 0);
+    }
+
+    kernelfs_appendData(entry, "# tag: live bytes, live objects, peak bytes, total allocations\n");
+    for (int i = 0; i < count; i++) {
+        if (!tags[i].allocations) continue;
+        kernelfs_appendData(entry, "%s: bytes %zu objects %zu peak %zu allocations %zu\n",
+                            tags[i].name, tags[i].bytes, tags[i].objects, tags[i].peak_bytes, tags[i].allocations);
+    }
+
+    kfree(tags);
+    return 0;
+}
+
+/**
+ * @brief Create /kernel/kmalloc, which reports every tag and the allocator's fragmentation
+ */
+void alloc_mountStats() {
+    kernelfs_createEntry("kmalloc", alloc_getStatsEntry, NULL);
+}
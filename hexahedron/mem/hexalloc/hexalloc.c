@@ -0,0 +1,664 @@
+/**
+ * @file hexahedron/mem/hexalloc/hexalloc.c
+ * @brief Hexahedron slab allocator
+ *
+ * hexalloc splits allocations into two groups:
+ * - Small allocations (up to HEXALLOC_SMALL_MAX bytes) are rounded up to a size class
+ *   and served from a cache of slabs. A slab is a single page with a header at offset 0
+ *   followed by equally sized objects.
+ * - Large allocations get their own page run, with a header at the start of the first page.
+ *
+ * Every CPU has a magazine per size class holding a handful of free objects. The fast path of
+ * @c alloc_malloc and @c alloc_free only touches the magazine of the current CPU with interrupts
+ * disabled (which also stops us from being moved to another CPU), and the cache lock is only taken
+ * to refill or flush half of a magazine at a time.
+ *
+ * Since slab objects never start on a page boundary, @c alloc_free can tell the kinds apart:
+ * - Page-aligned pointers came from @c alloc_valloc and have their header in the page before
+ * - Otherwise the page the pointer is in starts with either a slab or a large header
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/mem/alloc.h>
+#include <kernel/mem/mem.h>
+#include <kernel/arch/arch.h>
+#include <kernel/processor_data.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/panic.h>
+#include <kernel/debug.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Architecture-specific includes */
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/smp.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/smp.h>
+#else
+#error "Unsupported architecture - do not compile this file"
+#endif
+
+/*** DEFINITIONS ***/
+
+#define ALLOC_NAME "hexalloc"
+#define ALLOC_VERSION_MAJOR 2
+#define ALLOC_VERSION_MINOR 0
+
+#define HEXALLOC_SLAB_MAGIC         0x51AB51AB  // Slab header magic
+#define HEXALLOC_LARGE_MAGIC        0x1A26E0BB  // Large allocation header magic
+#define HEXALLOC_VALLOC_MAGIC       0xFA6EA116  // Page-aligned allocation header magic
+
+#define HEXALLOC_CLASS_COUNT        13          // Amount of size classes
+#define HEXALLOC_SMALL_MAX          1344        // Largest size served from a slab
+#define HEXALLOC_MAGAZINE_SIZE      16          // Objects held by a per-CPU magazine
+#define HEXALLOC_MAGAZINE_BATCH     (HEXALLOC_MAGAZINE_SIZE / 2) // Objects moved between a magazine and its cache at once
+#define HEXALLOC_MAX_EMPTY          4           // Empty slabs a cache will hold on to before giving pages back
+#define HEXALLOC_MAX_FREE_PAGES     64          // Mapped pages kept around for new slabs
+#define HEXALLOC_MAX_RANGES         64          // Unmapped heap ranges remembered for reuse
+
+#define HEXALLOC_ALIGN(x, a)        (((x) + ((a) - 1)) & ~((uintptr_t)(a) - 1))
+#define HEXALLOC_SLAB_HEADER_SIZE   HEXALLOC_ALIGN(sizeof(hexalloc_slab_t), 16)
+#define HEXALLOC_LARGE_HEADER_SIZE  32
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "ALLOC:HEXALLOC", __VA_ARGS__)
+
+/*** TYPES ***/
+
+struct hexalloc_cache;
+
+/**
+ * @brief Slab header, located at the start of the slab's page
+ */
+typedef struct hexalloc_slab {
+    uint32_t magic;                 // HEXALLOC_SLAB_MAGIC
+    uint16_t inuse;                 // Objects handed out of this slab (includes objects in magazines)
+    uint16_t total;                 // Objects that fit in this slab
+    struct hexalloc_cache *cache;   // Cache this slab belongs to
+    struct hexalloc_slab *next;     // Next slab in the cache list
+    struct hexalloc_slab *prev;     // Previous slab in the cache list
+    void *free;                     // First free object (objects are linked through their first word)
+} hexalloc_slab_t;
+
+/**
+ * @brief Size class cache
+ *
+ * Full slabs are not on any list, partial slabs are on @c partial and
+ * unused slabs are on @c empty.
+ */
+typedef struct hexalloc_cache {
+    spinlock_t lock;                // Lock
+    size_t size;                    // Object size
+    uint16_t per_slab;              // Objects per slab
+    hexalloc_slab_t *partial;       // Slabs with some free objects
+    hexalloc_slab_t *empty;         // Slabs with no objects in use
+    size_t empty_count;             // Amount of slabs in the empty list
+    size_t slabs;                   // Total amount of slabs
+    size_t objects;                 // Objects handed out of the slabs (includes objects in magazines)
+} hexalloc_cache_t;
+
+/**
+ * @brief Per-CPU magazine of free objects
+ */
+typedef struct hexalloc_magazine {
+    size_t count;                               // Objects in the magazine
+    void *objects[HEXALLOC_MAGAZINE_SIZE];      // Objects
+} hexalloc_magazine_t;
+
+/**
+ * @brief Header of a large or page-aligned allocation
+ */
+typedef struct hexalloc_large {
+    uint32_t magic;                 // HEXALLOC_LARGE_MAGIC or HEXALLOC_VALLOC_MAGIC
+    size_t pages;                   // Pages in the run, including the header page for valloc
+    size_t size;                    // Requested size
+} hexalloc_large_t;
+
+/**
+ * @brief Unmapped range of heap virtual memory
+ */
+typedef struct hexalloc_range {
+    uintptr_t start;                // Start of the range
+    size_t pages;                   // Amount of pages, 0 if this entry is unused
+} hexalloc_range_t;
+
+/*** VARIABLES ***/
+
+/* Size classes */
+static const size_t hexalloc_sizes[HEXALLOC_CLASS_COUNT] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1344 };
+
+/* Caches */
+static hexalloc_cache_t hexalloc_caches[HEXALLOC_CLASS_COUNT] = { 0 };
+
+/* Per-CPU magazines */
+static hexalloc_magazine_t hexalloc_magazines[MAX_CPUS][HEXALLOC_CLASS_COUNT] = { 0 };
+
+/* Mapped free pages, linked through their first word */
+static uintptr_t hexalloc_free_pages = 0x0;
+static size_t hexalloc_free_page_count = 0;
+
+/* Unmapped ranges */
+static hexalloc_range_t hexalloc_ranges[HEXALLOC_MAX_RANGES] = { 0 };
+
+/* Pages used by large and page-aligned allocations */
+static size_t hexalloc_large_pages = 0;
+
+/* Page lock (free pages and ranges) */
+static spinlock_t hexalloc_page_lock = { 0 };
+
+/* Initialized */
+static int hexalloc_initialized = 0;
+
+/* Allocator information */
+static allocator_info_t hexalloc_info = { 0 };
+
+_Static_assert(HEXALLOC_SMALL_MAX + HEXALLOC_SLAB_HEADER_SIZE <= PAGE_SIZE, "hexalloc: largest size class does not fit in a slab");
+_Static_assert(sizeof(hexalloc_large_t) <= HEXALLOC_LARGE_HEADER_SIZE, "hexalloc: large header too big");
+
+/*** PAGES ***/
+
+/**
+ * @brief Remember an unmapped range of heap memory (page lock held)
+ * @returns 0 on success, 1 if the range could not be recorded
+ */
+static int hexalloc_addRange(uintptr_t start, size_t pages) {
+    hexalloc_range_t *unused = NULL;
+    hexalloc_range_t *below = NULL;
+    hexalloc_range_t *above = NULL;
+
+    for (int i = 0; i < HEXALLOC_MAX_RANGES; i++) {
+        hexalloc_range_t *range = &hexalloc_ranges[i];
+        if (!range->pages) {
+            if (!unused) unused = range;
+            continue;
+        }
+
+        if (range->start + range->pages * PAGE_SIZE == start) below = range;
+        if (start + pages * PAGE_SIZE == range->start) above = range;
+    }
+
+    // Merge with neighbours. A range sandwiched between two others joins them into one
+    if (below) {
+        below->pages += pages;
+        if (above) {
+            below->pages += above->pages;
+            above->pages = 0;
+        }
+        return 0;
+    }
+
+    if (above) {
+        above->start = start;
+        above->pages += pages;
+        return 0;
+    }
+
+    if (!unused) return 1;
+    unused->start = start;
+    unused->pages = pages;
+    return 0;
+}
+
+/**
+ * @brief Get a run of mapped heap pages
+ * @param pages The amount of pages to get
+ * @returns Address of the pages or 0x0
+ */
+static uintptr_t hexalloc_getPages(size_t pages) {
+    uintptr_t ret = 0x0;
+    spinlock_acquire(&hexalloc_page_lock);
+
+    // Single pages come out of the free page list
+    if (pages == 1 && hexalloc_free_pages) {
+        ret = hexalloc_free_pages;
+        hexalloc_free_pages = *(uintptr_t*)ret;
+        hexalloc_free_page_count--;
+        spinlock_release(&hexalloc_page_lock);
+        return ret;
+    }
+
+    // Look for a range we unmapped previously (first fit)
+    for (int i = 0; i < HEXALLOC_MAX_RANGES; i++) {
+        hexalloc_range_t *range = &hexalloc_ranges[i];
+        if (range->pages < pages) continue;
+
+        if (!mem_allocate(range->start, pages * PAGE_SIZE, MEM_DEFAULT, MEM_PAGE_KERNEL)) {
+            LOG(WARN, "Failed to remap %d pages at %p\n", pages, range->start);
+            break;
+        }
+
+        ret = range->start;
+        range->start += pages * PAGE_SIZE;
+        range->pages -= pages;
+        spinlock_release(&hexalloc_page_lock);
+        return ret;
+    }
+
+    // Expand the heap
+    ret = mem_sbrk(pages * PAGE_SIZE);
+    spinlock_release(&hexalloc_page_lock);
+    return ret;
+}
+
+/**
+ * @brief Give back a run of heap pages
+ * @param addr The address of the pages
+ * @param pages The amount of pages
+ * 
+ * @warning Don't hold any lock or have interrupts disabled, unmapping waits on a TLB shootdown
+ */
+static void hexalloc_putPages(uintptr_t addr, size_t pages) {
+    spinlock_acquire(&hexalloc_page_lock);
+
+    // Keep a few mapped pages around for slabs
+    if (pages == 1 && hexalloc_free_page_count < HEXALLOC_MAX_FREE_PAGES) {
+        *(uintptr_t*)addr = hexalloc_free_pages;
+        hexalloc_free_pages = addr;
+        hexalloc_free_page_count++;
+        spinlock_release(&hexalloc_page_lock);
+        return;
+    }
+
+    spinlock_release(&hexalloc_page_lock);
+
+    // Give the frames back to the PMM. Nobody else knows about the range until it is recorded below
+    mem_free(addr, pages * PAGE_SIZE, MEM_DEFAULT);
+
+    spinlock_acquire(&hexalloc_page_lock);
+    if (hexalloc_addRange(addr, pages)) {
+        LOG(WARN, "Out of range entries, leaking %d pages of heap address space at %p\n", pages, addr);
+    }
+    spinlock_release(&hexalloc_page_lock);
+}
+
+/**
+ * @brief Give back the pages of slabs released by @c hexalloc_cacheFree
+ * @param release The released slabs, linked through their next pointers
+ * @note Call this after dropping the cache lock and restoring interrupts
+ */
+static void hexalloc_putSlabs(hexalloc_slab_t *release) {
+    while (release) {
+        hexalloc_slab_t *slab = release;
+        release = slab->next;
+        hexalloc_putPages((uintptr_t)slab, 1);
+    }
+}
+
+/*** SLABS ***/
+
+/**
+ * @brief Initialize the caches
+ */
+static void hexalloc_init() {
+    for (int i = 0; i < HEXALLOC_CLASS_COUNT; i++) {
+        hexalloc_caches[i].size = hexalloc_sizes[i];
+        hexalloc_caches[i].per_slab = (PAGE_SIZE - HEXALLOC_SLAB_HEADER_SIZE) / hexalloc_sizes[i];
+    }
+
+    hexalloc_initialized = 1;
+}
+
+/**
+ * @brief Get the size class for a size
+ * @returns Size class index
+ */
+static inline int hexalloc_getClass(size_t size) {
+    int i = 0;
+    while (hexalloc_sizes[i] < size) i++;
+    return i;
+}
+
+/**
+ * @brief Unlink a slab from a cache list (cache lock held)
+ */
+static void hexalloc_unlinkSlab(hexalloc_slab_t **list, hexalloc_slab_t *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+/**
+ * @brief Push a slab onto a cache list (cache lock held)
+ */
+static void hexalloc_linkSlab(hexalloc_slab_t **list, hexalloc_slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+/**
+ * @brief Create a new slab for a cache (cache lock held)
+ * @returns The slab or NULL
+ */
+static hexalloc_slab_t *hexalloc_createSlab(hexalloc_cache_t *cache) {
+    uintptr_t page = hexalloc_getPages(1);
+    if (!page) return NULL;
+
+    hexalloc_slab_t *slab = (hexalloc_slab_t*)page;
+    slab->magic = HEXALLOC_SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->total = cache->per_slab;
+    slab->cache = cache;
+    slab->next = slab->prev = NULL;
+
+    // Link the objects together, in address order
+    uintptr_t obj = page + HEXALLOC_SLAB_HEADER_SIZE;
+    slab->free = (void*)obj;
+    for (uint16_t i = 0; i < slab->total - 1; i++) {
+        *(uintptr_t*)obj = obj + cache->size;
+        obj += cache->size;
+    }
+    *(uintptr_t*)obj = 0x0;
+
+    cache->slabs++;
+    return slab;
+}
+
+/**
+ * @brief Take an object out of a cache (cache lock held)
+ * @returns The object or NULL
+ */
+static void *hexalloc_cacheAllocate(hexalloc_cache_t *cache) {
+    hexalloc_slab_t *slab = cache->partial;
+
+    if (!slab) {
+        // Reuse an empty slab if we have one
+        slab = cache->empty;
+        if (slab) {
+            hexalloc_unlinkSlab(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            slab = hexalloc_createSlab(cache);
+            if (!slab) return NULL;
+        }
+
+        hexalloc_linkSlab(&cache->partial, slab);
+    }
+
+    void *obj = slab->free;
+    slab->free = (void*)(*(uintptr_t*)obj);
+    slab->inuse++;
+    cache->objects++;
+
+    // Full slabs leave the partial list
+    if (slab->inuse == slab->total) hexalloc_unlinkSlab(&cache->partial, slab);
+
+    return obj;
+}
+
+/**
+ * @brief Return an object to its slab (cache lock held)
+ * @param cache The cache of the object
+ * @param obj The object
+ * @param release Slabs that should be given back are pushed here, see @c hexalloc_putSlabs
+ */
+static void hexalloc_cacheFree(hexalloc_cache_t *cache, void *obj, hexalloc_slab_t **release) {
+    hexalloc_slab_t *slab = (hexalloc_slab_t*)((uintptr_t)obj & ~(PAGE_SIZE - 1));
+
+    if (slab->inuse == slab->total) hexalloc_linkSlab(&cache->partial, slab);
+
+    *(uintptr_t*)obj = (uintptr_t)slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->objects--;
+
+    if (slab->inuse) return;
+
+    // The slab is now empty
+    hexalloc_unlinkSlab(&cache->partial, slab);
+    if (cache->empty_count < HEXALLOC_MAX_EMPTY) {
+        hexalloc_linkSlab(&cache->empty, slab);
+        cache->empty_count++;
+        return;
+    }
+
+    slab->magic = 0;
+    cache->slabs--;
+    slab->next = *release;
+    *release = slab;
+}
+
+/*** LARGE ALLOCATIONS ***/
+
+/**
+ * @brief Allocate a large object
+ * @param size The size of the object
+ * @param aligned Whether the object should be page-aligned
+ */
+static void *hexalloc_allocateLarge(size_t size, int aligned) {
+    size_t header_size = aligned ? PAGE_SIZE : HEXALLOC_LARGE_HEADER_SIZE;
+    if (size > SIZE_MAX - header_size - PAGE_SIZE) return NULL;
+
+    size_t pages = HEXALLOC_ALIGN(size + header_size, PAGE_SIZE) / PAGE_SIZE;
+    uintptr_t addr = hexalloc_getPages(pages);
+    if (!addr) return NULL;
+
+    hexalloc_large_t *header = (hexalloc_large_t*)addr;
+    header->magic = aligned ? HEXALLOC_VALLOC_MAGIC : HEXALLOC_LARGE_MAGIC;
+    header->pages = pages;
+    header->size = size;
+
+    __atomic_add_fetch(&hexalloc_large_pages, pages, __ATOMIC_RELAXED);
+    return (void*)(addr + header_size);
+}
+
+/**
+ * @brief Get the header of a pointer that is not in a slab
+ */
+static inline hexalloc_large_t *hexalloc_getLarge(void *ptr) {
+    if (((uintptr_t)ptr & (PAGE_SIZE - 1)) == 0) return (hexalloc_large_t*)((uintptr_t)ptr - PAGE_SIZE);
+    return (hexalloc_large_t*)((uintptr_t)ptr & ~(PAGE_SIZE - 1));
+}
+
+/*** ALLOCATOR SUBSYSTEM FUNCTIONS ***/
+
+/**
+ * @brief Get information on the allocator.
+ */
+allocator_info_t *alloc_getInfo() {
+    if (!hexalloc_info.version_major) {
+        strncpy((char*)hexalloc_info.name, ALLOC_NAME, 127);
+        hexalloc_info.version_major = ALLOC_VERSION_MAJOR;
+        hexalloc_info.version_minor = ALLOC_VERSION_MINOR;
+        hexalloc_info.support_valloc = 1;
+        hexalloc_info.support_stats = 1;
+    }
+
+    return &hexalloc_info;
+}
+
+/**
+ * @brief Get heap usage and fragmentation statistics
+ * 
+ * Objects sitting in magazines count as free. Slab headers and the space left at the end of a slab
+ * count as used, so @c heap_size is @c used plus @c free.
+ */
+void alloc_getStats(allocator_stats_t *stats) {
+    memset(stats, 0, sizeof(allocator_stats_t));
+
+    for (int i = 0; i < HEXALLOC_CLASS_COUNT; i++) {
+        hexalloc_cache_t *cache = &hexalloc_caches[i];
+
+        size_t in_magazines = 0;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) in_magazines += hexalloc_magazines[cpu][i].count;
+
+        size_t total = cache->slabs * cache->per_slab;
+        size_t used = cache->objects - in_magazines;
+
+        stats->heap_size += cache->slabs * PAGE_SIZE;
+        stats->used += cache->slabs * PAGE_SIZE - (total - used) * cache->size;
+        stats->free += (total - used) * cache->size;
+        stats->free_chunks += total - used;
+    }
+
+    size_t large = __atomic_load_n(&hexalloc_large_pages, __ATOMIC_RELAXED) * PAGE_SIZE;
+    stats->heap_size += large + hexalloc_free_page_count * PAGE_SIZE;
+    stats->used += large;
+    stats->free += hexalloc_free_page_count * PAGE_SIZE;
+    stats->free_chunks += hexalloc_free_page_count;
+}
+
+/**
+ * @brief Allocate memory
+ * @param nbyte The amount of bytes to allocate
+ */
+void *alloc_malloc(size_t nbyte) {
+    if (!nbyte) nbyte = 1;
+    if (nbyte > HEXALLOC_SMALL_MAX) return hexalloc_allocateLarge(nbyte, 0);
+    if (!hexalloc_initialized) hexalloc_init();
+
+    int class = hexalloc_getClass(nbyte);
+    hexalloc_cache_t *cache = &hexalloc_caches[class];
+
+    uintptr_t flags = arch_disable_interrupts();
+    int cpu = arch_current_cpu();
+
+    if (cpu >= MAX_CPUS) {
+        // No magazine for this CPU
+        spinlock_acquire(&cache->lock);
+        void *obj = hexalloc_cacheAllocate(cache);
+        spinlock_release(&cache->lock);
+        arch_restore_interrupts(flags);
+        return obj;
+    }
+
+    hexalloc_magazine_t *mag = &hexalloc_magazines[cpu][class];
+
+    if (!mag->count) {
+        // Refill half of the magazine from the cache
+        spinlock_acquire(&cache->lock);
+        while (mag->count < HEXALLOC_MAGAZINE_BATCH) {
+            void *obj = hexalloc_cacheAllocate(cache);
+            if (!obj) break;
+            mag->objects[mag->count++] = obj;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    void *ret = mag->count ? mag->objects[--mag->count] : NULL;
+    arch_restore_interrupts(flags);
+    return ret;
+}
+
+/**
+ * @brief Free memory
+ * @param ptr The pointer to free
+ */
+void alloc_free(void *ptr) {
+    if (!ptr) return;
+
+    hexalloc_slab_t *slab = (hexalloc_slab_t*)((uintptr_t)ptr & ~(PAGE_SIZE - 1));
+    if ((uintptr_t)ptr != (uintptr_t)slab && slab->magic == HEXALLOC_SLAB_MAGIC) {
+        hexalloc_cache_t *cache = slab->cache;
+
+        uintptr_t flags = arch_disable_interrupts();
+        int cpu = arch_current_cpu();
+
+        if (cpu >= MAX_CPUS) {
+            // No magazine for this CPU
+            spinlock_acquire(&cache->lock);
+            hexalloc_slab_t *release = NULL;
+            hexalloc_cacheFree(cache, ptr, &release);
+            spinlock_release(&cache->lock);
+            arch_restore_interrupts(flags);
+            hexalloc_putSlabs(release);
+            return;
+        }
+
+        hexalloc_magazine_t *mag = &hexalloc_magazines[cpu][cache - hexalloc_caches];
+
+        hexalloc_slab_t *release = NULL;
+        if (mag->count == HEXALLOC_MAGAZINE_SIZE) {
+            // Flush the older half of the magazine back to the cache
+            spinlock_acquire(&cache->lock);
+            for (size_t i = 0; i < HEXALLOC_MAGAZINE_BATCH; i++) hexalloc_cacheFree(cache, mag->objects[i], &release);
+            spinlock_release(&cache->lock);
+
+            memmove(mag->objects, &mag->objects[HEXALLOC_MAGAZINE_BATCH], (HEXALLOC_MAGAZINE_SIZE - HEXALLOC_MAGAZINE_BATCH) * sizeof(void*));
+            mag->count -= HEXALLOC_MAGAZINE_BATCH;
+        }
+
+        mag->objects[mag->count++] = ptr;
+        arch_restore_interrupts(flags);
+
+        // Unmapping the released slabs waits on other CPUs, so it can't happen with the cache locked or interrupts off
+        hexalloc_putSlabs(release);
+        return;
+    }
+
+    hexalloc_large_t *header = hexalloc_getLarge(ptr);
+    if (header->magic != HEXALLOC_LARGE_MAGIC && header->magic != HEXALLOC_VALLOC_MAGIC) {
+        kernel_panic_extended(MEMORY_MANAGEMENT_ERROR, "hexalloc", "*** Bad free of %p (corrupted or not allocated)\n", ptr);
+        __builtin_unreachable();
+    }
+
+    header->magic = 0;
+    __atomic_sub_fetch(&hexalloc_large_pages, header->pages, __ATOMIC_RELAXED);
+    hexalloc_putPages((uintptr_t)header, header->pages);
+}
+
+/**
+ * @brief Get the usable size of an allocation
+ */
+static size_t hexalloc_getSize(void *ptr) {
+    hexalloc_slab_t *slab = (hexalloc_slab_t*)((uintptr_t)ptr & ~(PAGE_SIZE - 1));
+    if ((uintptr_t)ptr != (uintptr_t)slab && slab->magic == HEXALLOC_SLAB_MAGIC) return slab->cache->size;
+
+    hexalloc_large_t *header = hexalloc_getLarge(ptr);
+    return header->pages * PAGE_SIZE - ((uintptr_t)ptr - (uintptr_t)header);
+}
+
+/**
+ * @brief Reallocate memory
+ * @param ptr The previous pointer
+ * @param nbyte The new size
+ */
+void *alloc_realloc(void *ptr, size_t nbyte) {
+    if (!ptr) return alloc_malloc(nbyte);
+
+    if (!nbyte) {
+        alloc_free(ptr);
+        return NULL;
+    }
+
+    // Still fits?
+    size_t old_size = hexalloc_getSize(ptr);
+    if (nbyte <= old_size) return ptr;
+
+    void *new = alloc_malloc(nbyte);
+    if (!new) return NULL;
+
+    memcpy(new, ptr, old_size);
+    alloc_free(ptr);
+    return new;
+}
+
+/**
+ * @brief Allocate zeroed memory
+ * @param elements The amount of elements
+ * @param size The size of each element
+ */
+void *alloc_calloc(size_t elements, size_t size) {
+    if (size && elements > SIZE_MAX / size) return NULL;
+
+    void *ptr = alloc_malloc(elements * size);
+    if (ptr) memset(ptr, 0, elements * size);
+    return ptr;
+}
+
+/**
+ * @brief Allocate page-aligned memory
+ * @param nbyte The amount of bytes to allocate
+ */
+void *alloc_valloc(size_t nbyte) {
+    if (!nbyte) nbyte = 1;
+    return hexalloc_allocateLarge(nbyte, 1);
+}
@@ -16,6 +16,7 @@
 
 #include "liballoc.h"
 #include <stdint.h>
+#include <kernel/mem/alloc.h>
 
 /**  Durand's Amazing Super Duper Memory functions.  */
 
@@ -205,6 +206,27 @@ void liballoc_dump()
 }
 #endif
 
+/** Fills in the heap statistics for Hexahedron. Every major block with
+ * room left in it counts as one free chunk. */
+void alloc_getStats(allocator_stats_t *stats)
+{
+	struct liballoc_major *maj;
+
+	liballoc_lock();
+
+	stats->heap_size = l_allocated;
+	stats->used = l_inuse;
+	stats->free = l_allocated - l_inuse;
+	stats->free_chunks = 0;
+
+	for ( maj = l_memRoot; maj != NULL; maj = maj->next )
+	{
+		if ( maj->usage < maj->size ) stats->free_chunks += 1;
+	}
+
+	liballoc_unlock();
+}
+
 
 
 // ***************************************************************
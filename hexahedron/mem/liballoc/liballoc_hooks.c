@@ -43,6 +43,7 @@ allocator_info_t *alloc_getInfo() {
         allocator_information->version_minor = ALLOC_VERSION_MINOR;
 
         allocator_information->support_valloc = 0;
+        allocator_information->support_stats = 1;
     }
     
     return allocator_information;
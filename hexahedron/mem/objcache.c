@@ -0,0 +1,130 @@
+/**
+ * @file hexahedron/mem/objcache.c
+ * @brief Object cache
+ *
+ * Caches objects that are expensive to set up or are allocated and freed all the time (kernel stacks,
+ * threads, processes), so that getting one is usually just popping a pointer.
+ *
+ * Like the magazines of hexalloc, every CPU has a magazine of free objects which is only touched with
+ * interrupts disabled. When it runs empty or full, half of it is moved from or to the depot under the lock.
+ * Only when the depot is empty too is a new object created, and only when the depot is over its limit
+ * is an object destroyed. Both happen without the lock or interrupts disabled.
+ *
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ *
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/mem/objcache.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/arch/arch.h>
+#include <kernel/debug.h>
+
+#include <string.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "MEM:OBJCACHE", __VA_ARGS__)
+
+/**
+ * @brief Create an object cache
+ * @param name Name for debugging
+ * @param size The size of an object (at least a pointer)
+ * @param depot_max How many free objects the depot may hold, 0 to never destroy objects
+ * @param create Creates a new object, or NULL to kmalloc @p size bytes
+ * @param destroy Destroys an object, or NULL to kfree it
+ * @returns The new cache
+ */
+objcache_t *objcache_create(char *name, size_t size, size_t depot_max, objcache_create_t create, objcache_destroy_t destroy) {
+    objcache_t *cache = kmalloc(sizeof(objcache_t));
+    memset(cache, 0, sizeof(objcache_t));
+    cache->name = name;
+    cache->size = (size < sizeof(void*)) ? sizeof(void*) : size;
+    cache->depot_max = depot_max;
+    cache->create = create;
+    cache->destroy = destroy;
+    return cache;
+}
+
+/**
+ * @brief Allocate an object from a cache
+ * @param cache The cache to allocate from
+ * @returns The object (not cleared) or NULL if a new one couldn't be created
+ */
+void *objcache_alloc(objcache_t *cache) {
+    uintptr_t flags = arch_disable_interrupts();
+    objcache_magazine_t *mag = &cache->magazines[arch_current_cpu()];
+
+    if (!mag->count && cache->depot) {
+        // Refill half of the magazine from the depot
+        spinlock_acquire(&cache->lock);
+        while (mag->count < OBJCACHE_MAGAZINE_BATCH && cache->depot) {
+            void *obj = cache->depot;
+            cache->depot = *(void**)obj;
+            cache->depot_count--;
+            mag->objects[mag->count++] = obj;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    void *ret = mag->count ? mag->objects[--mag->count] : NULL;
+    arch_restore_interrupts(flags);
+    if (ret) return ret;
+
+    // Nothing cached anywhere, make a new one
+    ret = cache->create ? cache->create(cache) : kmalloc(cache->size);
+    if (!ret) {
+        LOG(ERR, "Could not create a new object for cache \"%s\"\n", cache->name);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&cache->objects, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+/**
+ * @brief Return an object to its cache
+ * @param cache The cache the object came from
+ * @param obj The object
+ */
+void objcache_free(objcache_t *cache, void *obj) {
+    if (!obj) return;
+
+    // Objects pushed out of the depot, destroyed once we're out of here
+    void *excess[OBJCACHE_MAGAZINE_BATCH];
+    size_t excess_count = 0;
+
+    uintptr_t flags = arch_disable_interrupts();
+    objcache_magazine_t *mag = &cache->magazines[arch_current_cpu()];
+
+    if (mag->count == OBJCACHE_MAGAZINE_SIZE) {
+        // Flush the older half of the magazine to the depot
+        spinlock_acquire(&cache->lock);
+        for (size_t i = 0; i < OBJCACHE_MAGAZINE_BATCH; i++) {
+            if (cache->depot_max && cache->depot_count >= cache->depot_max) {
+                excess[excess_count++] = mag->objects[i];
+                continue;
+            }
+
+            *(void**)mag->objects[i] = cache->depot;
+            cache->depot = mag->objects[i];
+            cache->depot_count++;
+        }
+        spinlock_release(&cache->lock);
+
+        memmove(mag->objects, &mag->objects[OBJCACHE_MAGAZINE_BATCH], (OBJCACHE_MAGAZINE_SIZE - OBJCACHE_MAGAZINE_BATCH) * sizeof(void*));
+        mag->count -= OBJCACHE_MAGAZINE_BATCH;
+    }
+
+    mag->objects[mag->count++] = obj;
+    arch_restore_interrupts(flags);
+
+    for (size_t i = 0; i < excess_count; i++) {
+        if (cache->destroy) cache->destroy(cache, excess[i]);
+        else kfree(excess[i]);
+    }
+
+    if (excess_count) __atomic_sub_fetch(&cache->objects, excess_count, __ATOMIC_RELAXED);
+}
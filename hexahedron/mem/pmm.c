@@ -1,14 +1,25 @@
 /**
  * @file hexahedron/mem/pmm.c
- * @brief Physical memory manager 
- * 
- * This is the default Hexahedron PMM. It is a bitmap frame allocator.
- * 
+ * @brief Physical memory manager
+ *
+ * This is the default Hexahedron PMM. It is a buddy allocator.
+ *
+ * Free memory is kept as blocks of 2^order frames, aligned to their size, on one
+ * free list per order. Allocating splits a larger block in half until it is the right
+ * order, and freeing merges a block with its buddy (the other half of the block it came from)
+ * for as long as the buddy is free too. Both take O(PMM_MAX_ORDER) time.
+ *
+ * The free lists are linked through the per-frame storage given to @c pmm_init (see @c pmm_getStorageSize),
+ * so the free frames themselves are never touched.
+ *
+ * Single frames go through a per-CPU cache first (see @c pmm_cache_t), which is only touched with interrupts
+ * disabled. The global lock is taken to refill an empty cache or drain a full one, a batch at a time.
+ *
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
  * It is released under the terms of the BSD 3-clause license.
  * Please see the LICENSE file in the main repository for more details.
- * 
+ *
  * Copyright (C) 2024 Samuel Stuart
  */
 
@@ -19,101 +30,186 @@
 
 // Kernel includes
 #include <kernel/mem/pmm.h>
+#include <kernel/arch/arch.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
 #include <kernel/misc/spinlock.h>
 
-// Frames bitmap 
-uintptr_t    *frames;
+// Architecture-specific includes
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/smp.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/smp.h>
+#else
+#error "Unsupported architecture - do not compile this file"
+#endif
+
+// Per-frame block information
+pmm_block_t  *pmm_blocks;
 uintptr_t    nframes = 0;
 
+// Free lists
+static uint32_t pmm_freeLists[PMM_MAX_ORDER];
+static uintptr_t pmm_freeCounts[PMM_MAX_ORDER] = { 0 };
+
 // Debugging information
 uintptr_t    pmm_memorySize = 0;
 uintptr_t    pmm_usedBlocks = 0;
 uintptr_t    pmm_maxBlocks = 0;
 
+// Per-CPU frame caches
+static pmm_cache_t pmm_caches[MAX_CPUS] = { 0 };
+static size_t pmm_cacheLow = PMM_CACHE_LOW;
+static size_t pmm_cacheHigh = PMM_CACHE_HIGH;
+
+// Reclaimers
+static pmm_reclaimer_t pmm_reclaimers[PMM_MAX_RECLAIMERS] = { 0 };
+
 // Spinlock
 static spinlock_t frame_lock = { 0 };
 
+// Prototypes
+static size_t pmm_drainCaches();
+
+/**
+ * @brief Get the amount of bytes @c pmm_init needs for its per-frame storage
+ * @param memsize Available physical memory in bytes.
+ */
+size_t pmm_getStorageSize(uintptr_t memsize) {
+    return (memsize / PMM_BLOCK_SIZE) * sizeof(pmm_block_t);
+}
+
 /**
  * @brief Initialize the physical memory system.
  * @param memsize Available physical memory in bytes.
- * @param frames_bitmap The bitmap of frames allocated to the system (mapped into memory)
+ * @param storage Per-frame storage, at least @c pmm_getStorageSize bytes (mapped into memory)
  */
-int pmm_init(uintptr_t memsize, uintptr_t *frames_bitmap) {
-    if (!memsize || !frames_bitmap) kernel_panic(KERNEL_BAD_ARGUMENT_ERROR, "physmem");
+int pmm_init(uintptr_t memsize, void *storage) {
+    if (!memsize || !storage) kernel_panic(KERNEL_BAD_ARGUMENT_ERROR, "physmem");
 
     pmm_memorySize = memsize;
     pmm_maxBlocks = pmm_memorySize / PMM_BLOCK_SIZE;
     pmm_usedBlocks = pmm_maxBlocks; // By default, all is in use. You must mark valid memory manually
 
-    frames = frames_bitmap;
+    if (pmm_maxBlocks >= PMM_FRAME_NONE) {
+        kernel_panic_extended(KERNEL_BAD_ARGUMENT_ERROR, "physmem", "*** Too much physical memory (%d frames, the PMM can handle %d)\n", pmm_maxBlocks, PMM_FRAME_NONE);
+        __builtin_unreachable();
+    }
+
+    pmm_blocks = (pmm_block_t*)storage;
     nframes = pmm_maxBlocks;
 
-    // Set the bitmap to be all in use by default
-    memset(frames, 0xF, nframes / 8);
+    // No frame starts a free block
+    for (uintptr_t i = 0; i < nframes; i++) {
+        pmm_blocks[i].next = PMM_FRAME_NONE;
+        pmm_blocks[i].prev = PMM_FRAME_NONE;
+        pmm_blocks[i].order = PMM_ORDER_NONE;
+    }
+
+    for (int i = 0; i < PMM_MAX_ORDER; i++) pmm_freeLists[i] = PMM_FRAME_NONE;
 
     return 0;
 }
 
-// Set a frame/bit in the frames array
-void pmm_setFrame(int frame) {
-    frames[PMM_INDEX_BIT(frame)] |= (1 << PMM_OFFSET_BIT(frame));
+// Push a free block onto its free list
+static void pmm_pushBlock(uint32_t frame, int order) {
+    pmm_blocks[frame].order = order;
+    pmm_blocks[frame].prev = PMM_FRAME_NONE;
+    pmm_blocks[frame].next = pmm_freeLists[order];
+    if (pmm_freeLists[order] != PMM_FRAME_NONE) pmm_blocks[pmm_freeLists[order]].prev = frame;
+    pmm_freeLists[order] = frame;
+    pmm_freeCounts[order]++;
 }
 
-// Clear a frame/bit in the frames array
-void pmm_clearFrame(int frame) {
-    frames[PMM_INDEX_BIT(frame)] &= ~(1 << PMM_OFFSET_BIT(frame));
+// Remove a free block from its free list
+static void pmm_removeBlock(uint32_t frame) {
+    pmm_block_t *block = &pmm_blocks[frame];
+    int order = block->order;
+
+    if (block->prev != PMM_FRAME_NONE) pmm_blocks[block->prev].next = block->next;
+    else pmm_freeLists[order] = block->next;
+    if (block->next != PMM_FRAME_NONE) pmm_blocks[block->next].prev = block->prev;
+
+    block->next = block->prev = PMM_FRAME_NONE;
+    block->order = PMM_ORDER_NONE;
+    pmm_freeCounts[order]--;
 }
 
-// Test whether a frame is set
-int pmm_testFrame(int frame) {
-    return frames[PMM_INDEX_BIT(frame)] & (1 << PMM_OFFSET_BIT(frame));
+// Find the free block containing a frame, or PMM_FRAME_NONE if the frame is in use
+static uint32_t pmm_findFreeBlock(uint32_t frame) {
+    for (int order = 0; order < PMM_MAX_ORDER; order++) {
+        uint32_t head = frame & ~((1U << order) - 1);
+        if (pmm_blocks[head].order == order) return head;
+    }
+
+    return PMM_FRAME_NONE;
 }
 
-// Find the first free frame
-uint32_t pmm_findFirstFrame() {
-    for (uint32_t i = 0; i < PMM_INDEX_BIT(nframes); i++) {
-        if (frames[i] != 0xFFFFFFFF) {
-            // At least one bit is free. Which one?
-            for (uint32_t bit = 0; bit < 32; bit++) {
-                if (!(frames[i] & (1 << bit))) {
-                    return i * 4 * 8 + bit;
-                }
-            }
-        }
+// Free a block of 1 << order frames, merging it with its buddies
+static void pmm_freeOrder(uint32_t frame, int order) {
+    while (order < PMM_MAX_ORDER - 1) {
+        uint32_t buddy = frame ^ (1U << order);
+        if (buddy >= nframes || pmm_blocks[buddy].order != order) break;
+
+        pmm_removeBlock(buddy);
+        if (buddy < frame) frame = buddy;
+        order++;
     }
 
-    // No free frame
-    return -ENOMEM;
+    pmm_pushBlock(frame, order);
 }
 
-// Find first n frames
-int pmm_findFirstFrames(size_t n) {
-    if (n == 0) return 0x0;
-    if (n == 1) return pmm_findFirstFrame();
-
-    for (uint32_t i = 0; i < PMM_INDEX_BIT(nframes); i++) {
-        if (frames[i] != 0xFFFFFFFF) {
-            // At least one bit is free. Which one?
-            for (uint32_t bit = 0; bit < 32; bit++) {
-                if (!(frames[i] & (1 << bit))) {
-                    // Found it! But are there enough?
-
-                    int starting_bit = i * 32 + bit;
-
-                    uint32_t free_bits = 0;
-                    for (uint32_t check = 0; check < n; check++) {
-                        if (!pmm_testFrame(starting_bit + check)) free_bits++;
-                        if (free_bits == n) return i * 4 * 8 + bit; // Yes, there are!
-                    }
-                }
-            }
-        }
+// Get the largest order of an aligned block starting at frame that fits before end
+static int pmm_getChunkOrder(uint32_t frame, uint32_t end) {
+    int order = 0;
+    while (order < PMM_MAX_ORDER - 1 && !(frame & (1U << order)) && frame + (2U << order) <= end) order++;
+    return order;
+}
+
+// Free the frames [frame, end) in as few blocks as possible
+static void pmm_freeRange(uint32_t frame, uint32_t end) {
+    while (frame < end) {
+        int order = pmm_getChunkOrder(frame, end);
+        pmm_freeOrder(frame, order);
+        frame += (1U << order);
+    }
+}
+
+// Allocate a block of 1 << order frames
+static uint32_t pmm_allocateOrder(int order) {
+    // Find the smallest free block that fits
+    int found = order;
+    while (found < PMM_MAX_ORDER && pmm_freeLists[found] == PMM_FRAME_NONE) found++;
+    if (found == PMM_MAX_ORDER) return PMM_FRAME_NONE;
+
+    uint32_t frame = pmm_freeLists[found];
+    pmm_removeBlock(frame);
+
+    // Split it, giving back the upper halves
+    while (found > order) {
+        found--;
+        pmm_pushBlock(frame + (1U << found), found);
     }
 
-    // Not enough free frames
-    return -ENOMEM;
+    return frame;
+}
+
+// Take a frame out of its free block, giving the rest of the block back
+static void pmm_reserveFrame(uint32_t frame, uint32_t head) {
+    int order = pmm_blocks[head].order;
+    pmm_removeBlock(head);
+
+    // Split down to the frame, giving back the half it isn't in each time
+    while (order > 0) {
+        order--;
+        uint32_t half = head + (1U << order);
+        if (frame >= half) {
+            pmm_pushBlock(head, order);
+            head = half;
+        } else {
+            pmm_pushBlock(half, order);
+        }
+    }
 }
 
 /**
@@ -124,14 +220,19 @@ int pmm_findFirstFrames(size_t n) {
 void pmm_initializeRegion(uintptr_t base, uintptr_t size) {
     if (!size) return;
 
-    spinlock_acquire(&frame_lock);
+    // Only frames entirely inside the region are available
+    // Frame 0 is never handed out, so 0x0 can mean failure (see pmm_tryAllocateBlocks)
+    uintptr_t start = (base + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+    if (!start) start = 1;
+    uintptr_t end = (base + size) / PMM_BLOCK_SIZE;
+    if (end > nframes) end = nframes;
 
-    // Careful not to cause a div by zero on base.
-    int align = (base == 0x0) ? 0x0: base / PMM_BLOCK_SIZE;
-    int blocks = size / PMM_BLOCK_SIZE;
+    spinlock_acquire(&frame_lock);
 
-    for (; blocks > 0; blocks--) {
-        pmm_clearFrame(align++);
+    for (uintptr_t frame = start; frame < end; frame++) {
+        // Regions can overlap, so skip anything that is already free
+        if (pmm_findFreeBlock(frame) != PMM_FRAME_NONE) continue;
+        pmm_freeOrder(frame, 0);
         pmm_usedBlocks--;
     }
 
@@ -146,41 +247,96 @@ void pmm_initializeRegion(uintptr_t base, uintptr_t size) {
 void pmm_deinitializeRegion(uintptr_t base, uintptr_t size) {
     if (!size) return;
 
-    spinlock_acquire(&frame_lock);
+    // Every frame touching the region is unavailable
+    uintptr_t start = base / PMM_BLOCK_SIZE;
+    uintptr_t end = (base + size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+    if (end > nframes) end = nframes;
 
-    // Careful not to cause a div by zero on base.
-    int align = (base == 0x0) ? 0x0: base / PMM_BLOCK_SIZE;
-    int blocks = size / PMM_BLOCK_SIZE;
+    spinlock_acquire(&frame_lock);
 
-    for (; blocks > 0; blocks--) {
-        pmm_setFrame(align++);
+    for (uintptr_t frame = start; frame < end; frame++) {
+        uint32_t head = pmm_findFreeBlock(frame);
+        if (head == PMM_FRAME_NONE) continue;
+        pmm_reserveFrame(frame, head);
         pmm_usedBlocks++;
     }
 
     spinlock_release(&frame_lock);
 }
 
+/**
+ * @brief Ask the reclaimers for memory (call with no locks held)
+ * @param blocks How many blocks are wanted
+ * @returns 1 if anything was given back
+ */
+static int pmm_reclaim(size_t blocks) {
+    size_t reclaimed = 0;
+    for (int i = 0; i < PMM_MAX_RECLAIMERS; i++) {
+        pmm_reclaimer_t reclaimer = __atomic_load_n(&pmm_reclaimers[i], __ATOMIC_ACQUIRE);
+        if (reclaimer) reclaimed += reclaimer(blocks);
+    }
+
+    return reclaimed ? 1 : 0;
+}
+
 /**
  * @brief Allocate a block
  * @returns A pointer to the block. If we run out of memory it will critically fault
  */
 uintptr_t pmm_allocateBlock() {
-    if ((pmm_maxBlocks - pmm_usedBlocks) <= 0) {
-        goto _oom;
+    uintptr_t flags = arch_disable_interrupts();
+    int cpu = arch_current_cpu();
+    uint32_t frame;
+
+    if (cpu >= MAX_CPUS) {
+        // No cache for this CPU
+        spinlock_acquire(&frame_lock);
+        frame = pmm_allocateOrder(0);
+        if (frame != PMM_FRAME_NONE) pmm_usedBlocks++;
+        spinlock_release(&frame_lock);
+        if (frame == PMM_FRAME_NONE) goto _oom;
+
+        arch_restore_interrupts(flags);
+        return (uintptr_t)frame * PMM_BLOCK_SIZE;
     }
 
-    spinlock_acquire(&frame_lock);
+    pmm_cache_t *cache = &pmm_caches[cpu];
+    spinlock_acquire(&cache->lock);
+
+    if (!cache->count) {
+        // Refill the cold end up to the low watermark
+        spinlock_acquire(&frame_lock);
+        while (cache->count < pmm_cacheLow) {
+            frame = pmm_allocateOrder(0);
+            if (frame == PMM_FRAME_NONE) break;
+            pmm_usedBlocks++;
+
+            cache->start = (cache->start + PMM_CACHE_SIZE - 1) % PMM_CACHE_SIZE;
+            cache->frames[cache->start] = frame;
+            cache->count++;
+        }
+        spinlock_release(&frame_lock);
+
+        if (!cache->count) {
+            spinlock_release(&cache->lock);
+            goto _oom;
+        }
+    }
 
-    int frame = pmm_findFirstFrame();
-    if (frame == -ENOMEM) goto _oom;
-    pmm_setFrame(frame);
-    pmm_usedBlocks++;
+    // Take from the hot end
+    cache->count--;
+    frame = cache->frames[(cache->start + cache->count) % PMM_CACHE_SIZE];
 
-    spinlock_release(&frame_lock);    
-    return (uintptr_t)(frame * PMM_BLOCK_SIZE);
+    spinlock_release(&cache->lock);
+    arch_restore_interrupts(flags);
+    return (uintptr_t)frame * PMM_BLOCK_SIZE;
 
 _oom:
-    spinlock_release(&frame_lock);
+    arch_restore_interrupts(flags);
+
+    // Other CPUs' caches and then other caches can give memory back, only give up once they have nothing left
+    if (pmm_drainCaches() || pmm_reclaim(PMM_RECLAIM_BATCH)) return pmm_allocateBlock();
+
     kernel_panic(OUT_OF_MEMORY, "physmem");
     __builtin_unreachable();
 }
@@ -192,13 +348,130 @@ _oom:
 void pmm_freeBlock(uintptr_t block) {
     if (block % PMM_BLOCK_SIZE != 0) return;
 
+    uintptr_t frame = block / PMM_BLOCK_SIZE;
+    if (frame >= nframes) {
+        dprintf(WARN, "pmm_freeBlock: Tried to free block %p, which is past the end of memory\n", block);
+        return;
+    }
+
+    uintptr_t flags = arch_disable_interrupts();
+    int cpu = arch_current_cpu();
+
+    if (cpu >= MAX_CPUS) {
+        arch_restore_interrupts(flags);
+        pmm_freeBlocks(block, 1);
+        return;
+    }
+
+    pmm_cache_t *cache = &pmm_caches[cpu];
+    spinlock_acquire(&cache->lock);
+
+    // Double free? Without the lock this can miss a frame that is being freed right now, but never
+    // reports a frame in use (free blocks only ever cover free frames)
+    int double_free = (pmm_findFreeBlock(frame) != PMM_FRAME_NONE);
+    for (size_t i = 0; i < cache->count && !double_free; i++) {
+        if (cache->frames[(cache->start + i) % PMM_CACHE_SIZE] == frame) double_free = 1;
+    }
+
+    if (double_free) {
+        spinlock_release(&cache->lock);
+        arch_restore_interrupts(flags);
+        dprintf(WARN, "pmm_freeBlock: Double free of block %p\n", block);
+        return;
+    }
+
+    // Put it on the hot end
+    cache->frames[(cache->start + cache->count) % PMM_CACHE_SIZE] = frame;
+    cache->count++;
+
+    if (cache->count > pmm_cacheHigh) {
+        // Drain the cold end down to the low watermark
+        spinlock_acquire(&frame_lock);
+        while (cache->count > pmm_cacheLow) {
+            pmm_freeOrder(cache->frames[cache->start], 0);
+            pmm_usedBlocks--;
+
+            cache->start = (cache->start + 1) % PMM_CACHE_SIZE;
+            cache->count--;
+        }
+        spinlock_release(&frame_lock);
+    }
+
+    spinlock_release(&cache->lock);
+    arch_restore_interrupts(flags);
+}
+
+/**
+ * @brief Give the frames of every per-CPU cache back to the buddy allocator
+ * 
+ * Cached frames can't be merged with their buddies, so larger blocks can be missing while plenty of memory is free.
+ * 
+ * @returns How many frames were given back
+ */
+static size_t pmm_drainCaches() {
+    size_t drained = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pmm_cache_t *cache = &pmm_caches[cpu];
+        if (!__atomic_load_n(&cache->count, __ATOMIC_RELAXED)) continue;
+
+        uintptr_t flags = arch_disable_interrupts();
+        spinlock_acquire(&cache->lock);
+        spinlock_acquire(&frame_lock);
+
+        while (cache->count) {
+            pmm_freeOrder(cache->frames[cache->start], 0);
+            pmm_usedBlocks--;
+
+            cache->start = (cache->start + 1) % PMM_CACHE_SIZE;
+            cache->count--;
+            drained++;
+        }
+
+        spinlock_release(&frame_lock);
+        spinlock_release(&cache->lock);
+        arch_restore_interrupts(flags);
+    }
+
+    return drained;
+}
+
+/**
+ * @brief Try to allocate @c blocks amount of blocks, without faulting if there is no memory
+ * @param blocks The amount of blocks to allocate. Must be aligned to PMM_BLOCK_SIZE - do not pass bytes!
+ * @returns The address of the blocks, aligned to the next power of two, or 0x0 on failure
+ */
+uintptr_t pmm_tryAllocateBlocks(size_t blocks) {
+    if (!blocks) return 0x0;
+
+    // Round up to an order
+    int order = 0;
+    while (order < PMM_MAX_ORDER && ((size_t)1 << order) < blocks) order++;
+    if (order == PMM_MAX_ORDER) return 0x0;
+
     spinlock_acquire(&frame_lock);
 
-    int frame = (block == 0x0) ? 0: block / PMM_BLOCK_SIZE;
-    pmm_clearFrame(frame);
-    pmm_usedBlocks--;
+    uint32_t frame = pmm_allocateOrder(order);
+    if (frame == PMM_FRAME_NONE) {
+        spinlock_release(&frame_lock);
+
+        // Frames sitting in the per-CPU caches could complete a block, put them back and try again
+        if (pmm_getFreeBlocks() < blocks || !pmm_drainCaches()) return 0x0;
+
+        spinlock_acquire(&frame_lock);
+        frame = pmm_allocateOrder(order);
+        if (frame == PMM_FRAME_NONE) {
+            spinlock_release(&frame_lock);
+            return 0x0;
+        }
+    }
+
+    // Give back the frames that we rounded up by, so pmm_freeBlocks can take the same count
+    pmm_freeRange(frame + blocks, frame + (1U << order));
 
+    pmm_usedBlocks += blocks;
     spinlock_release(&frame_lock);
+    return (uintptr_t)frame * PMM_BLOCK_SIZE;
 }
 
 /**
@@ -207,21 +480,21 @@ void pmm_freeBlock(uintptr_t block) {
  */
 uintptr_t pmm_allocateBlocks(size_t blocks) {
     if (!blocks) kernel_panic(KERNEL_BAD_ARGUMENT_ERROR, "physmem");
-    if ((pmm_maxBlocks - pmm_usedBlocks) <= blocks) kernel_panic(OUT_OF_MEMORY, "physmem");
-    
-    spinlock_acquire(&frame_lock);
-    int frame = pmm_findFirstFrames(blocks);
-    if (frame == -ENOMEM) {
-        kernel_panic(OUT_OF_MEMORY, "physmem");
+
+    if (blocks > (1U << (PMM_MAX_ORDER - 1))) {
+        kernel_panic_extended(KERNEL_BAD_ARGUMENT_ERROR, "physmem", "*** Contiguous allocation of %d blocks is larger than the largest order (%d blocks)\n", blocks, 1 << (PMM_MAX_ORDER - 1));
+        __builtin_unreachable();
     }
 
-    for (uint32_t i = 0; i < blocks; i++) {
-        pmm_setFrame(frame + i);
+    uintptr_t ret = pmm_tryAllocateBlocks(blocks);
+    while (!ret && pmm_reclaim(blocks)) ret = pmm_tryAllocateBlocks(blocks);
+
+    if (!ret) {
+        kernel_panic(OUT_OF_MEMORY, "physmem");
+        __builtin_unreachable();
     }
 
-    pmm_usedBlocks += blocks;
-    spinlock_release(&frame_lock);
-    return (uintptr_t)(frame * PMM_BLOCK_SIZE);
+    return ret;
 }
 
 /**
@@ -231,12 +504,22 @@ uintptr_t pmm_allocateBlocks(size_t blocks) {
  */
 void pmm_freeBlocks(uintptr_t base, size_t blocks) {
     if (!blocks) return;
-    
+
+    uintptr_t frame = base / PMM_BLOCK_SIZE;
+    if (frame + blocks > nframes) {
+        dprintf(WARN, "pmm_freeBlocks: Tried to free %d blocks at %p, which is past the end of memory\n", blocks, base);
+        return;
+    }
+
     spinlock_acquire(&frame_lock);
 
-    // Careful not to cause a div by zero on base.
-    int frame = (base == 0x0) ? 0x0: base / PMM_BLOCK_SIZE;
-    for (uint32_t i = 0; i < blocks; i++) pmm_clearFrame(frame + i);
+    if (pmm_findFreeBlock(frame) != PMM_FRAME_NONE) {
+        spinlock_release(&frame_lock);
+        dprintf(WARN, "pmm_freeBlocks: Double free of %d blocks at %p\n", blocks, base);
+        return;
+    }
+
+    pmm_freeRange(frame, frame + blocks);
     pmm_usedBlocks -= blocks;
 
     spinlock_release(&frame_lock);
@@ -260,12 +543,61 @@ uintptr_t pmm_getMaximumBlocks() {
  * @brief Gets the used amount of blocks
  */
 uintptr_t pmm_getUsedBlocks() {
-    return pmm_usedBlocks;
+    return pmm_usedBlocks - pmm_getCachedBlocks();
 }
 
 /**
  * @brief Gets the free amount of blocks
  */
 uintptr_t pmm_getFreeBlocks() {
-    return (pmm_maxBlocks - pmm_usedBlocks);
-}
\ No newline at end of file
+    return (pmm_maxBlocks - pmm_usedBlocks) + pmm_getCachedBlocks();
+}
+
+/**
+ * @brief Gets the amount of free blocks of an order
+ * @param order The order (blocks of 1 << order frames)
+ */
+uintptr_t pmm_getFreeBlocksOfOrder(int order) {
+    if (order < 0 || order >= PMM_MAX_ORDER) return 0;
+    return pmm_freeCounts[order];
+}
+
+/**
+ * @brief Gets the amount of free blocks held in per-CPU caches
+ */
+uintptr_t pmm_getCachedBlocks() {
+    // This is racy, but it's only for statistics
+    uintptr_t cached = 0;
+    for (int i = 0; i < MAX_CPUS; i++) cached += pmm_caches[i].count;
+    return cached;
+}
+
+/**
+ * @brief Set the watermarks of the per-CPU frame caches
+ * @param low Frames an empty cache is refilled to, and a full cache is drained to
+ * @param high Frames a cache can hold before it is drained
+ * @returns 0 on success, -EINVAL if the watermarks are bad
+ */
+int pmm_setCacheWatermarks(size_t low, size_t high) {
+    // high + 1 frames must fit in a cache, since it is drained after going over
+    if (!low || low > high || high >= PMM_CACHE_SIZE) return -EINVAL;
+
+    // Caches above the new high watermark drain on their next free
+    pmm_cacheLow = low;
+    pmm_cacheHigh = high;
+    return 0;
+}
+
+/**
+ * @brief Register a reclaimer, which is asked to give memory back before an allocation fails
+ * @param reclaimer The reclaimer
+ * @returns 0 on success, -ENOSPC if too many are registered
+ */
+int pmm_registerReclaimer(pmm_reclaimer_t reclaimer) {
+    for (int i = 0; i < PMM_MAX_RECLAIMERS; i++) {
+        pmm_reclaimer_t expected = NULL;
+        if (__atomic_compare_exchange_n(&pmm_reclaimers[i], &expected, reclaimer, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return 0;
+    }
+
+    return -ENOSPC;
+}
@@ -25,23 +25,52 @@
 #include <kernel/mem/mem.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/mem/pmm.h>
-#include <kernel/misc/pool.h>
+#include <kernel/mem/vmem.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
 #include <structs/hashmap.h>
 
-/* DMA pool */
-pool_t *dma_pool = NULL;
+// Architecture-specific includes
+#if defined(__ARCH_I386__)
+#include <kernel/arch/i386/smp.h>
+#elif defined(__ARCH_X86_64__)
+#include <kernel/arch/x86_64/smp.h>
+#else
+#error "Unsupported architecture - do not compile this file"
+#endif
 
-/* MMIO pool */
-pool_t *mmio_pool = NULL;
+/* DMA arena */
+vmem_t *dma_arena = NULL;
 
-/* Driver pool */
-pool_t *driver_pool = NULL;
+/* MMIO arena */
+vmem_t *mmio_arena = NULL;
+
+/* Driver arena */
+vmem_t *driver_arena = NULL;
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "MEM:REGIONS", __VA_ARGS__)
 
+/**
+ * @brief Remove the kernel mappings of a range without freeing the frames behind them
+ * @param base The start of the range (page aligned)
+ * @param size The size of the range (page aligned)
+ */
+static void mem_regionsUnmap(uintptr_t base, size_t size) {
+    for (uintptr_t i = base; i < base + size; i += PAGE_SIZE) {
+        page_t *pg = mem_getPage(NULL, i, MEM_DEFAULT);
+        if (pg) pg->data = 0;
+    }
+
+#ifdef __ARCH_X86_64__
+    smp_tlbShootdownRange(NULL, base, size);
+#else
+    for (uintptr_t i = base; i < base + size; i += PAGE_SIZE) {
+        asm volatile ("invlpg (%0)" :: "r"(i) : "memory");
+        smp_tlbShootdown(i);
+    }
+#endif
+}
 
 
 /**
@@ -50,9 +79,9 @@ pool_t *driver_pool = NULL;
  * Call this after your memory system is fully initialized (heap ready)
  */
 void mem_regionsInitialize() {
-    dma_pool = pool_create("dma pool", PAGE_SIZE, MEM_DMA_REGION_SIZE, MEM_DMA_REGION, POOL_DEFAULT);
-    mmio_pool = pool_create("mmio pool", PAGE_SIZE, MEM_MMIO_REGION_SIZE, MEM_MMIO_REGION, POOL_DEFAULT);
-    driver_pool = pool_create("driver pool", PAGE_SIZE, MEM_DRIVER_REGION_SIZE, MEM_DRIVER_REGION, POOL_DEFAULT);
+    dma_arena = vmem_create("dma arena", MEM_DMA_REGION, MEM_DMA_REGION_SIZE, PAGE_SIZE);
+    mmio_arena = vmem_create("mmio arena", MEM_MMIO_REGION, MEM_MMIO_REGION_SIZE, PAGE_SIZE);
+    driver_arena = vmem_create("driver arena", MEM_DRIVER_REGION, MEM_DRIVER_REGION_SIZE, PAGE_SIZE);
 
     LOG(INFO, "Initialized region system.\n");
     LOG(INFO, "DMA region = %p, MMIO region = %p, driver region = %p\n", MEM_DMA_REGION, MEM_MMIO_REGION, MEM_DRIVER_REGION);
@@ -61,12 +90,12 @@ void mem_regionsInitialize() {
 /**
  * @brief Allocate a DMA region from the kernel
  * 
- * DMA regions are contiguous blocks that currently cannot be destroyed
+ * DMA regions are physically contiguous. Free them with @c mem_freeDMA
  */
 uintptr_t mem_allocateDMA(uintptr_t size) {
     if (!size) return 0x0;
 
-    if (!dma_pool) {
+    if (!dma_arena) {
         LOG(WARN, "Function 0x%x attempted to allocate %d bytes from DMA buffer but regions are not ready\n", __builtin_return_address(0), size);
         return 0x0;
     }
@@ -74,7 +103,7 @@ uintptr_t mem_allocateDMA(uintptr_t size) {
     // Align size
     if (size % PAGE_SIZE != 0) size = MEM_ALIGN_PAGE(size);
 
-    uintptr_t virt = pool_allocateChunks(dma_pool, size / PAGE_SIZE);
+    uintptr_t virt = vmem_alloc(dma_arena, size);
 
     // Success?
     if (virt == 0x0) {
@@ -100,10 +129,17 @@ uintptr_t mem_allocateDMA(uintptr_t size) {
 void mem_freeDMA(uintptr_t base, uintptr_t size) {
     if (!base) return;
 
-    // Free the memory
     if (size % PAGE_SIZE != 0) size = MEM_ALIGN_PAGE(size);
 
-    pool_freeChunks(dma_pool, base, size / PAGE_SIZE);
+    // Don't touch anything that isn't really ours
+    if (!vmem_isAllocated(dma_arena, base, size)) return;
+
+    // The frames came from one pmm_allocateBlocks call, give them back the same way
+    uintptr_t phys = mem_getPhysicalAddress(NULL, base);
+    mem_regionsUnmap(base, size);
+    if (phys) pmm_freeBlocks(phys, size / PMM_BLOCK_SIZE);
+
+    vmem_free(dma_arena, base, size);
 }
 
 
@@ -112,12 +148,10 @@ void mem_freeDMA(uintptr_t base, uintptr_t size) {
  * @param phys The physical address of the MMIO space
  * @param size Size of the requested space (must be aligned)
  * @returns Address to new mapped MMIO region
- * 
- * @warning MMIO regions cannot be destroyed.
  */
 uintptr_t mem_mapMMIO(uintptr_t phys, size_t size) {
     if (!size || !phys) return 0x0;
-    if (!mmio_pool) {
+    if (!mmio_arena) {
         LOG(WARN, "Function 0x%x attempted to allocate %d bytes from MMIO buffer but regions are not ready\n", __builtin_return_address(0), size);
         return 0x0;
     }
@@ -126,7 +160,7 @@ uintptr_t mem_mapMMIO(uintptr_t phys, size_t size) {
     if (size % PAGE_SIZE != 0) size = MEM_ALIGN_PAGE(size);
 
     // Get chunks
-    uintptr_t virt = pool_allocateChunks(mmio_pool, size / PAGE_SIZE);
+    uintptr_t virt = vmem_alloc(mmio_arena, size);
 
     // Success?
     if (virt == 0x0) {
@@ -149,10 +183,13 @@ uintptr_t mem_mapMMIO(uintptr_t phys, size_t size) {
 void mem_unmapMMIO(uintptr_t virt, uintptr_t size) {
     if (!virt) return;
 
-    // Free the memory
     if (size % PAGE_SIZE != 0) size = MEM_ALIGN_PAGE(size);
 
-    pool_freeChunks(mmio_pool, virt, size / PAGE_SIZE);
+    if (!vmem_isAllocated(mmio_arena, virt, size)) return;
+
+    // The physical memory isn't ours, only drop the mappings
+    mem_regionsUnmap(virt, size);
+    vmem_free(mmio_arena, virt, size);
 }
 
 /**
@@ -163,7 +200,7 @@ void mem_unmapMMIO(uintptr_t virt, uintptr_t size) {
 uintptr_t mem_mapDriver(size_t size) {
     if (!size) return 0x0;
 
-    if (!driver_pool) {
+    if (!driver_arena) {
         LOG(WARN, "Function 0x%x attempted to allocate %d bytes from driver buffer but regions are not ready\n", __builtin_return_address(0), size);
         return 0x0;
     }
@@ -171,7 +208,7 @@ uintptr_t mem_mapDriver(size_t size) {
     // Align size
     if (size % PAGE_SIZE != 0) size = MEM_ALIGN_PAGE(size);
 
-    uintptr_t virt = pool_allocateChunks(driver_pool, size / PAGE_SIZE);
+    uintptr_t virt = vmem_alloc(driver_arena, size);
 
     // Success?
     if (virt == 0x0) {
@@ -192,9 +229,11 @@ uintptr_t mem_mapDriver(size_t size) {
 void mem_unmapDriver(uintptr_t base, size_t size) {
     if (!base) return;
 
-    // Free the memory
     // Align size
     if (size % PAGE_SIZE != 0) size = MEM_ALIGN_PAGE(size);
 
-    pool_freeChunks(driver_pool, base, size / PAGE_SIZE);
+    if (!vmem_isAllocated(driver_arena, base, size)) return;
+
+    mem_free(base, size, MEM_DEFAULT);
+    vmem_free(driver_arena, base, size);
 }
\ No newline at end of file
@@ -71,11 +71,19 @@ allocator_info_t *alloc_getInfo() {
 
         allocator_information->support_profile = 1; 
         allocator_information->support_valloc = 1;
+        allocator_information->support_stats = 0;
     }
     
     return allocator_information;
 }
 
+/**
+ * @brief Fake statistics hook
+ */
+void alloc_getStats(allocator_stats_t *stats) {
+    memset(stats, 0, sizeof(allocator_stats_t));
+}
+
 
 /* Definitions {{{ */
 
@@ -0,0 +1,573 @@
+/**
+ * @file hexahedron/mem/vma.c
+ * @brief Virtual memory areas of a process
+ * 
+ * Every process keeps its mappings (ELF segments, mmap() areas) in an AVL tree ordered by
+ * address. Areas are populated lazily: the page fault handler calls @c vma_fault to map
+ * the page that was touched, reading it from the backing file if there is one.
+ * 
+ * Areas never overlap, so ordering them by start address also orders them by end address.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/mem/vma.h>
+#include <kernel/mem/mem.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/debug.h>
+
+#include <string.h>
+#include <errno.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "MEM:VMA", __VA_ARGS__)
+
+/* Height of a subtree */
+#define VMA_HEIGHT(vma) ((vma) ? (vma)->height : 0)
+
+/**
+ * @brief Recalculate the height of an area
+ */
+static inline void vma_updateHeight(vma_t *vma) {
+    int left = VMA_HEIGHT(vma->left);
+    int right = VMA_HEIGHT(vma->right);
+    vma->height = ((left > right) ? left : right) + 1;
+}
+
+/**
+ * @brief Rotate a subtree right
+ * @returns The new root of the subtree
+ */
+static vma_t *vma_rotateRight(vma_t *vma) {
+    vma_t *root = vma->left;
+    vma->left = root->right;
+    root->right = vma;
+    vma_updateHeight(vma);
+    vma_updateHeight(root);
+    return root;
+}
+
+/**
+ * @brief Rotate a subtree left
+ * @returns The new root of the subtree
+ */
+static vma_t *vma_rotateLeft(vma_t *vma) {
+    vma_t *root = vma->right;
+    vma->right = root->left;
+    root->left = vma;
+    vma_updateHeight(vma);
+    vma_updateHeight(root);
+    return root;
+}
+
+/**
+ * @brief Rebalance a subtree after one of its children changed
+ * @returns The new root of the subtree
+ */
+static vma_t *vma_balance(vma_t *vma) {
+    vma_updateHeight(vma);
+    int balance = VMA_HEIGHT(vma->left) - VMA_HEIGHT(vma->right);
+
+    if (balance > 1) {
+        if (VMA_HEIGHT(vma->left->left) < VMA_HEIGHT(vma->left->right)) vma->left = vma_rotateLeft(vma->left);
+        return vma_rotateRight(vma);
+    }
+
+    if (balance < -1) {
+        if (VMA_HEIGHT(vma->right->right) < VMA_HEIGHT(vma->right->left)) vma->right = vma_rotateRight(vma->right);
+        return vma_rotateLeft(vma);
+    }
+
+    return vma;
+}
+
+/**
+ * @brief Insert an area into a subtree
+ * @returns The new root of the subtree
+ */
+static vma_t *vma_insertNode(vma_t *root, vma_t *vma) {
+    if (!root) {
+        vma->left = vma->right = NULL;
+        vma->height = 1;
+        return vma;
+    }
+
+    if (vma->start < root->start) {
+        root->left = vma_insertNode(root->left, vma);
+    } else {
+        root->right = vma_insertNode(root->right, vma);
+    }
+
+    return vma_balance(root);
+}
+
+/**
+ * @brief Take the lowest area out of a subtree
+ * @param min Output for the lowest area
+ * @returns The new root of the subtree
+ */
+static vma_t *vma_removeMin(vma_t *root, vma_t **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = vma_removeMin(root->left, min);
+    return vma_balance(root);
+}
+
+/**
+ * @brief Remove an area from a subtree
+ * @returns The new root of the subtree
+ */
+static vma_t *vma_removeNode(vma_t *root, vma_t *vma) {
+    if (!root) return NULL;
+
+    if (vma->start < root->start) {
+        root->left = vma_removeNode(root->left, vma);
+    } else if (vma->start > root->start) {
+        root->right = vma_removeNode(root->right, vma);
+    } else {
+        vma_t *left = root->left;
+        vma_t *right = root->right;
+        if (!right) return left;
+
+        // Replace the area with the lowest one above it
+        vma_t *min;
+        right = vma_removeMin(right, &min);
+        min->left = left;
+        min->right = right;
+        return vma_balance(min);
+    }
+
+    return vma_balance(root);
+}
+
+/**
+ * @brief Find the first area that ends after an address
+ * @returns The area containing @p address, else the first area above it, else NULL
+ */
+static vma_t *vma_lookupNext(vma_t *root, uintptr_t address) {
+    vma_t *best = NULL;
+    while (root) {
+        if (root->end > address) {
+            best = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Find the area containing an address
+ */
+static vma_t *vma_lookup(vma_t *root, uintptr_t address) {
+    vma_t *vma = vma_lookupNext(root, address);
+    return (vma && vma->start <= address) ? vma : NULL;
+}
+
+/**
+ * @brief Split an area in two, the upper half is inserted as a new area
+ * @param tree The tree of the area (locked)
+ * @param vma The area to split
+ * @param address Where to split it (page aligned, inside the area)
+ */
+static void vma_split(vma_tree_t *tree, vma_t *vma, uintptr_t address) {
+    vma_t *upper = kmalloc(sizeof(vma_t));
+    memcpy(upper, vma, sizeof(vma_t));
+    upper->start = address;
+    if (upper->node) upper->node->refcount++;
+
+    // The file range is absolute, so both halves keep it as is
+    vma->end = address;
+
+    tree->root = vma_insertNode(tree->root, upper);
+    tree->count++;
+}
+
+/**
+ * @brief Split the areas around the edges of a range so every area is either inside or outside of it
+ * @param tree The tree (locked)
+ */
+static void vma_splitRange(vma_tree_t *tree, uintptr_t start, uintptr_t end) {
+    vma_t *vma = vma_lookup(tree->root, start);
+    if (vma && vma->start < start) vma_split(tree, vma, start);
+
+    vma = vma_lookup(tree->root, end);
+    if (vma && vma->start < end) vma_split(tree, vma, end);
+}
+
+/**
+ * @brief Add an area
+ * @param tree The tree to add the area to
+ * @param start The start of the area (rounded down to a page)
+ * @param size The size of the area (rounded up to a page)
+ * @param prot The protection of the area
+ * @param max_prot The highest protection @c vma_protect may give the area later
+ * @param flags The flags of the area
+ * @param node The file to read the start of the area from, or NULL to zero-fill all of it
+ * @param offset The offset of @p start in @p node
+ * @param file_size How many bytes from @p start are read from @p node
+ * @returns 0 on success, -EEXIST if another area is in the way
+ */
+int vma_map(vma_tree_t *tree, uintptr_t start, size_t size, int prot, int max_prot, int flags, fs_node_t *node, off_t offset, size_t file_size) {
+    if (!tree || !size || file_size > size || start + size < start) return -EINVAL;
+
+    vma_t *vma = kmalloc(sizeof(vma_t));
+    memset(vma, 0, sizeof(vma_t));
+    vma->start = start & ~(PAGE_SIZE - 1);
+    vma->end = start + size;
+    if (vma->end & (PAGE_SIZE - 1)) vma->end = (vma->end & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+    vma->prot = prot;
+    vma->max_prot = max_prot | prot;
+    vma->flags = flags;
+    vma->file_start = start;
+    vma->file_end = start + file_size;
+    vma->offset = offset;
+    vma->node = node;
+
+    spinlock_acquire(&tree->lock);
+
+    vma_t *next = vma_lookupNext(tree->root, vma->start);
+    if (next && next->start < vma->end) {
+        spinlock_release(&tree->lock);
+        kfree(vma);
+        return -EEXIST;
+    }
+
+    // The area keeps its own reference on the file
+    if (node) node->refcount++;
+
+    tree->root = vma_insertNode(tree->root, vma);
+    tree->count++;
+
+    spinlock_release(&tree->lock);
+
+#ifdef __ARCH_I386__
+    // i386 doesn't handle usermode page faults, populate everything now
+    for (uintptr_t i = vma->start; i < vma->end; i += PAGE_SIZE) vma_fault(tree, i, 1);
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Remove the areas in a range and free their pages in the current directory
+ * @param tree The tree to remove the areas from
+ * @param start The start of the range (page aligned)
+ * @param size The size of the range
+ * @returns 0 on success
+ * @note Areas partially in the range are split
+ */
+int vma_unmap(vma_tree_t *tree, uintptr_t start, size_t size) {
+    if (!tree || !size || (start & (PAGE_SIZE - 1))) return -EINVAL;
+
+    uintptr_t end = start + size;
+    if (end & (PAGE_SIZE - 1)) end = (end & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+    if (end < start) return -EINVAL;
+
+    spinlock_acquire(&tree->lock);
+    vma_splitRange(tree, start, end);
+
+    // Take the areas out of the tree, chaining them through their left pointers
+    vma_t *removed = NULL;
+    vma_t *vma;
+    while ((vma = vma_lookupNext(tree->root, start)) && vma->start < end) {
+        tree->root = vma_removeNode(tree->root, vma);
+        tree->count--;
+        vma->left = removed;
+        removed = vma;
+    }
+
+    spinlock_release(&tree->lock);
+
+    // Now free their pages
+    while (removed) {
+        vma = removed;
+        removed = vma->left;
+
+        mem_free(vma->start, vma->end - vma->start, MEM_DEFAULT);
+        if (vma->node) fs_close(vma->node);
+        kfree(vma);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Change the protection of the areas in a range and their pages in the current directory
+ * @param tree The tree of areas
+ * @param start The start of the range (page aligned)
+ * @param size The size of the range
+ * @param prot The new protection
+ * @returns 0 on success, -ENOMEM if part of the range isn't mapped, -EACCES if @p prot is above an area's maximum
+ */
+int vma_protect(vma_tree_t *tree, uintptr_t start, size_t size, int prot) {
+    if (!tree || !size || (start & (PAGE_SIZE - 1))) return -EINVAL;
+
+    uintptr_t end = start + size;
+    if (end & (PAGE_SIZE - 1)) end = (end & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+    if (end < start) return -EINVAL;
+
+    spinlock_acquire(&tree->lock);
+
+    // The whole range has to be mapped and allow the new protection
+    uintptr_t address = start;
+    while (address < end) {
+        vma_t *vma = vma_lookup(tree->root, address);
+        if (!vma) {
+            spinlock_release(&tree->lock);
+            return -ENOMEM;
+        }
+
+        if (prot & ~vma->max_prot) {
+            spinlock_release(&tree->lock);
+            return -EACCES;
+        }
+
+        address = vma->end;
+    }
+
+    vma_splitRange(tree, start, end);
+
+    for (vma_t *vma = vma_lookup(tree->root, start); vma && vma->start < end; vma = vma_lookup(tree->root, vma->end)) {
+        vma->prot = prot;
+    }
+
+    spinlock_release(&tree->lock);
+
+    // PROT_NONE keeps populated pages (and their contents) around, but takes them away from usermode
+    uintptr_t flags = (prot & PROT_WRITE) ? MEM_DEFAULT : MEM_PAGE_READONLY;
+    if (prot == PROT_NONE) flags |= MEM_PAGE_KERNEL;
+    mem_protect(start, end - start, flags);
+    return 0;
+}
+
+/**
+ * @brief Get the protection of the area containing an address
+ * @param tree The tree of areas
+ * @param address The address to look up
+ * @returns The protection of the area, or -1 if there is no area
+ */
+int vma_getProtection(vma_tree_t *tree, uintptr_t address) {
+    if (!tree) return -1;
+
+    spinlock_acquire(&tree->lock);
+    vma_t *vma = vma_lookup(tree->root, address);
+    int prot = vma ? vma->prot : -1;
+    spinlock_release(&tree->lock);
+
+    return prot;
+}
+
+/**
+ * @brief Check whether a range is free of areas
+ * @param tree The tree of areas
+ * @param start The start of the range
+ * @param size The size of the range
+ * @returns 1 if no area overlaps the range
+ */
+int vma_isFree(vma_tree_t *tree, uintptr_t start, size_t size) {
+    if (!tree) return 1;
+
+    spinlock_acquire(&tree->lock);
+    vma_t *vma = vma_lookupNext(tree->root, start);
+    int free = (!vma || vma->start >= start + size);
+    spinlock_release(&tree->lock);
+
+    return free;
+}
+
+/**
+ * @brief Find a free range in the mmap region
+ * @param tree The tree of areas
+ * @param hint Address to use if it is in the region and free (can be 0)
+ * @param size The size of the range (page aligned)
+ * @returns The start of the range or 0x0 if the region is full
+ */
+uintptr_t vma_findFree(vma_tree_t *tree, uintptr_t hint, size_t size) {
+    if (!tree || !size || size > MEM_MMAP_REGION_SIZE) return 0x0;
+
+    uintptr_t limit = MEM_MMAP_REGION + MEM_MMAP_REGION_SIZE;
+
+    spinlock_acquire(&tree->lock);
+
+    // Try the hint first
+    hint &= ~(PAGE_SIZE - 1);
+    if (hint >= MEM_MMAP_REGION && hint <= limit - size) {
+        vma_t *vma = vma_lookupNext(tree->root, hint);
+        if (!vma || vma->start >= hint + size) {
+            spinlock_release(&tree->lock);
+            return hint;
+        }
+    }
+
+    // Walk the gaps between areas from the bottom of the region
+    uintptr_t address = MEM_MMAP_REGION;
+    while (address <= limit - size) {
+        vma_t *vma = vma_lookupNext(tree->root, address);
+        if (!vma || vma->start >= address + size) {
+            spinlock_release(&tree->lock);
+            return address;
+        }
+
+        address = vma->end;
+    }
+
+    spinlock_release(&tree->lock);
+    return 0x0;
+}
+
+/**
+ * @brief Map the page of an area containing an address
+ * @param tree The tree of areas (must belong to the current directory)
+ * @param address The address that was touched
+ * @param write Whether the page is about to be written to. Reads of pages with nothing to read in map the shared zero page
+ * @returns 1 if the page is mapped now, 0 if the address isn't in an accessible area or it was already mapped
+ */
+int vma_fault(vma_tree_t *tree, uintptr_t address, int write) {
+    if (!tree) return 0;
+
+    spinlock_acquire(&tree->lock);
+
+    vma_t *vma = vma_lookup(tree->root, address);
+    if (!vma || vma->prot == PROT_NONE) {
+        spinlock_release(&tree->lock);
+        return 0;
+    }
+
+    // Keep what we need, the area can change while the page is read in
+    vma_t area = *vma;
+    if (area.node) area.node->refcount++;
+
+    spinlock_release(&tree->lock);
+
+    uintptr_t page = address & ~(PAGE_SIZE - 1);
+    page_t *pg = mem_getPage(NULL, page, MEM_CREATE);
+    if (!pg || pg->bits.present) {
+        if (area.node) fs_close(area.node);
+        return 0;
+    }
+
+    uintptr_t file_start = (area.file_start > page) ? area.file_start : page;
+    uintptr_t file_end = (area.file_end < page + PAGE_SIZE) ? area.file_end : page + PAGE_SIZE;
+    int anonymous = !(area.node && file_start < file_end);
+    if (area.node && anonymous) {
+        fs_close(area.node);
+        area.node = NULL;
+    }
+
+    if (anonymous && !write) {
+        // Nothing to read in, reads see the shared zero page until the first write
+        spinlock_acquire(&tree->lock);
+        vma = vma_lookup(tree->root, address);
+        pg = mem_getPage(NULL, page, MEM_CREATE);
+        if (vma && vma->prot != PROT_NONE && pg && !pg->bits.present) mem_allocatePage(pg, MEM_PAGE_ZERO);
+        spinlock_release(&tree->lock);
+        return (vma && pg && pg->bits.present);
+    }
+
+    // Fill the frame through the physical memory map before it is visible to anyone
+    uintptr_t frame = pmm_allocateBlock();
+    uint8_t *data = (uint8_t*)mem_remapPhys(frame, PAGE_SIZE);
+    memset(data, 0, PAGE_SIZE);
+
+    if (!anonymous) {
+        if (fs_read(area.node, area.offset + (file_start - area.file_start), file_end - file_start, data + (file_start - page)) != (ssize_t)(file_end - file_start)) {
+            LOG(ERR, "Failed to read page %p from its file\n", page);
+            mem_unmapPhys((uintptr_t)data, PAGE_SIZE);
+            pmm_freeBlock(frame);
+            fs_close(area.node);
+            return 0;
+        }
+    }
+
+    mem_unmapPhys((uintptr_t)data, PAGE_SIZE);
+    if (area.node) fs_close(area.node);
+
+    spinlock_acquire(&tree->lock);
+
+    // Make sure the area is still there and nobody else mapped the page
+    vma = vma_lookup(tree->root, address);
+    pg = mem_getPage(NULL, page, MEM_CREATE);
+    if (!vma || vma->prot == PROT_NONE || !pg || pg->bits.present) {
+        spinlock_release(&tree->lock);
+        pmm_freeBlock(frame);
+        return (vma && pg && pg->bits.present);
+    }
+
+    MEM_SET_FRAME(pg, frame);
+    mem_allocatePage(pg, MEM_PAGE_NOALLOC | ((vma->prot & PROT_WRITE) ? 0 : MEM_PAGE_READONLY));
+
+    spinlock_release(&tree->lock);
+    return 1;
+}
+
+/**
+ * @brief Copy a subtree
+ * @returns The copy
+ */
+static vma_t *vma_cloneNode(vma_t *vma) {
+    if (!vma) return NULL;
+
+    vma_t *copy = kmalloc(sizeof(vma_t));
+    memcpy(copy, vma, sizeof(vma_t));
+    if (copy->node) copy->node->refcount++;
+
+    copy->left = vma_cloneNode(vma->left);
+    copy->right = vma_cloneNode(vma->right);
+    return copy;
+}
+
+/**
+ * @brief Copy every area of a tree (the pages themselves are cloned with the directory)
+ * @param dest The tree to copy to (must be empty)
+ * @param src The tree to copy from
+ */
+void vma_clone(vma_tree_t *dest, vma_tree_t *src) {
+    if (!dest || !src) return;
+
+    spinlock_acquire(&src->lock);
+    dest->root = vma_cloneNode(src->root);
+    dest->count = src->count;
+    spinlock_release(&src->lock);
+}
+
+/**
+ * @brief Free a subtree
+ */
+static void vma_destroyNode(vma_t *vma) {
+    if (!vma) return;
+
+    vma_destroyNode(vma->left);
+    vma_destroyNode(vma->right);
+
+    if (vma->node) fs_close(vma->node);
+    kfree(vma);
+}
+
+/**
+ * @brief Remove every area of a tree
+ * @param tree The tree to empty
+ * @note This doesn't unmap pages, destroy the directory to do that
+ */
+void vma_destroy(vma_tree_t *tree) {
+    if (!tree) return;
+
+    spinlock_acquire(&tree->lock);
+    vma_t *root = tree->root;
+    tree->root = NULL;
+    tree->count = 0;
+    spinlock_release(&tree->lock);
+
+    vma_destroyNode(root);
+}
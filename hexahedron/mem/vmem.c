@@ -0,0 +1,260 @@
+/**
+ * @file hexahedron/mem/vmem.c
+ * @brief Virtual address arena allocator
+ * 
+ * An arena hands out ranges of addresses in multiples of its quantum. It never touches the
+ * addresses themselves, so it can manage any region (see regions.c).
+ * 
+ * The arena is split into segments that are kept in address order, and each segment knows its
+ * neighbours (the boundary tags). Freeing a range merges it with free neighbours right away.
+ * 
+ * Free segments sit on one list per power of two quanta, with a bitmap of the lists that aren't
+ * empty. An allocation takes the first segment on the lowest list whose segments are all big enough,
+ * which is a single bit scan. Only when all of those are empty is the list of the size itself searched.
+ * Allocated segments are hashed by their base so they can be found when freed.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/mem/vmem.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/debug.h>
+
+#include <string.h>
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "MEM:VMEM", __VA_ARGS__)
+
+/* Index of the highest set bit */
+#define VMEM_HIGHBIT(x) ((int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl((unsigned long)(x)))
+
+/**
+ * @brief Get the free list of a size
+ */
+static inline int vmem_listIndex(vmem_t *arena, size_t size) {
+    return VMEM_HIGHBIT(size / arena->quantum);
+}
+
+/**
+ * @brief Get the hash bucket of an allocated segment
+ */
+static inline size_t vmem_hash(vmem_t *arena, uintptr_t base) {
+    return (base / arena->quantum) % VMEM_HASH_BUCKETS;
+}
+
+/**
+ * @brief Put a segment on its free list (call with the lock held)
+ */
+static void vmem_insertFree(vmem_t *arena, vmem_segment_t *seg) {
+    int index = vmem_listIndex(arena, seg->size);
+
+    seg->free = 1;
+    seg->link_prev = NULL;
+    seg->link_next = arena->freelist[index];
+    if (seg->link_next) seg->link_next->link_prev = seg;
+
+    arena->freelist[index] = seg;
+    arena->freemap |= ((uintptr_t)1 << index);
+}
+
+/**
+ * @brief Take a segment off its free list (call with the lock held)
+ */
+static void vmem_removeFree(vmem_t *arena, vmem_segment_t *seg) {
+    int index = vmem_listIndex(arena, seg->size);
+
+    if (seg->link_prev) seg->link_prev->link_next = seg->link_next;
+    else arena->freelist[index] = seg->link_next;
+    if (seg->link_next) seg->link_next->link_prev = seg->link_prev;
+
+    if (!arena->freelist[index]) arena->freemap &= ~((uintptr_t)1 << index);
+    seg->free = 0;
+}
+
+/**
+ * @brief Find a free segment of at least @p size bytes (call with the lock held)
+ */
+static vmem_segment_t *vmem_findFree(vmem_t *arena, size_t size) {
+    size_t quanta = size / arena->quantum;
+    int index = VMEM_HIGHBIT(quanta);
+
+    // Every segment on the lists above the size's own list is big enough (unless the size is a power of two, then its own list is too)
+    int first = (quanta & (quanta - 1)) ? index + 1 : index;
+    uintptr_t map = (first < (int)VMEM_FREELISTS) ? (arena->freemap >> first) : 0;
+    if (map) return arena->freelist[first + __builtin_ctzl((unsigned long)map)];
+
+    // The size's own list can still have a segment that fits
+    if (first != index) {
+        for (vmem_segment_t *seg = arena->freelist[index]; seg; seg = seg->link_next) {
+            if (seg->size >= size) return seg;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Create an arena
+ * @param name Name for debugging
+ * @param base The start of the arena (aligned to @p quantum)
+ * @param size The size of the arena (a multiple of @p quantum)
+ * @param quantum The allocation granularity, a power of two
+ * @returns The new arena or NULL if the arguments are bad
+ */
+vmem_t *vmem_create(char *name, uintptr_t base, size_t size, size_t quantum) {
+    if (!quantum || (quantum & (quantum - 1)) || base % quantum || !size || size % quantum) {
+        LOG(ERR, "Bad arena \"%s\": base %p, size %p, quantum %p\n", name, base, size, quantum);
+        return NULL;
+    }
+
+    vmem_t *arena = kmalloc(sizeof(vmem_t));
+    memset(arena, 0, sizeof(vmem_t));
+    arena->name = name;
+    arena->base = base;
+    arena->size = size;
+    arena->quantum = quantum;
+
+    // The whole arena starts out as one free segment
+    vmem_segment_t *seg = kmalloc(sizeof(vmem_segment_t));
+    memset(seg, 0, sizeof(vmem_segment_t));
+    seg->base = base;
+    seg->size = size;
+    vmem_insertFree(arena, seg);
+
+    return arena;
+}
+
+/**
+ * @brief Allocate a range from an arena
+ * @param arena The arena to allocate from
+ * @param size The size of the range (rounded up to the quantum)
+ * @returns The start of the range or 0x0 if no free segment is big enough
+ */
+uintptr_t vmem_alloc(vmem_t *arena, size_t size) {
+    if (!arena || !size) return 0x0;
+    size = (size + arena->quantum - 1) & ~(arena->quantum - 1);
+
+    // Segment for whatever is left over, allocated up front so the heap isn't called with the lock held
+    vmem_segment_t *rest = kmalloc(sizeof(vmem_segment_t));
+
+    spinlock_acquire(&arena->lock);
+
+    vmem_segment_t *seg = vmem_findFree(arena, size);
+    if (!seg) {
+        spinlock_release(&arena->lock);
+        kfree(rest);
+        return 0x0;
+    }
+
+    vmem_removeFree(arena, seg);
+
+    if (seg->size > size) {
+        // Split the end off into a new free segment
+        rest->base = seg->base + size;
+        rest->size = seg->size - size;
+        rest->prev = seg;
+        rest->next = seg->next;
+        if (rest->next) rest->next->prev = rest;
+
+        seg->next = rest;
+        seg->size = size;
+        vmem_insertFree(arena, rest);
+        rest = NULL;
+    }
+
+    // Hash it so vmem_free can find it
+    size_t bucket = vmem_hash(arena, seg->base);
+    seg->link_prev = NULL;
+    seg->link_next = arena->hash[bucket];
+    arena->hash[bucket] = seg;
+
+    arena->used += size;
+    uintptr_t base = seg->base;
+
+    spinlock_release(&arena->lock);
+
+    if (rest) kfree(rest);
+    return base;
+}
+
+/**
+ * @brief Check that a range is allocated from an arena
+ * @param arena The arena the range came from
+ * @param base The address returned by @c vmem_alloc
+ * @param size The size given to @c vmem_alloc
+ * @returns 1 if @c vmem_free would accept the range
+ */
+int vmem_isAllocated(vmem_t *arena, uintptr_t base, size_t size) {
+    if (!arena || !size) return 0;
+    size = (size + arena->quantum - 1) & ~(arena->quantum - 1);
+
+    spinlock_acquire(&arena->lock);
+
+    vmem_segment_t *seg = arena->hash[vmem_hash(arena, base)];
+    while (seg && seg->base != base) seg = seg->link_next;
+    int allocated = (seg && seg->size == size);
+
+    spinlock_release(&arena->lock);
+
+    if (!allocated) LOG(WARN, "Bad free of %d bytes at %p in arena \"%s\" (allocated: %d bytes)\n", size, base, arena->name, seg ? seg->size : 0);
+    return allocated;
+}
+
+/**
+ * @brief Return a range to an arena
+ * @param arena The arena the range came from
+ * @param base The address returned by @c vmem_alloc
+ * @param size The size given to @c vmem_alloc
+ */
+void vmem_free(vmem_t *arena, uintptr_t base, size_t size) {
+    if (!arena || !size) return;
+    size = (size + arena->quantum - 1) & ~(arena->quantum - 1);
+
+    spinlock_acquire(&arena->lock);
+
+    vmem_segment_t **link = &arena->hash[vmem_hash(arena, base)];
+    while (*link && (*link)->base != base) link = &(*link)->link_next;
+
+    vmem_segment_t *seg = *link;
+    if (!seg || seg->size != size) {
+        spinlock_release(&arena->lock);
+        LOG(WARN, "Bad free of %d bytes at %p in arena \"%s\" (allocated: %d bytes)\n", size, base, arena->name, seg ? seg->size : 0);
+        return;
+    }
+
+    *link = seg->link_next;
+    arena->used -= size;
+
+    // Merge with free neighbours
+    vmem_segment_t *merged[2] = { NULL, NULL };
+
+    vmem_segment_t *next = seg->next;
+    if (next && next->free) {
+        vmem_removeFree(arena, next);
+        seg->size += next->size;
+        seg->next = next->next;
+        if (seg->next) seg->next->prev = seg;
+        merged[0] = next;
+    }
+
+    vmem_segment_t *prev = seg->prev;
+    if (prev && prev->free) {
+        vmem_removeFree(arena, prev);
+        prev->size += seg->size;
+        prev->next = seg->next;
+        if (prev->next) prev->next->prev = prev;
+        merged[1] = seg;
+        seg = prev;
+    }
+
+    vmem_insertFree(arena, seg);
+    spinlock_release(&arena->lock);
+
+    if (merged[0]) kfree(merged[0]);
+    if (merged[1]) kfree(merged[1]);
+}
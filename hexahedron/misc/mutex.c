@@ -0,0 +1,128 @@
+/**
+ * @file hexahedron/misc/mutex.c
+ * @brief Sleeping mutex
+ * 
+ * Waiters go to sleep in the mutex's sleep queue instead of spinning. The mutex
+ * is not handed off on release - the woken thread competes for it again, so
+ * a thread that never slept can take it first.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/misc/mutex.h>
+#include <kernel/task/process.h>
+#include <kernel/processor_data.h>
+#include <kernel/arch/arch.h>
+#include <kernel/mem/alloc.h>
+#include <kernel/panic.h>
+#include <string.h>
+
+/**
+ * @brief Create a new mutex
+ * @param name Optional mutex name (for debugging)
+ */
+mutex_t *mutex_create(char *name) {
+    mutex_t *mutex = kmalloc(sizeof(mutex_t));
+    mutex_init(mutex, name);
+    return mutex;
+}
+
+/**
+ * @brief Initialize a mutex embedded in another structure
+ * @param mutex The mutex to initialize
+ * @param name Optional mutex name (for debugging)
+ */
+void mutex_init(mutex_t *mutex, char *name) {
+    memset(mutex, 0, sizeof(mutex_t));
+    mutex->name = name;
+    mutex->lock.name = name;
+    sleep_initQueue(&mutex->waiters, name);
+}
+
+/**
+ * @brief Acquire a mutex, putting the current thread to sleep while it is held
+ * @param mutex The mutex to acquire
+ */
+void mutex_acquire(mutex_t *mutex) {
+    thread_t *thread = current_cpu->current_thread;
+
+    spinlock_acquire(&mutex->lock);
+
+    while (mutex->locked) {
+        if (thread && mutex->owner == thread) {
+            kernel_panic_extended(KERNEL_BAD_ARGUMENT_ERROR, "mutex", "*** Thread %p tried to acquire mutex '%s' which it already holds\n", thread, mutex->name ? mutex->name : "unnamed");
+            __builtin_unreachable();
+        }
+
+        if (!thread) {
+            // No scheduler yet, nothing to sleep with
+            spinlock_release(&mutex->lock);
+            arch_pause();
+            spinlock_acquire(&mutex->lock);
+            continue;
+        }
+
+        // Queue ourselves while still holding the mutex lock, so the release can't slip by
+        sleep_inQueue(thread, &mutex->waiters);
+        spinlock_release(&mutex->lock);
+        process_yield(0);
+        spinlock_acquire(&mutex->lock);
+    }
+
+    mutex->locked = 1;
+    mutex->owner = thread;
+    spinlock_release(&mutex->lock);
+}
+
+/**
+ * @brief Try to acquire a mutex without sleeping
+ * @param mutex The mutex to acquire
+ * @returns 1 if the mutex was acquired, 0 if it is held
+ */
+int mutex_tryAcquire(mutex_t *mutex) {
+    int acquired = 0;
+
+    spinlock_acquire(&mutex->lock);
+    if (!mutex->locked) {
+        mutex->locked = 1;
+        mutex->owner = current_cpu->current_thread;
+        acquired = 1;
+    }
+    spinlock_release(&mutex->lock);
+
+    return acquired;
+}
+
+/**
+ * @brief Release a mutex, waking up the next waiter
+ * @param mutex The mutex to release
+ */
+void mutex_release(mutex_t *mutex) {
+    spinlock_acquire(&mutex->lock);
+
+    if (!mutex->locked) {
+        kernel_panic_extended(KERNEL_BAD_ARGUMENT_ERROR, "mutex", "*** Released mutex '%s' which is not held\n", mutex->name ? mutex->name : "unnamed");
+        __builtin_unreachable();
+    }
+
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    sleep_wakeupQueueOne(&mutex->waiters);
+
+    spinlock_release(&mutex->lock);
+}
+
+/**
+ * @brief Destroy a mutex created with @c mutex_create
+ * @param mutex The mutex to destroy
+ */
+void mutex_destroy(mutex_t *mutex) {
+    // Anyone still waiting is a bug, but don't leave them asleep forever
+    sleep_drainQueue(&mutex->waiters);
+    kfree(mutex);
+}
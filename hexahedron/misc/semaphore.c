@@ -12,14 +12,18 @@
  */
 
 #include <kernel/misc/semaphore.h>
+#include <kernel/task/process.h>
+#include <kernel/processor_data.h>
+#include <kernel/arch/arch.h>
 #include <kernel/panic.h>
 #include <kernel/mem/alloc.h>
+#include <errno.h>
 
 /**
  * @brief Initialize and create a semaphore
  * @param name          Optional semaphore name (for debugging)
  * @param value         The initialization value of the semaphore
- * @param max_value     The maximum value of the semaphore (afterwards, signal will wait)
+ * @param max_value     The maximum value of the semaphore (0 for no maximum)
  */
 semaphore_t *semaphore_create(char *name, int value, int max_value) {
     semaphore_t *output = kmalloc(sizeof(semaphore_t));
@@ -27,33 +31,74 @@ semaphore_t *semaphore_create(char *name, int value, int max_value) {
     output->value = value;
     output->max_value = max_value;
     output->name = name;
+    output->waiting = 0;
+    sleep_initQueue(&output->waiters, name);
     return output;
 }
 
+/**
+ * @brief Take items from the semaphore (lock held)
+ */
+static int semaphore_take(semaphore_t *semaphore, int items) {
+    int items_taken = (semaphore->value > items) ? items : semaphore->value;
+    semaphore->value -= items_taken;
+    return items_taken;
+}
+
 /**
  * @brief Wait on the semaphore
  * @param semaphore     The semaphore to use
  * @param items         The amount of items to take from the semaphore
- * @returns Items taken
+ * @returns Items taken (at least one, at most @c items)
  */
 int semaphore_wait(semaphore_t *semaphore, int items) {
+    if (items <= 0) return 0;
+
     // Lock the semaphore
     spinlock_acquire(semaphore->lock);
+    semaphore->waiting++;
 
-    int items_taken = 0;
+    while (semaphore->value <= 0) {
+        thread_t *thread = current_cpu->current_thread;
+        if (!thread) {
+            // No scheduler yet, nothing to sleep with
+            spinlock_release(semaphore->lock);
+            arch_pause();
+            spinlock_acquire(semaphore->lock);
+            continue;
+        }
 
-    // Wait won't fault on not enough items taken
-    if (semaphore->value > 0) {
-        if (semaphore->value > items) items_taken = items;
-        else items_taken = semaphore->value;
-        semaphore->value -= items_taken;
-    } else {
-        // Wait how do we do that again
-        // Yeah I don't know what I am doing
-        kernel_panic_extended(KERNEL_BAD_ARGUMENT_ERROR, "semaphore", "*** Semaphore underflowed max value. No thread implementation is available\n"); 
+        // Queue ourselves while still holding the semaphore lock, so a signal can't slip by
+        sleep_inQueue(thread, &semaphore->waiters);
+        spinlock_release(semaphore->lock);
+        process_yield(0);
+        spinlock_acquire(semaphore->lock);
     }
 
-    // Release the semaphore
+    // Wait won't fault on not enough items taken
+    int items_taken = semaphore_take(semaphore, items);
+
+    // Leftovers? Pass them on to the next waiter
+    if (semaphore->value > 0) sleep_wakeupQueueOne(&semaphore->waiters);
+
+    // Release the semaphore. Nothing may touch it after this, destroy can go ahead now
+    semaphore->waiting--;
+    spinlock_release(semaphore->lock);
+
+    return items_taken;
+}
+
+/**
+ * @brief Take items from the semaphore without sleeping
+ * @param semaphore     The semaphore to use
+ * @param items         The amount of items to take from the semaphore
+ * @returns Items taken, 0 if the semaphore is empty
+ */
+int semaphore_tryWait(semaphore_t *semaphore, int items) {
+    if (items <= 0) return 0;
+
+    spinlock_acquire(semaphore->lock);
+    int items_taken = (semaphore->value > 0) ? semaphore_take(semaphore, items) : 0;
     spinlock_release(semaphore->lock);
 
     return items_taken;
@@ -63,30 +108,26 @@ int semaphore_wait(semaphore_t *semaphore, int items) {
  * @brief Signal to the semaphore
  * @param semaphore     The semaphore to use
  * @param items         The amount of items to add to the semaphore
- * @returns Items added
+ * @returns Items added (less than @c items if the maximum was reached)
  */
 int semaphore_signal(semaphore_t *semaphore, int items) {
+    if (items <= 0) return 0;
+
     // Lock the semaphore
     spinlock_acquire(semaphore->lock);
 
-    int items_added = 0;
-
-    // Okay, do we need to wait?
-    if (semaphore->max_value && semaphore->value >= semaphore->max_value) {
-        // Wait how do we do that again
-        // Yeah I don't know what I am doing
-        kernel_panic_extended(KERNEL_BAD_ARGUMENT_ERROR, "semaphore", "*** Semaphore exceeded max_value. No thread implementation is available.\n"); 
-    } else {
-        // Just add to semaphore. Make sure to limit though to prevent chaos
-        if (semaphore->value + items > semaphore->max_value) {
-            items_added = semaphore->max_value - semaphore->value;
-        } else {
-            items_added = items;
-        }
-
-        semaphore->value += items_added;
+    // Just add to semaphore. Make sure to limit though to prevent chaos
+    int items_added = items;
+    if (semaphore->max_value && semaphore->value + items > semaphore->max_value) {
+        items_added = semaphore->max_value - semaphore->value;
+        if (items_added < 0) items_added = 0;
     }
 
+    semaphore->value += items_added;
+
+    // Wake up one waiter - it passes on whatever it doesn't take
+    if (items_added) sleep_wakeupQueueOne(&semaphore->waiters);
+
     // Release the semaphore
     spinlock_release(semaphore->lock);
 
@@ -105,9 +146,19 @@ int semaphore_getItems(semaphore_t *semaphore) {
 /**
  * @brief Destroy the semaphore
  * @param semaphore     The semaphore to use
+ * @returns 0 on success, -EBUSY if threads are still waiting
  */
-void semaphore_destroy(semaphore_t *semaphore) {
+int semaphore_destroy(semaphore_t *semaphore) {
+    // Waiters (even ones already woken) still have to retake the lock, don't pull it out from under them
+    spinlock_acquire(semaphore->lock);
+    if (semaphore->waiting) {
+        spinlock_release(semaphore->lock);
+        return -EBUSY;
+    }
+    spinlock_release(semaphore->lock);
+
     // !!!: Free semaphore->name?
     kfree(semaphore->lock);
     kfree(semaphore);
-}
\ No newline at end of file
+    return 0;
+}
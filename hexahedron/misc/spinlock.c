@@ -4,6 +4,9 @@
  * 
  * This is used for safeguarding SMP memory accesses. It is an internal spinlock implementation.
  * 
+ * Spinlocks are ticket locks, so they are handed out in the order CPUs asked for them.
+ * Waiters only read the lock while spinning and back off based on how far back in line they are.
+ * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
  * It is released under the terms of the BSD 3-clause license.
@@ -16,7 +19,53 @@
 #include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
 #include <kernel/arch/arch.h>
+#include <kernel/fs/kernelfs.h>
 #include <stdatomic.h>
+#include <string.h>
+
+#if defined(__ARCH_X86_64__) || defined(__ARCH_I386__)
+#include <kernel/drivers/x86/clock.h>
+#define SPINLOCK_PAUSE() asm volatile ("pause")
+#define SPINLOCK_TIMESTAMP() clock_readTSC()
+#else
+#define SPINLOCK_PAUSE()
+#define SPINLOCK_TIMESTAMP() 0
+#endif
+
+#if defined(__ARCH_X86_64__)
+// TLB shootdowns wait for every target, including ones spinning here with interrupts disabled
+#include <kernel/arch/x86_64/smp.h>
+#define SPINLOCK_SERVICE() smp_tlbService()
+#else
+#define SPINLOCK_SERVICE()
+#endif
+
+#ifdef SPINLOCK_STATS
+
+/* Statistics table */
+static spinlock_stats_t spinlock_stats[SPINLOCK_STATS_MAX] = { 0 };
+
+/**
+ * @brief Find or create the statistics entry for a lock name
+ * @param name The name of the lock (NULL is tracked as "unnamed")
+ * @returns The statistics entry or NULL if the table is full
+ */
+static spinlock_stats_t *spinlock_findStats(char *name) {
+    if (!name) name = "unnamed";
+
+    for (int i = 0; i < SPINLOCK_STATS_MAX; i++) {
+        if (!spinlock_stats[i].name) {
+            // Claim this slot. If someone beat us to it, check whether they claimed it for the same name.
+            if (__sync_bool_compare_and_swap(&spinlock_stats[i].name, NULL, name)) return &spinlock_stats[i];
+        }
+
+        if (spinlock_stats[i].name == name || !strcmp(spinlock_stats[i].name, name)) return &spinlock_stats[i];
+    }
+
+    return NULL;
+}
+
+#endif
 
 /**
  * @brief Create a new spinlock
@@ -25,13 +74,15 @@
  */
 spinlock_t *spinlock_create(char *name) {
     spinlock_t *ret = kmalloc(sizeof(spinlock_t));
-    ret->cpu = 0;
+    memset(ret, 0, sizeof(spinlock_t));
+    ret->cpu = SPINLOCK_UNOWNED;
     ret->name = name;
-    
+
     // Because atomics and its consequences have been a disaster for the human race,
-    // we must use atomic_flag_clear to set this variable.
+    // we must use atomic_init to set these variables.
     // https://stackoverflow.com/questions/31526556/initializing-an-atomic-flag-in-a-mallocd-structure
-    atomic_flag_clear(&(ret->lock));
+    atomic_init(&(ret->next_ticket), 0);
+    atomic_init(&(ret->serving), 0);
 
     return ret;
 }
@@ -47,20 +98,121 @@ void spinlock_destroy(spinlock_t *spinlock) {
 /**
  * @brief Lock a spinlock
  * 
- * Will spin around until we acquire the lock
+ * Will spin around until we acquire the lock. Waiters are served in the order they arrived.
  */
 void spinlock_acquire(spinlock_t *spinlock) {
-    while (atomic_flag_test_and_set_explicit(&(spinlock->lock), memory_order_acquire)) {
-        // TODO: CPU pause
+    unsigned int ticket = atomic_fetch_add_explicit(&(spinlock->next_ticket), 1, memory_order_relaxed);
+
+#ifdef SPINLOCK_STATS
+    uint64_t spins = 0;
+#endif
+
+    unsigned int serving;
+    while ((serving = atomic_load_explicit(&(spinlock->serving), memory_order_acquire)) != ticket) {
+        // Back off proportionally to our place in line so we aren't all hammering the cache line
+        unsigned int ahead = ticket - serving;
+        for (unsigned int i = 0; i < ahead; i++) SPINLOCK_PAUSE();
+        SPINLOCK_SERVICE();
+
+#ifdef SPINLOCK_STATS
+        spins += ahead;
+#endif
+    }
+
+    spinlock->cpu = SPINLOCK_HOLDER(arch_current_cpu());
+
+#ifdef SPINLOCK_STATS
+    if (!spinlock->stats) spinlock->stats = spinlock_findStats(spinlock->name);
+    
+    if (spinlock->stats) {
+        __sync_fetch_and_add(&spinlock->stats->acquisitions, 1);
+        if (spins) {
+            __sync_fetch_and_add(&spinlock->stats->contended, 1);
+            __sync_fetch_and_add(&spinlock->stats->spins, spins);
+        }
     }
 
-    spinlock->cpu = arch_current_cpu();
+    spinlock->acquire_time = SPINLOCK_TIMESTAMP();
+#endif
 }
 
 /**
  * @brief Release a spinlock
  */
 void spinlock_release(spinlock_t *spinlock) {
-    spinlock->cpu = -1;
-    atomic_flag_clear_explicit(&(spinlock->lock), memory_order_release);
+#ifdef SPINLOCK_STATS
+    if (spinlock->stats) {
+        uint64_t held = SPINLOCK_TIMESTAMP() - spinlock->acquire_time;
+        uint64_t max = spinlock->stats->max_hold;
+        while (held > max && !__sync_bool_compare_and_swap(&spinlock->stats->max_hold, max, held)) {
+            max = spinlock->stats->max_hold;
+        }
+    }
+#endif
+
+    spinlock->cpu = SPINLOCK_UNOWNED;
+    atomic_fetch_add_explicit(&(spinlock->serving), 1, memory_order_release);
+}
+
+/**
+ * @brief Get the spinlock statistics table
+ * @param count Output for the amount of entries in the table
+ * @returns The statistics table, or NULL if SPINLOCK_STATS is disabled
+ */
+spinlock_stats_t *spinlock_getStats(size_t *count) {
+#ifdef SPINLOCK_STATS
+    size_t i = 0;
+    while (i < SPINLOCK_STATS_MAX && spinlock_stats[i].name) i++;
+    if (count) *count = i;
+    return spinlock_stats;
+#else
+    if (count) *count = 0;
+    return NULL;
+#endif
+}
+
+/**
+ * @brief Dump spinlock statistics to the debug log
+ */
+void spinlock_dumpStats() {
+    size_t count;
+    spinlock_stats_t *stats = spinlock_getStats(&count);
+    if (!stats) {
+        dprintf(INFO, "Spinlock statistics are disabled (build with USE_SPINLOCK_STATS)\n");
+        return;
+    }
+
+    dprintf(NOHEADER, "%-32s %16s %16s %16s %16s\n", "LOCK", "ACQUIRED", "CONTENDED", "SPINS", "MAX HOLD");
+    for (size_t i = 0; i < count; i++) {
+        dprintf(NOHEADER, "%-32s %16llu %16llu %16llu %16llu\n", stats[i].name, (unsigned long long)stats[i].acquisitions,
+                (unsigned long long)stats[i].contended, (unsigned long long)stats[i].spins, (unsigned long long)stats[i].max_hold);
+    }
+}
+
+/**
+ * @brief Generate /kernel/spinlocks
+ */
+static int spinlock_getStatsEntry(kernelfs_entry_t *entry, void *data) {
+    size_t count;
+    spinlock_stats_t *stats = spinlock_getStats(&count);
+    if (!stats) {
+        kernelfs_appendData(entry, "# spinlock statistics are disabled\n");
+        return 0;
+    }
+
+    kernelfs_appendData(entry, "# lock: acquisitions, contended acquisitions, spins, longest hold (TSC cycles)\n");
+    for (size_t i = 0; i < count; i++) {
+        kernelfs_appendData(entry, "%s: acquisitions %llu contended %llu spins %llu max_hold %llu\n", stats[i].name,
+                            (unsigned long long)stats[i].acquisitions, (unsigned long long)stats[i].contended,
+                            (unsigned long long)stats[i].spins, (unsigned long long)stats[i].max_hold);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create /kernel/spinlocks, which reports the statistics of every named lock
+ */
+void spinlock_mountStats() {
+    kernelfs_createEntry("spinlocks", spinlock_getStatsEntry, NULL);
 }
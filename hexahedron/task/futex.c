@@ -0,0 +1,141 @@
+/**
+ * @file hexahedron/task/futex.c
+ * @brief Futex wait/wake
+ * 
+ * Futexes are keyed on the physical address of the word, so processes sharing a page
+ * share the futex. Waiters are hashed into a fixed set of buckets, each with its own lock.
+ * The value check and the queueing happen under the bucket lock, and wakers take the same lock,
+ * so a wakeup between userspace seeing a contended lock and going to sleep cannot be lost.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <kernel/task/futex.h>
+#include <kernel/task/process.h>
+#include <kernel/task/sleep.h>
+#include <kernel/drivers/clock.h>
+#include <kernel/mem/mem.h>
+#include <kernel/misc/spinlock.h>
+#include <kernel/debug.h>
+#include <errno.h>
+
+/* Wait buckets */
+typedef struct futex_bucket {
+    spinlock_t lock;
+    ilist_t waiters;
+} futex_bucket_t;
+
+static futex_bucket_t futex_buckets[FUTEX_BUCKETS] = { 0 };
+
+/* Log method */
+#define LOG(status, ...) dprintf_module(status, "TASK:FUTEX", __VA_ARGS__)
+
+/**
+ * @brief Get the key of a futex word
+ * @param uaddr The futex word
+ * @returns The physical address of the word, or 0 if it is invalid
+ * 
+ * @note Pages pending copy-on-write (or mapping the shared zero page) get their own frame first,
+ *       otherwise a waiter and waker on either side of the first write would see different keys.
+ */
+static uintptr_t futex_getKey(uint32_t *uaddr) {
+    if ((uintptr_t)uaddr & (sizeof(uint32_t) - 1)) return 0;
+    mem_breakCopyOnWrite((uintptr_t)uaddr);
+    if (!mem_validate((void*)uaddr, PTR_USER | PTR_STRICT)) return 0;
+    return mem_getPhysicalAddress(NULL, (uintptr_t)uaddr);
+}
+
+/**
+ * @brief Get the bucket of a futex key
+ */
+static inline futex_bucket_t *futex_getBucket(uintptr_t key) {
+    // Words in the same page should spread across buckets, and so should the same offset in different pages
+    uintptr_t hash = (key >> 2) ^ (key >> 12) ^ (key >> 20);
+    return &futex_buckets[hash & (FUTEX_BUCKETS - 1)];
+}
+
+/**
+ * @brief Wait on a futex word
+ * @param uaddr The futex word in the current address space
+ * @param val The value the word must still have to go to sleep
+ * @param timeout Optional relative timeout
+ * @returns 0 when woken up, -EAGAIN if the value changed, -ETIMEDOUT on timeout, or -EINVAL
+ */
+long futex_wait(uint32_t *uaddr, uint32_t val, const struct timeval *timeout) {
+    uintptr_t key = futex_getKey(uaddr);
+    if (!key) return -EINVAL;
+    if (timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0 || timeout->tv_usec >= 1000000)) return -EINVAL;
+
+    futex_bucket_t *bucket = futex_getBucket(key);
+    futex_waiter_t waiter = { .key = key, .thread = current_cpu->current_thread };
+
+    spinlock_acquire(&bucket->lock);
+
+    if (__atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != val) {
+        spinlock_release(&bucket->lock);
+        return -EAGAIN;
+    }
+
+    ilist_append(&bucket->waiters, &waiter.node);
+    if (timeout) {
+        if (sleep_untilTime(waiter.thread, timeout->tv_sec, timeout->tv_usec)) {
+            ilist_delete(&bucket->waiters, &waiter.node);
+            spinlock_release(&bucket->lock);
+            return -ENOMEM;
+        }
+    } else {
+        sleep_untilNever(waiter.thread);
+    }
+
+    spinlock_release(&bucket->lock);
+    process_yield(0);
+
+    // If we're still in the bucket nobody woke us up
+    long ret = 0;
+    spinlock_acquire(&bucket->lock);
+    if (ilist_linked(&waiter.node)) {
+        ilist_delete(&bucket->waiters, &waiter.node);
+        ret = -ETIMEDOUT;
+    }
+    spinlock_release(&bucket->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Wake up threads waiting on a futex word
+ * @param uaddr The futex word in the current address space
+ * @param count Maximum amount of threads to wake
+ * @returns The amount of threads woken, or -EINVAL
+ */
+long futex_wake(uint32_t *uaddr, uint32_t count) {
+    uintptr_t key = futex_getKey(uaddr);
+    if (!key) return -EINVAL;
+
+    futex_bucket_t *bucket = futex_getBucket(key);
+    long woken = 0;
+
+    spinlock_acquire(&bucket->lock);
+
+    ilist_node_t *node = bucket->waiters.head;
+    while (node && (uint32_t)woken < count) {
+        ilist_node_t *next = node->next;
+        futex_waiter_t *waiter = ilist_entry(node, futex_waiter_t, node);
+
+        if (waiter->key == key) {
+            ilist_delete(&bucket->waiters, node);
+            sleep_wakeup(waiter->thread);
+            woken++;
+        }
+
+        node = next;
+    }
+
+    spinlock_release(&bucket->lock);
+    return woken;
+}
@@ -16,6 +16,7 @@
 #include <kernel/loader/elf_loader.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/mem/mem.h>
+#include <kernel/mem/objcache.h>
 #include <kernel/fs/vfs.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
@@ -31,6 +32,10 @@
 /* Process tree */
 tree_t *process_tree = NULL;
 
+/* List of all processes */
+ilist_t process_list = { .name = "process list" };
+spinlock_t process_list_lock = { 0 };
+
 /* PID bitmap */
 uint32_t *pid_bitmap = NULL;
 
@@ -47,9 +52,16 @@ process_t *reaper_proc = NULL;
 /* Reaper function */
 void process_reaper(void *ctx);
 
-/* Helper macro to check if a process is in use */
+/* Process structure cache */
+static objcache_t *process_cache = NULL;
+
+/* Kernel stack cache */
+static objcache_t *kstack_cache = NULL;
+
+/* Helper macro to check if a process is in use (owned by a CPU, or its main thread is still in a run queue) */
 /* !!!: Can fail */
-#define PROCESS_IN_USE(proc)    ({ int in_use = 0; for (int i = 0; i < processor_count; i++) { if (processor_data[i].current_process == proc) { in_use = 1; break; } }; in_use; })
+#define PROCESS_IN_USE(proc)    ({ int in_use = (proc->main_thread && ilist_linked(&proc->main_thread->sched_node)); \
+                                    for (int i = 0; i < processor_count; i++) { if (processor_data[i].current_process == proc) { in_use = 1; break; } }; in_use; })
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "TASK:PROCESS", __VA_ARGS__)
@@ -86,12 +98,18 @@ void process_init() {
  * @warning Don't call this unless you know what you're doing. Use @c process_yield
  */
 void __attribute__((noreturn)) process_switchNextThread() {
+    // Only the idle thread is accounted for here - anything else coming through is exiting or has never run
+    thread_t *prev = current_cpu->current_thread;
+    if (!current_cpu->idle_process || prev != current_cpu->idle_process->main_thread) prev = NULL;
+
     // Get next thread in queue
     thread_t *next_thread = scheduler_get();
     if (!next_thread) {
         kernel_panic_extended(SCHEDULER_ERROR, "scheduler", "*** No thread was found in the scheduler (or something has been corrupted). Got thread %p.\n", next_thread);
     }
 
+    scheduler_accountSwitch(prev, next_thread, 0);
+
     // Update CPU variables
     current_cpu->current_thread = next_thread;
     current_cpu->current_process = next_thread->parent;
@@ -155,6 +173,9 @@ void process_yield(uint8_t reschedule) {
         kernel_panic_extended(SCHEDULER_ERROR, "scheduler", "*** No thread was found in the scheduler (or something has been corrupted). Got thread %p.\n", next_thread);
     }
 
+    // Only timer preemption yields with reschedule set, everything else is giving up the CPU
+    scheduler_accountSwitch(prev, next_thread, reschedule);
+
     // Update CPU variables
     current_cpu->current_thread = next_thread;
     current_cpu->current_process = next_thread->parent;
@@ -228,6 +249,50 @@ void process_freePID(pid_t pid) {
     pid_bitmap[bitmap_idx] &= ~(1 << (pid - bitmap_idx));
 }
 
+/**
+ * @brief Create a kernel stack for the kernel stack cache
+ * 
+ * Kernel stacks come with an unmapped guard page below them, so overflowing one faults
+ * instead of silently trampling whatever is below it. The object is the lowest mapped address.
+ */
+static void *process_createKernelStack(objcache_t *cache) {
+    uintptr_t guard = mem_allocate(0, PAGE_SIZE + PROCESS_KSTACK_SIZE, MEM_ALLOC_HEAP, MEM_PAGE_KERNEL);
+    if (!guard) return NULL;
+
+    // Unmap the guard page
+    mem_free(guard, PAGE_SIZE, MEM_DEFAULT);
+
+#ifdef __ARCH_I386__
+    // i386 doesn't invalidate on mem_free
+    asm volatile ("invlpg (%0)" :: "r"(guard) : "memory");
+
+    // !!!: very dirty hack
+    // !!!: sets pages in the stack to be global, meaning they won't be invalidated when the TLB flushes (mem_switchDirectory)
+    // !!!: this is bad. kernel allocations should be global in all directories. they are in i386, but stacks cant be handled by its current system.
+    for (uintptr_t i = guard + PAGE_SIZE; i < guard + PAGE_SIZE + PROCESS_KSTACK_SIZE; i += PAGE_SIZE) {
+        page_t *pg = mem_getPage(NULL, i, MEM_CREATE);
+        if (pg) pg->bits.global = 1;
+    }
+#endif
+
+    LOG(DEBUG, "New kernel stack %p - %p (guard page %p)\n", guard + PAGE_SIZE, guard + PAGE_SIZE + PROCESS_KSTACK_SIZE, guard);
+    return (void*)(guard + PAGE_SIZE);
+}
+
+/**
+ * @brief Create the process and kernel stack caches
+ * 
+ * This happens on the first process created, which is an idle task made before the other CPUs are started.
+ */
+static void process_initCaches() {
+    if (process_cache) return;
+
+    process_cache = objcache_create("process cache", sizeof(process_t), PROCESS_CACHE_MAX, NULL, NULL);
+
+    // The heap can't take the addresses of a stack back, so stacks are always kept for reuse
+    kstack_cache = objcache_create("kernel stack cache", PROCESS_KSTACK_SIZE, 0, process_createKernelStack, NULL);
+}
+
 /**
  * @brief Internal method to create a new process
  * @param parent The parent of the process
@@ -236,7 +301,14 @@ void process_freePID(pid_t pid) {
  * @param priority The priority of the process
  */
 static process_t *process_createStructure(process_t *parent, char *name, unsigned int flags, unsigned int priority) {
-    process_t *process = kmalloc(sizeof(process_t));
+    process_initCaches();
+
+    process_t *process = objcache_alloc(process_cache);
+    if (!process) {
+        kernel_panic_extended(OUT_OF_MEMORY, "process", "*** Could not allocate a process structure for process \"%s\"\n", name);
+        __builtin_unreachable();
+    }
+
     memset(process, 0, sizeof(process_t));
 
     // Setup some variables
@@ -246,6 +318,11 @@ static process_t *process_createStructure(process_t *parent, char *name, unsigne
     process->priority = priority;
     process->gid = process->uid = 0;
     process->pid = process_allocatePID();
+    ilist_init(&process->waitpid_queue, "waitpid queue");
+
+    spinlock_acquire(&process_list_lock);
+    ilist_append(&process_list, &process->list_node);
+    spinlock_release(&process_list_lock);
 
     // Create working directory
     if (parent && parent->wd_path) {
@@ -260,9 +337,17 @@ static process_t *process_createStructure(process_t *parent, char *name, unsigne
         process->node = tree_insert_child(process_tree, parent->node, (void*)process);
     }
 
-    // Create process' kernel stack
-    process->kstack = mem_allocate(0, PROCESS_KSTACK_SIZE, MEM_ALLOC_HEAP, MEM_PAGE_KERNEL) + PROCESS_KSTACK_SIZE;
-    dprintf(DEBUG, "Process '%s' has had its kstack %p allocated in page directory %p\n", name, process->kstack, current_cpu->current_dir);
+    // Inherit mappings, the directory is cloned with them
+    if (parent) vma_clone(&process->vmas, &parent->vmas);
+
+    // Get the process' kernel stack (before the directory is cloned, i386 copies the kernel tables into the clone)
+    void *kstack = objcache_alloc(kstack_cache);
+    if (!kstack) {
+        kernel_panic_extended(OUT_OF_MEMORY, "process", "*** Could not allocate a kernel stack for process \"%s\"\n", name);
+        __builtin_unreachable();
+    }
+
+    process->kstack = (uintptr_t)kstack + PROCESS_KSTACK_SIZE;
     
     // Make directory
     if (process->flags & PROCESS_KERNEL) {
@@ -292,16 +377,6 @@ static process_t *process_createStructure(process_t *parent, char *name, unsigne
         memset(process->fd_table->fds, 0, sizeof(fd_t*) * PROCESS_FD_BASE_AMOUNT);
     }
 
-#ifdef __ARCH_I386__
-    // !!!: very dirty hack
-    // !!!: resets pages in process->kstack to be global, meaning they won't be invalidated when the TLB flushes (mem_switchDirectory)
-    // !!!: this is bad. kernel allocations should be global in all directories. they are in i386, but stacks cant be handled by its current system.
-    for (uintptr_t i = (process->kstack - PROCESS_KSTACK_SIZE); i < process->kstack; i += PAGE_SIZE) {
-        page_t *pg = mem_getPage(NULL, i, MEM_CREATE);
-        if (pg) pg->bits.global = 1;
-    }
-#endif
-
     return process;
 }
 
@@ -373,12 +448,18 @@ void process_destroy(process_t *proc) {
     LOG(DEBUG, "Destroying process \"%s\"...\n", proc->name);
 
     // Destroy everything we can
-    if (proc->waitpid_queue) list_destroy(proc->waitpid_queue, false);
     fd_destroyTable(proc);
+    vma_destroy(&proc->vmas);
     mem_destroyVAS(proc->dir);
-    mem_free(proc->kstack - PROCESS_KSTACK_SIZE, PROCESS_KSTACK_SIZE, MEM_DEFAULT);
+    objcache_free(kstack_cache, (void*)(proc->kstack - PROCESS_KSTACK_SIZE));
     
     if (proc->thread_list) list_destroy(proc->thread_list, false);
+    if (proc->main_thread) thread_free(proc->main_thread);
+
+    spinlock_acquire(&process_list_lock);
+    ilist_delete(&process_list, &proc->list_node);
+    spinlock_release(&process_list_lock);
+
     if (proc->node) {
         tree_remove(process_tree, proc->node);
         kfree(proc->node);
@@ -386,7 +467,7 @@ void process_destroy(process_t *proc) {
 
     kfree(proc->wd_path);
     kfree(proc->name);
-    kfree(proc);
+    objcache_free(process_cache, proc);
 }
 
 /**
@@ -506,11 +587,13 @@ int process_execute(fs_node_t *file, int argc, char **argv, char **envp) {
     page_t *last_dir = current_cpu->current_process->dir;
     current_cpu->current_process->dir = mem_clone(NULL);
     mem_destroyVAS(last_dir);
+    vma_destroy(&current_cpu->current_process->vmas);
 
     // Switch to directory
     mem_switchDirectory(current_cpu->current_process->dir);
 
     // Create a new main thread with a blank entrypoint
+    thread_t *old_thread = current_cpu->current_process->main_thread;
     current_cpu->current_process->main_thread = thread_create(current_cpu->current_process, current_cpu->current_process->dir, 0x0, THREAD_FLAG_DEFAULT);
 
     // Load file into memory
@@ -530,11 +613,15 @@ int process_execute(fs_node_t *file, int argc, char **argv, char **envp) {
 
     // Get the entrypoint
     uintptr_t process_entrypoint = elf_getEntrypoint(elf_binary);
+    kfree((void*)elf_binary);
     arch_initialize_context(current_cpu->current_process->main_thread, process_entrypoint, current_cpu->current_process->main_thread->stack);
 
     // We own this process
     current_cpu->current_thread = current_cpu->current_process->main_thread;
 
+    // The old main thread isn't referenced by anything anymore
+    if (old_thread && !ilist_linked(&old_thread->sched_node)) thread_free(old_thread);
+
     // Now we need to start pushing argc, argv, and envp onto the thread stack
 
     // Calculate envc
@@ -623,6 +710,9 @@ void process_exit(process_t *process, int status_code) {
     // TODO: Ugly
     current_cpu->current_process->exit_status = status_code;
 
+    // Once the parent or the reaper knows, the thread can be gone before we switch away
+    if (is_current_process && current_cpu->current_thread) scheduler_accountExit(current_cpu->current_thread);
+
 
     // Instead of freeing all the memory now, we add ourselves to the reap queue
     // The reap queue is either destroyed by:
@@ -630,10 +720,10 @@ void process_exit(process_t *process, int status_code) {
     //      2. The parent process waiting for this process to exit (POSIX - should only happen during waitpid)
     
     // If our parent is waiting, wake them up
-    if (process->parent && process->parent->waitpid_queue && process->parent->waitpid_queue->length) {
+    if (process->parent && process->parent->waitpid_queue.length) {
         // TODO: Locking?
-        foreach(thr_node, process->parent->waitpid_queue) {
-            thread_t *thr = (thread_t*)thr_node->value;
+        ilist_foreach(thr_node, &process->parent->waitpid_queue) {
+            thread_t *thr = ilist_entry(thr_node, thread_t, wait_node);
             sleep_wakeup(thr);
         }
 
@@ -706,9 +796,10 @@ long process_waitpid(pid_t pid, int *wstatus, int options) {
             return -ECHILD;
         }
 
-        // Put ourselves in our wait queue
-        if (!current_cpu->current_process->waitpid_queue) current_cpu->current_process->waitpid_queue = list_create("waitpid queue");
-        list_append(current_cpu->current_process->waitpid_queue, (void*)current_cpu->current_thread);
+        // Put ourselves in our wait queue (we're still in it if we were woken up)
+        process_t *proc = current_cpu->current_process;
+        thread_t *thr = current_cpu->current_thread;
+        if (!ilist_linked(&thr->wait_node)) ilist_append(&proc->waitpid_queue, &thr->wait_node);
 
         // We need this to stop interferance from other threads also trying to waitpid
         spinlock_acquire(&reap_queue_lock);
@@ -717,7 +808,7 @@ long process_waitpid(pid_t pid, int *wstatus, int options) {
         if (!current_cpu->current_process->node->children || !current_cpu->current_process->node->children->length) {
             // There are no children available
             spinlock_release(&reap_queue_lock);
-            list_delete(current_cpu->current_process->waitpid_queue, list_find(current_cpu->current_process->waitpid_queue, (void*)current_cpu->current_thread));
+            ilist_delete(&proc->waitpid_queue, &thr->wait_node);
             return -ECHILD;
         }
    
@@ -756,8 +847,8 @@ long process_waitpid(pid_t pid, int *wstatus, int options) {
                 spinlock_release(&reap_queue_lock);
 
                 // Take us out and return
-                list_delete(current_cpu->current_process->waitpid_queue, list_find(current_cpu->current_process->waitpid_queue, (void*)current_cpu->current_thread));
-                return child->pid;
+                ilist_delete(&proc->waitpid_queue, &thr->wait_node);
+                return ret_pid;
             }
 
             // TODO: Look for continued, interrupted, etc
@@ -768,7 +859,7 @@ long process_waitpid(pid_t pid, int *wstatus, int options) {
         // There were children available but they didn't seem important
         if (options & WNOHANG) {
             // Return immediately, we didn't get anything.
-            list_delete(current_cpu->current_process->waitpid_queue, list_find(current_cpu->current_process->waitpid_queue, (void*)current_cpu->current_thread));
+            ilist_delete(&proc->waitpid_queue, &thr->wait_node);
             return 0;
         } else {
             // Sleep until we get woken up
@@ -776,4 +867,4 @@ long process_waitpid(pid_t pid, int *wstatus, int options) {
             process_yield(0);
         }
     }
-}
\ No newline at end of file
+}
@@ -3,6 +3,16 @@
  * @brief Task scheduler for Hexahedron
  * 
  * Implements a priority-based round robin scheduling algorithm
+ * using per-CPU run queues. Idle cores steal work from busy ones.
+ * 
+ * Each CPU has one queue per priority and a bitmap of the non-empty ones,
+ * so picking the next thread is a single bit scan. Threads that sit in a queue
+ * for longer than SCHEDULER_AGING_TICKS are picked before higher priorities
+ * so they can't starve.
+ * 
+ * Run time, run queue wait time and latency are accounted per thread and per process
+ * from clock timestamps, and wakeups, switches and migrations go into a trace ring.
+ * Both are readable from /kernel/scheduler and /kernel/schedtrace.
  * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
@@ -16,9 +26,11 @@
 #include <kernel/task/scheduler.h>
 #include <kernel/misc/spinlock.h>
 #include <kernel/drivers/clock.h>
+#include <kernel/fs/kernelfs.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
 #include <kernel/panic.h>
+#include <string.h>
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "TASK:SCHED", __VA_ARGS__)
@@ -30,25 +42,51 @@ time_t scheduler_timeslices[] = {
     [PRIORITY_LOW] = 3,
 };
 
-/* Thread queue */
-list_t *thread_queue = NULL;
+/* Minimum amount of queued threads another CPU must have before we steal from it */
+#define SCHEDULER_STEAL_THRESHOLD   1
+
+/* Get the run queue a thread belongs in */
+#define SCHEDULER_PRIORITY(thread) (((thread)->parent->priority >= PRIORITY_LOW && (thread)->parent->priority <= PRIORITY_HIGH) ? (int)(thread)->parent->priority : PRIORITY_LOW)
 
-/* Scheduler lock */
-spinlock_t scheduler_lock = { 0 };
+/* Scheduler initialized */
+static int scheduler_initialized = 0;
+
+/* Scheduler trace ring */
+static scheduler_trace_event_t scheduler_trace_ring[SCHEDULER_TRACE_SIZE];
+static volatile size_t scheduler_trace_head = 0;
+
+/* Trace event names */
+static char *scheduler_event_names[] = {
+    [SCHEDULER_EVENT_WAKEUP] = "WAKEUP",
+    [SCHEDULER_EVENT_SWITCH] = "SWITCH",
+    [SCHEDULER_EVENT_MIGRATE] = "MIGRATE",
+};
 
 
 /**
  * @brief Scheduler tick method, called every update
  */
 int scheduler_update(uint64_t ticks) {
+    return scheduler_updateElapsed(ticks, 1);
+}
+
+/**
+ * @brief Scheduler tick method for timers that don't fire every tick
+ * @param ticks Current clock ticks
+ * @param elapsed The amount of scheduler ticks that passed since the last update
+ * @returns 1 if the current thread is out of its timeslice
+ */
+int scheduler_updateElapsed(uint64_t ticks, unsigned int elapsed) {
+    current_cpu->run_queue_ticks += elapsed;
+
     // Update the current process' time
     if (!current_cpu->current_thread) {
         return 0; // Before a process was initialized
     }
 
-    current_cpu->current_thread->total_ticks = clock_getTickCount();
+    current_cpu->current_thread->total_ticks += elapsed;
 
-    current_cpu->current_thread->preempt_ticks--;
+    current_cpu->current_thread->preempt_ticks -= elapsed;
     if (current_cpu->current_thread->preempt_ticks <= 0) {
         // Get out of here, you're out of your timeslice
         scheduler_reschedule();
@@ -58,14 +96,245 @@ int scheduler_update(uint64_t ticks) {
     return 0;
 }
 
+/**
+ * @brief Record an event in the scheduler trace
+ * @param event The event type (SCHEDULER_EVENT_...)
+ * @param thread The thread the event is about
+ * @param arg Event-specific argument
+ */
+void scheduler_trace(int event, thread_t *thread, long arg) {
+    size_t idx = __atomic_fetch_add(&scheduler_trace_head, 1, __ATOMIC_RELAXED) % SCHEDULER_TRACE_SIZE;
+    scheduler_trace_event_t *ev = &scheduler_trace_ring[idx];
+
+    ev->timestamp = clock_getTimestamp();
+    ev->cpu = current_cpu->cpu_id;
+    ev->event = event;
+    ev->pid = (thread && thread->parent) ? thread->parent->pid : -1;
+    ev->thread = thread;
+    ev->arg = arg;
+}
+
+/**
+ * @brief Account for a context switch
+ * @param prev The thread being switched away from, or NULL
+ * @param next The thread being switched to
+ * @param involuntary Whether @c prev was preempted rather than giving up the CPU
+ */
+void scheduler_accountSwitch(thread_t *prev, thread_t *next, int involuntary) {
+    uint64_t now = clock_getTimestamp();
+
+    if (prev) {
+        uint64_t ran = now - prev->stamp;
+        prev->run_time += ran;
+        prev->parent->run_time += ran;
+        prev->stamp = now;
+
+        // The idle thread bouncing back to itself isn't a switch
+        if (prev == next) return;
+
+        if (involuntary) {
+            prev->involuntary_switches++;
+            prev->parent->involuntary_switches++;
+        } else {
+            prev->voluntary_switches++;
+            prev->parent->voluntary_switches++;
+        }
+    }
+
+    next->stamp = now;
+    scheduler_trace(SCHEDULER_EVENT_SWITCH, next, prev ? prev->parent->pid : -1);
+}
+
+/**
+ * @brief Account for the last time slice of an exiting thread
+ * @param thread The thread, still running on this CPU
+ * @note @c process_switchNextThread doesn't touch exiting threads, call this before the thread can be reaped
+ */
+void scheduler_accountExit(thread_t *thread) {
+    uint64_t now = clock_getTimestamp();
+    uint64_t ran = now - thread->stamp;
+    thread->run_time += ran;
+    thread->parent->run_time += ran;
+    thread->stamp = now;
+}
+
+/**
+ * @brief One line of /kernel/scheduler, copied out under the process list lock
+ */
+typedef struct scheduler_stat {
+    thread_t *thread;           // Thread of the line (only printed), NULL for a process line
+    pid_t pid;                  // PID of the process
+    char name[32];              // Name of the process
+    int cpu;                    // CPU the thread last ran on
+    uint64_t run_time;          // Time spent running
+    uint64_t wait_time;         // Time spent in a run queue
+    uint64_t max_latency;       // Longest run queue latency
+    size_t voluntary;           // Voluntary switches
+    size_t involuntary;         // Involuntary switches
+    long ticks;                 // Ticks of the thread
+} scheduler_stat_t;
+
+/**
+ * @brief Copy the accounting of one thread (process list lock held)
+ */
+static void scheduler_snapshotThread(scheduler_stat_t *stat, thread_t *thread) {
+    stat->thread = thread;
+    stat->cpu = thread->cpu;
+    stat->run_time = thread->run_time;
+    stat->wait_time = thread->wait_time;
+    stat->max_latency = thread->max_latency;
+    stat->voluntary = thread->voluntary_switches;
+    stat->involuntary = thread->involuntary_switches;
+    stat->ticks = (long)thread->total_ticks;
+}
+
+/**
+ * @brief Copy the accounting of every process and thread
+ * @param stats Where to copy it to
+ * @param max How many lines fit in @p stats
+ * @returns The amount of lines copied
+ */
+static size_t scheduler_snapshot(scheduler_stat_t *stats, size_t max) {
+    size_t count = 0;
+
+    spinlock_acquire(&process_list_lock);
+
+    ilist_foreach(node, &process_list) {
+        process_t *proc = ilist_entry(node, process_t, list_node);
+        if (count >= max) break;
+
+        scheduler_stat_t *stat = &stats[count++];
+        memset(stat, 0, sizeof(scheduler_stat_t));
+        stat->pid = proc->pid;
+        if (proc->name) strncpy(stat->name, proc->name, sizeof(stat->name) - 1);
+        stat->run_time = proc->run_time;
+        stat->wait_time = proc->wait_time;
+        stat->max_latency = proc->max_latency;
+        stat->voluntary = proc->voluntary_switches;
+        stat->involuntary = proc->involuntary_switches;
+
+        if (proc->main_thread && count < max) scheduler_snapshotThread(&stats[count++], proc->main_thread);
+        if (proc->thread_list) {
+            foreach(thread_node, proc->thread_list) {
+                thread_t *thread = (thread_t*)thread_node->value;
+                if (thread && thread != proc->main_thread && count < max) scheduler_snapshotThread(&stats[count++], thread);
+            }
+        }
+    }
+
+    spinlock_release(&process_list_lock);
+    return count;
+}
+
+/**
+ * @brief Count the lines of /kernel/scheduler
+ */
+static size_t scheduler_countStats() {
+    size_t count = 0;
+
+    spinlock_acquire(&process_list_lock);
+    ilist_foreach(node, &process_list) {
+        process_t *proc = ilist_entry(node, process_t, list_node);
+        count += 2 + (proc->thread_list ? proc->thread_list->length : 0);
+    }
+    spinlock_release(&process_list_lock);
+
+    return count;
+}
+
+/**
+ * @brief Generate /kernel/scheduler
+ */
+static int scheduler_getStats(kernelfs_entry_t *entry, void *data) {
+    kernelfs_appendData(entry, "# times in microseconds\n");
+
+    for (int i = 0; i < processor_count; i++) {
+        processor_t *cpu = &processor_data[i];
+        kernelfs_appendData(entry, "CPU%d: queued %zu current %d\n", i, cpu->run_queue_count, cpu->current_process ? cpu->current_process->pid : -1);
+    }
+
+    // Copy everything out first, appending reallocates and can't happen under the process list lock
+    // Processes created in between are left out
+    size_t max = scheduler_countStats();
+    scheduler_stat_t *stats = kmalloc(max * sizeof(scheduler_stat_t));
+    size_t count = scheduler_snapshot(stats, max);
+
+    for (size_t i = 0; i < count; i++) {
+        scheduler_stat_t *stat = &stats[i];
+        if (stat->thread) {
+            kernelfs_appendData(entry, "\tthread %p: cpu %d run %llu wait %llu max_latency %llu voluntary %zu involuntary %zu ticks %ld\n",
+                                stat->thread, stat->cpu, stat->run_time, stat->wait_time, stat->max_latency,
+                                stat->voluntary, stat->involuntary, stat->ticks);
+        } else {
+            kernelfs_appendData(entry, "%d %s: run %llu wait %llu max_latency %llu voluntary %zu involuntary %zu\n",
+                                stat->pid, stat->name, stat->run_time, stat->wait_time, stat->max_latency,
+                                stat->voluntary, stat->involuntary);
+        }
+    }
+
+    kfree(stats);
+    return 0;
+}
+
+/**
+ * @brief Generate /kernel/schedtrace
+ */
+static int scheduler_getTrace(kernelfs_entry_t *entry, void *data) {
+    size_t head = scheduler_trace_head;
+    size_t count = (head < SCHEDULER_TRACE_SIZE) ? head : SCHEDULER_TRACE_SIZE;
+
+    // Oldest first
+    for (size_t i = head - count; i < head; i++) {
+        scheduler_trace_event_t *ev = &scheduler_trace_ring[i % SCHEDULER_TRACE_SIZE];
+        kernelfs_appendData(entry, "%llu CPU%d %s pid %d thread %p arg %ld\n",
+                            ev->timestamp, ev->cpu, scheduler_event_names[ev->event], ev->pid, ev->thread, ev->arg);
+    }
+
+    return 0;
+}
+
 /**
  * @brief Initialize the scheduler
+ * 
+ * Each CPU gets its own run queue. Cores will only touch another core's queue when
+ * inserting a new thread or when they run dry and need to steal work.
  */
 void scheduler_init() {
-    thread_queue = list_create("thread queue");
-    LOG(INFO, "Scheduler initialized\n");
+    for (int i = 0; i < processor_count; i++) {
+        for (int prio = PRIORITY_LOW; prio < SCHEDULER_PRIORITY_LEVELS; prio++) {
+            ilist_init(&processor_data[i].run_queue[prio], "run queue");
+        }
+
+        processor_data[i].run_queue_lock = spinlock_create("run queue lock");
+    }
+
+    kernelfs_createEntry("scheduler", scheduler_getStats, NULL);
+    kernelfs_createEntry("schedtrace", scheduler_getTrace, NULL);
+
+    scheduler_initialized = 1;
+    LOG(INFO, "Scheduler initialized with %i run queues\n", processor_count);
 }
 
+/**
+ * @brief Pick the CPU a thread should be queued on
+ * @param thread The thread being queued
+ * 
+ * Threads go back to the CPU they last ran on so they can keep their cache warm.
+ * New threads are given to the CPU with the shortest queue.
+ */
+static processor_t *scheduler_pickCPU(thread_t *thread) {
+    if (thread->cpu >= 0 && thread->cpu < processor_count && processor_data[thread->cpu].run_queue_lock) {
+        return &processor_data[thread->cpu];
+    }
+
+    processor_t *target = &processor_data[current_cpu->cpu_id];
+    for (int i = 0; i < processor_count; i++) {
+        if (!processor_data[i].run_queue_lock) continue;
+        if (processor_data[i].run_queue_count < target->run_queue_count) target = &processor_data[i];
+    }
+
+    return target;
+}
 
 /**
  * @brief Queue in a new thread
@@ -73,13 +342,25 @@ void scheduler_init() {
  * @returns 0 on success
  */
 int scheduler_insertThread(thread_t *thread) {
-    if (!thread || !thread_queue) return -1;
-
-    spinlock_acquire(&scheduler_lock);
-    list_append(thread_queue, (void*)thread);
-    spinlock_release(&scheduler_lock);
+    if (!thread || !scheduler_initialized) return -1;
+
+    processor_t *cpu = scheduler_pickCPU(thread);
+    int prio = SCHEDULER_PRIORITY(thread);
+
+    spinlock_acquire(cpu->run_queue_lock);
+    thread->queue_ticks = cpu->run_queue_ticks;
+    thread->stamp = clock_getTimestamp();
+    ilist_append(&cpu->run_queue[prio], &thread->sched_node);
+    cpu->run_queue_bitmap |= (1 << prio);
+    cpu->run_queue_count++;
+    spinlock_release(cpu->run_queue_lock);
+
+    // If the CPU is idling it might not have a timer coming for a while
+    if (cpu->cpu_id != current_cpu->cpu_id && cpu->current_process == cpu->idle_process) {
+        arch_wakeup_cpu(cpu->cpu_id);
+    }
 
-    // LOG(INFO, "Inserted thread %p for process '%s' (priority: %d)\n", thread, thread->parent->name, thread->parent->priority);
+    // LOG(INFO, "Inserted thread %p for process '%s' (priority: %d) on CPU%d\n", thread, thread->parent->name, thread->parent->priority, cpu->cpu_id);
     return 0;
 }
 
@@ -89,23 +370,33 @@ int scheduler_insertThread(thread_t *thread) {
  * @returns 0 on success
  */
 int scheduler_removeThread(thread_t *thread) {
-    if (!thread) return -1;
-
-    spinlock_acquire(&scheduler_lock);
-    node_t *thread_node = list_find(thread_queue, thread);
+    if (!thread || !scheduler_initialized) return -1;
+
+    // The thread could have been stolen, so check every queue
+    for (int i = 0; i < processor_count; i++) {
+        processor_t *cpu = &processor_data[i];
+        if (!cpu->run_queue_lock) continue;
+
+        spinlock_acquire(cpu->run_queue_lock);
+
+        // The priority can change while the thread is queued, so go by the queue it is actually in
+        ilist_t *queue = thread->sched_node.owner;
+        if (queue >= &cpu->run_queue[0] && queue < &cpu->run_queue[SCHEDULER_PRIORITY_LEVELS]) {
+            int prio = queue - cpu->run_queue;
+            ilist_delete(queue, &thread->sched_node);
+            if (!cpu->run_queue[prio].length) cpu->run_queue_bitmap &= ~(1 << prio);
+            cpu->run_queue_count--;
+            spinlock_release(cpu->run_queue_lock);
+
+            LOG(INFO, "Removed thread %p for process '%s' (priority: %d)\n", thread, thread->parent->name, thread->parent->priority);
+            return 0;
+        }
 
-    if (!thread_node) {
-        LOG(WARN, "Could not delete thread %p (process '%s') because it was not found in the queue\n", thread, thread->parent->name);
-        spinlock_release(&scheduler_lock);
-        return -1;
+        spinlock_release(cpu->run_queue_lock);
     }
 
-    list_delete(thread_queue, thread_node);
-    kfree(thread_node); // Node structure is useless
-    spinlock_release(&scheduler_lock);
-
-    LOG(INFO, "Removed thread %p for process '%s' (priority: %d)\n", thread, thread->parent->name, thread->parent->priority);
-    return 0;
+    LOG(WARN, "Could not delete thread %p (process '%s') because it was not found in any queue\n", thread, thread->parent->name);
+    return -1;
 }
 
 /**
@@ -119,65 +410,57 @@ void scheduler_reschedule() {
 
     // If the current thread is still running, we can append it to the back of the queue
     if (current_cpu->current_thread->status & THREAD_STATUS_RUNNING) {
-        spinlock_acquire(&scheduler_lock);
         // Get the thread's timeslice
         current_cpu->current_thread->preempt_ticks = scheduler_timeslices[current_cpu->current_thread->parent->priority];
-
-        spinlock_release(&scheduler_lock);
     }
 }
 
 /**
- * @brief Get the next thread to switch to
- * @returns A pointer to the next thread
+ * @brief Pick the queue to pop the next thread from
+ * @param cpu The CPU to pick from (run queue lock held)
+ * @returns The priority of the queue to use, or 0 if all are empty
  */
-thread_t *scheduler_get() {
-    // Is this core fit to schedule?
-    if (current_cpu->idle_process == NULL || current_cpu->idle_process->main_thread == NULL) {
-        // Huh
-        kernel_panic_extended(UNSUPPORTED_FUNCTION_ERROR, "scheduler", "*** Tried to switch tasks with no queue and no idle task\n");
+static int scheduler_pickQueue(processor_t *cpu) {
+    if (!cpu->run_queue_bitmap) return 0;
+
+    // Highest non-empty priority
+    int prio = 31 - __builtin_clz(cpu->run_queue_bitmap);
+
+    // Has anything below it waited too long? Lowest priorities have waited the longest, so check them first.
+    uint32_t lower = cpu->run_queue_bitmap & ((1 << prio) - 1);
+    while (lower) {
+        int low_prio = __builtin_ctz(lower);
+        thread_t *waiting = ilist_entry(cpu->run_queue[low_prio].head, thread_t, sched_node);
+        if (cpu->run_queue_ticks - waiting->queue_ticks >= SCHEDULER_AGING_TICKS) return low_prio;
+        lower &= ~(1 << low_prio);
     }
 
-    // Get lock
-    spinlock_acquire(&scheduler_lock);
-
-    // Is there a queue and does it have a head?
-    if (!thread_queue || !thread_queue->head) {
-        // Release lock
-        spinlock_release(&scheduler_lock);
-
+    return prio;
+}
 
-        // No thread queue. This likely means a core entered the switcher before scheduling initialized, which is fine.
-        // We just need to return the kernel idle task's thread
-        return current_cpu->idle_process->main_thread;
-    }
-    
-    node_t *thread_node;
-    thread_t *thread;
-
-    do {
-        // Pop the next thread off the list
-        thread_node = list_popleft(thread_queue);
-    
-        // Did that work?
-        if (!thread_node || !thread_node->value) {
-            // Normally this would be fatal, but it just in fact means we've cleared our queue of all running processes
-            // This is supposed to be fatal (no init process), but other parts of the code will catch this.
-            // Else, guess it just freezes. Who knows!
-            return current_cpu->idle_process->main_thread;
-        }
+/**
+ * @brief Pop the next runnable thread off of a CPU's run queue
+ * @param cpu The CPU to pop from
+ * @returns A thread or NULL if the queue is empty
+ */
+static thread_t *scheduler_popThread(processor_t *cpu) {
+    spinlock_acquire(cpu->run_queue_lock);
 
-        // Get thread and free node
-        thread = (thread_t*)(thread_node->value);
+    thread_t *thread = NULL;
+    int prio;
 
-        // Now free the node
-        kfree(thread_node);
+    while ((prio = scheduler_pickQueue(cpu)) != 0) {
+        // Get thread
+        thread = ilist_entry(ilist_popleft(&cpu->run_queue[prio]), thread_t, sched_node);
+        if (!cpu->run_queue[prio].length) cpu->run_queue_bitmap &= ~(1 << prio);
+        cpu->run_queue_count--;
 
         if (thread->status & THREAD_STATUS_STOPPING) {
             // Update status to be STOPPED
-            LOG(INFO, "Thread %p was caught in the scheduler and has been shutdown\n");
+            LOG(INFO, "Thread %p was caught in the scheduler and has been shutdown\n", thread);
             __sync_or_and_fetch(&thread->status, THREAD_STATUS_STOPPED);
             thread_destroy(thread);
+            thread = NULL;
             continue;
         }
 
@@ -186,12 +469,80 @@ thread_t *scheduler_get() {
         }
 
         break;
-    } while (1);
-    
+    }
+
+    spinlock_release(cpu->run_queue_lock);
+    return thread;
+}
+
+/**
+ * @brief Try to steal a thread from the busiest CPU
+ * 
+ * This is only done when our own queue is empty, since otherwise the thread loses its
+ * warm cache for nothing.
+ * 
+ * @returns A stolen thread or NULL
+ */
+static thread_t *scheduler_steal() {
+    processor_t *victim = NULL;
+    size_t victim_length = SCHEDULER_STEAL_THRESHOLD - 1;
+
+    // Lockless peek - a stale length only means we pick a slightly worse victim
+    for (int i = 0; i < processor_count; i++) {
+        if (i == current_cpu->cpu_id || !processor_data[i].run_queue_lock) continue;
+
+        size_t length = processor_data[i].run_queue_count;
+        if (length > victim_length) {
+            victim = &processor_data[i];
+            victim_length = length;
+        }
+    }
+
+    if (!victim) return NULL;
+    return scheduler_popThread(victim);
+}
+
+/**
+ * @brief Get the next thread to switch to
+ * @returns A pointer to the next thread
+ */
+thread_t *scheduler_get() {
+    // Is this core fit to schedule?
+    if (current_cpu->idle_process == NULL || current_cpu->idle_process->main_thread == NULL) {
+        // Huh
+        kernel_panic_extended(UNSUPPORTED_FUNCTION_ERROR, "scheduler", "*** Tried to switch tasks with no queue and no idle task\n");
+    }
 
-    // Unlock
-    spinlock_release(&scheduler_lock);
+    // Is there a queue for us?
+    if (!scheduler_initialized || !current_cpu->run_queue_lock) {
+        // No run queue. This likely means a core entered the switcher before scheduling initialized, which is fine.
+        // We just need to return the kernel idle task's thread
+        return current_cpu->idle_process->main_thread;
+    }
+
+    // Try our own queue first, then see if anyone else has work for us
+    thread_t *thread = scheduler_popThread(&processor_data[current_cpu->cpu_id]);
+    if (!thread) thread = scheduler_steal();
+
+    if (!thread) {
+        // Nothing to do, idle until something comes in
+        return current_cpu->idle_process->main_thread;
+    }
+
+    // Account for the time spent waiting
+    uint64_t now = clock_getTimestamp();
+    uint64_t latency = now - thread->stamp;
+    thread->wait_time += latency;
+    thread->parent->wait_time += latency;
+    if (latency > thread->max_latency) thread->max_latency = latency;
+    if (latency > thread->parent->max_latency) thread->parent->max_latency = latency;
+    thread->stamp = now;
+
+    if (thread->cpu >= 0 && thread->cpu != current_cpu->cpu_id) {
+        scheduler_trace(SCHEDULER_EVENT_MIGRATE, thread, thread->cpu);
+    }
 
-    // Return it
+    // This is now the CPU with the warm cache
+    thread->cpu = current_cpu->cpu_id;
     return thread;
-}
\ No newline at end of file
+}
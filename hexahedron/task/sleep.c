@@ -2,6 +2,10 @@
  * @file hexahedron/task/sleep.c
  * @brief Thread blocker/sleeper handler
  * 
+ * Timed sleepers are kept in a min-heap ordered by deadline, so each tick only has to
+ * look at the top of the heap. Conditional sleepers sit in a sleep queue and are only
+ * rechecked when someone calls @c sleep_wakeupQueue on it. Wakeups are deferred to the
+ * next tick so the thread has time to switch away before it can be rescheduled.
  * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
@@ -15,89 +19,239 @@
 #include <kernel/drivers/clock.h>
 #include <kernel/task/sleep.h>
 #include <kernel/mem/alloc.h>
-#include <structs/list.h>
+#include <structs/ilist.h>
+#include <kernel/arch/arch.h>
 #include <kernel/debug.h>
 #include <string.h>
 
-/* Sleeping queue */
-list_t *sleep_queue = NULL;
+/* Initial capacity of the deadline heap */
+#define SLEEP_HEAP_INITIAL_CAPACITY     32
 
-/* Sleep queue lock */
-spinlock_t sleep_queue_lock = { 0 };
+/* Deadline heap */
+static thread_sleep_t **sleep_heap = NULL;
+static size_t sleep_heap_size = 0;
+static size_t sleep_heap_capacity = 0;
+
+/* Earliest deadline in the heap, checked without the lock */
+static volatile uint64_t sleep_next_deadline = UINT64_MAX;
+
+/* Threads waiting to be woken up on the next tick */
+static ilist_t sleep_wakeup_queue = { .name = "thread wakeup queue" };
+
+/* Sleep lock */
+spinlock_t sleep_lock = { 0 };
+
+/* Queues are woken from IRQ handlers (and the clock), so the sleep lock is always taken with interrupts off */
+#define SLEEP_LOCK() uintptr_t sleep_flags = arch_disable_interrupts(); spinlock_acquire(&sleep_lock)
+#define SLEEP_UNLOCK() spinlock_release(&sleep_lock); arch_restore_interrupts(sleep_flags)
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "TASK:SLEEP", __VA_ARGS__)
 
+/* Convert seconds and subseconds to a heap key */
+#define SLEEP_DEADLINE(seconds, subseconds) (((uint64_t)(seconds) * SUBSECONDS_PER_SECOND) + (subseconds))
+
+/**
+ * @brief Swap two entries in the deadline heap
+ */
+static inline void sleep_heapSwap(size_t a, size_t b) {
+    thread_sleep_t *tmp = sleep_heap[a];
+    sleep_heap[a] = sleep_heap[b];
+    sleep_heap[b] = tmp;
+    sleep_heap[a]->heap_index = a;
+    sleep_heap[b]->heap_index = b;
+}
+
+/**
+ * @brief Move a heap entry up until its parent expires before it
+ */
+static void sleep_heapUp(size_t idx) {
+    while (idx > 0) {
+        size_t parent = (idx - 1) / 2;
+        if (sleep_heap[parent]->deadline <= sleep_heap[idx]->deadline) break;
+        sleep_heapSwap(idx, parent);
+        idx = parent;
+    }
+}
+
+/**
+ * @brief Move a heap entry down until both children expire after it
+ */
+static void sleep_heapDown(size_t idx) {
+    while (1) {
+        size_t smallest = idx;
+        size_t left = idx * 2 + 1;
+        size_t right = idx * 2 + 2;
+
+        if (left < sleep_heap_size && sleep_heap[left]->deadline < sleep_heap[smallest]->deadline) smallest = left;
+        if (right < sleep_heap_size && sleep_heap[right]->deadline < sleep_heap[smallest]->deadline) smallest = right;
+        if (smallest == idx) break;
+
+        sleep_heapSwap(idx, smallest);
+        idx = smallest;
+    }
+}
+
+/**
+ * @brief Insert a sleeper into the deadline heap
+ * @returns 0 on success, 1 if the heap is full and could not be grown
+ */
+static int sleep_heapInsert(thread_sleep_t *sleep) {
+    thread_sleep_t **grown = NULL;
+    thread_sleep_t **old = NULL;
+    size_t grown_capacity = 0;
+
+    SLEEP_LOCK();
+
+    while (sleep_heap_size >= sleep_heap_capacity) {
+        if (grown && grown_capacity > sleep_heap_size) {
+            memcpy(grown, sleep_heap, sleep_heap_size * sizeof(thread_sleep_t*));
+            old = sleep_heap;
+            sleep_heap = grown;
+            sleep_heap_capacity = grown_capacity;
+            grown = NULL;
+            break;
+        }
+
+        // The allocator can't be called with the sleep lock held and interrupts off, so grow the heap
+        // without it and check again (someone else may have grown or filled it in the meantime)
+        grown_capacity = sleep_heap_capacity ? sleep_heap_capacity * 2 : SLEEP_HEAP_INITIAL_CAPACITY;
+        SLEEP_UNLOCK();
+
+        if (grown) kfree(grown);
+        grown = kmalloc(grown_capacity * sizeof(thread_sleep_t*));
+        if (!grown) {
+            LOG(ERR, "Could not grow the deadline heap to %d sleepers\n", grown_capacity);
+            return 1;
+        }
+
+        sleep_flags = arch_disable_interrupts();
+        spinlock_acquire(&sleep_lock);
+    }
+
+    sleep->heap_index = sleep_heap_size;
+    sleep_heap[sleep_heap_size++] = sleep;
+    sleep_heapUp(sleep->heap_index);
+
+    sleep_next_deadline = sleep_heap[0]->deadline;
+
+    SLEEP_UNLOCK();
+
+    if (old) kfree(old);
+    if (grown) kfree(grown);
+    return 0;
+}
+
+/**
+ * @brief Remove a sleeper from the deadline heap (sleep lock held)
+ */
+static void sleep_heapRemove(thread_sleep_t *sleep) {
+    size_t idx = sleep->heap_index;
+    sleep_heap_size--;
+
+    if (idx != sleep_heap_size) {
+        sleep_heap[idx] = sleep_heap[sleep_heap_size];
+        sleep_heap[idx]->heap_index = idx;
+        sleep_heapUp(idx);
+        sleep_heapDown(sleep_heap[idx]->heap_index);
+    }
+
+    sleep_next_deadline = sleep_heap_size ? sleep_heap[0]->deadline : UINT64_MAX;
+}
+
+/**
+ * @brief Finish waking up a sleeping thread (sleep lock held)
+ * @param sleep The sleeper to wakeup
+ */
+static void sleep_finishWakeup(thread_sleep_t *sleep) {
+    __sync_and_and_fetch(&sleep->thread->status, ~(THREAD_STATUS_SLEEPING));
+    sleep->thread->sleep = NULL;
+    scheduler_trace(SCHEDULER_EVENT_WAKEUP, sleep->thread, sleep->thread->cpu);
+    scheduler_insertThread(sleep->thread);
+}
+
+/**
+ * @brief Move a sleeper to the wakeup queue, pulling it out of whatever it was sleeping in (sleep lock held)
+ * @param sleep The sleeper to wakeup
+ */
+static void sleep_queueWakeup(thread_sleep_t *sleep) {
+    if (sleep->sleep_state == SLEEP_FLAG_WAKEUP) return; // Already queued
+
+    if (sleep->sleep_state == SLEEP_FLAG_TIME) {
+        sleep_heapRemove(sleep);
+    } else if (sleep->sleep_state == SLEEP_FLAG_COND && sleep->queue) {
+        ilist_delete(&sleep->queue->sleepers, &sleep->node);
+        sleep->queue = NULL;
+    }
+
+    sleep->sleep_state = SLEEP_FLAG_WAKEUP;
+    ilist_append(&sleep_wakeup_queue, &sleep->node);
+}
+
 /**
  * @brief Wakeup sleepers callback
  * @param ticks Current clock ticks
  */
 static void sleep_callback(uint64_t ticks) {
-    if (!sleep_queue) return;
-
-    // Get time for any threads that need it
-    unsigned long seconds, subseconds;
-    clock_getCurrentTime(&seconds, &subseconds);
-    
-    spinlock_acquire(&sleep_queue_lock);
-    foreach(node, sleep_queue) {
-        thread_sleep_t *sleep = (thread_sleep_t*)node->value;
-        if (!sleep || !sleep->thread) {
-            LOG(WARN, "Corrupt node in sleep queue %p\n", node);
+    // Get time only if there's someone who needs it
+    unsigned long seconds = 0, subseconds = 0;
+    if (sleep_next_deadline != UINT64_MAX) clock_getCurrentTime(&seconds, &subseconds);
+    uint64_t now = SLEEP_DEADLINE(seconds, subseconds);
+
+    // Nothing to do?
+    if (!sleep_wakeup_queue.length && sleep_next_deadline > now) return;
+
+    SLEEP_LOCK();
+
+    // Handle explicit wakeups
+    ilist_node_t *node;
+    while ((node = ilist_popleft(&sleep_wakeup_queue)) != NULL) {
+        thread_sleep_t *sleep = ilist_entry(node, thread_sleep_t, node);
+        if (!sleep->thread) {
+            LOG(WARN, "Corrupt node in wakeup queue %p\n", node);
             continue;
         }
 
-        int wakeup = 0;
-
-        if (sleep->sleep_state == SLEEP_FLAG_NOCOND) {
-            continue; // Thread doesn't need to wakeup
-        } else if (sleep->sleep_state == SLEEP_FLAG_TIME) {
-            // We're sleeping on time.
-            if ((sleep->seconds == seconds && sleep->subseconds <= subseconds) || (sleep->seconds < seconds)) {
-                // Wakeup now
-                LOG(DEBUG, "WAKEUP: Time passed, waking up thread %p\n", sleep->thread);
-                wakeup = 1;
-            }
-        } else if (sleep->sleep_state == SLEEP_FLAG_COND) {
-            if (!sleep->condition) {
-                LOG(WARN, "Corrupt node in sleep queue has SLEEP_FLAG_COND but has no condition (sleep state %p, thread %p)\n", sleep, sleep->thread);
-                continue;
-            }
-
-            if (sleep->condition(sleep->thread, sleep->context)) {
-                LOG(DEBUG, "WAKEUP: Condition success, waking up thread %p\n", sleep->thread);
-                wakeup = 1;
-            }
-        } else if (sleep->sleep_state == SLEEP_FLAG_WAKEUP) {
-            // Immediately wakeup
-            LOG(DEBUG, "WAKEUP: Immediately waking up thread %p\n", sleep->thread);
-            wakeup = 1;
-        }
+        LOG(DEBUG, "WAKEUP: Immediately waking up thread %p\n", sleep->thread);
+        sleep_finishWakeup(sleep);
+    }
 
-        if (wakeup) {
-            // Ready to wake up
-            list_delete(sleep_queue, node);
-            
-            __sync_and_and_fetch(&sleep->thread->status, ~(THREAD_STATUS_SLEEPING));
-            scheduler_insertThread(sleep->thread);
-            sleep->thread->sleep = NULL;
+    // Handle expired deadlines
+    while (sleep_heap_size && sleep_heap[0]->deadline <= now) {
+        thread_sleep_t *sleep = sleep_heap[0];
+        sleep_heapRemove(sleep);
 
-            kfree(node);
-            kfree(sleep);
-        }
+        LOG(DEBUG, "WAKEUP: Time passed, waking up thread %p\n", sleep->thread);
+        sleep_finishWakeup(sleep);
     }
 
-    spinlock_release(&sleep_queue_lock);
+    SLEEP_UNLOCK();
 }
 
 /**
  * @brief Initialize the sleeper system
  */
 void sleep_init() {
-    sleep_queue = list_create("thread sleep queue");
+    // Allocate the deadline heap up front. It only grows if we have more timed sleepers than ever before.
+    sleep_heap_capacity = SLEEP_HEAP_INITIAL_CAPACITY;
+    sleep_heap = kmalloc(sleep_heap_capacity * sizeof(thread_sleep_t*));
+
     clock_registerUpdateCallback(sleep_callback);
 }
 
+/**
+ * @brief Create a sleep structure for a thread
+ * @param thread The thread going to sleep
+ * @param state The sleep state
+ */
+static thread_sleep_t *sleep_createSleeper(struct thread *thread, int state) {
+    thread_sleep_t *sleep = &thread->sleep_record;
+    memset(sleep, 0, sizeof(thread_sleep_t));
+    sleep->sleep_state = state;
+    sleep->thread = thread;
+    thread->sleep = sleep;
+    return sleep;
+}
 
 /**
  * @brief Put a thread to sleep, no condition and no way to wakeup without @c sleep_wakeup
@@ -109,20 +263,8 @@ void sleep_init() {
 int sleep_untilNever(struct thread *thread) {
     if (!thread) return 1;
 
-    // Construct a sleep node
-    thread_sleep_t *sleep = kmalloc(sizeof(thread_sleep_t));
-    memset(sleep, 0, sizeof(thread_sleep_t));
-    sleep->sleep_state = SLEEP_FLAG_NOCOND;
-    sleep->thread = thread;
-    thread->sleep = sleep;
-
-    // Manually create node..
-    node_t *node = kmalloc(sizeof(node_t));
-    node->value = (void*)sleep;
-
-    spinlock_acquire(&sleep_queue_lock);
-    list_append_node(sleep_queue, node);
-    spinlock_release(&sleep_queue_lock);
+    // Nothing to queue - the thread just waits for sleep_wakeup
+    sleep_createSleeper(thread, SLEEP_FLAG_NOCOND);
 
     // Mark thread as sleeping. If process_yield finds this thread to be trying to reschedule,
     // it will disallow it and just switch away
@@ -135,7 +277,7 @@ int sleep_untilNever(struct thread *thread) {
  * @param thread The thread to put to sleep
  * @param seconds Seconds to wait in the future
  * @param subseconds Subseconds to wait in the future
- * @returns 0 on success
+ * @returns 0 on success, 1 if the thread could not be put to sleep (it is still runnable)
  * 
  * @note If you're putting the current thread to sleep, yield immediately after without rescheduling.
  */
@@ -143,25 +285,19 @@ int sleep_untilTime(struct thread *thread, unsigned long seconds, unsigned long
     if (!thread) return 1;
 
     // Construct a sleep node
-    thread_sleep_t *sleep = kmalloc(sizeof(thread_sleep_t));
-    memset(sleep, 0, sizeof(thread_sleep_t));
-    sleep->sleep_state = SLEEP_FLAG_TIME;
-    sleep->thread = thread;
-    thread->sleep = sleep;
+    thread_sleep_t *sleep = sleep_createSleeper(thread, SLEEP_FLAG_TIME);
 
     // Get relative time
     unsigned long new_seconds, new_subseconds;
     clock_relative(seconds, subseconds, &new_seconds, &new_subseconds);
     sleep->seconds = new_seconds;
     sleep->subseconds = new_subseconds;
+    sleep->deadline = SLEEP_DEADLINE(new_seconds, new_subseconds);
 
-    // Manually create node..
-    node_t *node = kmalloc(sizeof(node_t));
-    node->value = (void*)sleep;
-
-    spinlock_acquire(&sleep_queue_lock);
-    list_append_node(sleep_queue, node);
-    spinlock_release(&sleep_queue_lock);
+    if (sleep_heapInsert(sleep)) {
+        thread->sleep = NULL;
+        return 1;
+    }
 
     // Mark thread as sleeping. If process_yield finds this thread to be trying to reschedule,
     // it will disallow it and just switch away
@@ -172,37 +308,59 @@ int sleep_untilTime(struct thread *thread, unsigned long seconds, unsigned long
 /**
  * @brief Put a thread to sleep until a specific condition is ready
  * @param thread The thread to put to sleep
+ * @param queue The sleep queue to wait in. The condition is only checked when this queue is woken up.
  * @param condition Condition function
  * @param context Optional context passed to condition function
  * @returns 0 on success
  * 
  * @note If you're putting the current thread to sleep, yield immediately after without rescheduling.
  */
-int sleep_untilCondition(struct thread *thread, sleep_condition_t condition, void *context) {
-    if (!thread) return 1;
+int sleep_untilCondition(struct thread *thread, sleep_queue_t *queue, sleep_condition_t condition, void *context) {
+    if (!thread || !queue || !condition) return 1;
 
     // Construct a sleep node
-    thread_sleep_t *sleep = kmalloc(sizeof(thread_sleep_t));
-    memset(sleep, 0, sizeof(thread_sleep_t));
-    sleep->sleep_state = SLEEP_FLAG_COND;
-    sleep->thread = thread;
-    thread->sleep = sleep;
+    thread_sleep_t *sleep = sleep_createSleeper(thread, SLEEP_FLAG_COND);
 
     // Set condition
     sleep->condition = condition;
     sleep->context = context;
-
-    // Manually create node..
-    node_t *node = kmalloc(sizeof(node_t));
-    node->value = (void*)sleep;
-
-    spinlock_acquire(&sleep_queue_lock);
-    list_append_node(sleep_queue, node);
-    spinlock_release(&sleep_queue_lock);
+    sleep->queue = queue;
 
     // Mark thread as sleeping. If process_yield finds this thread to be trying to reschedule,
     // it will disallow it and just switch away
     __sync_or_and_fetch(&thread->status, THREAD_STATUS_SLEEPING);
+
+    SLEEP_LOCK();
+    ilist_append(&queue->sleepers, &sleep->node);
+
+    // Whoever changes the condition wakes the queue under the sleep lock, so checking it here means
+    // we can't miss a change that happened before we were queued
+    if (condition(thread, context)) sleep_queueWakeup(sleep);
+
+    SLEEP_UNLOCK();
+    return 0;
+}
+
+/**
+ * @brief Put a thread to sleep in a sleep queue until it is woken up
+ * @param thread The thread to put to sleep
+ * @param queue The sleep queue to wait in
+ * @returns 0 on success
+ * 
+ * @note If you're putting the current thread to sleep, yield immediately after without rescheduling.
+ */
+int sleep_inQueue(struct thread *thread, sleep_queue_t *queue) {
+    if (!thread || !queue) return 1;
+
+    // Construct a sleep node with no condition
+    thread_sleep_t *sleep = sleep_createSleeper(thread, SLEEP_FLAG_COND);
+    sleep->queue = queue;
+
+    __sync_or_and_fetch(&thread->status, THREAD_STATUS_SLEEPING);
+
+    SLEEP_LOCK();
+    ilist_append(&queue->sleepers, &sleep->node);
+    SLEEP_UNLOCK();
     return 0;
 }
 
@@ -212,9 +370,123 @@ int sleep_untilCondition(struct thread *thread, sleep_condition_t condition, voi
  * @returns 0 on success
  */
 int sleep_wakeup(struct thread *thread) {
-    if (!thread || !thread->sleep) return 1;
+    if (!thread) return 1;
+
+    SLEEP_LOCK();
     
     thread_sleep_t *sleep = thread->sleep;
-    sleep->sleep_state = SLEEP_FLAG_WAKEUP;
+    if (!sleep) {
+        SLEEP_UNLOCK();
+        return 1;
+    }
+
+    sleep_queueWakeup(sleep);
+    SLEEP_UNLOCK();
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Get the earliest time a sleeping thread needs to be woken up at
+ * @returns The deadline in subseconds (see @c clock_getCurrentTime), 0 if a wakeup is pending, or UINT64_MAX if there is none
+ */
+uint64_t sleep_getNextDeadline() {
+    if (sleep_wakeup_queue.length) return 0;
+    return sleep_next_deadline;
+}
+
+/**
+ * @brief Create a new sleep queue
+ * @param name The name of the sleep queue
+ * @returns A new sleep queue
+ */
+sleep_queue_t *sleep_createQueue(char *name) {
+    sleep_queue_t *queue = kmalloc(sizeof(sleep_queue_t));
+    sleep_initQueue(queue, name);
+    return queue;
+}
+
+/**
+ * @brief Initialize a sleep queue embedded in another structure
+ * @param queue The queue to initialize
+ * @param name The name of the sleep queue
+ */
+void sleep_initQueue(sleep_queue_t *queue, char *name) {
+    queue->name = name;
+    ilist_init(&queue->sleepers, name);
+}
+
+/**
+ * @brief Wake up every thread in a sleep queue without freeing it
+ * @param queue The queue to drain
+ */
+void sleep_drainQueue(sleep_queue_t *queue) {
+    if (!queue) return;
+
+    SLEEP_LOCK();
+    while (queue->sleepers.head) {
+        sleep_queueWakeup(ilist_entry(queue->sleepers.head, thread_sleep_t, node));
+    }
+    SLEEP_UNLOCK();
+}
+
+/**
+ * @brief Destroy a sleep queue, waking up anything still in it
+ * @param queue The queue to destroy
+ */
+void sleep_destroyQueue(sleep_queue_t *queue) {
+    if (!queue) return;
+    sleep_drainQueue(queue);
+    kfree(queue);
+}
+
+/**
+ * @brief Recheck the conditions of every thread in a sleep queue
+ * @param queue The queue to wake up
+ * @returns The amount of threads woken up
+ */
+int sleep_wakeupQueue(sleep_queue_t *queue) {
+    if (!queue) return 0;
+
+    int woken = 0;
+    SLEEP_LOCK();
+
+    ilist_node_t *node = queue->sleepers.head;
+    while (node) {
+        ilist_node_t *next = node->next;
+        thread_sleep_t *sleep = ilist_entry(node, thread_sleep_t, node);
+
+        if (!sleep->condition || sleep->condition(sleep->thread, sleep->context)) {
+            LOG(DEBUG, "WAKEUP: Condition success, waking up thread %p\n", sleep->thread);
+            sleep_queueWakeup(sleep);
+            woken++;
+        }
+
+        node = next;
+    }
+
+    SLEEP_UNLOCK();
+    return woken;
+}
+
+/**
+ * @brief Wake up the first thread in a sleep queue that is ready to go
+ * @param queue The queue to wake up
+ * @returns 1 if a thread was woken up, 0 if not
+ */
+int sleep_wakeupQueueOne(sleep_queue_t *queue) {
+    if (!queue) return 0;
+
+    SLEEP_LOCK();
+
+    ilist_foreach(node, &queue->sleepers) {
+        thread_sleep_t *sleep = ilist_entry(node, thread_sleep_t, node);
+        if (!sleep->condition || sleep->condition(sleep->thread, sleep->context)) {
+            sleep_queueWakeup(sleep);
+            SLEEP_UNLOCK();
+            return 1;
+        }
+    }
+
+    SLEEP_UNLOCK();
+    return 0;
+}
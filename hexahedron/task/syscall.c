@@ -13,6 +13,7 @@
 
 #include <kernel/task/syscall.h>
 #include <kernel/task/process.h>
+#include <kernel/task/futex.h>
 #include <kernel/fs/vfs.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
@@ -46,7 +47,11 @@ static syscall_func_t syscall_table[] = {
     [SYS_WAIT]          = (syscall_func_t)(uintptr_t)sys_wait,
     [SYS_GETCWD]        = (syscall_func_t)(uintptr_t)sys_getcwd,
     [SYS_CHDIR]         = (syscall_func_t)(uintptr_t)sys_chdir,
-    [SYS_FCHDIR]        = (syscall_func_t)(uintptr_t)sys_fchdir
+    [SYS_FCHDIR]        = (syscall_func_t)(uintptr_t)sys_fchdir,
+    [SYS_FUTEX]         = (syscall_func_t)(uintptr_t)sys_futex,
+    [SYS_MMAP]          = (syscall_func_t)(uintptr_t)sys_mmap,
+    [SYS_MUNMAP]        = (syscall_func_t)(uintptr_t)sys_munmap,
+    [SYS_MPROTECT]      = (syscall_func_t)(uintptr_t)sys_mprotect
 };
 
 /* Unimplemented system call */
@@ -62,10 +67,26 @@ static syscall_func_t syscall_table[] = {
  * @returns Only if resolved.
  */
 void syscall_pointerValidateFailed(void *ptr) {
+    // Pending CoW or the shared zero page? The kernel would write straight through it, give it its own frame
+    if (mem_breakCopyOnWrite((uintptr_t)ptr)) return;
+
+    // Part of a mapping? Populate it if it hasn't been yet (read-only pages stay shared)
+    int prot = vma_getProtection(&current_cpu->current_process->vmas, (uintptr_t)ptr);
+    if (prot > 0) {
+        vma_fault(&current_cpu->current_process->vmas, (uintptr_t)ptr, 1);
+        if (mem_getPhysicalAddress(NULL, (uintptr_t)ptr)) return;
+    }
+
     // Check to see if this pointer is within process heap boundary
     if ((uintptr_t)ptr >= current_cpu->current_process->heap_base && (uintptr_t)ptr < current_cpu->current_process->heap) {
-        // Yep, it's valid. Map a page
-        mem_allocatePage(mem_getPage(NULL, (uintptr_t)ptr, MEM_CREATE), MEM_DEFAULT);
+        // Yep, it's valid. Map a zeroed page
+        page_t *pg = mem_getPage(NULL, (uintptr_t)ptr, MEM_CREATE);
+        mem_allocatePage(pg, MEM_DEFAULT);
+        if (pg) {
+            uintptr_t frame = mem_remapPhys(MEM_GET_FRAME(pg), PAGE_SIZE);
+            memset((void*)frame, 0, PAGE_SIZE);
+            mem_unmapPhys(frame, PAGE_SIZE);
+        }
         return;
     }
 
@@ -146,6 +167,7 @@ int sys_open(const char *pathname, int flags, mode_t mode) {
 
     // Create the file descriptor and return
     fd_t *fd = fd_add(current_cpu->current_process, node);
+    fd->mode = flags;
     
     // Are they trying to append? If so modify length to be equal to node length
     if (flags & O_APPEND) {
@@ -336,6 +358,11 @@ void *sys_brk(void *addr) {
     }
 
 
+    // Don't grow into a mapping
+    if (!vma_isFree(&current_cpu->current_process->vmas, current_cpu->current_process->heap, (uintptr_t)addr - current_cpu->current_process->heap)) {
+        return (void*)current_cpu->current_process->heap;
+    }
+
     // Else, "handle"
     current_cpu->current_process->heap = (uintptr_t)addr;   // Sure.. you can totally have this memory ;)
                                                             // (page fault handler will map this on a critical failure)
@@ -406,7 +433,7 @@ long sys_usleep(useconds_t usec) {
     }
 
     LOG(DEBUG, "sys_usleep %d\n", usec);
-    sleep_untilTime(current_cpu->current_thread, (usec / 10000) / 1000, (usec / 10000) % 1000);
+    if (sleep_untilTime(current_cpu->current_thread, (usec / 10000) / 1000, (usec / 10000) % 1000)) return -ENOMEM;
     process_yield(0);
 
     LOG(DEBUG, "resuming process\n");
@@ -528,4 +555,105 @@ long sys_chdir(const char *path) {
 long sys_fchdir(int fd) {
     // TODO
     return -EINVAL;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Futex system call
+ */
+long sys_futex(uint32_t *uaddr, int op, uint32_t val, const struct timeval *timeout) {
+    switch (op) {
+        case FUTEX_WAIT:
+            if (timeout) SYSCALL_VALIDATE_PTR(timeout);
+            return futex_wait(uaddr, val, timeout);
+
+        case FUTEX_WAKE:
+            return futex_wake(uaddr, val);
+
+        default:
+            return -EINVAL;
+    }
+}
+
+/**
+ * @brief mmap system call
+ * @param context The arguments of mmap (there are too many to pass in registers)
+ */
+long sys_mmap(sys_mmap_context_t *context) {
+    SYSCALL_VALIDATE_PTR_SIZE(context, sizeof(sys_mmap_context_t));
+    sys_mmap_context_t ctx = *context;
+
+    LOG(DEBUG, "sys_mmap addr %p len %d prot %d flags 0x%x filedes %d off %d\n", ctx.addr, ctx.len, ctx.prot, ctx.flags, ctx.filedes, ctx.off);
+
+    if (!ctx.len || ctx.len > MEM_MMAP_REGION_SIZE) return -EINVAL;
+    if (!(ctx.flags & MAP_SHARED) == !(ctx.flags & MAP_PRIVATE)) return -EINVAL;
+    if (ctx.prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -EINVAL;
+
+    size_t size = ctx.len;
+    if (size & (PAGE_SIZE - 1)) size = (size & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+
+    // Get the file
+    fs_node_t *node = NULL;
+    size_t file_size = 0;
+    int max_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    if (!(ctx.flags & MAP_ANONYMOUS)) {
+        if (!FD_VALIDATE(current_cpu->current_process, ctx.filedes)) return -EBADF;
+        if (ctx.off < 0 || (ctx.off & (PAGE_SIZE - 1))) return -EINVAL;
+
+        // The file has to be readable, and writable for a shared mapping to ever be writable
+        fd_t *fd = FD(current_cpu->current_process, ctx.filedes);
+        if ((fd->mode & (O_WRONLY | O_RDWR)) == O_WRONLY) return -EACCES;
+        if ((ctx.flags & MAP_SHARED) && !(fd->mode & O_RDWR)) max_prot &= ~PROT_WRITE;
+        if (ctx.prot & ~max_prot) return -EACCES;
+
+        node = fd->node;
+        if ((uint64_t)ctx.off < node->length) {
+            file_size = node->length - ctx.off;
+            if (file_size > ctx.len) file_size = ctx.len;
+        }
+    }
+
+    // Shared mappings are populated with private copies of the file, which only behaves like sharing while nobody
+    // can write to them. Writable (and anonymous) shared mappings are refused rather than silently made private,
+    // and mprotect() can't make a shared mapping writable later.
+    if ((ctx.flags & MAP_SHARED) && (!node || (ctx.prot & PROT_WRITE))) return -ENOTSUP;
+    if (ctx.flags & MAP_SHARED) max_prot &= ~PROT_WRITE;
+
+    // Find where to put it
+    uintptr_t address;
+    if (ctx.flags & MAP_FIXED) {
+        address = (uintptr_t)ctx.addr;
+        if (address & (PAGE_SIZE - 1)) return -EINVAL;
+        if (address < MEM_MMAP_REGION || address + size > MEM_MMAP_REGION + MEM_MMAP_REGION_SIZE || address + size < address) return -ENOMEM;
+
+        // Replace whatever was there
+        vma_unmap(&current_cpu->current_process->vmas, address, size);
+    } else {
+        address = vma_findFree(&current_cpu->current_process->vmas, (uintptr_t)ctx.addr, size);
+        if (!address) return -ENOMEM;
+    }
+
+    int ret = vma_map(&current_cpu->current_process->vmas, address, size, ctx.prot, max_prot, ctx.flags, node, ctx.off, file_size);
+    if (ret < 0) return ret;
+
+    return (long)address;
+}
+
+/**
+ * @brief munmap system call
+ */
+long sys_munmap(void *addr, size_t len) {
+    if (((uintptr_t)addr & (PAGE_SIZE - 1)) || !len) return -EINVAL;
+    if ((uintptr_t)addr < MEM_MMAP_REGION || (uintptr_t)addr + len > MEM_MMAP_REGION + MEM_MMAP_REGION_SIZE) return -EINVAL;
+
+    return vma_unmap(&current_cpu->current_process->vmas, (uintptr_t)addr, len);
+}
+
+/**
+ * @brief mprotect system call
+ */
+long sys_mprotect(void *addr, size_t len, int prot) {
+    if (((uintptr_t)addr & (PAGE_SIZE - 1)) || !len) return -EINVAL;
+    if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -EINVAL;
+
+    return vma_protect(&current_cpu->current_process->vmas, (uintptr_t)addr, len, prot);
+}
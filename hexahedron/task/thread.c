@@ -14,13 +14,18 @@
 #include <kernel/task/process.h>
 #include <kernel/mem/alloc.h>
 #include <kernel/mem/mem.h>
+#include <kernel/mem/objcache.h>
 #include <kernel/drivers/clock.h>
 #include <kernel/debug.h>
+#include <kernel/panic.h>
 #include <string.h>
 
 /* Log method */
 #define LOG(status, ...) dprintf_module(status, "TASK:THREAD", __VA_ARGS__)
 
+/* Thread structure cache */
+static objcache_t *thread_cache = NULL;
+
 /**
  * @brief Create a new thread (internal)
  * @param parent The parent process of the thread
@@ -31,12 +36,21 @@
  * @note No ticks are set and context will need to be saved
  */
 static thread_t *thread_createStructure(process_t *parent, page_t *dir, int status,  int flags) {
-    thread_t *thr = kmalloc(sizeof(thread_t));
+    // The first thread is made before the other CPUs are started, so this can't race
+    if (!thread_cache) thread_cache = objcache_create("thread cache", sizeof(thread_t), THREAD_CACHE_MAX, NULL, NULL);
+
+    thread_t *thr = objcache_alloc(thread_cache);
+    if (!thr) {
+        kernel_panic_extended(OUT_OF_MEMORY, "thread", "*** Could not allocate a thread structure for process \"%s\"\n", parent ? parent->name : "(none)");
+        __builtin_unreachable();
+    }
+
     memset(thr, 0, sizeof(thread_t));
     thr->parent = parent;
     thr->status = status;
     thr->dir = dir;
     thr->flags = flags;
+    thr->cpu = -1;
 
     // Thread ticks aren't updated because they should ONLY be updated when scheduler_insertThread is called
     return thr;
@@ -104,4 +118,13 @@ int thread_destroy(thread_t *thr) {
     LOG(INFO, "Thread %p has exited successfully\n", thr);
 
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Return the structure of a thread to the thread cache
+ * @param thr The thread, which must not be running, queued or sleeping anymore
+ */
+void thread_free(thread_t *thr) {
+    if (!thr) return;
+    objcache_free(thread_cache, thr);
+}
@@ -0,0 +1,112 @@
+/**
+ * @file libkstructures/ilist/ilist.c
+ * @brief Intrusive list implementation
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <structs/ilist.h>
+
+/**
+ * @brief Initialize an intrusive list
+ * @param list The list to initialize
+ * @param name Optional name for debugging
+ */
+void ilist_init(ilist_t *list, char *name) {
+    list->name = name;
+    list->head = NULL;
+    list->tail = NULL;
+    list->length = 0;
+}
+
+/**
+ * @brief Append a node to the end of the list
+ * @param list The list to append to
+ * @param node The node to append (must not be in a list)
+ */
+void ilist_append(ilist_t *list, ilist_node_t *node) {
+    node->next = NULL;
+    node->prev = list->tail;
+    node->owner = list;
+
+    if (list->tail) {
+        list->tail->next = node;
+    } else {
+        list->head = node;
+    }
+
+    list->tail = node;
+    list->length++;
+}
+
+/**
+ * @brief Insert a node at the start of the list
+ * @param list The list to insert into
+ * @param node The node to insert (must not be in a list)
+ */
+void ilist_prepend(ilist_t *list, ilist_node_t *node) {
+    node->prev = NULL;
+    node->next = list->head;
+    node->owner = list;
+
+    if (list->head) {
+        list->head->prev = node;
+    } else {
+        list->tail = node;
+    }
+
+    list->head = node;
+    list->length++;
+}
+
+/**
+ * @brief Delete a node from the list
+ * @param list The list to delete from
+ * @param node The node to delete
+ */
+void ilist_delete(ilist_t *list, ilist_node_t *node) {
+    if (node->owner != list) return; // Not ours
+
+    if (node == list->head) list->head = node->next;
+    if (node == list->tail) list->tail = node->prev;
+    if (node->next) node->next->prev = node->prev;
+    if (node->prev) node->prev->next = node->next;
+
+    node->prev = NULL;
+    node->next = NULL;
+    node->owner = NULL;
+    list->length--;
+}
+
+/**
+ * @brief Pop the last node off the list and return it
+ * @param list The list to pop off
+ * @returns The node or NULL if the list is empty
+ */
+ilist_node_t *ilist_pop(ilist_t *list) {
+    if (!list || !list->tail) return NULL;
+    ilist_node_t *out = list->tail;
+    ilist_delete(list, out);
+    return out;
+}
+
+/**
+ * @brief Pop the first node off the list and return it
+ * @param list The list to pop left on
+ * @returns The node or NULL if the list is empty
+ */
+ilist_node_t *ilist_popleft(ilist_t *list) {
+    if (!list || !list->head) return NULL;
+    ilist_node_t *out = list->head;
+    ilist_delete(list, out);
+    return out;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file libkstructures/include/structs/ilist.h
+ * @brief Intrusive list implementation
+ * 
+ * Intrusive lists don't allocate anything. Instead, the structure being listed embeds an
+ * @c ilist_node_t and @c ilist_entry is used to get back to the structure from the node.
+ * This makes them suitable for hot paths (e.g. scheduler queues) where kmalloc is too expensive.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#ifndef STRUCTS_ILIST_H
+#define STRUCTS_ILIST_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+
+/**** TYPES ****/
+
+struct ilist;
+
+// Intrusive node structure, embed this in whatever you want to list
+typedef struct ilist_node {
+    struct ilist_node *next;    // Next node
+    struct ilist_node *prev;    // Previous node
+    struct ilist *owner;        // List this node is in, or NULL
+} ilist_node_t;
+
+// Intrusive list structure
+typedef struct ilist {
+    char    *name;              // Optional name for debugging
+    ilist_node_t *head;         // Starting node of the list
+    ilist_node_t *tail;         // Ending node of the list
+    size_t  length;             // Length of the list, in nodes
+} ilist_t;
+
+/**** MACROS ****/
+
+/* Get the structure containing a node */
+#define ilist_entry(node, type, member) ((type*)((uintptr_t)(node) - offsetof(type, member)))
+
+/* Iterate through an intrusive list (don't delete i while iterating) */
+#define ilist_foreach(i, list) for (ilist_node_t *i = (list)->head; i != NULL; i = i->next)
+
+/* Check whether a node is in a list */
+#define ilist_linked(node) ((node)->owner != NULL)
+
+/**** FUNCTIONS ****/
+
+/**
+ * @brief Initialize an intrusive list
+ * @param list The list to initialize
+ * @param name Optional name for debugging
+ */
+void ilist_init(ilist_t *list, char *name);
+
+/**
+ * @brief Append a node to the end of the list
+ * @param list The list to append to
+ * @param node The node to append (must not be in a list)
+ */
+void ilist_append(ilist_t *list, ilist_node_t *node);
+
+/**
+ * @brief Insert a node at the start of the list
+ * @param list The list to insert into
+ * @param node The node to insert (must not be in a list)
+ */
+void ilist_prepend(ilist_t *list, ilist_node_t *node);
+
+/**
+ * @brief Delete a node from the list
+ * @param list The list to delete from
+ * @param node The node to delete
+ */
+void ilist_delete(ilist_t *list, ilist_node_t *node);
+
+/**
+ * @brief Pop the last node off the list and return it
+ * @param list The list to pop off
+ * @returns The node or NULL if the list is empty
+ */
+ilist_node_t *ilist_pop(ilist_t *list);
+
+/**
+ * @brief Pop the first node off the list and return it
+ * @param list The list to pop left on
+ * @returns The node or NULL if the list is empty
+ */
+ilist_node_t *ilist_popleft(ilist_t *list);
+
+#endif
@@ -43,6 +43,10 @@ _Begin_C_Header
 #define SYS_GETCWD          28
 #define SYS_CHDIR           29
 #define SYS_FCHDIR          30
+#define SYS_FUTEX           31
+#define SYS_MMAP            32
+#define SYS_MUNMAP          33
+#define SYS_MPROTECT        34
 
 /* Syscall macros */
 #define DEFINE_SYSCALL0(name, num) \
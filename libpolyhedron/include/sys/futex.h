@@ -0,0 +1,75 @@
+/**
+ * @file libpolyhedron/include/sys/futex.h
+ * @brief Futex (fast userspace mutex) interface
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <sys/cheader.h>
+
+_Begin_C_Header
+
+#ifndef _SYS_FUTEX_H
+#define _SYS_FUTEX_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+/**** DEFINITIONS ****/
+
+#define FUTEX_WAIT          0       // Sleep if *uaddr == val, until woken or the timeout passes
+#define FUTEX_WAKE          1       // Wake up to val threads sleeping on uaddr
+
+/**** TYPES ****/
+
+// A lock built on a futex. Zero-initialize it (or use FUTEX_LOCK_INITIALIZER).
+// 0 = unlocked, 1 = locked, 2 = locked and someone may be sleeping on it
+typedef struct futex_lock {
+    volatile uint32_t state;
+} futex_lock_t;
+
+#define FUTEX_LOCK_INITIALIZER { 0 }
+
+/**** FUNCTIONS ****/
+
+#ifndef __LIBK
+
+/**
+ * @brief Wait on or wake up a futex
+ * @param uaddr The futex word (must be 4-byte aligned)
+ * @param op FUTEX_WAIT or FUTEX_WAKE
+ * @param val For FUTEX_WAIT, the value *uaddr must still hold. For FUTEX_WAKE, how many threads to wake.
+ * @param timeout Optional relative timeout for FUTEX_WAIT
+ * @returns For FUTEX_WAKE, the amount of threads woken. For FUTEX_WAIT, 0. -1 and errno on failure.
+ */
+long futex(uint32_t *uaddr, int op, uint32_t val, const struct timeval *timeout);
+
+/**
+ * @brief Acquire a futex lock, sleeping in the kernel only if it is contended
+ */
+void futex_lock(futex_lock_t *lock);
+
+/**
+ * @brief Try to acquire a futex lock without sleeping
+ * @returns 0 on success, -1 if the lock is held
+ */
+int futex_trylock(futex_lock_t *lock);
+
+/**
+ * @brief Release a futex lock, entering the kernel only if someone may be waiting
+ */
+void futex_unlock(futex_lock_t *lock);
+
+#endif
+
+#endif
+
+_End_C_Header
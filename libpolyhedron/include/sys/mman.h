@@ -0,0 +1,65 @@
+/**
+ * @file libpolyhedron/include/sys/mman.h
+ * @brief Memory management declarations
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <sys/cheader.h>
+
+_Begin_C_Header
+
+#ifndef _SYS_MMAN_H
+#define _SYS_MMAN_H
+
+/**** INCLUDES ****/
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**** DEFINITIONS ****/
+
+#define PROT_NONE           0x0     // Pages may not be accessed
+#define PROT_READ           0x1     // Pages may be read
+#define PROT_WRITE          0x2     // Pages may be written
+#define PROT_EXEC           0x4     // Pages may be executed
+
+#define MAP_SHARED          0x01    // Changes are shared
+#define MAP_PRIVATE         0x02    // Changes are private
+#define MAP_FIXED           0x10    // Interpret addr exactly
+#define MAP_ANONYMOUS       0x20    // Not backed by a file
+#define MAP_ANON            MAP_ANONYMOUS
+
+#define MAP_FAILED          ((void*)-1)
+
+/**** TYPES ****/
+
+// mmap takes six parameters, which is more than a system call can carry, so they are passed in this
+typedef struct sys_mmap_context {
+    void *addr;
+    size_t len;
+    int prot;
+    int flags;
+    int filedes;
+    off_t off;
+} sys_mmap_context_t;
+
+/**** FUNCTIONS ****/
+
+#ifndef __LIBK
+
+void *mmap(void *addr, size_t len, int prot, int flags, int filedes, off_t off);
+int munmap(void *addr, size_t len);
+int mprotect(void *addr, size_t len, int prot);
+
+#endif
+
+#endif
+
+_End_C_Header
@@ -26,6 +26,7 @@ _Begin_C_Header
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 /**** MACROS ****/
 
@@ -60,6 +61,10 @@ DECLARE_SYSCALL3(wait, pid_t, int*, int);
 DECLARE_SYSCALL2(getcwd, char*, size_t);
 DECLARE_SYSCALL1(chdir, const char*);
 DECLARE_SYSCALL1(fchdir, int);
+DECLARE_SYSCALL4(futex, uint32_t*, int, uint32_t, const struct timeval*);
+DECLARE_SYSCALL1(mmap, sys_mmap_context_t*);
+DECLARE_SYSCALL2(munmap, void*, size_t);
+DECLARE_SYSCALL3(mprotect, void*, size_t, int);
 
 #endif
 
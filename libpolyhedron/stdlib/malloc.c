@@ -2,6 +2,19 @@
  * @file libpolyhedron/stdlib/malloc.c
  * @brief malloc, calloc, realloc, etc.
  * 
+ * In libk these forward to the kernel allocator. In libc they are a size class allocator:
+ * - Small allocations (up to MALLOC_SMALL_MAX bytes) are rounded up to a size class and carved out
+ *   of spans. A span is MALLOC_SPAN_SIZE bytes, aligned to its size, with a header at offset 0.
+ * - Large allocations get their own anonymous mapping, also aligned to MALLOC_SPAN_SIZE with a header at offset 0.
+ * 
+ * That means the header of any pointer is found by rounding it down to MALLOC_SPAN_SIZE.
+ * 
+ * Spans come out of address space reserved from the kernel MALLOC_GROW_SIZE at a time. The kernel only
+ * populates pages when they are touched, and spans hand out objects they have never used before anything
+ * else, so reserving a lot at once costs nothing but saves a syscall for every span.
+ * 
+ * Freed objects go to a cache of up to MALLOC_CACHE_SIZE objects per size class. malloc and free only touch the
+ * cache, and take the lock of a size class to move half a cache worth of objects at a time.
  * 
  * @copyright
  * This file is part of the Hexahedron kernel, which is part of reduceOS.
@@ -15,7 +28,8 @@
 
 #if defined(__LIBK)
 
-// Forwarders to kernel functions
+// Forwarders to kernel functions (charged to one tag, the callers are all over the place)
+#define ALLOC_TAG "libk"
 #include <kernel/mem/alloc.h>
 #include <kernel/debug.h>
 
@@ -36,4 +50,408 @@ void free( void *ptr ) {
     return kfree(ptr);
 }
 
-#endif
\ No newline at end of file
+#else
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/futex.h>
+
+/**** DEFINITIONS ****/
+
+#define MALLOC_SPAN_SIZE        0x10000     // Size (and alignment) of a span
+#define MALLOC_GROW_SIZE        0x100000    // Address space reserved for spans at once
+#define MALLOC_HEADER_SIZE      64          // Space for the span or large header at the start of a mapping
+#define MALLOC_PAGE_SIZE        4096        // TODO: Don't hardcode page size
+
+#define MALLOC_CLASS_COUNT      36          // Amount of size classes
+#define MALLOC_SMALL_MAX        16384       // Largest size served from a span
+#define MALLOC_CACHE_SIZE       32          // Objects a cache holds per size class
+#define MALLOC_CACHE_BATCH      (MALLOC_CACHE_SIZE / 2) // Objects moved between a cache and the spans at once
+#define MALLOC_MAX_FREE_SPANS   16          // Empty spans kept around before they are unmapped
+
+#define MALLOC_SPAN_MAGIC       0x5BA45BA4  // Span header magic
+#define MALLOC_LARGE_MAGIC      0x1A26EB1C  // Large allocation header magic
+
+#define MALLOC_ALIGN(x, a)      (((x) + ((a) - 1)) & ~((uintptr_t)(a) - 1))
+#define MALLOC_HEADER(ptr)      ((uintptr_t)(ptr) & ~((uintptr_t)MALLOC_SPAN_SIZE - 1))
+
+/**** TYPES ****/
+
+/**
+ * @brief Span header, located at the start of the span
+ */
+typedef struct malloc_span {
+    uint32_t magic;                 // MALLOC_SPAN_MAGIC
+    uint16_t class;                 // Size class of the span
+    uint16_t total;                 // Objects that fit in the span
+    uint16_t inuse;                 // Objects handed out of this span (includes objects in caches)
+    uint16_t carved;                // Objects handed out at least once, the rest has never been touched
+    void *free;                     // First freed object (objects are linked through their first word)
+    struct malloc_span *next;       // Next span in the partial list (or free span list)
+    struct malloc_span *prev;       // Previous span in the partial list
+} malloc_span_t;
+
+/**
+ * @brief Large allocation header, located at the start of the mapping
+ */
+typedef struct malloc_large {
+    uint32_t magic;                 // MALLOC_LARGE_MAGIC
+    size_t length;                  // Length of the mapping
+} malloc_large_t;
+
+/**
+ * @brief Size class
+ * 
+ * Spans with no free objects are not on any list. Empty spans go back to the span pool.
+ */
+typedef struct malloc_class {
+    futex_lock_t lock;              // Lock
+    malloc_span_t *partial;         // Spans with some free objects
+} malloc_class_t;
+
+/**
+ * @brief Cache of free objects
+ */
+typedef struct malloc_cache {
+    size_t count[MALLOC_CLASS_COUNT];                       // Objects in each class
+    void *objects[MALLOC_CLASS_COUNT][MALLOC_CACHE_SIZE];   // Objects
+} malloc_cache_t;
+
+_Static_assert(sizeof(malloc_span_t) <= MALLOC_HEADER_SIZE, "malloc: span header too big");
+_Static_assert(sizeof(malloc_large_t) <= MALLOC_HEADER_SIZE, "malloc: large header too big");
+
+/**** VARIABLES ****/
+
+/* Size classes: 16 byte steps up to 128, then four steps per power of two */
+static const size_t malloc_sizes[MALLOC_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384
+};
+
+/* Size classes */
+static malloc_class_t malloc_classes[MALLOC_CLASS_COUNT] = { 0 };
+
+/* The cache of the process (see malloc_getCache) */
+static malloc_cache_t malloc_main_cache = { 0 };
+
+/* Reserved address space that hasn't been made into spans yet */
+static uintptr_t malloc_heap_next = 0x0;
+static uintptr_t malloc_heap_end = 0x0;
+
+/* Empty spans */
+static malloc_span_t *malloc_free_spans = NULL;
+static size_t malloc_free_span_count = 0;
+
+/* Heap lock (reserved address space and empty spans) */
+static futex_lock_t malloc_heap_lock = FUTEX_LOCK_INITIALIZER;
+
+/**** SPANS ****/
+
+/**
+ * @brief Map anonymous memory aligned to MALLOC_SPAN_SIZE
+ * @param length Length of the mapping (page aligned)
+ * @param hint Address to try first, can be 0x0
+ * @returns The mapping or 0x0
+ */
+static uintptr_t malloc_mapAligned(size_t length, uintptr_t hint) {
+    void *addr;
+
+    if (hint) {
+        addr = mmap((void*)hint, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) return 0x0;
+        if (MALLOC_HEADER(addr) == (uintptr_t)addr) return (uintptr_t)addr;
+        munmap(addr, length);
+    }
+
+    // Map enough to align it ourselves and trim the ends
+    addr = mmap(NULL, length + MALLOC_SPAN_SIZE - MALLOC_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return 0x0;
+
+    uintptr_t start = MALLOC_ALIGN((uintptr_t)addr, MALLOC_SPAN_SIZE);
+    uintptr_t end = (uintptr_t)addr + length + MALLOC_SPAN_SIZE - MALLOC_PAGE_SIZE;
+    if (start != (uintptr_t)addr) munmap(addr, start - (uintptr_t)addr);
+    if (start + length != end) munmap((void*)(start + length), end - (start + length));
+
+    return start;
+}
+
+/**
+ * @brief Get an empty span
+ * @returns The span or NULL
+ */
+static malloc_span_t *malloc_getSpan(int class) {
+    malloc_span_t *span = NULL;
+    futex_lock(&malloc_heap_lock);
+
+    if (malloc_free_spans) {
+        span = malloc_free_spans;
+        malloc_free_spans = span->next;
+        malloc_free_span_count--;
+    } else {
+        if (malloc_heap_next == malloc_heap_end) {
+            // Reserve more, right after the last reservation if we can
+            uintptr_t heap = malloc_mapAligned(MALLOC_GROW_SIZE, malloc_heap_end);
+            if (!heap) {
+                futex_unlock(&malloc_heap_lock);
+                return NULL;
+            }
+
+            malloc_heap_next = heap;
+            malloc_heap_end = heap + MALLOC_GROW_SIZE;
+        }
+
+        span = (malloc_span_t*)malloc_heap_next;
+        malloc_heap_next += MALLOC_SPAN_SIZE;
+    }
+
+    futex_unlock(&malloc_heap_lock);
+
+    span->magic = MALLOC_SPAN_MAGIC;
+    span->class = class;
+    span->total = (MALLOC_SPAN_SIZE - MALLOC_HEADER_SIZE) / malloc_sizes[class];
+    span->inuse = 0;
+    span->carved = 0;
+    span->free = NULL;
+    span->next = span->prev = NULL;
+    return span;
+}
+
+/**
+ * @brief Give back an empty span
+ */
+static void malloc_putSpan(malloc_span_t *span) {
+    span->magic = 0;
+    futex_lock(&malloc_heap_lock);
+
+    if (malloc_free_span_count < MALLOC_MAX_FREE_SPANS) {
+        span->next = malloc_free_spans;
+        malloc_free_spans = span;
+        malloc_free_span_count++;
+        futex_unlock(&malloc_heap_lock);
+        return;
+    }
+
+    futex_unlock(&malloc_heap_lock);
+    munmap(span, MALLOC_SPAN_SIZE);
+}
+
+/**
+ * @brief Unlink a span from a partial list (class lock held)
+ */
+static void malloc_unlinkSpan(malloc_class_t *cls, malloc_span_t *span) {
+    if (span->prev) span->prev->next = span->next;
+    else cls->partial = span->next;
+    if (span->next) span->next->prev = span->prev;
+    span->next = span->prev = NULL;
+}
+
+/**
+ * @brief Push a span onto a partial list (class lock held)
+ */
+static void malloc_linkSpan(malloc_class_t *cls, malloc_span_t *span) {
+    span->prev = NULL;
+    span->next = cls->partial;
+    if (cls->partial) cls->partial->prev = span;
+    cls->partial = span;
+}
+
+/**** SIZE CLASSES ****/
+
+/**
+ * @brief Get the size class for a size (at most MALLOC_SMALL_MAX)
+ */
+static inline int malloc_getClass(size_t size) {
+    if (size <= 128) return (size + 15) / 16 - 1;
+
+    // Four classes per power of two above that
+    int shift = (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl((unsigned long)(size - 1));
+    return 8 + (shift - 7) * 4 + (int)((size - 1) >> (shift - 2)) - 4;
+}
+
+/**
+ * @brief Get the cache of the calling thread
+ * 
+ * libpolyhedron has no threads yet, so the whole process shares one cache and it is used without a lock.
+ * Once threads exist this has to return a thread-local cache.
+ */
+static inline malloc_cache_t *malloc_getCache() {
+    return &malloc_main_cache;
+}
+
+/**
+ * @brief Move objects from the spans of a class to a cache
+ */
+static void malloc_refill(malloc_cache_t *cache, int class) {
+    malloc_class_t *cls = &malloc_classes[class];
+    size_t size = malloc_sizes[class];
+
+    futex_lock(&cls->lock);
+
+    while (cache->count[class] < MALLOC_CACHE_BATCH) {
+        malloc_span_t *span = cls->partial;
+        if (!span) {
+            span = malloc_getSpan(class);
+            if (!span) break;
+            malloc_linkSpan(cls, span);
+        }
+
+        void *obj;
+        if (span->free) {
+            obj = span->free;
+            span->free = *(void**)obj;
+        } else {
+            obj = (void*)((uintptr_t)span + MALLOC_HEADER_SIZE + span->carved * size);
+            span->carved++;
+        }
+
+        // Full spans leave the partial list
+        if (++span->inuse == span->total) malloc_unlinkSpan(cls, span);
+
+        cache->objects[class][cache->count[class]++] = obj;
+    }
+
+    futex_unlock(&cls->lock);
+}
+
+/**
+ * @brief Move the oldest half of a cache back to the spans of a class
+ */
+static void malloc_flush(malloc_cache_t *cache, int class) {
+    malloc_class_t *cls = &malloc_classes[class];
+
+    futex_lock(&cls->lock);
+
+    for (size_t i = 0; i < MALLOC_CACHE_BATCH; i++) {
+        void *obj = cache->objects[class][i];
+        malloc_span_t *span = (malloc_span_t*)MALLOC_HEADER(obj);
+
+        if (span->inuse == span->total) malloc_linkSpan(cls, span);
+
+        *(void**)obj = span->free;
+        span->free = obj;
+
+        if (--span->inuse == 0) {
+            malloc_unlinkSpan(cls, span);
+            malloc_putSpan(span);
+        }
+    }
+
+    futex_unlock(&cls->lock);
+
+    memmove(cache->objects[class], &cache->objects[class][MALLOC_CACHE_BATCH], (MALLOC_CACHE_SIZE - MALLOC_CACHE_BATCH) * sizeof(void*));
+    cache->count[class] -= MALLOC_CACHE_BATCH;
+}
+
+/**** LARGE ALLOCATIONS ****/
+
+/**
+ * @brief Allocate a large object in its own mapping
+ */
+static void *malloc_allocateLarge(size_t size) {
+    if (size > SIZE_MAX - MALLOC_HEADER_SIZE - MALLOC_SPAN_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t length = MALLOC_ALIGN(size + MALLOC_HEADER_SIZE, MALLOC_PAGE_SIZE);
+    uintptr_t addr = malloc_mapAligned(length, 0x0);
+    if (!addr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    malloc_large_t *header = (malloc_large_t*)addr;
+    header->magic = MALLOC_LARGE_MAGIC;
+    header->length = length;
+    return (void*)(addr + MALLOC_HEADER_SIZE);
+}
+
+/**
+ * @brief Get the usable size of an allocation
+ */
+static size_t malloc_getSize(void *ptr) {
+    malloc_span_t *span = (malloc_span_t*)MALLOC_HEADER(ptr);
+    if (span->magic == MALLOC_SPAN_MAGIC) return malloc_sizes[span->class];
+
+    malloc_large_t *header = (malloc_large_t*)span;
+    return header->length - MALLOC_HEADER_SIZE;
+}
+
+/**** FUNCTIONS ****/
+
+__attribute__((malloc)) void *malloc( size_t size ) {
+    if (!size) size = 1;
+    if (size > MALLOC_SMALL_MAX) return malloc_allocateLarge(size);
+
+    int class = malloc_getClass(size);
+    malloc_cache_t *cache = malloc_getCache();
+
+    if (!cache->count[class]) {
+        malloc_refill(cache, class);
+        if (!cache->count[class]) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    return cache->objects[class][--cache->count[class]];
+}
+
+void free( void *ptr ) {
+    if (!ptr) return;
+
+    malloc_span_t *span = (malloc_span_t*)MALLOC_HEADER(ptr);
+    if (span->magic == MALLOC_SPAN_MAGIC) {
+        malloc_cache_t *cache = malloc_getCache();
+        if (cache->count[span->class] == MALLOC_CACHE_SIZE) malloc_flush(cache, span->class);
+        cache->objects[span->class][cache->count[span->class]++] = ptr;
+        return;
+    }
+
+    malloc_large_t *header = (malloc_large_t*)span;
+    if (header->magic != MALLOC_LARGE_MAGIC) abort(); // Corrupted or not allocated
+
+    header->magic = 0;
+    munmap(header, header->length);
+}
+
+__attribute__((malloc)) void *calloc( size_t num, size_t size ) {
+    if (size && num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Large allocations are fresh anonymous mappings, which are already zeroed
+    if (num * size > MALLOC_SMALL_MAX) return malloc_allocateLarge(num * size);
+
+    void *ptr = malloc(num * size);
+    if (ptr) memset(ptr, 0, num * size);
+    return ptr;
+}
+
+__attribute__((malloc)) void *realloc( void *ptr, size_t new_size ) {
+    if (!ptr) return malloc(new_size);
+
+    if (!new_size) {
+        free(ptr);
+        return NULL;
+    }
+
+    // Still fits?
+    size_t old_size = malloc_getSize(ptr);
+    if (new_size <= old_size) return ptr;
+
+    void *new = malloc(new_size);
+    if (!new) return NULL;
+
+    memcpy(new, ptr, old_size);
+    free(ptr);
+    return new;
+}
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * @file libpolyhedron/unistd/futex.c
+ * @brief futex and futex locks
+ * 
+ * The lock is the classic three-state futex mutex: an uncontended lock/unlock is a
+ * single atomic operation, and the kernel is only entered once a thread has to wait.
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <sys/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+DEFINE_SYSCALL4(futex, SYS_FUTEX, uint32_t*, int, uint32_t, const struct timeval*);
+
+long futex(uint32_t *uaddr, int op, uint32_t val, const struct timeval *timeout) {
+    __sets_errno(__syscall_futex(uaddr, op, val, timeout));
+}
+
+/* Compare and swap the lock state, returning the old value */
+static inline uint32_t futex_cmpxchg(futex_lock_t *lock, uint32_t expected, uint32_t desired) {
+    __atomic_compare_exchange_n(&lock->state, &expected, desired, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return expected;
+}
+
+void futex_lock(futex_lock_t *lock) {
+    // Fast path: 0 -> 1
+    uint32_t state = futex_cmpxchg(lock, 0, 1);
+    if (state == 0) return;
+
+    // Contended. Mark the lock as having waiters and sleep until we get it
+    if (state != 2) state = __atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+    while (state != 0) {
+        __syscall_futex((uint32_t*)&lock->state, FUTEX_WAIT, 2, NULL);
+        state = __atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+int futex_trylock(futex_lock_t *lock) {
+    return (futex_cmpxchg(lock, 0, 1) == 0) ? 0 : -1;
+}
+
+void futex_unlock(futex_lock_t *lock) {
+    // Only go to the kernel if somebody may be waiting
+    if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2) {
+        __syscall_futex((uint32_t*)&lock->state, FUTEX_WAKE, 1, NULL);
+    }
+}
@@ -0,0 +1,48 @@
+/**
+ * @file libpolyhedron/unistd/mmap.c
+ * @brief mmap, munmap and mprotect
+ * 
+ * 
+ * @copyright
+ * This file is part of the Hexahedron kernel, which is part of reduceOS.
+ * It is released under the terms of the BSD 3-clause license.
+ * Please see the LICENSE file in the main repository for more details.
+ * 
+ * Copyright (C) 2024 Samuel Stuart
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+DEFINE_SYSCALL1(mmap, SYS_MMAP, sys_mmap_context_t*);
+DEFINE_SYSCALL2(munmap, SYS_MUNMAP, void*, size_t);
+DEFINE_SYSCALL3(mprotect, SYS_MPROTECT, void*, size_t, int);
+
+void *mmap(void *addr, size_t len, int prot, int flags, int filedes, off_t off) {
+    sys_mmap_context_t context = {
+        .addr = addr,
+        .len = len,
+        .prot = prot,
+        .flags = flags,
+        .filedes = filedes,
+        .off = off
+    };
+
+    long ret = __syscall_mmap(&context);
+    if (ret < 0 && ret > -4096) {
+        errno = -ret;
+        return MAP_FAILED;
+    }
+
+    return (void*)ret;
+}
+
+int munmap(void *addr, size_t len) {
+    __sets_errno(__syscall_munmap(addr, len));
+}
+
+int mprotect(void *addr, size_t len, int prot) {
+    __sets_errno(__syscall_mprotect(addr, len, prot));
+}